@@ -0,0 +1,76 @@
+// GB/s of the elementwise kernels the CPU runs, on buffers that fit in
+// L1, in L2 and only in memory, against memcpy of as many bytes. a
+// kernel runs at memory bandwidth when, on the largest buffers, it
+// moves its bytes about as fast as memcpy does
+//
+// g++ -O3 -std=c++17 -Isrc bench_elementwise.cpp -o bench_elementwise && ./bench_elementwise
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "elementwise.h"
+
+
+// seconds per call of fn, over enough calls to take a good fraction
+// of a second
+template <class F>
+static double seconds(F fn) {
+    fn();
+    size_t calls = 1;
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            fn();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() > 0.3) {
+            return elapsed.count() / double(calls);
+        }
+        calls *= 2;
+    }
+}
+
+template <typename T>
+static std::vector<T> random_vector(size_t n) {
+    std::vector<T> v(n);
+    for (auto& x : v) {
+        x = T(std::rand()) / T(RAND_MAX) * T(2) - T(1);
+    }
+    return v;
+}
+
+template <typename T>
+static void bench(const char* type) {
+    using O = ptMgrad::ElementwiseOp;
+    // 16 KiB, 512 KiB and 256 MiB of input and output together
+    for (size_t bytes : {size_t(16) << 10, size_t(512) << 10, size_t(256) << 20}) {
+        size_t n = bytes / 3 / sizeof(T);
+        std::vector<T> a = random_vector<T>(n), b = random_vector<T>(n), out(n);
+
+        // memcpy reads n elements and writes n
+        double s = seconds([&] { std::memcpy(out.data(), a.data(), n * sizeof(T)); });
+        double copy = 2.0 * n * sizeof(T) / s * 1e-9;
+        std::printf("memcpy  %-6s %-8s %9zu  %7.2f GB/s\n", type, "", n, copy);
+
+        for (const auto& kern : ptMgrad::elementwise_kernels<T>()) {
+            s = seconds([&] { kern.binary(O::Mul, n, out.data(), a.data(), b.data()); });
+            double mul = 3.0 * n * sizeof(T) / s * 1e-9;
+            s = seconds([&] { kern.scalar(O::Add, n, out.data(), a.data(), T(0.5)); });
+            double add = 2.0 * n * sizeof(T) / s * 1e-9;
+            s = seconds([&] { kern.unary(O::Relu, n, out.data(), a.data()); });
+            double relu = 2.0 * n * sizeof(T) / s * 1e-9;
+            std::printf("kernel  %-6s %-8s %9zu  %7.2f GB/s a * b  %7.2f a + s  %7.2f relu\n",
+                        type, kern.name, n, mul, add, relu);
+        }
+    }
+}
+
+
+int main() {
+    bench<double>("double");
+    bench<float>("float");
+    return 0;
+}
@@ -0,0 +1,103 @@
+// GFLOP/s of gemm for every micro-kernel the CPU runs, and of a
+// matmul forward and backward, against the peak of one core: clock x
+// 2 FMA units x 2 flops x the lanes of the fastest kernel's vectors.
+// the clock is read from /proc/cpuinfo, or given in GHz as argv[1]
+//
+// g++ -O3 -std=c++17 -Isrc bench_gemm.cpp -o bench_gemm && ./bench_gemm
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "tensor.h"
+
+
+static double clock_ghz(int argc, char** argv) {
+    if (argc > 1) {
+        return std::atof(argv[1]);
+    }
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.rfind("cpu MHz", 0) == 0) {
+            return std::atof(line.substr(line.find(':') + 1).c_str()) / 1000.0;
+        }
+    }
+    return 0.0;
+}
+
+// seconds per call of fn, over enough calls to take a good fraction
+// of a second
+template <class F>
+static double seconds(F fn) {
+    fn();
+    size_t calls = 1;
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            fn();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() > 0.3) {
+            return elapsed.count() / double(calls);
+        }
+        calls *= 2;
+    }
+}
+
+template <typename T>
+static std::vector<T> random_matrix(size_t n) {
+    std::vector<T> v(n);
+    for (auto& x : v) {
+        x = T(std::rand()) / T(RAND_MAX) * T(2) - T(1);
+    }
+    return v;
+}
+
+// lanes of the vectors a kernel uses
+template <typename T>
+static double lanes(const std::string& name) {
+    double bytes = name == "avx512" ? 64 : name == "avx2" ? 32 : sizeof(T);
+    return bytes / sizeof(T);
+}
+
+template <typename T>
+static void bench(const char* type, double ghz) {
+    double peak = ghz * 2 * 2 * lanes<T>(ptMgrad::gemm_kernel<T>().name);
+    for (const auto& kern : ptMgrad::gemm_kernels<T>()) {
+        for (size_t n : {64, 128, 256, 512, 1024}) {
+            std::vector<T> a = random_matrix<T>(n * n), b = random_matrix<T>(n * n), c(n * n);
+            double s = seconds([&] {
+                ptMgrad::gemm(n, n, n, a.data(), n, 1, b.data(), n, 1, c.data(), n, false, kern);
+            });
+            double gflops = 2.0 * n * n * n / s * 1e-9;
+            std::printf("gemm    %-6s %-8s %5zu  %8.2f GFLOP/s  %5.1f%% of %.1f\n",
+                        type, kern.name, n, gflops, 100.0 * gflops / peak, peak);
+        }
+    }
+
+    // forward and the two gemms of backward, with the fastest kernel
+    for (size_t n : {256, 1024}) {
+        ptMgrad::Tensor<T> a({n, n}, random_matrix<T>(n * n));
+        ptMgrad::Tensor<T> b({n, n}, random_matrix<T>(n * n));
+        double s = seconds([&] {
+            ptMgrad::Tensor<T> e = sum(matmul(a, b));
+            e.backward();
+        });
+        double gflops = 3 * 2.0 * n * n * n / s * 1e-9;
+        std::printf("matmul  %-6s %-8s %5zu  %8.2f GFLOP/s  %5.1f%% of %.1f (forward + backward)\n",
+                    type, ptMgrad::gemm_kernel<T>().name, n, gflops, 100.0 * gflops / peak, peak);
+    }
+}
+
+
+int main(int argc, char** argv) {
+    double ghz = clock_ghz(argc, argv);
+    std::printf("one core at %.2f GHz\n", ghz);
+    bench<double>("double", ghz);
+    bench<float>("float", ghz);
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <cmath>
 
 #include "nn.h"
+#include "graph.h"
 
 using namespace ptMgrad;
 
@@ -22,6 +23,13 @@ int main() {
     };
     std::vector<double> ys = {0.0, 1.0, 1.0, 0.0};
 
+    // inputs are constants, backward never needs their gradient
+    for (auto& x : xs) {
+        for (auto& xi : x) {
+            xi.set_requires_grad(false);
+        }
+    }
+
     // Model — MLP: 2 inputs -> hidden(4, ReLU) -> output(1, linear)
     MLP<double> model(2, {4, 1});
 
@@ -32,28 +40,30 @@ int main() {
     const double lr     = 0.1;
     const int    epochs = 200;
 
-    for (int epoch = 0; epoch < epochs; ++epoch) {
+    // forward pass: accumulate MSE loss
+    // Use operator+ (not +=) so every addition is a graph node.
+    V loss(0.0);
+    for (size_t i = 0; i < xs.size(); ++i) {
+        V pred = model(xs[i])[0];
+        V diff = pred - V(ys[i]);
+        V sq   = pow(diff, 2.0);
+        loss   = loss + sq;
+    }
+    // mean
+    V mse = loss * V(1.0 / static_cast<double>(xs.size()));
 
-        // forward pass: accumulate MSE loss
-        // Use operator+ (not +=) so every addition is a graph node.
-        V loss(0.0);
-        for (size_t i = 0; i < xs.size(); ++i) {
-            V pred = model(xs[i])[0];
-            V diff = pred - V(ys[i]);
-            V sq   = pow(diff, 2.0);
-            loss   = loss + sq;
-        }
-        // mean
-        V mse = loss * V(1.0 / static_cast<double>(xs.size()));
+    // every epoch has the same graph, so it is built once and replayed
+    Graph<double> graph(mse);
 
-        // backward pass
+    for (int epoch = 0; epoch < epochs; ++epoch) {
+        // forward and backward pass
         model.zero_grad();
-        mse.backward();
+        graph.replay();
 
-        // SGD parameter update
+        // SGD parameter update, in place so the graph sees it
         for (auto* p : model.parameters()) {
             double updated = p->dataX() - lr * p->get_grad();
-            *p = updated;
+            p->set_data(updated);
         }
 
         if (epoch % 20 == 0 || epoch == epochs - 1) {
@@ -62,9 +72,12 @@ int main() {
         }
     }
 
-    // predictions
+    // predictions: values only, no graph, kept in an arena
+    NoGradGuard no_grad;
+    Arena arena;
     std::cout << "\n--- Predictions after training ---\n";
     for (size_t i = 0; i < xs.size(); ++i) {
+        ArenaScope scope(arena);
         V pred = model(xs[i])[0];
         std::cout << "x=(" << xs[i][0] << "," << xs[i][1] << ")"
                   << "  pred=" << pred
@@ -8,15 +8,6 @@
 using namespace ptMgrad;
 using V = Value<double>;
 
-// dot product: Array<V> · Array<V> → scalar V
-static V dot(const Array<V>& a, const Array<V>& b) {
-    Array<V> ab = a * b;
-    V s(0.0);
-    for (size_t i = 0; i < ab.size(); ++i)
-        s = s + ab[i];
-    return s;
-}
-
 int main() {
     std::srand(0);
 
@@ -60,7 +51,11 @@ int main() {
     const double lr = 0.1;
     const int epochs = 400;
 
+    // graph storage, rewound at the end of every epoch
+    Arena arena;
+
     for (int epoch = 0; epoch < epochs; ++epoch) {
+        ArenaScope scope(arena);
 
         // zero gradients
         for (int j = 0; j < NHID; ++j) {
@@ -103,9 +98,11 @@ int main() {
                       << "  MSE = " << mse.dataX() << "\n";
     }
 
-    // predictions
+    // predictions: values only, no graph
+    NoGradGuard no_grad;
     std::cout << "\n--- Predictions after training ---\n";
     for (size_t s = 0; s < xs.size(); ++s) {
+        ArenaScope scope(arena);
         Array<V> h;
         for (int j = 0; j < NHID; ++j)
             h.push_back(relu(dot(W1[j], xs[s]) + b1[j]));
@@ -4,6 +4,7 @@
 #include <vector>
 #include <type_traits>
 #include <stdexcept>
+#include <utility>
 
 #include "engine.h"
 
@@ -21,7 +22,7 @@ private:
     void resize(size_t new_capacity) {
         T* new_data = new T[new_capacity];
         for (size_t i = 0; i < _size; i++) {
-            new_data[i] = data[i];
+            new_data[i] = std::move(data[i]);
         }
         delete[] data;
         data = new_data;
@@ -121,6 +122,13 @@ public:
         data[_size++] = value;
     }
 
+    void push_back(T&& value) {
+        if (_size >= capacity) {
+            resize(capacity == 0 ? 1 : capacity * 2);
+        }
+        data[_size++] = std::move(value);
+    }
+
     void pop_back() {
         if (_size > 0) {
             _size--;
@@ -955,6 +963,21 @@ rdiv(const T& _x, const Array<Value<U>>& _y) {
     return _y / _x;
 }
 
+template <typename T>
+Value<T>
+sum(const Array<Value<T>>& _x) {
+    return sum(_x.begin(), _x.size());
+}
+
+template <typename T>
+Value<T>
+dot(const Array<Value<T>>& _x, const Array<Value<T>>& _y) {
+    if (_x.size() != _y.size()) {
+        throw std::invalid_argument("Arrays must have the same size");
+    }
+    return dot(_x.begin(), _y.begin(), _x.size());
+}
+
 }
 
 #endif
@@ -0,0 +1,187 @@
+// bump allocator for graph storage
+// every node built while an arena is active lives in it,
+// and the whole graph is dropped at once with reset()
+//
+// lifetime rules:
+// - a handle to a node built in an arena must not be used once the
+//   arena is reset, which ArenaScope does when it ends
+// - ops in the arena hold a counted reference to the heap nodes they
+//   use, dropped on reset, so a parameter may be reassigned while a
+//   graph built on its old node is still alive
+// - assigning an arena value to a handle holding a heap leaf copies the
+//   value into a fresh heap leaf, so parameters never move into the
+//   arena; declare a handle inside the scope to keep the graph instead
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+
+namespace ptMgrad {
+
+
+class Arena {
+private:
+    struct Block {
+        Block* next;
+        size_t size;
+    };
+
+    struct Deferred {
+        void (*fn)(void*);
+        void* p;
+    };
+
+    static inline thread_local Arena* active = nullptr;
+
+    Block* head = nullptr;
+    Block* cur = nullptr;
+    char* ptr = nullptr;
+    char* end = nullptr;
+    size_t block_size;
+    size_t nblocks = 0;
+    size_t used = 0;
+    std::vector<Deferred> deferred;
+
+    static char* data(Block* b) {
+        return reinterpret_cast<char*>(b + 1);
+    }
+
+    static char* align_up(char* p, size_t align) {
+        auto v = reinterpret_cast<std::uintptr_t>(p);
+        return reinterpret_cast<char*>((v + align - 1) & ~(std::uintptr_t(align) - 1));
+    }
+
+    // last registered first, like destructors
+    void run_deferred() {
+        while (!deferred.empty()) {
+            Deferred d = deferred.back();
+            deferred.pop_back();
+            d.fn(d.p);
+        }
+    }
+
+    void enter(Block* b) {
+        cur = b;
+        ptr = data(b);
+        end = ptr + b->size;
+    }
+
+    // move on to the next retained block, or allocate one if none fits
+    void grow(size_t n, size_t align) {
+        size_t need = n + align;
+        Block* next = cur ? cur->next : head;
+        if (next && next->size >= need) {
+            enter(next);
+            return;
+        }
+
+        size_t size = need > block_size ? need : block_size;
+        Block* b = static_cast<Block*>(std::malloc(sizeof(Block) + size));
+        if (!b) {
+            throw std::bad_alloc();
+        }
+        b->size = size;
+        b->next = next;
+        if (cur) {
+            cur->next = b;
+        } else {
+            head = b;
+        }
+        ++nblocks;
+        enter(b);
+    }
+
+public:
+    explicit Arena(size_t block_size = size_t(1) << 16) : block_size(block_size) {}
+
+    ~Arena() {
+        if (active == this) {
+            active = nullptr;
+        }
+        run_deferred();
+        while (head) {
+            Block* next = head->next;
+            std::free(head);
+            head = next;
+        }
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t n, size_t align = alignof(std::max_align_t)) {
+        char* p = align_up(ptr, align);
+        if (!cur || p + n > end) {
+            grow(n, align);
+            p = align_up(ptr, align);
+        }
+        ptr = p + n;
+        used += n;
+        return p;
+    }
+
+    template <typename U, typename... Args>
+    U* create(Args&&... args) {
+        return new (allocate(sizeof(U), alignof(U))) U(std::forward<Args>(args)...);
+    }
+
+    // call fn(p) on the next reset, for what the arena's contents hold
+    // outside of it
+    void defer(void (*fn)(void*), void* p) {
+        deferred.push_back({fn, p});
+    }
+
+    // drop everything allocated so far; blocks are kept for reuse,
+    // so a steady-state training loop stops calling malloc after warm-up
+    void reset() {
+        run_deferred();
+        if (head) {
+            enter(head);
+        }
+        used = 0;
+    }
+
+    size_t bytes_used() const {
+        return used;
+    }
+
+    size_t num_blocks() const {
+        return nblocks;
+    }
+
+    static Arena* current() {
+        return active;
+    }
+
+    friend class ArenaScope;
+};
+
+
+// makes an arena the allocator for graph nodes of this thread,
+// and frees the graph built inside it when the scope ends
+class ArenaScope {
+private:
+    Arena& arena;
+    Arena* prev;
+
+public:
+    explicit ArenaScope(Arena& arena) : arena(arena), prev(Arena::active) {
+        Arena::active = &arena;
+    }
+
+    ~ArenaScope() {
+        Arena::active = prev;
+        arena.reset();
+    }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+}  // namespace ptMgrad
@@ -0,0 +1,350 @@
+// gradient checkpointing. checkpoint(fn, inputs) runs fn, a segment of
+// the forward, without keeping its graph: what it builds is a node for
+// the segment, over the inputs, and a node for every output of fn over
+// that one. backward runs fn again from the inputs, this time building
+// its graph, passes the gradients of the outputs through it and drops
+// it. a segment thus holds on to its outputs rather than to all of its
+// nodes, at the price of a second forward.
+//
+// fn has to compute the same thing every time, and whatever else it
+// reads, such as the parameters of a layer, has to outlive backward;
+// those get their gradients during the second run.
+//
+// Checkpointed runs a sequence of stages, such as the layers of an MLP,
+// and picks the spans of them to checkpoint so that the graph held for
+// backward fits in a memory budget
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "engine.h"
+
+
+namespace ptMgrad {
+
+
+// a leaf with the value of v, and none of the graph below it
+template <typename T>
+inline
+Value<T>
+detach(const Value<T>& v) {
+    Value<T> __k;
+    __k.set_data(v.dataX(), v.dataY());
+    __k.set_requires_grad(v.requires_grad());
+    return __k;
+}
+
+
+// the outputs of a segment function, which returns a Value or a
+// vector of them
+template <typename T>
+inline std::vector<Value<T>> segment_outputs(std::vector<Value<T>> out) {
+    return out;
+}
+
+template <typename T>
+inline std::vector<Value<T>> segment_outputs(Value<T> out) {
+    return {std::move(out)};
+}
+
+
+// the nodes of a segment over inputs: one for the segment, which keeps
+// an S made from args after its operands, and an Output over it for
+// each of the values S computed. the result is shaped like that of F
+template <typename T, class S, class F, class... Args>
+inline
+auto
+segment_nodes(const std::vector<Value<T>>& inputs, Args&&... args) {
+    using Result = std::decay_t<std::invoke_result_t<F&, const std::vector<Value<T>>&>>;
+    static_assert(alignof(S) <= alignof(Node<T>*), "the segment must fit after the operands");
+
+    Value<T> __k;
+    void* extra = __k.reserve_children(inputs.size(), sizeof(S));
+    S* segment = new (extra) S(std::forward<Args>(args)...);
+    for (const Value<T>& v : inputs) {
+        __k.add_child(v);
+    }
+    // what fn reads besides its inputs is not an operand, so the
+    // segment has to be run whatever its operands are
+    __k.set_requires_grad(true);
+    __k.set_backward(Op::Checkpoint);
+
+    std::vector<Value<T>> out;
+    out.reserve(segment->xs.size());
+    for (size_t i = 0; i < segment->xs.size(); ++i) {
+        Value<T> o;
+        o.set_data(segment->xs[i], segment->ys[i]);
+        o.add_child(__k);
+        o.set_backward(Op::Output, T(double(i)));
+        out.push_back(std::move(o));
+    }
+
+    if constexpr (std::is_same_v<Result, Value<T>>) {
+        return out[0];
+    } else {
+        return out;
+    }
+}
+
+
+// the function of a checkpoint, kept in its segment node
+template <typename T, class F>
+struct SegmentOf : Node<T>::Segment {
+    F fn;
+
+    // the first run, for the values of the outputs only
+    SegmentOf(F _fn, const std::vector<Value<T>>& inputs) : fn(std::move(_fn)) {
+        std::vector<Value<T>> out;
+        {
+            NoGradGuard no_grad;
+            out = segment_outputs<T>(fn(inputs));
+        }
+        for (const Value<T>& o : out) {
+            this->xs.push_back(o.dataX());
+            this->ys.push_back(o.dataY());
+        }
+        this->grads.assign(out.size(), T(0.0));
+        this->apply = &SegmentOf::run;
+        this->destroy = [](typename Node<T>::Segment& s) {
+            static_cast<SegmentOf&>(s).~SegmentOf();
+        };
+    }
+
+    static void run(typename Node<T>::Segment& s, Node<T>& node, bool forward) {
+        auto& self = static_cast<SegmentOf&>(s);
+
+        // the second run records on a tape of its own, never on one
+        // that is being run backward
+        Tape<T> tape;
+        TapeScope<T> scope(tape);
+
+        std::vector<Value<T>> in;
+        in.reserve(node.num_children());
+        for (size_t i = 0, n = node.num_children(); i < n; ++i) {
+            const Node<T>& c = node.child(i);
+            Value<T> leaf;
+            leaf.set_data(c.x, c.dataY());
+            leaf.set_requires_grad(c.requires_grad);
+            in.push_back(std::move(leaf));
+        }
+
+        std::vector<Value<T>> out;
+        if (forward) {
+            NoGradGuard no_grad;
+            out = segment_outputs<T>(self.fn(in));
+        } else {
+            out = segment_outputs<T>(self.fn(in));
+        }
+        if (out.size() != self.xs.size()) {
+            throw std::logic_error("checkpointed function changed its number of outputs");
+        }
+
+        if (forward) {
+            for (size_t i = 0; i < out.size(); ++i) {
+                self.xs[i] = out[i].dataX();
+                self.ys[i] = out[i].dataY();
+            }
+            return;
+        }
+
+        backward(out, self.grads);
+        for (size_t i = 0; i < in.size(); ++i) {
+            node.child(i).add_grad(in[i].get_grad());
+        }
+        std::fill(self.grads.begin(), self.grads.end(), T(0.0));
+    }
+};
+
+
+// fn(inputs), with the graph of fn rebuilt during backward instead of
+// kept. fn returns a Value or a vector of them, and so does checkpoint.
+// under an ArenaScope, run backward before the arena is reset: the
+// segment frees what it owns only then
+template <typename T, class F>
+inline
+auto
+checkpoint(F fn, const std::vector<Value<T>>& inputs) {
+    using Result = std::decay_t<std::invoke_result_t<F&, const std::vector<Value<T>>&>>;
+
+    if (NoGradGuard::enabled()) {
+        return Result(fn(inputs));
+    }
+    // fresh output nodes, since fn may return one of its inputs
+    return segment_nodes<T, SegmentOf<T, F>, F>(inputs, std::move(fn), inputs);
+}
+
+
+// a segment of the forward, from its inputs to its outputs
+template <typename T>
+using Stage = std::function<std::vector<Value<T>>(const std::vector<Value<T>>&)>;
+
+
+// stages run one after the other, with spans of them checkpointed so
+// that the graph held for backward fits in budget bytes. the first
+// call measures every stage, building its graph once on its own, and
+// picks the spans; later calls reuse them, so the inputs should keep
+// their size. the stages are called from backward, so they and this
+// object have to outlive it
+template <typename T>
+class Checkpointed {
+public:
+    // stages begin to end, kept as they are or checkpointed as one
+    struct Span {
+        size_t begin;
+        size_t end;
+        bool checkpointed;
+    };
+
+private:
+    std::vector<Stage<T>> stages;
+    size_t budget;
+    std::vector<Span> spans;
+    size_t peak = 0;
+
+    std::vector<Value<T>> run(size_t begin, size_t end, std::vector<Value<T>> x) const {
+        for (size_t i = begin; i < end; ++i) {
+            x = stages[i](x);
+        }
+        return x;
+    }
+
+    // every split into spans of at most `cap` bytes is tried, with as
+    // few of them checkpointed as fit. the one that fits and runs the
+    // least again wins; if none fits, the one that holds the least
+    void plan(const std::vector<Value<T>>& inputs) {
+        size_t n = stages.size();
+
+        // bytes of the graph of every stage, and the number of values
+        // between stages
+        std::vector<size_t> cost(n), width(n + 1);
+        width[0] = inputs.size();
+        std::vector<Value<T>> x;
+        for (const Value<T>& v : inputs) {
+            x.push_back(detach(v));
+        }
+        for (size_t i = 0; i < n; ++i) {
+            std::vector<Value<T>> y;
+            {
+                Tape<T> tape;
+                TapeScope<T> scope(tape);
+                y = stages[i](x);
+                cost[i] = tape.bytes();
+            }
+            width[i + 1] = y.size();
+            x.clear();
+            for (const Value<T>& v : y) {
+                x.push_back(detach(v));
+            }
+        }
+
+        std::vector<size_t> prefix(n + 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            prefix[i + 1] = prefix[i] + cost[i];
+        }
+
+        // what a checkpointed span holds: its outputs, and the segment
+        // with its operands. during backward, the largest one is built
+        // again on top of everything else
+        auto held = [&](const std::vector<Span>& split) {
+            size_t total = 0, rebuilt = 0;
+            for (const Span& s : split) {
+                size_t c = prefix[s.end] - prefix[s.begin];
+                if (s.checkpointed) {
+                    total += (width[s.end] + 1) * sizeof(Node<T>) + width[s.begin] * sizeof(Node<T>*);
+                    rebuilt = std::max(rebuilt, c);
+                } else {
+                    total += c;
+                }
+            }
+            return total + rebuilt;
+        };
+
+        std::vector<size_t> caps;
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = i + 1; j <= n; ++j) {
+                caps.push_back(prefix[j] - prefix[i]);
+            }
+        }
+        std::sort(caps.begin(), caps.end());
+        caps.erase(std::unique(caps.begin(), caps.end()), caps.end());
+
+        bool best_fits = false;
+        size_t best_held = 0, best_rerun = 0;
+        for (size_t cap : caps) {
+            std::vector<Span> split;
+            for (size_t i = 0; i < n; ++i) {
+                if (split.empty() || prefix[i + 1] - prefix[split.back().begin] > cap) {
+                    split.push_back({i, i + 1, true});
+                } else {
+                    split.back().end = i + 1;
+                }
+            }
+            for (Span& s : split) {
+                s.checkpointed = false;
+                if (held(split) > budget) {
+                    s.checkpointed = true;
+                }
+            }
+
+            size_t h = held(split), rerun = 0;
+            for (const Span& s : split) {
+                rerun += s.checkpointed ? prefix[s.end] - prefix[s.begin] : 0;
+            }
+            bool fits = h <= budget;
+            if (spans.empty() || (fits && (!best_fits || rerun < best_rerun)) ||
+                (!fits && !best_fits && h < best_held)) {
+                spans = split;
+                best_fits = fits;
+                best_held = h;
+                best_rerun = rerun;
+            }
+        }
+        peak = best_held;
+    }
+
+public:
+    Checkpointed(std::vector<Stage<T>> stages, size_t budget)
+        : stages(std::move(stages)), budget(budget) {}
+
+    std::vector<Value<T>> operator()(const std::vector<Value<T>>& inputs) {
+        if (NoGradGuard::enabled()) {
+            return run(0, stages.size(), inputs);
+        }
+        if (spans.empty() && !stages.empty()) {
+            plan(inputs);
+        }
+
+        std::vector<Value<T>> x = inputs;
+        for (const Span& s : spans) {
+            if (s.checkpointed) {
+                x = checkpoint([this, s](const std::vector<Value<T>>& in) {
+                    return run(s.begin, s.end, in);
+                }, x);
+            } else {
+                x = run(s.begin, s.end, std::move(x));
+            }
+        }
+        return x;
+    }
+
+    // the spans picked by the first call, in order
+    const std::vector<Span>& segments() const {
+        return spans;
+    }
+
+    // estimated bytes of the graph held for backward, including the
+    // largest checkpointed span while it is built again
+    size_t peak_bytes() const {
+        return peak;
+    }
+};
+
+}  // namespace ptMgrad
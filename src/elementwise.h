@@ -0,0 +1,526 @@
+// elementwise arithmetic over contiguous buffers. one op applied to n
+// elements, with the other operand a second buffer or a single value,
+// in vectors of whatever width the CPU has: AVX-512, AVX2 or SSE2 on
+// x86-64, and a portable loop otherwise, which also serves complex
+// elements.
+//
+// every vector op is the IEEE operation of the scalar loop lane by
+// lane, so that each kernel gives the portable one's results bit for
+// bit, NaNs and signed zeros included
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "engine.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PTMGRAD_ELEMENTWISE_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace ptMgrad {
+
+
+// the ops. with a single value s for the other operand, RSub is s - a
+// and RDiv s / a
+enum class ElementwiseOp : unsigned char {
+    Add,
+    Sub,
+    Mul,
+    Div,
+    RSub,
+    RDiv,
+    Neg,
+    Relu,
+    Square
+};
+
+
+// a set of kernels: out = a op b, out = a op s, and out = op a, over
+// n elements each
+template <typename T>
+struct ElementwiseKernel {
+    const char* name;
+    void (*binary)(ElementwiseOp op, size_t n, T* out, const T* a, const T* b);
+    void (*scalar)(ElementwiseOp op, size_t n, T* out, const T* a, T s);
+    void (*unary)(ElementwiseOp op, size_t n, T* out, const T* a);
+};
+
+
+namespace kernel {
+
+// complex has no unary minus
+template <class T>
+inline T negate(const T& x) {
+    if constexpr (is_complex_v<T>) {
+        return T(-x.real(), -x.imag());
+    } else {
+        return -x;
+    }
+}
+
+// relu of complex values works on either part alone
+template <class T>
+inline T relu(const T& x) {
+    if constexpr (is_complex_v<T>) {
+        using R = decltype(x.real());
+        return T(x.real() < R(0) ? R(0) : x.real(), x.imag() < R(0) ? R(0) : x.imag());
+    } else {
+        return x < T(0) ? T(0) : x;
+    }
+}
+
+// one element of an op, which every kernel's vectors match
+template <ElementwiseOp O, class T>
+inline T apply(const T& a, const T& b) {
+    if constexpr (O == ElementwiseOp::Add) {
+        return a + b;
+    } else if constexpr (O == ElementwiseOp::Sub) {
+        return a - b;
+    } else if constexpr (O == ElementwiseOp::Mul) {
+        return a * b;
+    } else if constexpr (O == ElementwiseOp::Div) {
+        return a / b;
+    } else if constexpr (O == ElementwiseOp::RSub) {
+        return b - a;
+    } else if constexpr (O == ElementwiseOp::RDiv) {
+        return b / a;
+    } else if constexpr (O == ElementwiseOp::Neg) {
+        return kernel::negate(a);
+    } else if constexpr (O == ElementwiseOp::Relu) {
+        return kernel::relu(a);
+    } else {
+        return a * a;
+    }
+}
+
+// f(std::integral_constant<ElementwiseOp, op>()), turning an op known
+// at run time into one known at compile time
+template <class F>
+inline void with_op(ElementwiseOp op, F f) {
+    using O = ElementwiseOp;
+    switch (op) {
+    case O::Add: f(std::integral_constant<O, O::Add>()); break;
+    case O::Sub: f(std::integral_constant<O, O::Sub>()); break;
+    case O::Mul: f(std::integral_constant<O, O::Mul>()); break;
+    case O::Div: f(std::integral_constant<O, O::Div>()); break;
+    case O::RSub: f(std::integral_constant<O, O::RSub>()); break;
+    case O::RDiv: f(std::integral_constant<O, O::RDiv>()); break;
+    case O::Neg: f(std::integral_constant<O, O::Neg>()); break;
+    case O::Relu: f(std::integral_constant<O, O::Relu>()); break;
+    case O::Square: f(std::integral_constant<O, O::Square>()); break;
+    }
+}
+
+
+// the vectors of an instruction set: lanes elements at a time, loaded
+// and stored unaligned. they take and return pointers only, so that
+// no vector crosses into code built for another instruction set
+template <class T>
+struct Portable {
+    static constexpr size_t lanes = 1;
+
+    template <ElementwiseOp O>
+    static void binary(T* out, const T* a, const T* b) {
+        *out = apply<O>(*a, *b);
+    }
+};
+
+#ifdef PTMGRAD_ELEMENTWISE_X86
+
+template <class T>
+struct Sse2;
+
+template <>
+struct Sse2<double> {
+    static constexpr size_t lanes = 2;
+
+    template <ElementwiseOp O>
+    static void binary(double* out, const double* a, const double* b) {
+        __m128d x = _mm_loadu_pd(a);
+        __m128d r;
+        if constexpr (O == ElementwiseOp::Add) {
+            r = _mm_add_pd(x, _mm_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Sub) {
+            r = _mm_sub_pd(x, _mm_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Mul) {
+            r = _mm_mul_pd(x, _mm_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Div) {
+            r = _mm_div_pd(x, _mm_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::RSub) {
+            r = _mm_sub_pd(_mm_loadu_pd(b), x);
+        } else if constexpr (O == ElementwiseOp::RDiv) {
+            r = _mm_div_pd(_mm_loadu_pd(b), x);
+        } else if constexpr (O == ElementwiseOp::Neg) {
+            r = _mm_xor_pd(x, _mm_set1_pd(-0.0));
+        } else if constexpr (O == ElementwiseOp::Relu) {
+            r = _mm_andnot_pd(_mm_cmplt_pd(x, _mm_setzero_pd()), x);
+        } else {
+            r = _mm_mul_pd(x, x);
+        }
+        _mm_storeu_pd(out, r);
+    }
+};
+
+template <>
+struct Sse2<float> {
+    static constexpr size_t lanes = 4;
+
+    template <ElementwiseOp O>
+    static void binary(float* out, const float* a, const float* b) {
+        __m128 x = _mm_loadu_ps(a);
+        __m128 r;
+        if constexpr (O == ElementwiseOp::Add) {
+            r = _mm_add_ps(x, _mm_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Sub) {
+            r = _mm_sub_ps(x, _mm_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Mul) {
+            r = _mm_mul_ps(x, _mm_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Div) {
+            r = _mm_div_ps(x, _mm_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::RSub) {
+            r = _mm_sub_ps(_mm_loadu_ps(b), x);
+        } else if constexpr (O == ElementwiseOp::RDiv) {
+            r = _mm_div_ps(_mm_loadu_ps(b), x);
+        } else if constexpr (O == ElementwiseOp::Neg) {
+            r = _mm_xor_ps(x, _mm_set1_ps(-0.0f));
+        } else if constexpr (O == ElementwiseOp::Relu) {
+            r = _mm_andnot_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), x);
+        } else {
+            r = _mm_mul_ps(x, x);
+        }
+        _mm_storeu_ps(out, r);
+    }
+};
+
+
+template <class T>
+struct Avx2;
+
+template <>
+struct Avx2<double> {
+    static constexpr size_t lanes = 4;
+
+    template <ElementwiseOp O>
+    __attribute__((target("avx2")))
+    static void binary(double* out, const double* a, const double* b) {
+        __m256d x = _mm256_loadu_pd(a);
+        __m256d r;
+        if constexpr (O == ElementwiseOp::Add) {
+            r = _mm256_add_pd(x, _mm256_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Sub) {
+            r = _mm256_sub_pd(x, _mm256_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Mul) {
+            r = _mm256_mul_pd(x, _mm256_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Div) {
+            r = _mm256_div_pd(x, _mm256_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::RSub) {
+            r = _mm256_sub_pd(_mm256_loadu_pd(b), x);
+        } else if constexpr (O == ElementwiseOp::RDiv) {
+            r = _mm256_div_pd(_mm256_loadu_pd(b), x);
+        } else if constexpr (O == ElementwiseOp::Neg) {
+            r = _mm256_xor_pd(x, _mm256_set1_pd(-0.0));
+        } else if constexpr (O == ElementwiseOp::Relu) {
+            r = _mm256_andnot_pd(_mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LT_OQ), x);
+        } else {
+            r = _mm256_mul_pd(x, x);
+        }
+        _mm256_storeu_pd(out, r);
+    }
+};
+
+template <>
+struct Avx2<float> {
+    static constexpr size_t lanes = 8;
+
+    template <ElementwiseOp O>
+    __attribute__((target("avx2")))
+    static void binary(float* out, const float* a, const float* b) {
+        __m256 x = _mm256_loadu_ps(a);
+        __m256 r;
+        if constexpr (O == ElementwiseOp::Add) {
+            r = _mm256_add_ps(x, _mm256_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Sub) {
+            r = _mm256_sub_ps(x, _mm256_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Mul) {
+            r = _mm256_mul_ps(x, _mm256_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Div) {
+            r = _mm256_div_ps(x, _mm256_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::RSub) {
+            r = _mm256_sub_ps(_mm256_loadu_ps(b), x);
+        } else if constexpr (O == ElementwiseOp::RDiv) {
+            r = _mm256_div_ps(_mm256_loadu_ps(b), x);
+        } else if constexpr (O == ElementwiseOp::Neg) {
+            r = _mm256_xor_ps(x, _mm256_set1_ps(-0.0f));
+        } else if constexpr (O == ElementwiseOp::Relu) {
+            r = _mm256_andnot_ps(_mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ), x);
+        } else {
+            r = _mm256_mul_ps(x, x);
+        }
+        _mm256_storeu_ps(out, r);
+    }
+};
+
+
+// AVX-512F has no floating point xor, which is AVX-512DQ: the sign is
+// flipped as integers
+template <class T>
+struct Avx512;
+
+template <>
+struct Avx512<double> {
+    static constexpr size_t lanes = 8;
+
+    template <ElementwiseOp O>
+    __attribute__((target("avx512f")))
+    static void binary(double* out, const double* a, const double* b) {
+        __m512d x = _mm512_loadu_pd(a);
+        __m512d r;
+        if constexpr (O == ElementwiseOp::Add) {
+            r = _mm512_add_pd(x, _mm512_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Sub) {
+            r = _mm512_sub_pd(x, _mm512_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Mul) {
+            r = _mm512_mul_pd(x, _mm512_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::Div) {
+            r = _mm512_div_pd(x, _mm512_loadu_pd(b));
+        } else if constexpr (O == ElementwiseOp::RSub) {
+            r = _mm512_sub_pd(_mm512_loadu_pd(b), x);
+        } else if constexpr (O == ElementwiseOp::RDiv) {
+            r = _mm512_div_pd(_mm512_loadu_pd(b), x);
+        } else if constexpr (O == ElementwiseOp::Neg) {
+            r = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(x),
+                                                     _mm512_set1_epi64(INT64_MIN)));
+        } else if constexpr (O == ElementwiseOp::Relu) {
+            __mmask8 negative = _mm512_cmp_pd_mask(x, _mm512_setzero_pd(), _CMP_LT_OQ);
+            r = _mm512_maskz_mov_pd(__mmask8(~negative), x);
+        } else {
+            r = _mm512_mul_pd(x, x);
+        }
+        _mm512_storeu_pd(out, r);
+    }
+};
+
+template <>
+struct Avx512<float> {
+    static constexpr size_t lanes = 16;
+
+    template <ElementwiseOp O>
+    __attribute__((target("avx512f")))
+    static void binary(float* out, const float* a, const float* b) {
+        __m512 x = _mm512_loadu_ps(a);
+        __m512 r;
+        if constexpr (O == ElementwiseOp::Add) {
+            r = _mm512_add_ps(x, _mm512_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Sub) {
+            r = _mm512_sub_ps(x, _mm512_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Mul) {
+            r = _mm512_mul_ps(x, _mm512_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::Div) {
+            r = _mm512_div_ps(x, _mm512_loadu_ps(b));
+        } else if constexpr (O == ElementwiseOp::RSub) {
+            r = _mm512_sub_ps(_mm512_loadu_ps(b), x);
+        } else if constexpr (O == ElementwiseOp::RDiv) {
+            r = _mm512_div_ps(_mm512_loadu_ps(b), x);
+        } else if constexpr (O == ElementwiseOp::Neg) {
+            r = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(x),
+                                                     _mm512_set1_epi32(INT32_MIN)));
+        } else if constexpr (O == ElementwiseOp::Relu) {
+            __mmask16 negative = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_LT_OQ);
+            r = _mm512_maskz_mov_ps(__mmask16(~negative), x);
+        } else {
+            r = _mm512_mul_ps(x, x);
+        }
+        _mm512_storeu_ps(out, r);
+    }
+};
+
+#endif  // PTMGRAD_ELEMENTWISE_X86
+
+
+// the loops, lanes of V at a time and then one element at a time for
+// the rest. a single value s is spread over a vector's worth of lanes
+// once, and a unary op reads its operand as the second as well. all
+// are always inlined, into functions built for V's instruction set
+template <template <class> class V, ElementwiseOp O, class T>
+__attribute__((always_inline))
+inline void binary_loop(size_t n, T* out, const T* a, const T* b) {
+    size_t i = 0;
+    for (; i + V<T>::lanes <= n; i += V<T>::lanes) {
+        V<T>::template binary<O>(out + i, a + i, b + i);
+    }
+    for (; i < n; ++i) {
+        out[i] = apply<O>(a[i], b[i]);
+    }
+}
+
+template <template <class> class V, ElementwiseOp O, class T>
+__attribute__((always_inline))
+inline void scalar_loop(size_t n, T* out, const T* a, T s) {
+    T spread[V<T>::lanes];
+    for (auto& x : spread) {
+        x = s;
+    }
+    size_t i = 0;
+    for (; i + V<T>::lanes <= n; i += V<T>::lanes) {
+        V<T>::template binary<O>(out + i, a + i, spread);
+    }
+    for (; i < n; ++i) {
+        out[i] = apply<O>(a[i], s);
+    }
+}
+
+template <template <class> class V, class T>
+__attribute__((always_inline))
+inline void binary_lanes(ElementwiseOp op, size_t n, T* out, const T* a, const T* b) {
+    using O = ElementwiseOp;
+    switch (op) {
+    case O::Add: binary_loop<V, O::Add>(n, out, a, b); break;
+    case O::Sub: binary_loop<V, O::Sub>(n, out, a, b); break;
+    case O::Mul: binary_loop<V, O::Mul>(n, out, a, b); break;
+    case O::Div: binary_loop<V, O::Div>(n, out, a, b); break;
+    case O::RSub: binary_loop<V, O::RSub>(n, out, a, b); break;
+    case O::RDiv: binary_loop<V, O::RDiv>(n, out, a, b); break;
+    case O::Neg: binary_loop<V, O::Neg>(n, out, a, b); break;
+    case O::Relu: binary_loop<V, O::Relu>(n, out, a, b); break;
+    case O::Square: binary_loop<V, O::Square>(n, out, a, b); break;
+    }
+}
+
+template <template <class> class V, class T>
+__attribute__((always_inline))
+inline void scalar_lanes(ElementwiseOp op, size_t n, T* out, const T* a, T s) {
+    using O = ElementwiseOp;
+    switch (op) {
+    case O::Add: scalar_loop<V, O::Add>(n, out, a, s); break;
+    case O::Sub: scalar_loop<V, O::Sub>(n, out, a, s); break;
+    case O::Mul: scalar_loop<V, O::Mul>(n, out, a, s); break;
+    case O::Div: scalar_loop<V, O::Div>(n, out, a, s); break;
+    case O::RSub: scalar_loop<V, O::RSub>(n, out, a, s); break;
+    case O::RDiv: scalar_loop<V, O::RDiv>(n, out, a, s); break;
+    default: binary_lanes<V>(op, n, out, a, a); break;
+    }
+}
+
+template <template <class> class V, class T>
+__attribute__((always_inline))
+inline void unary_lanes(ElementwiseOp op, size_t n, T* out, const T* a) {
+    binary_lanes<V>(op, n, out, a, a);
+}
+
+template <class T>
+inline void binary_portable(ElementwiseOp op, size_t n, T* out, const T* a, const T* b) {
+    binary_lanes<Portable>(op, n, out, a, b);
+}
+
+template <class T>
+inline void scalar_portable(ElementwiseOp op, size_t n, T* out, const T* a, T s) {
+    scalar_lanes<Portable>(op, n, out, a, s);
+}
+
+template <class T>
+inline void unary_portable(ElementwiseOp op, size_t n, T* out, const T* a) {
+    unary_lanes<Portable>(op, n, out, a);
+}
+
+#ifdef PTMGRAD_ELEMENTWISE_X86
+
+template <class T>
+inline void binary_sse2(ElementwiseOp op, size_t n, T* out, const T* a, const T* b) {
+    binary_lanes<Sse2>(op, n, out, a, b);
+}
+
+template <class T>
+inline void scalar_sse2(ElementwiseOp op, size_t n, T* out, const T* a, T s) {
+    scalar_lanes<Sse2>(op, n, out, a, s);
+}
+
+template <class T>
+inline void unary_sse2(ElementwiseOp op, size_t n, T* out, const T* a) {
+    unary_lanes<Sse2>(op, n, out, a);
+}
+
+template <class T>
+__attribute__((target("avx2")))
+inline void binary_avx2(ElementwiseOp op, size_t n, T* out, const T* a, const T* b) {
+    binary_lanes<Avx2>(op, n, out, a, b);
+}
+
+template <class T>
+__attribute__((target("avx2")))
+inline void scalar_avx2(ElementwiseOp op, size_t n, T* out, const T* a, T s) {
+    scalar_lanes<Avx2>(op, n, out, a, s);
+}
+
+template <class T>
+__attribute__((target("avx2")))
+inline void unary_avx2(ElementwiseOp op, size_t n, T* out, const T* a) {
+    unary_lanes<Avx2>(op, n, out, a);
+}
+
+template <class T>
+__attribute__((target("avx512f")))
+inline void binary_avx512(ElementwiseOp op, size_t n, T* out, const T* a, const T* b) {
+    binary_lanes<Avx512>(op, n, out, a, b);
+}
+
+template <class T>
+__attribute__((target("avx512f")))
+inline void scalar_avx512(ElementwiseOp op, size_t n, T* out, const T* a, T s) {
+    scalar_lanes<Avx512>(op, n, out, a, s);
+}
+
+template <class T>
+__attribute__((target("avx512f")))
+inline void unary_avx512(ElementwiseOp op, size_t n, T* out, const T* a) {
+    unary_lanes<Avx512>(op, n, out, a);
+}
+
+#endif  // PTMGRAD_ELEMENTWISE_X86
+
+}  // namespace kernel
+
+
+// the kernels this CPU can run, widest first; the portable one is
+// always last
+template <typename T>
+inline
+std::vector<ElementwiseKernel<T>>
+elementwise_kernels() {
+    std::vector<ElementwiseKernel<T>> kernels;
+#ifdef PTMGRAD_ELEMENTWISE_X86
+    if constexpr (std::is_same_v<T, double> || std::is_same_v<T, float>) {
+        if (__builtin_cpu_supports("avx512f")) {
+            kernels.push_back({"avx512", &kernel::binary_avx512<T>, &kernel::scalar_avx512<T>,
+                               &kernel::unary_avx512<T>});
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.push_back({"avx2", &kernel::binary_avx2<T>, &kernel::scalar_avx2<T>,
+                               &kernel::unary_avx2<T>});
+        }
+        kernels.push_back({"sse2", &kernel::binary_sse2<T>, &kernel::scalar_sse2<T>,
+                           &kernel::unary_sse2<T>});
+    }
+#endif
+    kernels.push_back({"portable", &kernel::binary_portable<T>, &kernel::scalar_portable<T>,
+                       &kernel::unary_portable<T>});
+    return kernels;
+}
+
+// the widest of them, picked once
+template <typename T>
+inline
+const ElementwiseKernel<T>&
+elementwise_kernel() {
+    static const ElementwiseKernel<T> best = elementwise_kernels<T>().front();
+    return best;
+}
+
+
+}  // namespace ptMgrad
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <set>
 #include <functional>
@@ -15,8 +16,15 @@
 #include <type_traits>
 #include <stdexcept>
 #include <memory>
+#include <initializer_list>
 #include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <atomic>
 
+#include "arena.h"
+#include "parallel.h"
 #include "complex.h"
 
 
@@ -33,153 +41,1540 @@ template <typename U>
 inline constexpr bool is_complex_v = is_complex<U>::value;
 
 
+// operation that produced a node; run_forward and run_backward
+// dispatch on it. Add and Sub also cover the forms with a constant
+// operand, which simply have a single child
+enum class Op : unsigned char {
+    None,       // leaf
+    Cast,       // conversion from an operand of another type
+    Add,
+    Sub,
+    Mul,
+    MulConst,
+    Div,
+    DivConst,
+    Neg,
+    Pow,
+    PowConst,
+    Relu,
+    Sum,        // sum of any number of operands
+    Dot,        // sum of a[i] * b[i], operands a then b
+    Fused,      // compound expression of expr.h, with generated kernels
+    Checkpoint, // segment of the forward with a backward of its own, see checkpoint.h
+    Output,     // one output of a Checkpoint, its only child
+    Freed       // an op whose graph backward has freed, see Node::free_graph
+};
+
+
+// a node of the computational graph, Value is a handle to one.
+// ops link to the nodes of their operands, so a value used several
+// times is still a single node and backward visits it once.
+// nodes built while an Arena is active live in it and go away
+// with the arena, all others are reference counted on the heap
+template <typename T>
+class Tape;
+
+template <typename T>
+class Graph;
+
+template <typename T>
+class Trace;
+
+
+// backward leaves out ops whose gradient is exactly zero: they would
+// only pass zeros on, so a subgraph reached through them alone stays
+// at zero and is left out too. skipped() counts the ops left out,
+// over all threads, since the last reset
+class BackwardStats {
+private:
+    static inline std::atomic<uint64_t> n_skipped{0};
+
+public:
+    static uint64_t skipped() {
+        return n_skipped.load(std::memory_order_relaxed);
+    }
+
+    static void reset() {
+        n_skipped.store(0, std::memory_order_relaxed);
+    }
+
+    static void add_skipped(uint64_t n) {
+        if (n) {
+            n_skipped.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+};
+
+
+// the gradient of a leaf is stamped with the generation it was last
+// written in, and one from an older generation reads as zero. advance()
+// thus zeroes the gradient of every leaf at once, without touching any
+class GradGeneration {
+private:
+    static inline std::atomic<uint32_t> value{0};
+
+public:
+    static uint32_t current() {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    static void advance() {
+        value.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+
+// a generation of its own for a group of leaves, such as the parameters
+// of a module. a leaf bound to a scope is stamped with the sum of the
+// global generation and those of its scope and the scopes around it, so
+// that advancing any of them zeroes its gradient and no other. handles
+// share the scope they were copied from; the leaves bound to it hold
+// counted references to its Counter, which therefore outlives them
+class GradScope {
+public:
+    struct Counter {
+        std::atomic<uint32_t> value{0};
+        std::atomic<uint32_t> refs{1};
+        Counter* parent = nullptr;
+    };
+
+private:
+    Counter* counter;
+
+public:
+    GradScope() : counter(new Counter) {}
+
+    GradScope(const GradScope& other) : counter(other.counter) {
+        retain(counter);
+    }
+
+    GradScope& operator=(const GradScope& other) {
+        retain(other.counter);
+        release(counter);
+        counter = other.counter;
+        return *this;
+    }
+
+    ~GradScope() {
+        release(counter);
+    }
+
+    Counter* get() const {
+        return counter;
+    }
+
+    void advance() {
+        counter->value.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // make this scope one of those advancing parent zeroes. done before
+    // any of its leaves gets a gradient, since it moves their generation
+    void nest_in(const GradScope& parent) {
+        retain(parent.counter);
+        release(counter->parent);
+        counter->parent = parent.counter;
+    }
+
+    static void retain(Counter* c) {
+        if (c) {
+            c->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    static void release(Counter* c) {
+        while (c && c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            Counter* parent = c->parent;
+            delete c;
+            c = parent;
+        }
+    }
+
+    // the generation of a leaf in scope c, or of one in none
+    static uint32_t current(const Counter* c) {
+        uint32_t g = GradGeneration::current();
+        for (; c; c = c->parent) {
+            g += c->value.load(std::memory_order_relaxed);
+        }
+        return g;
+    }
+};
+
+
+// the second component y of a value. only complex values keep one;
+// for real types it reads as zero and takes no space in the node
+template <typename T, bool = is_complex_v<T>>
+struct SecondComponent {
+    T y;
+
+    explicit SecondComponent(const T& y) : y(y) {}
+
+    T dataY() const {
+        return y;
+    }
+
+    void set_y(const T& _y) {
+        y = _y;
+    }
+};
+
+template <typename T>
+struct SecondComponent<T, false> {
+    explicit SecondComponent(const T&) {}
+
+    T dataY() const {
+        return T(0);
+    }
+
+    void set_y(const T&) {}
+};
+
+
+template <typename T>
+class Node : public SecondComponent<T> {
+public:
+    // a cast node reads its value from a node of another type
+    // and hands the gradient back to it. it holds a reference to
+    // that node, by the rules of link, dropped by the Release step
+    enum class CastStep : unsigned char { Forward, Backward, Release };
+
+    struct CastState {
+        void* src;
+        void (*apply)(void* src, Node& self, CastStep step);
+    };
+
+    // ops over any number of operands keep them in an array of their
+    // own, allocated where the node lives; n_children is then `many`
+    struct Operands {
+        Node** nodes;
+        uint32_t n;
+        uint32_t cap;
+    };
+
+    // a fused op keeps its kernels, followed by its constants, right
+    // after the operand array. both are generated from the type of the
+    // expression; forward reads the operand values, and backward passes
+    // the gradient g of the node on to the operands
+    struct Fused {
+        T (*forward)(Node* const* in, const T* c);
+        void (*backward)(Node* const* in, const T* c, const T& g);
+
+        const T* constants() const {
+            return reinterpret_cast<const T*>(this + 1);
+        }
+    };
+
+    // a checkpointed segment of the forward keeps none of its own nodes.
+    // apply runs it again from the current values of the operands,
+    // either for the values of its outputs, or to pass the gradients
+    // of its outputs, which they collect in grads, on to the operands.
+    // kept after the operand array, like Fused
+    struct Segment {
+        std::vector<T> xs, ys, grads;
+        void (*apply)(Segment& self, Node& node, bool forward);
+        void (*destroy)(Segment& self);
+    };
+
+    static constexpr unsigned char many = 0xFF;
+
+    // the constant operand sits in place of the second child
+    static constexpr size_t constant_offset =
+        (sizeof(Node*) + alignof(T) - 1) / alignof(T) * alignof(T);
+
+    static constexpr size_t slot_bytes = std::max({
+        2 * sizeof(Node*), constant_offset + sizeof(T), sizeof(CastState), sizeof(Operands)});
+
+    T x;
+    // kept inline: a pointer to a lazily allocated gradient would take
+    // as much room as the gradient itself. nodes that need no gradient
+    // never write it
+    mutable T grad = T(0);
+    // what the op reads, by kind of op: up to two children; a single
+    // child followed by the constant operand; the Operands of an n-ary
+    // op; or the CastState of a cast node, which has no children
+    alignas(T) alignas(void*) unsigned char slots[slot_bytes];
+    unsigned char n_children = 0;
+    bool in_arena = false;
+    // false for leaves marked as constants and for ops that don't
+    // depend on any leaf that needs a gradient
+    bool requires_grad = true;
+    Op op = Op::None;
+    // atomic so that threads may share handles to the same nodes
+    std::atomic<uint32_t> refs{1};
+
+    Node(const T& x, const T& y) : SecondComponent<T>(y), x(x) {
+        new (slots) uint32_t(GradGeneration::current());
+        new (slots + sizeof(void*)) GradScope::Counter*(nullptr);
+    }
+
+    ~Node() {
+        if (stamped()) {
+            GradScope::release(scope());
+        }
+        if (op == Op::Cast) {
+            cast_state().apply(cast_state().src, *this, CastStep::Release);
+        }
+        if (op == Op::Checkpoint) {
+            segment().destroy(segment());
+        }
+        if (n_children == many) {
+            ::operator delete(operands().nodes);
+        }
+    }
+
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
+
+    static Node* create(const T& x, const T& y, bool on_heap = false) {
+        Arena* arena = on_heap ? nullptr : Arena::current();
+        Node* n = arena ? arena->create<Node>(x, y) : new Node(x, y);
+        n->in_arena = arena != nullptr;
+        return n;
+    }
+
+    static void retain(Node* n) {
+        if (!n->in_arena) {
+            n->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    static void release(Node* n) {
+        if (n->in_arena || n->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+
+        // free iteratively so that long chains don't overflow the stack
+        static thread_local std::vector<Node*> dead;
+        size_t base = dead.size();
+        dead.push_back(n);
+
+        while (dead.size() > base) {
+            Node* d = dead.back();
+            dead.pop_back();
+
+            Node* const* cs = d->child_nodes();
+            for (size_t i = 0, n = d->num_children(); i < n; ++i) {
+                Node* c = cs[i];
+                if (!c->in_arena && c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    dead.push_back(c);
+                }
+            }
+            delete d;
+        }
+    }
+
+    // hand a reference held by an arena node to the arena, which drops
+    // it on reset: the node itself is never destroyed
+    template <typename U>
+    static void defer_release(U* target) {
+        Arena::current()->defer([](void* p) { U::release(static_cast<U*>(p)); }, target);
+    }
+
+    // arena nodes are never counted, but count the heap nodes they use
+    void link(Node* target) {
+        if (!target->in_arena) {
+            target->refs.fetch_add(1, std::memory_order_relaxed);
+            if (in_arena) {
+                defer_release(target);
+            }
+        }
+    }
+
+    // same as link for a reference the caller already holds
+    void take(Node* target) {
+        if (in_arena && !target->in_arena) {
+            defer_release(target);
+        }
+    }
+
+    // with adopt, the caller's reference to child is handed over,
+    // rather than a new one taken
+    void add_child(Node* child, bool adopt = false) {
+        child->check_not_freed();
+        if (n_children == many) {
+            Operands& ops = operands();
+            if (ops.n == ops.cap) {
+                throw std::logic_error("more children than reserved");
+            }
+            adopt ? take(child) : link(child);
+            requires_grad = child->requires_grad || (ops.n > 0 && requires_grad);
+            ops.nodes[ops.n++] = child;
+            return;
+        }
+        if (n_children == 2) {
+            throw std::logic_error("Node supports at most two children");
+        }
+        adopt ? take(child) : link(child);
+        requires_grad = child->requires_grad || (n_children > 0 && requires_grad);
+        inline_children()[n_children++] = child;
+    }
+
+    // make room for n children of an n-ary op, before adding any,
+    // and for `extra` bytes after them, which are returned
+    void* reserve_children(size_t n, size_t extra = 0) {
+        if (n_children != 0) {
+            throw std::logic_error("children already added");
+        }
+        size_t bytes = n * sizeof(Node*) + extra;
+        void* block = in_arena
+            ? Arena::current()->allocate(bytes, alignof(Node*))
+            : ::operator new(bytes);
+        Node** nodes = static_cast<Node**>(block);
+        new (slots) Operands{nodes, 0, static_cast<uint32_t>(n)};
+        n_children = many;
+        return nodes + n;
+    }
+
+    Operands& operands() {
+        return *reinterpret_cast<Operands*>(slots);
+    }
+
+    const Operands& operands() const {
+        return *reinterpret_cast<const Operands*>(slots);
+    }
+
+    Node** inline_children() {
+        return reinterpret_cast<Node**>(slots);
+    }
+
+    Node* const* inline_children() const {
+        return reinterpret_cast<Node* const*>(slots);
+    }
+
+    size_t num_children() const {
+        return n_children == many ? operands().n : n_children;
+    }
+
+    Node* const* child_nodes() const {
+        return n_children == many ? operands().nodes : inline_children();
+    }
+
+    Node& child(size_t i) const {
+        return *child_nodes()[i];
+    }
+
+    // drop the children once the gradient has been passed to them.
+    // the node keeps its value and gradient, but it is no leaf: an op
+    // built on it, a backward through it or a replay of it would give
+    // gradients that silently miss its children, and throws instead
+    void free_graph() {
+        if (op == Op::None || op == Op::Freed) {
+            return;
+        }
+        if (op == Op::Cast) {
+            cast_state().apply(cast_state().src, *this, CastStep::Release);
+        }
+        Node* const* cs = child_nodes();
+        for (size_t i = 0, n = num_children(); i < n; ++i) {
+            if (!in_arena) {
+                release(cs[i]);
+            }
+        }
+        // the segment lives in the arena too, but what it owns doesn't
+        if (op == Op::Checkpoint) {
+            segment().destroy(segment());
+        }
+        if (n_children == many && !in_arena) {
+            ::operator delete(operands().nodes);
+        }
+        n_children = 0;
+        op = Op::Freed;
+        generation() = GradGeneration::current();
+        scope() = nullptr;
+    }
+
+    void check_not_freed() const {
+        if (op == Op::Freed) {
+            throw std::logic_error(
+                "graph was freed by an earlier backward, pass retain_graph to keep it");
+        }
+    }
+
+    // backward over a topological order, last node first, running
+    // only the nodes in `only` if given. unless the graph is retained,
+    // every node frees its part of the graph right after running, so
+    // nodes no handle refers to are freed during the sweep
+    static void sweep(const std::vector<Node*>& topo, bool retain_graph,
+                      const std::unordered_set<Node*>* only = nullptr) {
+        if (!retain_graph) {
+            for (Node* n : topo) {
+                retain(n);
+            }
+        }
+        uint64_t skipped = 0;
+        for (auto it = topo.rbegin(); it != topo.rend(); ++it) {
+            Node* n = *it;
+            if (!only || only->count(n)) {
+                skipped += !n->run_backward();
+            }
+            if (!retain_graph) {
+                n->free_graph();
+                release(n);
+            }
+        }
+        BackwardStats::add_skipped(skipped);
+    }
+
+    // same as above with the nodes of one level run side by side on
+    // the pool. the level of a node is its longest distance from the
+    // root, so all of its parents sit on lower levels and have run
+    // before it. small levels are run inline, and the graph is freed
+    // level by level on the calling thread
+    static void sweep(const std::vector<Node*>& topo, bool retain_graph, ThreadPool& pool) {
+        static constexpr size_t grain = 64;
+
+        // open addressed table from op to level, far cheaper to fill
+        // than a node based map. leaves have nothing to run and are
+        // left out
+        size_t cap = 16;
+        while (cap < 2 * topo.size()) {
+            cap *= 2;
+        }
+        std::vector<std::pair<Node*, uint32_t>> level(cap, {nullptr, 0});
+        auto level_of = [&](Node* n) -> uint32_t& {
+            size_t h = (reinterpret_cast<std::uintptr_t>(n) >> 4) * 0x9E3779B97F4A7C15ull;
+            for (size_t i = h & (cap - 1);; i = (i + 1) & (cap - 1)) {
+                if (level[i].first == n || !level[i].first) {
+                    level[i].first = n;
+                    return level[i].second;
+                }
+            }
+        };
+
+        std::vector<std::vector<Node*>> levels;
+        std::vector<Node*> leaves;
+        for (auto it = topo.rbegin(); it != topo.rend(); ++it) {
+            Node* n = *it;
+            if (n->op == Op::None) {
+                leaves.push_back(n);
+                continue;
+            }
+            uint32_t l = level_of(n);
+            if (levels.size() <= l) {
+                levels.resize(l + 1);
+            }
+            levels[l].push_back(n);
+            Node* const* cs = n->child_nodes();
+            for (size_t i = 0, nc = n->num_children(); i < nc; ++i) {
+                Node* c = cs[i];
+                if (c->requires_grad && c->op != Op::None) {
+                    uint32_t& lc = level_of(c);
+                    lc = lc > l + 1 ? lc : l + 1;
+                }
+            }
+        }
+
+        if (!retain_graph) {
+            for (Node* n : topo) {
+                retain(n);
+            }
+        }
+        uint64_t skipped = 0;
+        for (const std::vector<Node*>& nodes : levels) {
+            if (pool.size() == 1 || nodes.size() < 2 * grain) {
+                for (Node* n : nodes) {
+                    skipped += !n->run_backward();
+                }
+            } else {
+                size_t n_chunks = (nodes.size() + grain - 1) / grain;
+                n_chunks = n_chunks < 4 * pool.size() ? n_chunks : 4 * pool.size();
+                pool.run(n_chunks, [&](size_t c) {
+                    GradLock::Scope locked;
+                    size_t begin = nodes.size() * c / n_chunks;
+                    size_t end = nodes.size() * (c + 1) / n_chunks;
+                    uint64_t chunk_skipped = 0;
+                    for (size_t i = begin; i < end; ++i) {
+                        chunk_skipped += !nodes[i]->run_backward();
+                    }
+                    BackwardStats::add_skipped(chunk_skipped);
+                });
+            }
+            if (!retain_graph) {
+                for (Node* n : nodes) {
+                    n->free_graph();
+                    release(n);
+                }
+            }
+        }
+        if (!retain_graph) {
+            for (Node* n : leaves) {
+                release(n);
+            }
+        }
+        BackwardStats::add_skipped(skipped);
+    }
+
+    // topological order of the graph below root, children first;
+    // with grad_only, branches that need no gradient are left out
+    static void sort(Node* root, std::vector<Node*>& topo, bool grad_only = false) {
+        sort(&root, 1, topo, grad_only);
+    }
+
+    // one order for the union of the graphs below several roots
+    static void sort(Node* const* roots, size_t n_roots, std::vector<Node*>& topo,
+                     bool grad_only = false) {
+        std::unordered_set<Node*> visited;
+
+        std::vector<std::pair<Node*, bool>> stack;
+        for (size_t i = n_roots; i-- > 0;) {
+            stack.push_back({roots[i], false});
+        }
+
+        while (!stack.empty()) {
+            auto [v, processed] = stack.back();
+            stack.pop_back();
+
+            if (processed) {
+                topo.push_back(v);
+                continue;
+            }
+
+            if (visited.count(v)) continue;
+            visited.insert(v);
+            v->check_not_freed();
+
+            // Re-push self so it is added to topo after all children
+            stack.push_back({v, true});
+
+            Node* const* cs = v->child_nodes();
+            for (size_t i = 0, n = v->num_children(); i < n; ++i) {
+                Node* child = cs[i];
+                if (grad_only && !child->requires_grad) {
+                    continue;
+                }
+                if (!visited.count(child)) {
+                    stack.push_back({child, false});
+                }
+            }
+        }
+    }
+
+    T dataX() const {
+        return x;
+    }
+
+    // a leaf keeps the generation of its gradient in the slots it has
+    // no use for, and so does a freed op. the gradients of ops are
+    // zeroed before every backward and need none
+    bool stamped() const {
+        return (op == Op::None || op == Op::Freed) && n_children == 0;
+    }
+
+    // mutable along with the gradient
+    uint32_t& generation() const {
+        return *reinterpret_cast<uint32_t*>(const_cast<unsigned char*>(slots));
+    }
+
+    // the GradScope of a leaf, kept after its generation; null for
+    // leaves in none
+    GradScope::Counter*& scope() const {
+        return *reinterpret_cast<GradScope::Counter**>(
+            const_cast<unsigned char*>(slots + sizeof(void*)));
+    }
+
+    // bind a leaf to a scope. what gradient it had reads as zero after
+    void set_scope(GradScope::Counter* c) {
+        GradScope::retain(c);
+        GradScope::release(scope());
+        scope() = c;
+        grad = T(0);
+        generation() = GradScope::current(c);
+    }
+
+    T get_grad() const {
+        if (stamped() && generation() != GradScope::current(scope())) {
+            return T(0);
+        }
+        return grad;
+    }
+
+    void add_grad(const T& _grad) const {
+        if (!requires_grad) {
+            return;
+        }
+        if (GradLock::enabled()) {
+            GradLock lock(this);
+            accumulate(_grad);
+        } else {
+            accumulate(_grad);
+        }
+    }
+
+    // a stale gradient is dropped before the first addition of
+    // the generation
+    void accumulate(const T& _grad) const {
+        if (stamped()) {
+            uint32_t now = GradScope::current(scope());
+            if (generation() != now) {
+                generation() = now;
+                grad = T(0);
+            }
+        }
+        grad += _grad;
+    }
+
+    template <typename _X, typename U=T>
+    typename std::enable_if<is_complex_v<U>, void>::type
+    add_grad(_X real, _X imag) const {
+        add_grad(T(real, imag));
+    }
+
+    void set_grad(const T& _grad) const {
+        grad = _grad;
+        if (stamped()) {
+            generation() = GradScope::current(scope());
+        }
+    }
+
+    const T& constant() const {
+        return *reinterpret_cast<const T*>(slots + constant_offset);
+    }
+
+    const CastState& cast_state() const {
+        return *reinterpret_cast<const CastState*>(slots);
+    }
+
+    const Fused& fused() const {
+        return *reinterpret_cast<const Fused*>(operands().nodes + operands().cap);
+    }
+
+    Segment& segment() const {
+        return *reinterpret_cast<Segment*>(operands().nodes + operands().cap);
+    }
+
+    // an Output keeps its index among the outputs as its constant
+    size_t output_index() const {
+        if constexpr (is_complex_v<T>) {
+            return static_cast<size_t>(constant().real());
+        } else {
+            return static_cast<size_t>(constant());
+        }
+    }
+
+    // memory of the node and of its operand array
+    size_t footprint() const {
+        return sizeof(Node) + (n_children == many ? operands().cap * sizeof(Node*) : 0);
+    }
+
+    void set_backward(Op _op) {
+        op = _op;
+        if (Tape<T>* tape = Tape<T>::current()) {
+            tape->record(this);
+        }
+    }
+
+    void set_backward(Op _op, const T& c) {
+        static_assert(std::is_trivially_destructible_v<T>,
+                      "saved constants are never destroyed");
+        if (n_children > 1) {
+            throw std::logic_error("an op with a constant has a single child");
+        }
+        new (slots + constant_offset) T(c);
+        set_backward(_op);
+    }
+
+    // the source is kept alive as a child would be
+    template <typename _X>
+    void set_cast(Node<_X>* src) {
+        Node<_X>::retain(src);
+        if (in_arena && !src->in_arena) {
+            defer_release(src);
+        }
+        new (slots) CastState{src, [](void* p, Node& self, CastStep step) {
+            auto* s = static_cast<Node<_X>*>(p);
+            switch (step) {
+            case CastStep::Forward:
+                self.x = T(s->x);
+                self.set_y(T(s->dataY()));
+                break;
+            case CastStep::Backward:
+                s->add_grad(self.get_grad());
+                break;
+            case CastStep::Release:
+                if (!self.in_arena) {
+                    Node<_X>::release(s);
+                }
+                break;
+            }
+        }};
+        set_backward(Op::Cast);
+    }
+
+    // recompute the value from the current values of the children,
+    // the same way the op computed it when the node was built
+    void run_forward() {
+        switch (op) {
+        case Op::None:
+            break;
+
+        case Op::Cast:
+            cast_state().apply(cast_state().src, *this, CastStep::Forward);
+            break;
+
+        case Op::Add:
+            if constexpr (is_complex_v<T>) {
+                const T& b = n_children == 2 ? child(1).x : constant();
+                x = T(child(0).x.real() + b.real(), child(0).x.imag() + b.imag());
+            } else {
+                x = child(0).x + (n_children == 2 ? child(1).x : constant());
+            }
+            break;
+
+        case Op::Sub:
+            if constexpr (is_complex_v<T>) {
+                const T& b = n_children == 2 ? child(1).x : constant();
+                x = T(child(0).x.real() - b.real(), child(0).x.imag() - b.imag());
+            } else {
+                x = child(0).x - (n_children == 2 ? child(1).x : constant());
+            }
+            break;
+
+        case Op::Mul:
+        case Op::MulConst: {
+            const T& a = child(0).x;
+            const T& b = op == Op::Mul ? child(1).x : constant();
+            if constexpr (is_complex_v<T>) {
+                x = T(a.real() * b.real() - a.imag() * b.imag(),
+                      a.real() * b.imag() + a.imag() * b.real());
+            } else {
+                x = a * b;
+            }
+            break;
+        }
+
+        case Op::Div:
+        case Op::DivConst: {
+            const T& a = child(0).x;
+            const T& b = op == Op::Div ? child(1).x : constant();
+            if constexpr (is_complex_v<T>) {
+                auto dr = b.real() * b.real() + b.imag() * b.imag();
+                if (dr == 0) {
+                    throw std::invalid_argument("Division by zero");
+                }
+                // the constant form keeps the sign of its imaginary part as built
+                auto im = op == Op::Div ? a.imag() * b.real() - a.real() * b.imag()
+                                        : a.imag() * b.real() + a.real() * b.imag();
+                x = T((a.real() * b.real() + a.imag() * b.imag()) / dr, im / dr);
+            } else {
+                if (b == 0) {
+                    throw std::invalid_argument("Division by zero");
+                }
+                using Type = std::conditional_t<std::is_integral_v<T>, double, T>;
+                x = static_cast<T>(static_cast<Type>(a) / static_cast<Type>(b));
+            }
+            break;
+        }
+
+        case Op::Neg:
+            if constexpr (is_complex_v<T>) {
+                x = T(-child(0).x.real(), -child(0).x.imag());
+            } else {
+                x = -child(0).x;
+            }
+            break;
+
+        case Op::Pow:
+        case Op::PowConst:
+            if constexpr (!is_complex_v<T>) {
+                const T& b = op == Op::Pow ? child(1).x : constant();
+                x = T(std::pow(child(0).x, b));
+            }
+            break;
+
+        case Op::Relu:
+            if constexpr (is_complex_v<T>) {
+                using R = decltype(x.real());
+                R re = child(0).x.real();
+                R im = child(0).x.imag();
+                x = T(re < R(0) ? R(0) : re, im < R(0) ? R(0) : im);
+            } else {
+                x = child(0).x < 0.0 ? T(0.0) : child(0).x;
+            }
+            break;
+
+        case Op::Sum:
+        case Op::Dot:
+            x = reduce(op, child_nodes(), num_children());
+            break;
+
+        case Op::Fused:
+            x = fused().forward(child_nodes(), fused().constants());
+            break;
+
+        case Op::Checkpoint:
+            segment().apply(segment(), *this, true);
+            break;
+
+        // nothing to read once the segment has freed its graph
+        case Op::Output:
+            if (child(0).op == Op::Checkpoint) {
+                const Segment& s = child(0).segment();
+                x = s.xs[output_index()];
+                this->set_y(s.ys[output_index()]);
+            }
+            break;
+
+        case Op::Freed:
+            check_not_freed();
+            break;
+        }
+    }
+
+    // value of a Sum or Dot over the given operands, in one loop
+    static T reduce(Op op, Node* const* cs, size_t n) {
+        if constexpr (is_complex_v<T>) {
+            using R = decltype(T().real());
+            R re = R(0), im = R(0);
+            if (op == Op::Sum) {
+                for (size_t i = 0; i < n; ++i) {
+                    re += cs[i]->x.real();
+                    im += cs[i]->x.imag();
+                }
+            } else {
+                for (size_t i = 0, m = n / 2; i < m; ++i) {
+                    const T& a = cs[i]->x;
+                    const T& b = cs[m + i]->x;
+                    re += a.real() * b.real() - a.imag() * b.imag();
+                    im += a.real() * b.imag() + a.imag() * b.real();
+                }
+            }
+            return T(re, im);
+        } else {
+            T sx = T(0);
+            if (op == Op::Sum) {
+                for (size_t i = 0; i < n; ++i) {
+                    sx += cs[i]->x;
+                }
+            } else {
+                for (size_t i = 0, m = n / 2; i < m; ++i) {
+                    sx += cs[i]->x * cs[m + i]->x;
+                }
+            }
+            return sx;
+        }
+    }
+
+    // exactly zero, not merely small: skipping such an op changes no
+    // finite gradient. for other value types nothing is ever skipped
+    bool grad_is_zero() const {
+        if constexpr (is_complex_v<T>) {
+            return grad.real() == 0 && grad.imag() == 0;
+        } else if constexpr (std::is_arithmetic_v<T>) {
+            return grad == T(0);
+        } else {
+            return false;
+        }
+    }
+
+    // pass the gradient of the op on to its children; false if the op
+    // was skipped for a zero gradient, see BackwardStats
+    bool run_backward() {
+        if (op != Op::None && grad_is_zero()) {
+            return false;
+        }
+
+        switch (op) {
+        case Op::None:
+            break;
+
+        case Op::Cast:
+            cast_state().apply(cast_state().src, *this, CastStep::Backward);
+            break;
+
+        case Op::Add:
+            for (unsigned char i = 0; i < n_children; ++i) {
+                if constexpr (is_complex_v<T>) {
+                    child(i).add_grad(get_grad().real(), get_grad().imag());
+                } else {
+                    child(i).add_grad(get_grad());
+                }
+            }
+            break;
+
+        case Op::Sub:
+            if constexpr (is_complex_v<T>) {
+                child(0).add_grad(get_grad().real(), get_grad().imag());
+                if (n_children == 2) {
+                    child(1).add_grad(-get_grad().real(), -get_grad().imag());
+                }
+            } else {
+                child(0).add_grad(get_grad());
+                if (n_children == 2) {
+                    child(1).add_grad(-get_grad());
+                }
+            }
+            break;
+
+        case Op::Mul: {
+            auto& x = child(0);
+            auto& y = child(1);
+            if constexpr (is_complex_v<T>) {
+                x.add_grad(
+                    get_grad().real() * y.dataX().real() - get_grad().imag() * y.dataX().imag(),
+                    get_grad().real() * y.dataX().imag() + get_grad().imag() * y.dataX().real()
+                );
+                y.add_grad(
+                    get_grad().real() * x.dataX().real() - get_grad().imag() * x.dataX().imag(),
+                    get_grad().real() * x.dataX().imag() + get_grad().imag() * x.dataX().real()
+                );
+            } else {
+                x.add_grad(get_grad() * y.dataX());
+                y.add_grad(get_grad() * x.dataX());
+            }
+            break;
+        }
+
+        case Op::MulConst: {
+            auto& x = child(0);
+            const T& y = constant();
+            if constexpr (is_complex_v<T>) {
+                x.add_grad(
+                    get_grad().real() * y.real() - get_grad().imag() * y.imag(),
+                    get_grad().real() * y.imag() + get_grad().imag() * y.real()
+                );
+            } else {
+                x.add_grad(get_grad() * y);
+            }
+            break;
+        }
+
+        case Op::Div: {
+            auto& x = child(0);
+            auto& y = child(1);
+            if constexpr (is_complex_v<T>) {
+                auto dr = y.dataX().real() * y.dataX().real() + y.dataX().imag() * y.dataX().imag();
+                x.add_grad(
+                    (get_grad().real() * y.dataX().real() + get_grad().imag() * y.dataX().imag()) / dr,
+                    (get_grad().real() * y.dataX().imag() - get_grad().imag() * y.dataX().real()) / dr
+                );
+                y.add_grad(
+                    (-get_grad().real() * x.dataX().imag() + get_grad().imag() * x.dataX().real()) / dr,
+                    (-get_grad().real() * x.dataX().real() - get_grad().imag() * x.dataX().imag()) / dr
+                );
+            } else {
+                x.add_grad(get_grad() / y.dataX());
+                y.add_grad(-get_grad() * x.dataX() / (y.dataX() * y.dataX()));
+            }
+            break;
+        }
+
+        case Op::DivConst: {
+            auto& x = child(0);
+            const T& y = constant();
+            if constexpr (is_complex_v<T>) {
+                auto dr = y.real() * y.real() + y.imag() * y.imag();
+                x.add_grad(
+                    (get_grad().real() * y.real() + get_grad().imag() * y.imag()) / dr,
+                    (get_grad().real() * y.imag() - get_grad().imag() * y.real()) / dr
+                );
+            } else {
+                x.add_grad(get_grad() / y);
+            }
+            break;
+        }
+
+        case Op::Neg:
+            if constexpr (is_complex_v<T>) {
+                child(0).add_grad(-get_grad().real(), -get_grad().imag());
+            } else {
+                child(0).add_grad(-get_grad());
+            }
+            break;
+
+        case Op::Pow:
+            // pow of complex values is not differentiable here
+            if constexpr (!is_complex_v<T>) {
+                auto& x = child(0);
+                auto& y = child(1);
+                x.add_grad(get_grad() * y.dataX() * std::pow(x.dataX(), y.dataX() - 1));
+                y.add_grad(get_grad() * std::pow(x.dataX(), y.dataX()) * std::log(x.dataX()));
+            }
+            break;
+
+        case Op::PowConst:
+            if constexpr (!is_complex_v<T>) {
+                auto& x = child(0);
+                const T& y = constant();
+                x.add_grad(get_grad() * y * std::pow(x.dataX(), y - 1));
+            }
+            break;
+
+        case Op::Relu: {
+            auto& x = child(0);
+            if constexpr (is_complex_v<T>) {
+                using R = decltype(x.dataX().real());
+                R re = x.dataX().real();
+                R im = x.dataX().imag();
+                auto g = get_grad();
+                x.add_grad(re < R(0) ? R(0) : g.real(),
+                           im < R(0) ? R(0) : g.imag());
+            } else {
+                // nothing to add below zero
+                if (!(x.dataX() < 0.0)) {
+                    x.add_grad(get_grad());
+                }
+            }
+            break;
+        }
+
+        case Op::Sum: {
+            Node* const* cs = child_nodes();
+            const T g = get_grad();
+            for (size_t i = 0, n = num_children(); i < n; ++i) {
+                cs[i]->add_grad(g);
+            }
+            break;
+        }
+
+        case Op::Dot: {
+            Node* const* cs = child_nodes();
+            const T g = get_grad();
+            for (size_t i = 0, m = num_children() / 2; i < m; ++i) {
+                Node* a = cs[i];
+                Node* b = cs[m + i];
+                if constexpr (is_complex_v<T>) {
+                    a->add_grad(g.real() * b->x.real() - g.imag() * b->x.imag(),
+                                g.real() * b->x.imag() + g.imag() * b->x.real());
+                    b->add_grad(g.real() * a->x.real() - g.imag() * a->x.imag(),
+                                g.real() * a->x.imag() + g.imag() * a->x.real());
+                } else {
+                    a->add_grad(g * b->x);
+                    b->add_grad(g * a->x);
+                }
+            }
+            break;
+        }
+
+        case Op::Fused:
+            fused().backward(child_nodes(), fused().constants(), get_grad());
+            break;
+
+        case Op::Checkpoint:
+            segment().apply(segment(), *this, false);
+            break;
+
+        // the outputs of a segment all run before it, being its parents.
+        // the segment is marked with a gradient of one to be run at all
+        case Op::Output:
+            if (child(0).op == Op::Checkpoint) {
+                child(0).segment().grads[output_index()] += get_grad();
+                child(0).add_grad(T(1.0));
+            }
+            break;
+
+        // one with a zero gradient was skipped above, having nothing
+        // to pass on to the children it lost
+        case Op::Freed:
+            check_not_freed();
+            break;
+        }
+        return true;
+    }
+};
+
+
+// linear record of the ops built while it is active, in program order.
+// since every op is created after its operands, walking the tape in
+// reverse is a valid order for backward, no graph sort needed
+template <typename T>
+class Tape {
+private:
+    static inline thread_local Tape* active = nullptr;
+
+    std::vector<Node<T>*> records;
+
+public:
+    Tape() = default;
+
+    ~Tape() {
+        clear();
+        if (active == this) {
+            active = nullptr;
+        }
+    }
+
+    Tape(const Tape&) = delete;
+    Tape& operator=(const Tape&) = delete;
+
+    void record(Node<T>* n) {
+        Node<T>::retain(n);
+        records.push_back(n);
+    }
+
+    // drop the records, keeping the capacity for the next pass
+    void clear() {
+        for (Node<T>* n : records) {
+            Node<T>::release(n);
+        }
+        records.clear();
+    }
+
+    size_t size() const {
+        return records.size();
+    }
+
+    // the recorded ops, in program order
+    const std::vector<Node<T>*>& nodes() const {
+        return records;
+    }
+
+    // memory held by the recorded ops
+    size_t bytes() const {
+        size_t total = 0;
+        for (const Node<T>* n : records) {
+            total += n->footprint();
+        }
+        return total;
+    }
+
+    // run backward from root over everything recorded up to it;
+    // returns false when root is not on this tape, or when an op on it
+    // uses an op that isn't, built before the tape was active: the
+    // tape alone can't run that one backward. unless the graph is
+    // retained, the ops that passed a gradient on drop their children
+    // afterwards. ops root doesn't reach pass nothing on and keep
+    // theirs, for a later backward from another root
+    bool backward(Node<T>* root, bool retain_graph = false) {
+        size_t end = records.size();
+        while (end > 0 && records[end - 1] != root) {
+            --end;
+        }
+        if (end == 0) {
+            return false;
+        }
+
+        std::unordered_set<Node<T>*> recorded(records.begin(), records.begin() + end);
+        for (size_t i = 0; i < end; ++i) {
+            Node<T>* const* cs = records[i]->child_nodes();
+            for (size_t j = 0, n = records[i]->num_children(); j < n; ++j) {
+                if (cs[j]->op != Op::None && !recorded.count(cs[j])) {
+                    return false;
+                }
+            }
+        }
+
+        // intermediate gradients start from zero, so that ops recorded
+        // before root but not reachable from it contribute nothing
+        for (size_t i = 0; i < end; ++i) {
+            records[i]->set_grad(T(0.0));
+        }
+        root->set_grad(T(1.0));
+
+        uint64_t skipped = 0;
+        for (size_t i = end; i-- > 0;) {
+            if (!records[i]->requires_grad) {
+                continue;
+            }
+            bool passed = records[i]->run_backward();
+            skipped += !passed;
+            if (passed && !retain_graph) {
+                records[i]->free_graph();
+            }
+        }
+        BackwardStats::add_skipped(skipped);
+        return true;
+    }
+
+    static Tape* current() {
+        return active;
+    }
+
+    template <typename> friend class TapeScope;
+};
+
+
+// records every op of type T built inside it onto a tape, and
+// clears the tape when the scope ends
+template <typename T>
+class TapeScope {
+private:
+    Tape<T>& tape;
+    Tape<T>* prev;
+
+public:
+    explicit TapeScope(Tape<T>& tape) : tape(tape), prev(Tape<T>::active) {
+        Tape<T>::active = &tape;
+    }
+
+    ~TapeScope() {
+        Tape<T>::active = prev;
+        tape.clear();
+    }
+
+    TapeScope(const TapeScope&) = delete;
+    TapeScope& operator=(const TapeScope&) = delete;
+};
+
+
+// turns off graph building on this thread while alive: ops still
+// compute their value, but the result is a leaf with no children,
+// nothing is recorded on a tape and backward through it is a no-op
+class NoGradGuard {
+private:
+    static inline thread_local bool active = false;
+
+    bool prev;
+
+public:
+    NoGradGuard() : prev(active) {
+        active = true;
+    }
+
+    ~NoGradGuard() {
+        active = prev;
+    }
+
+    NoGradGuard(const NoGradGuard&) = delete;
+    NoGradGuard& operator=(const NoGradGuard&) = delete;
+
+    static bool enabled() {
+        return active;
+    }
+};
+
+
 template <typename T>
 class Value {
 public:
     typedef T value_type;
 
 private:
-    T x;
-    T y;
-    mutable std::shared_ptr<T> grad = std::make_shared<T>(T(0));
-    std::vector<std::shared_ptr<Value<T>>> owned_children;
-    std::vector<Value<T>*> children;
-    std::function<void()> backward_fn = []() {};
+    template <typename> friend class Value;
+    friend class Graph<T>;
+    friend class Trace<T>;
+    template <typename U>
+    friend void backward(const std::vector<Value<U>>& roots, const std::vector<U>& seeds,
+                         bool retain_graph);
+
+    Node<T>* node;
+
+    // intermediate gradients start from zero on every pass, so that
+    // a subexpression shared with an earlier graph adds nothing stale;
+    // leaves keep accumulating
+    static void zero_op_grads(const std::vector<Node<T>*>& topo) {
+        for (Node<T>* n : topo) {
+            if (n->op != Op::None) {
+                n->set_grad(T(0.0));
+            }
+        }
+    }
+
+    // point this handle at a fresh leaf, allocated where the old node
+    // lives so that parameters never end up inside an arena. a leaf
+    // replaces a leaf: it stays in the old leaf's GradScope, so that it
+    // stays in its module's, and keeps whether it requires grad
+    void reset_leaf(const T& _x, const T& _y) {
+        Node<T>* fresh = Node<T>::create(_x, _y, node && !node->in_arena);
+        if (node && node->op == Op::None) {
+            if (node->stamped() && node->scope()) {
+                fresh->set_scope(node->scope());
+            }
+            fresh->requires_grad = node->requires_grad;
+        }
+        if (node) {
+            Node<T>::release(node);
+        }
+        node = fresh;
+    }
 
 public:
     // default constructor
-    Value() : x(T(0.0)), y(T(0.0)) {}
+    Value() : node(Node<T>::create(T(0.0), T(0.0))) {}
+
+    Value(const Value& other) : node(other.node) {
+        Node<T>::retain(node);
+    }
+
+    // a moved from handle holds no node; it may only be assigned to
+    // or destroyed
+    Value(Value&& other) noexcept : node(other.node) {
+        other.node = nullptr;
+    }
 
-    Value(const Value& other)
-        : x(other.x),
-          y(other.y),
-          grad(other.grad),
-          owned_children(other.owned_children),
-          children(other.children),
-          backward_fn(other.backward_fn) {}
+    // a heap leaf is never pointed into an arena, which would leave the
+    // handle dangling once the arena is reset: it takes the value instead
+    bool keeps_leaf(const Node<T>* other) const {
+        return node && node->op == Op::None && !node->in_arena && other->in_arena;
+    }
 
     Value& operator=(const Value& other) {
+        if (keeps_leaf(other.node)) {
+            reset_leaf(other.node->x, other.node->dataY());
+            return *this;
+        }
         if (this != &other) {
-            x = other.x;
-            y = other.y;
-            grad = other.grad;
-            owned_children = other.owned_children;
-            children = other.children;
-            backward_fn = other.backward_fn;
+            Node<T>::retain(other.node);
+            if (node) {
+                Node<T>::release(node);
+            }
+            node = other.node;
         }
         return *this;
     }
 
+    Value& operator=(Value&& other) noexcept {
+        if (keeps_leaf(other.node)) {
+            reset_leaf(other.node->x, other.node->dataY());
+            return *this;
+        }
+        if (this != &other) {
+            if (node) {
+                Node<T>::release(node);
+            }
+            node = other.node;
+            other.node = nullptr;
+        }
+        return *this;
+    }
+
+    ~Value() {
+        if (node) {
+            Node<T>::release(node);
+        }
+    }
+
     template <class _X> constexpr
-    Value(const Value<_X>& _x) : x(_x.dataX()), y(_x.dataY()) {}
+    Value(const Value<_X>& _x) : node(Node<T>::create(T(_x.dataX()), T(_x.dataY()))) {}
 
     template <class _X> constexpr
-    Value(const Value<_X>& _x, const Value<_X>& _y) : x(_x.dataX()), y(_y.dataY()) {}
+    Value(const Value<_X>& _x, const Value<_X>& _y)
+        : node(Node<T>::create(T(_x.dataX()), T(_y.dataY()))) {}
 
     // for scalar values
     template <class _X> constexpr
-    Value(const _X& _x) : x(_x), y(T(0.0)) {}
+    Value(const _X& _x) : node(Node<T>::create(T(_x), T(0.0))) {}
 
     template <class _X> constexpr
-    Value(const _X& _x, const _X& _y) : x(_x), y(_y) {}
+    Value(const _X& _x, const _X& _y) : node(Node<T>::create(T(_x), T(_y))) {}
 
     // for complex
     template <class _X> constexpr
-    Value(const complex<_X>& _x) {
+    Value(const complex<_X>& _x) : node(Node<T>::create(T(0.0), T(0.0))) {
         // : x(_x.real()), y(_x.imag()) {}
         if  constexpr (is_complex_v<_X>) {
-            x = _x;
+            node->x = _x;
         } else {
-            x = complex<_X>(_x.real(), _x.imag());
+            node->x = complex<_X>(_x.real(), _x.imag());
         }
     }
 
     template <class _X> constexpr
-    Value(const complex<_X>& _x, const complex<_X>& _y) {
+    Value(const complex<_X>& _x, const complex<_X>& _y) : node(Node<T>::create(T(0.0), T(0.0))) {
          //: x(complex<_X>(_x.real(), _y.real())), y(complex<_X>(_x.imag(), _y.imag())) {}
         if constexpr (is_complex_v<_X>) {
-            x = _x;
-            y = _y;
+            node->x = _x;
+            node->set_y(_y);
         } else {
-            x = complex<_X>(_x.real(), _y.real());
-            y = complex<_X>(_x.imag(), _y.imag());
+            node->x = complex<_X>(_x.real(), _y.real());
+            node->set_y(complex<_X>(_x.imag(), _y.imag()));
         }
     }
 
     void add_child(const Value<T>* child) {
-        owned_children.push_back(std::make_shared<Value<T>>(*child));
-        children.push_back(owned_children.back().get());
+        if (NoGradGuard::enabled()) {
+            return;
+        }
+        node->add_child(child->node);
+    }
+
+    void add_child(const Value<T>& child) {
+        add_child(&child);
     }
 
+    // a temporary operand hands its reference over to this node
+    void add_child(Value<T>&& child) {
+        if (NoGradGuard::enabled()) {
+            return;
+        }
+        node->add_child(child.node, true);
+        child.node = nullptr;
+    }
+
+    // an operand of another type is converted through a cast node that
+    // hands its gradient back to the original, and keeps it alive
     template <typename _X>
     void add_child(const Value<_X>* child) {
-        owned_children.push_back(std::make_shared<Value<T>>(child->dataX(), child->dataY()));
-        children.push_back(owned_children.back().get());
+        if (NoGradGuard::enabled()) {
+            return;
+        }
+        Node<T>* c = Node<T>::create(T(child->dataX()), T(child->dataY()));
+        c->requires_grad = child->node->requires_grad;
+        c->set_cast(child->node);
+        node->add_child(c);
+        Node<T>::release(c);
+    }
+
+    // room for the operands of an n-ary op, added after with add_child,
+    // and for `extra` bytes of the op's own. null if no graph is built
+    void* reserve_children(size_t n, size_t extra = 0) {
+        if (NoGradGuard::enabled()) {
+            return nullptr;
+        }
+        return node->reserve_children(n, extra);
     }
 
     void add_grad(const T& _grad) const {
-        *grad += _grad;
+        node->add_grad(_grad);
     }
 
 	template <typename _X, typename U=T>
     typename std::enable_if<is_complex_v<U>, void>::type
     add_grad(_X real, _X imag) const {
-        *grad += T(real, imag);
+        node->add_grad(real, imag);
     }
 
 	void zero_grad() {
-        *grad = T(0.0);
+        node->set_grad(T(0.0));
     }
 
     void set_grad(const T& _grad) {
-        *grad = _grad;
+        node->set_grad(_grad);
     }
 
     template <class _X> constexpr
     Value& operator=(const Value<_X>& x) {
-        // error: ‘double ptMgrad::Value<double>::x’ is private within this context
-        this->x = x.dataX();
-        this->y = x.dataY();
-        this->grad = std::make_shared<T>(T(0));
-        this->owned_children.clear();
-        this->children.clear();
-        this->backward_fn = []() {};
+        reset_leaf(T(x.dataX()), T(x.dataY()));
         return *this;
     }
 
     template <class _X> constexpr
     Value& operator=(const _X& x) {
-        this->x = x;
-        this->y = T(0);
-        this->grad = std::make_shared<T>(T(0));
-        this->owned_children.clear();
-        this->children.clear();
-        this->backward_fn = []() {};
+        reset_leaf(T(x), T(0));
         return *this;
     }
 
+    // overwrite the value in place, unlike assignment which makes this
+    // handle a new leaf; a captured Graph sees the new value on replay
+    void set_data(const T& _x) {
+        node->x = _x;
+    }
+
+    void set_data(const T& _x, const T& _y) {
+        node->x = _x;
+        node->set_y(_y);
+    }
+
     T dataX() const {
         if constexpr (is_complex_v<T>) {
-            return x;
+            return node->x;
         } else {
-            return x;
+            return node->x;
         }
     }
 
     T dataY() const {
-        return y;
+        return node->dataY();
     }
 
     T gradX() const {
-        return *grad;
+        return node->get_grad();
     }
 
     T gradY() const {
-        return *grad;
+        return node->get_grad();
     }
 
     T get_grad() const {
-        return *grad;
+        return node->get_grad();
     }
 
     // void add_grad(const T& _grad) const {
@@ -188,54 +1583,122 @@ public:
 
     template <class _X> constexpr
     Value operator- () const {
-        return Value(-x, -y);
+        return Value(-dataX(), -dataY());
+    }
+
+    constexpr operator bool() const {
+        return node->x || node->dataY();
+    }
+
+    // add backward function implementation.
+    // the graph is freed on the way unless retain_graph is set. after
+    // that, its ops keep their values and gradients, but another
+    // backward through them, or an op built on them, throws
+    void backward(bool retain_graph = false) {
+        // with a tape recording, its reverse order replaces the sort
+        if (Tape<T>* tape = Tape<T>::current(); tape && tape->backward(node, retain_graph)) {
+            return;
+        }
+
+        // topological order all of the children in the graph
+        std::vector<Node<T>*> topo;
+        Node<T>::sort(node, topo, true);
+
+        // go one variable at a time and apply the chain rule to get its gradient
+        zero_op_grads(topo);
+        node->set_grad(T(1.0));
+
+        Node<T>::sweep(topo, retain_graph);
     }
 
-    constexpr operator bool() const {
-        return x || y;
+    // gradient of this value with respect to the given leaves only.
+    // every branch that cannot reach one of them is skipped; other
+    // leaves beside a kept branch may still receive gradient
+    void backward(const std::vector<Value<T>*>& inputs, bool retain_graph = false) {
+        std::vector<Node<T>*> topo;
+        Node<T>::sort(node, topo, true);
+
+        std::unordered_set<Node<T>*> reaches;
+        for (auto* input : inputs) {
+            reaches.insert(input->node);
+        }
+        for (Node<T>* n : topo) {
+            // what the function of a segment or the source of a cast
+            // reads isn't among the children, so these always run
+            if (n->op == Op::Checkpoint || n->op == Op::Output || n->op == Op::Cast) {
+                reaches.insert(n);
+                continue;
+            }
+            Node<T>* const* cs = n->child_nodes();
+            for (size_t i = 0, nc = n->num_children(); i < nc; ++i) {
+                if (reaches.count(cs[i])) {
+                    reaches.insert(n);
+                    break;
+                }
+            }
+        }
+
+        zero_op_grads(topo);
+        node->set_grad(T(1.0));
+
+        Node<T>::sweep(topo, retain_graph, &reaches);
     }
 
-    // add backward function implementation
-    void backward() {
-        // topological order all of the children in the graph
-        std::vector<Value<T>*> topo;
-        std::unordered_set<Value<T>*> visited;
+    void backward(std::initializer_list<Value<T>*> inputs, bool retain_graph = false) {
+        backward(std::vector<Value<T>*>(inputs), retain_graph);
+    }
 
-        std::vector<std::pair<Value<T>*, bool>> stack;
-        stack.push_back({this, false});
+    // backward with independent nodes run concurrently on the pool;
+    // gradients match the serial pass up to the order of summation.
+    // no other thread may touch the graph meanwhile
+    void backward(ThreadPool& pool, bool retain_graph = false) {
+        std::vector<Node<T>*> topo;
+        Node<T>::sort(node, topo, true);
 
-        while (!stack.empty()) {
-            auto [v, processed] = stack.back();
-            stack.pop_back();
+        zero_op_grads(topo);
+        node->set_grad(T(1.0));
 
-            if (processed) {
-                topo.push_back(v);
-                continue;
-            }
+        Node<T>::sweep(topo, retain_graph, pool);
+    }
 
-            if (visited.count(v)) continue;
-            visited.insert(v);
+    // a leaf that doesn't require grad is a constant: backward never
+    // enters it, and ops built only from constants are constants too.
+    // set it before building the graph, ops copy it when they are made
+    void set_requires_grad(bool _requires_grad) {
+        node->requires_grad = _requires_grad;
+    }
 
-            // Re-push self so it is added to topo after all children
-            stack.push_back({v, true});
+    bool requires_grad() const {
+        return node->requires_grad;
+    }
 
-            for (auto* child : v->children) {
-                if (!visited.count(child)) {
-                    stack.push_back({child, false});
-                }
-            }
+    // zero the gradient of this leaf whenever scope advances, along with
+    // the global generation. for leaves off the arena
+    void set_grad_scope(const GradScope& scope) {
+        if (node->op != Op::None || node->n_children != 0 || node->in_arena) {
+            throw std::invalid_argument("only leaves off the arena can be bound to a GradScope");
         }
+        node->set_scope(scope.get());
+    }
 
-        // go one variable at a time and apply the chain rule to get its gradient
-        *this->grad = T(1.0);
+    void set_backward(Op op) {
+        if (!NoGradGuard::enabled()) {
+            node->set_backward(op);
+        }
+    }
 
-        for (auto it = topo.rbegin(); it != topo.rend(); ++it) {
-            (*it)->backward_fn();
+    void set_backward(Op op, const T& c) {
+        if (!NoGradGuard::enabled()) {
+            node->set_backward(op, c);
         }
     }
 
-    void set_backward(const std::function<void()>& fn) {
-        backward_fn = fn;
+    // gradient of this value over a recorded tape, see Tape::backward
+    void backward(Tape<T>& tape, bool retain_graph = false) {
+        if (!tape.backward(node, retain_graph)) {
+            throw std::invalid_argument(
+                "Value was not recorded on this tape, or its graph reaches ops that were not");
+        }
     }
 
     // don't keep this
@@ -268,67 +1731,97 @@ public:
     }
     */
 
+    // like assignment, these make this handle a new leaf, so copies
+    // of it keep the value they had
     template <class _X> constexpr
     Value& operator+= (const Value<_X>& x) {
-        this->x += x.dataX();
-        this->y += x.dataY();
+        T _x = node->x;
+        T _y = dataY();
+        _x += x.dataX();
+        if constexpr (is_complex_v<T>) {
+            _y += x.dataY();
+        }
+        reset_leaf(_x, _y);
         return *this;
     }
 
     template <class _X> constexpr
     Value& operator+= (const _X& x) {
-        this->x += x;
+        T _x = node->x;
+        _x += x;
+        reset_leaf(_x, dataY());
         return *this;
     }
 
     template <class _X> constexpr
     Value& operator-= (const Value<_X>& x) {
-        this->x -= x.dataX();
-        this->y -= x.dataY();
+        T _x = node->x;
+        T _y = dataY();
+        _x -= x.dataX();
+        if constexpr (is_complex_v<T>) {
+            _y -= x.dataY();
+        }
+        reset_leaf(_x, _y);
         return *this;
     }
 
     template <class _X> constexpr
     Value& operator-= (const _X& x) {
-        this->x -= x;
+        T _x = node->x;
+        _x -= x;
+        reset_leaf(_x, dataY());
         return *this;
     }
 
     template <class _X> constexpr
     Value& operator*= (const Value<_X>& x) {
-        this->x *= x.dataX();
-        this->y *= x.dataY();
+        T _x = node->x;
+        T _y = dataY();
+        _x *= x.dataX();
+        if constexpr (is_complex_v<T>) {
+            _y *= x.dataY();
+        }
+        reset_leaf(_x, _y);
         return *this;
     }
 
     template <class _X> constexpr
     Value& operator*= (const _X& x) {
-        this->x *= x;
+        T _x = node->x;
+        _x *= x;
+        reset_leaf(_x, dataY());
         return *this;
     }
 
     template <class _X> constexpr
     Value& operator/= (const Value<_X>& x) {
-        this->x /= x.dataX();
-        this->y /= x.dataY();
+        T _x = node->x;
+        T _y = dataY();
+        _x /= x.dataX();
+        if constexpr (is_complex_v<T>) {
+            _y /= x.dataY();
+        }
+        reset_leaf(_x, _y);
         return *this;
     }
 
     template <class _X> constexpr
     Value& operator/= (const _X& x) {
-        this->x /= x;
+        T _x = node->x;
+        _x /= x;
+        reset_leaf(_x, dataY());
         return *this;
     }
 
     // TODO: why const?
     template <class _X> constexpr
     bool operator<(const Value<_X>& _x) const {  // Note: return type bool
-        return x < _x.dataX();
+        return node->x < _x.dataX();
     }
 
     template <class _X> constexpr
     bool operator<(const _X& _x) {
-        return x < _x;
+        return node->x < _x;
     }
 
     // TODO: why we don't need operator>
@@ -348,10 +1841,60 @@ public:
 // }
 
 
+// backward from several roots at once, each seeded with its own
+// gradient, in one sort and one sweep; leaves get the gradient of
+// the sum of seeds[i] * roots[i]. a root that is also inside another
+// root's graph gets its seed on top of what flows into it
+template <typename T>
+void backward(const std::vector<Value<T>>& roots, const std::vector<T>& seeds,
+              bool retain_graph = false) {
+    if (roots.size() != seeds.size()) {
+        throw std::invalid_argument("Vectors must have the same size");
+    }
+
+    std::vector<Node<T>*> nodes;
+    nodes.reserve(roots.size());
+    for (const auto& root : roots) {
+        nodes.push_back(root.node);
+    }
+
+    std::vector<Node<T>*> topo;
+    Node<T>::sort(nodes.data(), nodes.size(), topo, true);
+
+    Value<T>::zero_op_grads(topo);
+    for (Node<T>* n : nodes) {
+        n->set_grad(T(0.0));
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        nodes[i]->grad += seeds[i];
+    }
+
+    Node<T>::sweep(topo, retain_graph);
+}
+
+// every root seeded with 1
+template <typename T>
+void backward(const std::vector<Value<T>>& roots, bool retain_graph = false) {
+    backward(roots, std::vector<T>(roots.size(), T(1.0)), retain_graph);
+}
+
+
 template <class T, class U>
 using ResultType = std::common_type_t<T, U>;
 
 
+// set for the expression types of expr.h, which the scalar overloads
+// below leave to operators of their own
+template <class T>
+struct is_expression : std::false_type {};
+
+template <class T>
+inline constexpr bool is_expression_v = is_expression<T>::value;
+
+template <class T, class U = T>
+using ScalarOperands = std::enable_if_t<!is_expression_v<T> && !is_expression_v<U>, int>;
+
+
 template <class T>
 inline
 Value <T>
@@ -366,10 +1909,7 @@ operator+ (const Value<T>& x, const Value<T>& y) {
 		__k.add_child(&x);
 		__k.add_child(&y);
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-			y.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-		});
+		__k.set_backward(Op::Add);
 
         return __k;
     }
@@ -379,12 +1919,7 @@ operator+ (const Value<T>& x, const Value<T>& y) {
     __k.add_child(&x);
     __k.add_child(&y);
 
-    __k.set_backward([x, y, __k]() {
-        // x.grad = add_grad(x.get_grad(), __k.get_grad());
-        // y.grad = add_grad(y.get_grad(), __k.get_grad());
-        x.add_grad(__k.get_grad());
-        y.add_grad(__k.get_grad());
-    });
+    __k.set_backward(Op::Add);
 
     return __k;
 }
@@ -406,10 +1941,7 @@ operator+ (const Value<T>& x, const Value<U>& y) {
         __k.add_child(&x);
         __k.add_child(&y);
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-			y.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-		});
+		__k.set_backward(Op::Add);
 
         return __k;
     }
@@ -422,10 +1954,7 @@ operator+ (const Value<T>& x, const Value<U>& y) {
     __k.add_child(&x);
     __k.add_child(&y);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad());
-        y.add_grad(__k.get_grad());
-    });
+    __k.set_backward(Op::Add);
 
     return __k;
 }
@@ -445,9 +1974,7 @@ operator+ (const Value<T>& x, const T& y) {
         __k.add_child(&x);
 		// __k.add_child(&y);    // y is scalar
 
-        __k.set_backward([x, y, __k]() {
-            x.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-        });
+        __k.set_backward(Op::Add, y);
 
         return __k;
     }
@@ -456,9 +1983,7 @@ operator+ (const Value<T>& x, const T& y) {
 
     __k.add_child(&x);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad());
-    });
+    __k.set_backward(Op::Add, y);
 
     return __k;
 }
@@ -477,9 +2002,7 @@ operator+ (const Value<T>& x, const U& y) {
 
 		__k.add_child(static_cast<Value<ResultType<T, U>>*>(&x));
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-		});
+		__k.set_backward(Op::Add, y);
 
         return __k;
     }
@@ -488,15 +2011,13 @@ operator+ (const Value<T>& x, const U& y) {
 
     __k.add_child(&x);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad());
-    });
+    __k.set_backward(Op::Add, y);
 
     return __k;
 }
 
 
-template <class T>
+template <class T, ScalarOperands<T> = 0>
 inline
 Value <T>
 operator+ (const T& x, const T& y) {
@@ -514,7 +2035,7 @@ operator+ (const T& x, const T& y) {
 }
 
 
-template <class T, class U>
+template <class T, class U, ScalarOperands<T, U> = 0>
 inline
 Value <ResultType<T, U>>
 operator+ (const T& x, const U& y) {
@@ -546,10 +2067,7 @@ operator- (const Value<T>& x, const Value<T>& y) {
         __k.add_child(&x);
         __k.add_child(&y);
 
-        __k.set_backward([x, y, __k]() {
-            x.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-            y.add_grad(-__k.get_grad().real(), -__k.get_grad().imag());
-        });
+        __k.set_backward(Op::Sub);
 
         return __k;
     }
@@ -559,10 +2077,7 @@ operator- (const Value<T>& x, const Value<T>& y) {
     __k.add_child(&x);
     __k.add_child(&y);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad());
-        y.add_grad(-__k.get_grad());
-    });
+    __k.set_backward(Op::Sub);
 
     return __k;
 }
@@ -582,10 +2097,7 @@ operator- (const Value<T>& x, const Value<U>& y) {
 		__k.add_child(&x);
 		__k.add_child(&y);
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-			y.add_grad(-__k.get_grad().real(), -__k.get_grad().imag());
-		});
+		__k.set_backward(Op::Sub);
 
         return __k;
     }
@@ -595,10 +2107,7 @@ operator- (const Value<T>& x, const Value<U>& y) {
     __k.add_child(&x);
     __k.add_child(&y);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad());
-        y.add_grad(-__k.get_grad());
-    });
+    __k.set_backward(Op::Sub);
 
     return __k;
 }
@@ -617,9 +2126,7 @@ operator- (const Value<T>& x, const T& y) {
 
 		__k.add_child(&x);
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-		});
+		__k.set_backward(Op::Sub, y);
 
         return __k;
     }
@@ -628,9 +2135,7 @@ operator- (const Value<T>& x, const T& y) {
 
     __k.add_child(&x);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad());
-    });
+    __k.set_backward(Op::Sub, y);
 
     return __k;
 }
@@ -648,9 +2153,7 @@ operator- (const Value<T>& x, const U& y) {
 
 		__k.add_child(static_cast<Value<ResultType<T, U>>*>(&x));
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(__k.get_grad().real(), __k.get_grad().imag());
-		});
+		__k.set_backward(Op::Sub, y);
 
         return __k;
     }
@@ -659,15 +2162,13 @@ operator- (const Value<T>& x, const U& y) {
 
     __k.add_child(&x);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad());
-    });
+    __k.set_backward(Op::Sub, y);
 
     return __k;
 }
 
 
-template <class T>
+template <class T, ScalarOperands<T> = 0>
 inline
 Value <T>
 operator- (const T& x, const T& y) {
@@ -684,7 +2185,7 @@ operator- (const T& x, const T& y) {
     return __k;
 }
 
-template <class T, class U>
+template <class T, class U, ScalarOperands<T, U> = 0>
 inline
 Value <ResultType<T, U>>
 operator- (const T& x, const U& y) {
@@ -716,16 +2217,7 @@ operator* (const Value<T>& x, const Value<T>& y) {
 		__k.add_child(&x);
 		__k.add_child(&y);
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(
-				__k.get_grad().real() * y.dataX().real() - __k.get_grad().imag() * y.dataX().imag(),
-				__k.get_grad().real() * y.dataX().imag() + __k.get_grad().imag() * y.dataX().real()
-			);
-			y.add_grad(
-				__k.get_grad().real() * x.dataX().real() - __k.get_grad().imag() * x.dataX().imag(),
-				__k.get_grad().real() * x.dataX().imag() + __k.get_grad().imag() * x.dataX().real()
-			);
-		});
+		__k.set_backward(Op::Mul);
 
 		return __k;
     }
@@ -735,10 +2227,7 @@ operator* (const Value<T>& x, const Value<T>& y) {
     __k.add_child(&x);
     __k.add_child(&y);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad() * y.dataX());
-        y.add_grad(__k.get_grad() * x.dataX());
-    });
+    __k.set_backward(Op::Mul);
 
     return __k;
 }
@@ -758,16 +2247,7 @@ operator* (const Value<T>& x, const Value<U>& y) {
 		__k.add_child(&x);
 		__k.add_child(&y);
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(
-				__k.get_grad().real() * y.dataX().real() - __k.get_grad().imag() * y.dataX().imag(),
-				__k.get_grad().real() * y.dataX().imag() + __k.get_grad().imag() * y.dataX().real()
-			);
-			y.add_grad(
-				__k.get_grad().real() * x.dataX().real() - __k.get_grad().imag() * x.dataX().imag(),
-				__k.get_grad().real() * x.dataX().imag() + __k.get_grad().imag() * x.dataX().real()
-			);
-		});
+		__k.set_backward(Op::Mul);
 
 		return __k;
     }
@@ -777,10 +2257,7 @@ operator* (const Value<T>& x, const Value<U>& y) {
     __k.add_child(&x);
     __k.add_child(&y);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad() * y.dataX());
-        y.add_grad(__k.get_grad() * x.dataX());
-    });
+    __k.set_backward(Op::Mul);
 
     return __k;
 }
@@ -799,12 +2276,7 @@ operator* (const Value<T>& x, const T& y) {
 
 		__k.add_child(&x);
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(
-				__k.get_grad().real() * y.real() - __k.get_grad().imag() * y.imag(),
-				__k.get_grad().real() * y.imag() + __k.get_grad().imag() * y.real()
-			);
-		});
+		__k.set_backward(Op::MulConst, y);
 
         return __k;
     }
@@ -813,9 +2285,7 @@ operator* (const Value<T>& x, const T& y) {
 
     __k.add_child(&x);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad() * y);
-    });
+    __k.set_backward(Op::MulConst, y);
 
     return __k;
 }
@@ -834,12 +2304,7 @@ operator* (const Value<T>& x, const U& y) {
 
 		__k.add_child(static_cast<Value<ResultType<T, U>>*>(&x));
 
-		__k.set_backward([x, y, __k]() {
-			x.add_grad(
-				__k.get_grad().real() * y.real() - __k.get_grad().imag() * y.imag(),
-				__k.get_grad().real() * y.imag() + __k.get_grad().imag() * y.real()
-			);
-		});
+		__k.set_backward(Op::MulConst, y);
 
 		return __k;
     }
@@ -848,15 +2313,13 @@ operator* (const Value<T>& x, const U& y) {
 
     __k.add_child(&x);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad() * y);
-    });
+    __k.set_backward(Op::MulConst, y);
 
     return __k;
 }
 
 
-template <class T>
+template <class T, ScalarOperands<T> = 0>
 inline
 Value <T>
 operator* (const T& x, const T& y) {
@@ -874,7 +2337,7 @@ operator* (const T& x, const T& y) {
 }
 
 
-template <class T, class U>
+template <class T, class U, ScalarOperands<T, U> = 0>
 inline
 Value <ResultType<T, U>>
 operator* (const T& x, const U& y) {
@@ -911,17 +2374,7 @@ operator/ (const Value<T>& x, const Value<T>& y) {
 		__k.add_child(&x);
 		__k.add_child(&y);
 
-        __k.set_backward([x, y, __k]() {
-            auto dr = y.dataX().real() * y.dataX().real() + y.dataX().imag() * y.dataX().imag();
-            x.add_grad(
-                (__k.get_grad().real() * y.dataX().real() + __k.get_grad().imag() * y.dataX().imag()) / dr,
-                (__k.get_grad().real() * y.dataX().imag() - __k.get_grad().imag() * y.dataX().real()) / dr
-            );
-            y.add_grad(
-                (-__k.get_grad().real() * x.dataX().imag() + __k.get_grad().imag() * x.dataX().real()) / dr,
-                (-__k.get_grad().real() * x.dataX().real() - __k.get_grad().imag() * x.dataX().imag()) / dr
-            );
-        });
+        __k.set_backward(Op::Div);
 
 		return __k;
     }
@@ -938,10 +2391,7 @@ operator/ (const Value<T>& x, const Value<T>& y) {
     __k.add_child(&x);
     __k.add_child(&y);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad() / y.dataX());
-        y.add_grad(-__k.get_grad() * x.dataX() / (y.dataX() * y.dataX()));
-    });
+    __k.set_backward(Op::Div);
 
     return __k;
 }
@@ -966,17 +2416,7 @@ operator/ (const Value<T>& x, const Value<U>& y) {
 		__k.add_child(&x);
 		__k.add_child(&y);
 
-		__k.set_backward([x, y, __k]() {
-            auto dr = y.dataX().real() * y.dataX().real() + y.dataX().imag() * y.dataX().imag();
-			x.add_grad(
-				(__k.get_grad().real() * y.dataX().real() + __k.get_grad().imag() * y.dataX().imag()) / dr,
-				(__k.get_grad().real() * y.dataX().imag() - __k.get_grad().imag() * y.dataX().real()) / dr
-			);
-			y.add_grad(
-				(__k.get_grad().real() * x.dataX().imag() - __k.get_grad().imag() * x.dataX().real()) / dr,
-				(__k.get_grad().real() * x.dataX().real() - __k.get_grad().imag() * x.dataX().imag()) / dr
-			);
-		});
+		__k.set_backward(Op::Div);
 
         return Value<ResultType<T, U>>(val);
     }
@@ -990,10 +2430,7 @@ operator/ (const Value<T>& x, const Value<U>& y) {
     __k.add_child(&x);
     __k.add_child(&y);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad() / y.dataX());
-        y.add_grad(-__k.get_grad() * x.dataX() / (y.dataX() * y.dataX()));
-    });
+    __k.set_backward(Op::Div);
 
     return __k;
 }
@@ -1017,13 +2454,7 @@ operator/ (const Value<T>& x, const T& y) {
 
 		__k.add_child(&x);
 
-		__k.set_backward([x, y, __k]() {
-            auto dr = y.real() * y.real() + y.imag() * y.imag();
-			x.add_grad(
-				(__k.get_grad().real() * y.real() + __k.get_grad().imag() * y.imag()) / dr,
-				(__k.get_grad().real() * y.imag() - __k.get_grad().imag() * y.real()) / dr
-			);
-		});
+		__k.set_backward(Op::DivConst, y);
 
         return __k;
     }
@@ -1042,9 +2473,7 @@ operator/ (const Value<T>& x, const T& y) {
 
     __k.add_child(&x);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad() / y);
-    });
+    __k.set_backward(Op::DivConst, y);
 
     return __k;
 }
@@ -1068,13 +2497,7 @@ operator/ (const Value<T>& x, const U& y) {
 
 		__k.add_child(static_cast<Value<ResultType<T, U>>*>(&x));
 
-		__k.set_backward([x, y, __k]() {
-            auto dr = y.real() * y.real() + y.imag() * y.imag();
-			x.add_grad(
-				(__k.get_grad().real() * y.real() + __k.get_grad().imag() * y.imag()) / dr,
-				(__k.get_grad().real() * y.imag() - __k.get_grad().imag() * y.real()) / dr
-			);
-		});
+		__k.set_backward(Op::DivConst, y);
 
 		return __k;
     }
@@ -1087,15 +2510,13 @@ operator/ (const Value<T>& x, const U& y) {
 
     __k.add_child(&x);
 
-    __k.set_backward([x, y, __k]() {
-        x.add_grad(__k.get_grad() / y);
-    });
+    __k.set_backward(Op::DivConst, y);
 
     return __k;
 }
 
 
-template <class T>
+template <class T, ScalarOperands<T> = 0>
 inline
 Value <T>
 operator/ (const T& x, const T& y) {
@@ -1127,7 +2548,7 @@ operator/ (const T& x, const T& y) {
     return __k;
 }
 
-template <class T, class U>
+template <class T, class U, ScalarOperands<T, U> = 0>
 inline
 Value <ResultType<T, U>>
 operator/ (const T& x, const U& y) {
@@ -1159,13 +2580,11 @@ inline
 Value <T>
 operator-(const Value<T>& _x) {
     if constexpr (is_complex_v<T>) {
-        Value<T> __k = Value<T>(-_x.dataX().real(), -_x.dataX().imag());
+        Value<T> __k = Value<T>(T(-_x.dataX().real(), -_x.dataX().imag()));
 
         __k.add_child(&_x);
 
-        __k.set_backward([_x, __k]() {
-            _x.add_grad(-__k.get_grad());
-        });
+        __k.set_backward(Op::Neg);
 
         return __k;
     } else {
@@ -1173,9 +2592,7 @@ operator-(const Value<T>& _x) {
 
         __k.add_child(&_x);
 
-        __k.set_backward([_x, __k]() {
-            _x.add_grad(-__k.get_grad());
-        });
+        __k.set_backward(Op::Neg);
 
         return __k;
     }
@@ -2216,10 +3633,7 @@ pow(const Value<T>& _x, const Value<T>& _y) {
 	__k.add_child(&_x);
 	__k.add_child(&_y);
 
-	__k.set_backward([_x, _y, __k]() {
-		_x.add_grad(__k.get_grad() * _y.dataX() * std::pow(_x.dataX(), _y.dataX() - 1));
-		_y.add_grad(__k.get_grad() * std::pow(_x.dataX(), _y.dataX()) * std::log(_x.dataX()));
-	});
+	__k.set_backward(Op::Pow);
 
 	return __k;
 }
@@ -2233,14 +3647,12 @@ pow(const Value<T>& _x, const T& _y) {
 
 	__k.add_child(&_x);
 
-	__k.set_backward([_x, _y, __k]() {
-		_x.add_grad(__k.get_grad() * _y * std::pow(_x.dataX(), _y - 1));
-	});
+	__k.set_backward(Op::PowConst, _y);
 
 	return __k;
 }
 
-template <class T>
+template <class T, ScalarOperands<T> = 0>
 inline
 Value <T>
 pow(const T& _x, const T& _y) {
@@ -2326,9 +3738,7 @@ neg(const Value<T>& _x) {
 
         __k.add_child(&_x);
 
-        __k.set_backward([_x, __k]() {
-            _x.add_grad(-__k.get_grad().real(), -__k.get_grad().imag());
-        });
+        __k.set_backward(Op::Neg);
 
         return __k;
     } else {
@@ -2336,9 +3746,7 @@ neg(const Value<T>& _x) {
 
         __k.add_child(&_x);
 
-        __k.set_backward([_x, __k]() {
-            _x.add_grad(-__k.get_grad());
-        });
+        __k.set_backward(Op::Neg);
 
         return __k;
     }
@@ -2578,14 +3986,7 @@ relu(const Value<T>& _x) {
 
         __k.add_child(&_x);
 
-        __k.set_backward([_x, __k]() {
-            using R = decltype(_x.dataX().real());
-            R re = _x.dataX().real();
-            R im = _x.dataX().imag();
-            auto g = __k.get_grad();
-            _x.add_grad(re < R(0) ? R(0) : g.real(),
-                        im < R(0) ? R(0) : g.imag());
-        });
+        __k.set_backward(Op::Relu);
 
         return __k;
     } else {
@@ -2598,19 +3999,13 @@ relu(const Value<T>& _x) {
 
         __k.add_child(&_x);
 
-        __k.set_backward([_x, __k]() {
-            if (_x.dataX() < 0.0) {
-                _x.add_grad(0.0);
-            } else {
-                _x.add_grad(__k.get_grad());
-            }
-        });
+        __k.set_backward(Op::Relu);
 
         return __k;
     }
 }
 
-template <class T>
+template <class T, ScalarOperands<T> = 0>
 inline
 Value <T>
 relu(const T& _x) {
@@ -2650,4 +4045,313 @@ relu(const std::vector<std::vector<Value<T>>>& _x) {
     return __k;
 }
 
+
+// rvalue operands
+
+// a temporary operand hands its reference over to the op built from
+// it, rather than the op taking a new reference and the temporary
+// dropping its own right after. the value comes from the overloads
+// above, run with graph building off, so the ops behave the same
+
+template <class T, class X, class Y, class F>
+inline
+Value <T>
+steal_operands(X&& x, Y&& y, Op op, F f) {
+    Value<T> __k = [&] {
+        NoGradGuard no_grad;
+        return f(static_cast<const Value<T>&>(x), static_cast<const Value<T>&>(y));
+    }();
+
+    if (static_cast<const void*>(&x) == static_cast<const void*>(&y)) {
+        // the same temporary twice can only be handed over once
+        __k.add_child(&x);
+        __k.add_child(std::forward<Y>(y));
+    } else {
+        __k.add_child(std::forward<X>(x));
+        __k.add_child(std::forward<Y>(y));
+    }
+
+    __k.set_backward(op);
+
+    return __k;
+}
+
+
+template <class T, class F>
+inline
+Value <T>
+steal_operand(Value<T>&& x, Op op, F f) {
+    Value<T> __k = [&] {
+        NoGradGuard no_grad;
+        return f(static_cast<const Value<T>&>(x));
+    }();
+
+    __k.add_child(std::move(x));
+
+    __k.set_backward(op);
+
+    return __k;
+}
+
+
+template <class T, class F>
+inline
+Value <T>
+steal_operand(Value<T>&& x, const T& c, Op op, F f) {
+    Value<T> __k = [&] {
+        NoGradGuard no_grad;
+        return f(static_cast<const Value<T>&>(x), c);
+    }();
+
+    __k.add_child(std::move(x));
+
+    __k.set_backward(op, c);
+
+    return __k;
+}
+
+
+template <class T>
+inline
+Value <T>
+operator+ (Value<T>&& x, const Value<T>& y) {
+    return steal_operands<T>(std::move(x), y, Op::Add,
+                             [](const Value<T>& a, const Value<T>& b) { return a + b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator+ (const Value<T>& x, Value<T>&& y) {
+    return steal_operands<T>(x, std::move(y), Op::Add,
+                             [](const Value<T>& a, const Value<T>& b) { return a + b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator+ (Value<T>&& x, Value<T>&& y) {
+    return steal_operands<T>(std::move(x), std::move(y), Op::Add,
+                             [](const Value<T>& a, const Value<T>& b) { return a + b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator+ (Value<T>&& x, const T& y) {
+    return steal_operand(std::move(x), y, Op::Add,
+                         [](const Value<T>& a, const T& b) { return a + b; });
+}
+
+
+template <class T>
+inline
+Value <T>
+operator- (Value<T>&& x, const Value<T>& y) {
+    return steal_operands<T>(std::move(x), y, Op::Sub,
+                             [](const Value<T>& a, const Value<T>& b) { return a - b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator- (const Value<T>& x, Value<T>&& y) {
+    return steal_operands<T>(x, std::move(y), Op::Sub,
+                             [](const Value<T>& a, const Value<T>& b) { return a - b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator- (Value<T>&& x, Value<T>&& y) {
+    return steal_operands<T>(std::move(x), std::move(y), Op::Sub,
+                             [](const Value<T>& a, const Value<T>& b) { return a - b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator- (Value<T>&& x, const T& y) {
+    return steal_operand(std::move(x), y, Op::Sub,
+                         [](const Value<T>& a, const T& b) { return a - b; });
+}
+
+
+template <class T>
+inline
+Value <T>
+operator* (Value<T>&& x, const Value<T>& y) {
+    return steal_operands<T>(std::move(x), y, Op::Mul,
+                             [](const Value<T>& a, const Value<T>& b) { return a * b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator* (const Value<T>& x, Value<T>&& y) {
+    return steal_operands<T>(x, std::move(y), Op::Mul,
+                             [](const Value<T>& a, const Value<T>& b) { return a * b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator* (Value<T>&& x, Value<T>&& y) {
+    return steal_operands<T>(std::move(x), std::move(y), Op::Mul,
+                             [](const Value<T>& a, const Value<T>& b) { return a * b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator* (Value<T>&& x, const T& y) {
+    return steal_operand(std::move(x), y, Op::MulConst,
+                         [](const Value<T>& a, const T& b) { return a * b; });
+}
+
+
+template <class T>
+inline
+Value <T>
+operator/ (Value<T>&& x, const Value<T>& y) {
+    return steal_operands<T>(std::move(x), y, Op::Div,
+                             [](const Value<T>& a, const Value<T>& b) { return a / b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator/ (const Value<T>& x, Value<T>&& y) {
+    return steal_operands<T>(x, std::move(y), Op::Div,
+                             [](const Value<T>& a, const Value<T>& b) { return a / b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator/ (Value<T>&& x, Value<T>&& y) {
+    return steal_operands<T>(std::move(x), std::move(y), Op::Div,
+                             [](const Value<T>& a, const Value<T>& b) { return a / b; });
+}
+
+template <class T>
+inline
+Value <T>
+operator/ (Value<T>&& x, const T& y) {
+    return steal_operand(std::move(x), y, Op::DivConst,
+                         [](const Value<T>& a, const T& b) { return a / b; });
+}
+
+
+template <class T>
+inline
+Value <T>
+operator- (Value<T>&& x) {
+    return steal_operand(std::move(x), Op::Neg, [](const Value<T>& a) { return -a; });
+}
+
+
+template <class T>
+inline
+Value <T>
+relu(Value<T>&& x) {
+    return steal_operand(std::move(x), Op::Relu, [](const Value<T>& a) { return relu(a); });
+}
+
+
+// sum
+
+// one node for the whole sum, however many terms: the forward is a
+// single loop over the operands, and so is the backward
+template <class T>
+inline
+Value <T>
+sum(const Value<T>* _x, size_t n) {
+    Value<T> __k;
+    __k.reserve_children(n);
+    for (size_t i = 0; i < n; ++i) {
+        __k.add_child(&_x[i]);
+    }
+
+    if constexpr (is_complex_v<T>) {
+        using R = decltype(T().real());
+        R re = R(0), im = R(0);
+        for (size_t i = 0; i < n; ++i) {
+            re += _x[i].dataX().real();
+            im += _x[i].dataX().imag();
+        }
+        __k.set_data(T(re, im));
+    } else {
+        T sx = T(0);
+        for (size_t i = 0; i < n; ++i) {
+            sx += _x[i].dataX();
+        }
+        __k.set_data(sx);
+    }
+
+    __k.set_backward(Op::Sum);
+
+    return __k;
+}
+
+
+template <class T>
+inline
+Value <T>
+sum(const std::vector<Value<T>>& _x) {
+    return sum(_x.data(), _x.size());
+}
+
+
+// dot
+
+// sum of _x[i] * _y[i] as one node, rather than a product and an add
+// per term
+template <class T>
+inline
+Value <T>
+dot(const Value<T>* _x, const Value<T>* _y, size_t n) {
+    Value<T> __k;
+    __k.reserve_children(2 * n);
+    for (size_t i = 0; i < n; ++i) {
+        __k.add_child(&_x[i]);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        __k.add_child(&_y[i]);
+    }
+
+    if constexpr (is_complex_v<T>) {
+        using R = decltype(T().real());
+        R re = R(0), im = R(0);
+        for (size_t i = 0; i < n; ++i) {
+            T a = _x[i].dataX();
+            T b = _y[i].dataX();
+            re += a.real() * b.real() - a.imag() * b.imag();
+            im += a.real() * b.imag() + a.imag() * b.real();
+        }
+        __k.set_data(T(re, im));
+    } else {
+        T sx = T(0);
+        for (size_t i = 0; i < n; ++i) {
+            sx += _x[i].dataX() * _y[i].dataX();
+        }
+        __k.set_data(sx);
+    }
+
+    __k.set_backward(Op::Dot);
+
+    return __k;
+}
+
+
+template <class T>
+inline
+Value <T>
+dot(const std::vector<Value<T>>& _x, const std::vector<Value<T>>& _y) {
+    if (_x.size() != _y.size()) {
+        throw std::invalid_argument("Vectors must have the same size");
+    }
+    return dot(_x.data(), _y.data(), _x.size());
+}
+
 }
@@ -0,0 +1,391 @@
+// expression templates over Value. once ex(v) is one of the operands,
+// + - * /, unary -, relu and pow build the type of the whole
+// expression at compile time instead of a node per op, and fuse()
+// turns it into a single node with a forward and a backward generated
+// from that type. fuse(ex(w) * x + b) is then one node over w, x and b,
+// and fuse(pow(ex(pred) - y, 2.0)) one node over pred, where the plain
+// ops would build two.
+//
+// an expression refers to the Values it was built from, so build and
+// fuse it in one statement. real types only
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+#include "engine.h"
+
+
+namespace ptMgrad {
+
+namespace expr {
+
+
+// the nodes of an expression. every one knows at compile time how many
+// leaves and constants it reads; in the kernels, the leaves below a
+// node start at index L of the operands and its constants at index C.
+// forward reads a leaf value through in(i), which is the value of an
+// operand node in the kernels, and of the Value itself when fusing
+
+template <class T>
+struct Leaf {
+    using value_type = T;
+    static constexpr size_t n_leaves = 1;
+    static constexpr size_t n_constants = 0;
+
+    const Value<T>* v;
+
+    void collect(const Value<T>** leaves, T*) const {
+        leaves[0] = v;
+    }
+
+    template <size_t L, size_t C, class In>
+    static T forward(const In& in, const T*) {
+        return in(L);
+    }
+
+    template <size_t L, size_t C>
+    static void backward(Node<T>* const* in, const T*, const T& g) {
+        in[L]->add_grad(g);
+    }
+};
+
+
+template <class T>
+struct Constant {
+    using value_type = T;
+    static constexpr size_t n_leaves = 0;
+    static constexpr size_t n_constants = 1;
+
+    T c;
+
+    void collect(const Value<T>**, T* constants) const {
+        constants[0] = c;
+    }
+
+    template <size_t L, size_t C, class In>
+    static T forward(const In&, const T* c) {
+        return c[C];
+    }
+};
+
+
+// value of operand node i, for the kernels
+template <class T>
+struct NodeValues {
+    Node<T>* const* in;
+
+    T operator()(size_t i) const {
+        return in[i]->x;
+    }
+};
+
+
+template <class F, class A, class B>
+struct Binary {
+    using value_type = typename A::value_type;
+    static constexpr size_t n_leaves = A::n_leaves + B::n_leaves;
+    static constexpr size_t n_constants = A::n_constants + B::n_constants;
+
+    A a;
+    B b;
+
+    void collect(const Value<value_type>** leaves, value_type* constants) const {
+        a.collect(leaves, constants);
+        b.collect(leaves + A::n_leaves, constants + A::n_constants);
+    }
+
+    template <size_t L, size_t C, class In>
+    static value_type forward(const In& in, const value_type* c) {
+        return F::forward(A::template forward<L, C>(in, c),
+                          B::template forward<L + A::n_leaves, C + A::n_constants>(in, c));
+    }
+
+    // the operand values are computed again on the way down; the
+    // expressions are small, and this keeps the kernels free of state.
+    // nothing is passed to a side without leaves
+    template <size_t L, size_t C>
+    static void backward(Node<value_type>* const* in, const value_type* c, const value_type& g) {
+        NodeValues<value_type> values{in};
+        value_type va = A::template forward<L, C>(values, c);
+        value_type vb = B::template forward<L + A::n_leaves, C + A::n_constants>(values, c);
+        if constexpr (A::n_leaves > 0) {
+            A::template backward<L, C>(in, c, F::grad_a(g, va, vb));
+        }
+        if constexpr (B::n_leaves > 0) {
+            B::template backward<L + A::n_leaves, C + A::n_constants>(in, c, F::grad_b(g, va, vb));
+        }
+    }
+};
+
+
+template <class F, class A>
+struct Unary {
+    using value_type = typename A::value_type;
+    static constexpr size_t n_leaves = A::n_leaves;
+    static constexpr size_t n_constants = A::n_constants;
+
+    A a;
+
+    void collect(const Value<value_type>** leaves, value_type* constants) const {
+        a.collect(leaves, constants);
+    }
+
+    template <size_t L, size_t C, class In>
+    static value_type forward(const In& in, const value_type* c) {
+        return F::forward(A::template forward<L, C>(in, c));
+    }
+
+    template <size_t L, size_t C>
+    static void backward(Node<value_type>* const* in, const value_type* c, const value_type& g) {
+        value_type va = A::template forward<L, C>(NodeValues<value_type>{in}, c);
+        A::template backward<L, C>(in, c, F::grad(g, va));
+    }
+};
+
+
+// the ops, computed and differentiated the same way as their nodes
+// in Node::run_forward and Node::run_backward
+
+struct AddOp {
+    template <class T> static T forward(const T& a, const T& b) { return a + b; }
+    template <class T> static T grad_a(const T& g, const T&, const T&) { return g; }
+    template <class T> static T grad_b(const T& g, const T&, const T&) { return g; }
+};
+
+struct SubOp {
+    template <class T> static T forward(const T& a, const T& b) { return a - b; }
+    template <class T> static T grad_a(const T& g, const T&, const T&) { return g; }
+    template <class T> static T grad_b(const T& g, const T&, const T&) { return -g; }
+};
+
+struct MulOp {
+    template <class T> static T forward(const T& a, const T& b) { return a * b; }
+    template <class T> static T grad_a(const T& g, const T&, const T& b) { return g * b; }
+    template <class T> static T grad_b(const T& g, const T& a, const T&) { return g * a; }
+};
+
+struct DivOp {
+    template <class T>
+    static T forward(const T& a, const T& b) {
+        if (b == 0) {
+            throw std::invalid_argument("Division by zero");
+        }
+        using Type = std::conditional_t<std::is_integral_v<T>, double, T>;
+        return static_cast<T>(static_cast<Type>(a) / static_cast<Type>(b));
+    }
+    template <class T> static T grad_a(const T& g, const T&, const T& b) { return g / b; }
+    template <class T> static T grad_b(const T& g, const T& a, const T& b) { return -g * a / (b * b); }
+};
+
+struct PowOp {
+    template <class T>
+    static T forward(const T& a, const T& b) {
+        return T(std::pow(a, b));
+    }
+    template <class T>
+    static T grad_a(const T& g, const T& a, const T& b) {
+        return g * b * std::pow(a, b - 1);
+    }
+    template <class T>
+    static T grad_b(const T& g, const T& a, const T& b) {
+        return g * std::pow(a, b) * std::log(a);
+    }
+};
+
+struct NegOp {
+    template <class T> static T forward(const T& a) { return -a; }
+    template <class T> static T grad(const T& g, const T&) { return -g; }
+};
+
+struct ReluOp {
+    template <class T> static T forward(const T& a) { return a < 0.0 ? T(0.0) : a; }
+    template <class T> static T grad(const T& g, const T& a) { return a < 0.0 ? T(0.0) : g; }
+};
+
+}  // namespace expr
+
+
+template <class T>
+struct is_expression<expr::Leaf<T>> : std::true_type {};
+
+template <class T>
+struct is_expression<expr::Constant<T>> : std::true_type {};
+
+template <class F, class A, class B>
+struct is_expression<expr::Binary<F, A, B>> : std::true_type {};
+
+template <class F, class A>
+struct is_expression<expr::Unary<F, A>> : std::true_type {};
+
+
+namespace expr {
+
+// operands an expression op takes next to an expression: another
+// expression, a Value of the same type, which becomes a leaf, or a
+// scalar, which becomes a constant
+
+template <class X, class = void>
+struct value_of {};
+
+template <class T>
+struct value_of<Value<T>> {
+    using type = T;
+};
+
+template <class X>
+struct value_of<X, std::enable_if_t<is_expression_v<X>>> {
+    using type = typename X::value_type;
+};
+
+// the value type of an op over A and B, for which at least one of
+// them has to be an expression
+template <class A, class B, class = void>
+struct common_value {};
+
+template <class A, class B>
+struct common_value<A, B, std::enable_if_t<
+        (is_expression_v<A> || is_expression_v<B>) &&
+        std::is_same_v<typename value_of<A>::type, typename value_of<B>::type>>> {
+    using type = typename value_of<A>::type;
+};
+
+template <class A, class U>
+struct common_value<A, U, std::enable_if_t<is_expression_v<A> && std::is_arithmetic_v<U>>> {
+    using type = typename A::value_type;
+};
+
+template <class U, class B>
+struct common_value<U, B, std::enable_if_t<std::is_arithmetic_v<U> && is_expression_v<B>>> {
+    using type = typename B::value_type;
+};
+
+template <class A, class B>
+using common_value_t = typename common_value<A, B>::type;
+
+
+template <class T, class E, std::enable_if_t<is_expression_v<E>, int> = 0>
+inline const E& operand(const E& e) {
+    return e;
+}
+
+template <class T>
+inline Leaf<T> operand(const Value<T>& v) {
+    return {&v};
+}
+
+template <class T, class U, std::enable_if_t<std::is_arithmetic_v<U>, int> = 0>
+inline Constant<T> operand(const U& u) {
+    return {T(u)};
+}
+
+template <class T, class X>
+using operand_t = std::decay_t<decltype(operand<T>(std::declval<const X&>()))>;
+
+template <class F, class T, class A, class B>
+inline Binary<F, operand_t<T, A>, operand_t<T, B>> binary(const A& a, const B& b) {
+    return {operand<T>(a), operand<T>(b)};
+}
+
+
+template <class A, class B, class T = common_value_t<A, B>>
+inline auto operator+ (const A& a, const B& b) {
+    return binary<AddOp, T>(a, b);
+}
+
+template <class A, class B, class T = common_value_t<A, B>>
+inline auto operator- (const A& a, const B& b) {
+    return binary<SubOp, T>(a, b);
+}
+
+template <class A, class B, class T = common_value_t<A, B>>
+inline auto operator* (const A& a, const B& b) {
+    return binary<MulOp, T>(a, b);
+}
+
+template <class A, class B, class T = common_value_t<A, B>>
+inline auto operator/ (const A& a, const B& b) {
+    return binary<DivOp, T>(a, b);
+}
+
+template <class A, class B, class T = common_value_t<A, B>>
+inline auto pow(const A& a, const B& b) {
+    return binary<PowOp, T>(a, b);
+}
+
+template <class A, std::enable_if_t<is_expression_v<A>, int> = 0>
+inline Unary<NegOp, A> operator- (const A& a) {
+    return {a};
+}
+
+template <class A, std::enable_if_t<is_expression_v<A>, int> = 0>
+inline Unary<ReluOp, A> relu(const A& a) {
+    return {a};
+}
+
+
+// the kernels stored in a fused node
+template <class E>
+struct Kernels {
+    using T = typename E::value_type;
+
+    static T forward(Node<T>* const* in, const T* c) {
+        return E::template forward<0, 0>(NodeValues<T>{in}, c);
+    }
+
+    static void backward(Node<T>* const* in, const T* c, const T& g) {
+        E::template backward<0, 0>(in, c, g);
+    }
+};
+
+}  // namespace expr
+
+
+// starts an expression at v
+template <class T>
+inline
+expr::Leaf<T>
+ex(const Value<T>& v) {
+    return {&v};
+}
+
+
+// one node for the whole expression. its operands are the leaves of
+// the expression, in order, and its constants are kept next to them
+template <class E, std::enable_if_t<is_expression_v<E>, int> = 0>
+inline
+Value <typename E::value_type>
+fuse(const E& e) {
+    using T = typename E::value_type;
+    using Fused = typename Node<T>::Fused;
+    static_assert(std::is_arithmetic_v<T>, "only expressions of real types can be fused");
+    static_assert(alignof(T) <= alignof(Fused), "constants must fit after the kernels");
+
+    const Value<T>* leaves[E::n_leaves];
+    T constants[E::n_constants > 0 ? E::n_constants : 1];
+    e.collect(leaves, constants);
+
+    Value<T> __k;
+    __k.set_data(E::template forward<0, 0>(
+        [&](size_t i) { return leaves[i]->dataX(); }, constants));
+
+    void* extra = __k.reserve_children(E::n_leaves, sizeof(Fused) + E::n_constants * sizeof(T));
+    for (size_t i = 0; i < E::n_leaves; ++i) {
+        __k.add_child(leaves[i]);
+    }
+    if (extra) {
+        Fused* f = new (extra) Fused{&expr::Kernels<E>::forward, &expr::Kernels<E>::backward};
+        std::memcpy(static_cast<void*>(f + 1), constants, E::n_constants * sizeof(T));
+    }
+
+    __k.set_backward(Op::Fused);
+
+    return __k;
+}
+
+}  // namespace ptMgrad
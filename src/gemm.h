@@ -0,0 +1,309 @@
+// matrix multiply. gemm computes C = A B, or adds A B to C, with A and
+// B read through a row and a column stride each, so that a transposed
+// operand is only a swap of its strides. the work is split into blocks
+// that stay in the caches: a KC x NC panel of B and an MC x KC block of
+// A are packed into slivers laid out in the order a micro-kernel reads
+// them, which multiplies an MR x KC sliver of A by a KC x NR sliver of
+// B into an MR x NR tile of C held in registers.
+//
+// the micro-kernel is picked at run time: AVX-512 or AVX2 with FMA
+// where the CPU has them, and a portable one otherwise, which also
+// serves complex elements
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PTMGRAD_GEMM_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace ptMgrad {
+
+
+// a micro-kernel: adds the product of a packed sliver of A, mr values
+// per step, and a packed sliver of B, nr values per step, over k steps
+// to the mr x nr tile of C at c, whose rows are ldc apart
+template <typename T>
+struct GemmKernel {
+    const char* name;
+    size_t mr;
+    size_t nr;
+    void (*run)(size_t k, const T* a, const T* b, T* c, size_t ldc);
+};
+
+
+namespace kernel {
+
+template <typename T, size_t MR, size_t NR>
+inline void gemm_portable(size_t k, const T* a, const T* b, T* c, size_t ldc) {
+    T acc[MR][NR];
+    for (size_t i = 0; i < MR; ++i) {
+        for (size_t j = 0; j < NR; ++j) {
+            acc[i][j] = T(0);
+        }
+    }
+    for (size_t p = 0; p < k; ++p, a += MR, b += NR) {
+        for (size_t i = 0; i < MR; ++i) {
+            const T ai = a[i];
+            for (size_t j = 0; j < NR; ++j) {
+                acc[i][j] += ai * b[j];
+            }
+        }
+    }
+    for (size_t i = 0; i < MR; ++i) {
+        for (size_t j = 0; j < NR; ++j) {
+            c[i * ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#ifdef PTMGRAD_GEMM_X86
+
+// 12 x 16 doubles, or 12 x 32 floats: 24 accumulators out of the 32
+// registers, two loads of B and a broadcast of A per row
+__attribute__((target("avx512f")))
+inline void gemm_avx512(size_t k, const double* a, const double* b, double* c, size_t ldc) {
+    __m512d acc[12][2];
+    for (int i = 0; i < 12; ++i) {
+        acc[i][0] = _mm512_setzero_pd();
+        acc[i][1] = _mm512_setzero_pd();
+    }
+    for (size_t p = 0; p < k; ++p, a += 12, b += 16) {
+        __m512d b0 = _mm512_loadu_pd(b);
+        __m512d b1 = _mm512_loadu_pd(b + 8);
+        for (int i = 0; i < 12; ++i) {
+            __m512d ai = _mm512_set1_pd(a[i]);
+            acc[i][0] = _mm512_fmadd_pd(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_pd(ai, b1, acc[i][1]);
+        }
+    }
+    for (int i = 0; i < 12; ++i) {
+        double* ci = c + i * ldc;
+        _mm512_storeu_pd(ci, _mm512_add_pd(_mm512_loadu_pd(ci), acc[i][0]));
+        _mm512_storeu_pd(ci + 8, _mm512_add_pd(_mm512_loadu_pd(ci + 8), acc[i][1]));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void gemm_avx512(size_t k, const float* a, const float* b, float* c, size_t ldc) {
+    __m512 acc[12][2];
+    for (int i = 0; i < 12; ++i) {
+        acc[i][0] = _mm512_setzero_ps();
+        acc[i][1] = _mm512_setzero_ps();
+    }
+    for (size_t p = 0; p < k; ++p, a += 12, b += 32) {
+        __m512 b0 = _mm512_loadu_ps(b);
+        __m512 b1 = _mm512_loadu_ps(b + 16);
+        for (int i = 0; i < 12; ++i) {
+            __m512 ai = _mm512_set1_ps(a[i]);
+            acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    for (int i = 0; i < 12; ++i) {
+        float* ci = c + i * ldc;
+        _mm512_storeu_ps(ci, _mm512_add_ps(_mm512_loadu_ps(ci), acc[i][0]));
+        _mm512_storeu_ps(ci + 16, _mm512_add_ps(_mm512_loadu_ps(ci + 16), acc[i][1]));
+    }
+}
+
+// 6 x 8 doubles, or 6 x 16 floats: 12 accumulators out of 16 registers
+__attribute__((target("avx2,fma")))
+inline void gemm_avx2(size_t k, const double* a, const double* b, double* c, size_t ldc) {
+    __m256d acc[6][2];
+    for (int i = 0; i < 6; ++i) {
+        acc[i][0] = _mm256_setzero_pd();
+        acc[i][1] = _mm256_setzero_pd();
+    }
+    for (size_t p = 0; p < k; ++p, a += 6, b += 8) {
+        __m256d b0 = _mm256_loadu_pd(b);
+        __m256d b1 = _mm256_loadu_pd(b + 4);
+        for (int i = 0; i < 6; ++i) {
+            __m256d ai = _mm256_broadcast_sd(a + i);
+            acc[i][0] = _mm256_fmadd_pd(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_pd(ai, b1, acc[i][1]);
+        }
+    }
+    for (int i = 0; i < 6; ++i) {
+        double* ci = c + i * ldc;
+        _mm256_storeu_pd(ci, _mm256_add_pd(_mm256_loadu_pd(ci), acc[i][0]));
+        _mm256_storeu_pd(ci + 4, _mm256_add_pd(_mm256_loadu_pd(ci + 4), acc[i][1]));
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void gemm_avx2(size_t k, const float* a, const float* b, float* c, size_t ldc) {
+    __m256 acc[6][2];
+    for (int i = 0; i < 6; ++i) {
+        acc[i][0] = _mm256_setzero_ps();
+        acc[i][1] = _mm256_setzero_ps();
+    }
+    for (size_t p = 0; p < k; ++p, a += 6, b += 16) {
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        for (int i = 0; i < 6; ++i) {
+            __m256 ai = _mm256_broadcast_ss(a + i);
+            acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    for (int i = 0; i < 6; ++i) {
+        float* ci = c + i * ldc;
+        _mm256_storeu_ps(ci, _mm256_add_ps(_mm256_loadu_ps(ci), acc[i][0]));
+        _mm256_storeu_ps(ci + 8, _mm256_add_ps(_mm256_loadu_ps(ci + 8), acc[i][1]));
+    }
+}
+
+#endif  // PTMGRAD_GEMM_X86
+
+}  // namespace kernel
+
+
+// the micro-kernels this CPU can run, fastest first; the portable one
+// is always last
+template <typename T>
+inline
+std::vector<GemmKernel<T>>
+gemm_kernels() {
+    std::vector<GemmKernel<T>> kernels;
+#ifdef PTMGRAD_GEMM_X86
+    if constexpr (std::is_same_v<T, double>) {
+        if (__builtin_cpu_supports("avx512f")) {
+            kernels.push_back({"avx512", 12, 16, &kernel::gemm_avx512});
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            kernels.push_back({"avx2", 6, 8, &kernel::gemm_avx2});
+        }
+    } else if constexpr (std::is_same_v<T, float>) {
+        if (__builtin_cpu_supports("avx512f")) {
+            kernels.push_back({"avx512", 12, 32, &kernel::gemm_avx512});
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            kernels.push_back({"avx2", 6, 16, &kernel::gemm_avx2});
+        }
+    }
+#endif
+    kernels.push_back({"portable", 4, 4, &kernel::gemm_portable<T, 4, 4>});
+    return kernels;
+}
+
+// the fastest of them, picked once
+template <typename T>
+inline
+const GemmKernel<T>&
+gemm_kernel() {
+    static const GemmKernel<T> best = gemm_kernels<T>().front();
+    return best;
+}
+
+
+// what gemm does with a tile of C once it is complete: nothing, by
+// default. an epilogue is called as e(i, j, c, rows, cols, ldc) for the
+// rows x cols tile at C(i, j), while it is still in the caches
+struct NoEpilogue {
+    template <typename T>
+    void operator()(size_t, size_t, T*, size_t, size_t, size_t) const {}
+};
+
+
+// C = A B, or C += A B with accumulate, for an m x k matrix A and a
+// k x n matrix B, where A(i, p) is a[i * rsa + p * csa] and B(p, j) is
+// b[p * rsb + j * csb]. C is row major with rows ldc apart
+template <typename T, class Epilogue = NoEpilogue>
+inline
+void
+gemm(size_t m, size_t n, size_t k,
+     const T* a, size_t rsa, size_t csa,
+     const T* b, size_t rsb, size_t csb,
+     T* c, size_t ldc, bool accumulate = false,
+     const GemmKernel<T>& kern = gemm_kernel<T>(),
+     const Epilogue& epilogue = Epilogue()) {
+    if (!accumulate) {
+        for (size_t i = 0; i < m; ++i) {
+            std::fill(c + i * ldc, c + i * ldc + n, T(0));
+        }
+    }
+    if (m == 0 || n == 0) {
+        return;
+    }
+    if (k == 0) {
+        epilogue(size_t(0), size_t(0), c, m, n, ldc);
+        return;
+    }
+
+    // a block of A takes half of a 1 MiB L2, a panel of B stays in L3
+    const size_t mr = kern.mr, nr = kern.nr;
+    const size_t kc_max = 256;
+    const size_t mc_max = std::max(mr, (size_t(512) * 1024 / (kc_max * sizeof(T))) / mr * mr);
+    const size_t nc_max = std::max(nr, size_t(4096) / nr * nr);
+
+    static thread_local std::vector<T> packed_a, packed_b, tile;
+    packed_a.resize(mc_max * kc_max);
+    packed_b.resize(nc_max * kc_max);
+    tile.resize(mr * nr);
+
+    for (size_t jc = 0; jc < n; jc += nc_max) {
+        size_t nc = std::min(nc_max, n - jc);
+        for (size_t pc = 0; pc < k; pc += kc_max) {
+            size_t kc = std::min(kc_max, k - pc);
+
+            // slivers of nr columns, zero padded past n
+            for (size_t jr = 0; jr < nc; jr += nr) {
+                T* dst = packed_b.data() + jr * kc;
+                for (size_t p = 0; p < kc; ++p) {
+                    const T* src = b + (pc + p) * rsb + (jc + jr) * csb;
+                    for (size_t j = 0; j < nr; ++j) {
+                        dst[p * nr + j] = jr + j < nc ? src[j * csb] : T(0);
+                    }
+                }
+            }
+
+            for (size_t ic = 0; ic < m; ic += mc_max) {
+                size_t mc = std::min(mc_max, m - ic);
+
+                // slivers of mr rows, zero padded past m
+                for (size_t ir = 0; ir < mc; ir += mr) {
+                    T* dst = packed_a.data() + ir * kc;
+                    for (size_t p = 0; p < kc; ++p) {
+                        const T* src = a + (ic + ir) * rsa + (pc + p) * csa;
+                        for (size_t i = 0; i < mr; ++i) {
+                            dst[p * mr + i] = ir + i < mc ? src[i * rsa] : T(0);
+                        }
+                    }
+                }
+
+                for (size_t jr = 0; jr < nc; jr += nr) {
+                    for (size_t ir = 0; ir < mc; ir += mr) {
+                        const T* pa = packed_a.data() + ir * kc;
+                        const T* pb = packed_b.data() + jr * kc;
+                        T* cij = c + (ic + ir) * ldc + jc + jr;
+                        size_t mt = std::min(mr, mc - ir), nt = std::min(nr, nc - jr);
+                        if (mt == mr && nt == nr) {
+                            kern.run(kc, pa, pb, cij, ldc);
+                        } else {
+                            // an edge tile goes through a full one
+                            std::fill(tile.begin(), tile.end(), T(0));
+                            kern.run(kc, pa, pb, tile.data(), nr);
+                            for (size_t i = 0; i < mt; ++i) {
+                                for (size_t j = 0; j < nt; ++j) {
+                                    cij[i * ldc + j] += tile[i * nr + j];
+                                }
+                            }
+                        }
+                        if (pc + kc == k) {
+                            epilogue(ic + ir, jc + jr, cij, mt, nt, ldc);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+}  // namespace ptMgrad
@@ -0,0 +1,128 @@
+// captured computational graph for loops that rebuild the same
+// structure every step and only change leaf values.
+// capture sorts the graph once; replay re-evaluates every op in
+// place and runs backward over the stored order, so a step neither
+// allocates nodes nor sorts anything
+
+#pragma once
+
+#include <vector>
+#include <stdexcept>
+
+#include "engine.h"
+
+
+namespace ptMgrad {
+
+
+template <typename T>
+class Compiled;
+
+
+template <typename T>
+class Graph {
+private:
+    friend class Compiled<T>;
+
+    Node<T>* root = nullptr;
+    // ops in topological order; leaves are not stored
+    std::vector<Node<T>*> ops;
+
+public:
+    Graph() = default;
+
+    explicit Graph(const Value<T>& output) {
+        capture(output);
+    }
+
+    ~Graph() {
+        clear();
+    }
+
+    Graph(const Graph&) = delete;
+    Graph& operator=(const Graph&) = delete;
+
+    // record the graph below output. captured nodes are kept alive,
+    // but nodes built inside an ArenaScope only last as long as it
+    void capture(const Value<T>& output) {
+        clear();
+
+        std::vector<Node<T>*> topo;
+        Node<T>::sort(output.node, topo);
+        for (Node<T>* n : topo) {
+            if (n->op != Op::None) {
+                Node<T>::retain(n);
+                ops.push_back(n);
+            }
+        }
+        root = output.node;
+        Node<T>::retain(root);
+    }
+
+    void clear() {
+        for (Node<T>* n : ops) {
+            Node<T>::release(n);
+        }
+        ops.clear();
+        if (root) {
+            Node<T>::release(root);
+            root = nullptr;
+        }
+    }
+
+    size_t size() const {
+        return ops.size();
+    }
+
+    // recompute every op from the current leaf values. operands of
+    // another type are read as they are, their graph is not replayed.
+    // a backward without retain_graph since the capture has freed the
+    // ops, and replaying them throws
+    void forward() {
+        for (Node<T>* n : ops) {
+            n->check_not_freed();
+        }
+        for (Node<T>* n : ops) {
+            n->run_forward();
+        }
+    }
+
+    // gradients of the output; like Value::backward, leaf gradients
+    // accumulate and are left for the caller to zero
+    void backward() {
+        if (!root) {
+            throw std::logic_error("no graph captured");
+        }
+        for (Node<T>* n : ops) {
+            n->check_not_freed();
+            n->set_grad(T(0.0));
+        }
+        root->set_grad(T(1.0));
+
+        uint64_t skipped = 0;
+        for (auto it = ops.rbegin(); it != ops.rend(); ++it) {
+            if ((*it)->requires_grad) {
+                skipped += !(*it)->run_backward();
+            }
+        }
+        BackwardStats::add_skipped(skipped);
+    }
+
+    void replay() {
+        forward();
+        backward();
+    }
+
+    // set new values for input leaves, then replay
+    void replay(const std::vector<Value<T>*>& inputs, const std::vector<T>& values) {
+        if (inputs.size() != values.size()) {
+            throw std::invalid_argument("Vectors must have the same size");
+        }
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            inputs[i]->set_data(values[i]);
+        }
+        replay();
+    }
+};
+
+}  // namespace ptMgrad
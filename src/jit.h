@@ -0,0 +1,517 @@
+// tracing compiler for a captured Graph.
+// the ops of the graph are written out as straight-line C++ over two
+// flat arrays of values and gradients, built into a shared object with
+// the system compiler and loaded with dlopen. objects are cached on
+// disk under a hash of the generated source, the compiler and what
+// its flags resolve to on this CPU, so a graph seen before is only
+// loaded, not compiled again.
+// only float and double graphs without cast, fused or checkpointed
+// nodes can be compiled
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "graph.h"
+
+
+namespace ptMgrad {
+
+
+struct JitOptions {
+    // where sources and objects are kept; $PTMGRAD_JIT_CACHE if empty,
+    // or else ptmgrad_jit in $XDG_CACHE_HOME or ~/.cache. objects in it
+    // are loaded and run, so it has to belong to this user and be
+    // writable by no other
+    std::string cache_dir;
+    // $CXX, or c++ if empty
+    std::string compiler;
+    // fp contraction is off so that results match the interpreter
+    std::string flags = "-O3 -march=native -ffp-contract=off";
+};
+
+
+template <typename T>
+class Compiled {
+private:
+    static_assert(std::is_floating_point_v<T>,
+                  "only float and double graphs can be compiled");
+
+    typedef int (*kernel_type)(T*, T*);
+
+    // slots [0, leaves.size()) hold the leaves, the ops follow in
+    // topological order
+    std::vector<Node<T>*> leaves;
+    Node<T>* root = nullptr;
+    size_t root_slot = 0;
+    std::vector<T> values;
+    std::vector<T> grads;
+
+    std::string src;
+    std::string so_path;
+    bool cache_hit = false;
+    void* handle = nullptr;
+    kernel_type kernel = nullptr;
+
+    // exact, as a hex float. %a prints infinities and NaNs as inf and
+    // nan, which aren't C++, so those are spelled with builtins
+    static std::string literal(const T& c) {
+        double d = static_cast<double>(c);
+        const char* sign = std::signbit(d) ? "-" : "";
+        if (std::isnan(d)) {
+            return std::string("T(") + sign + "__builtin_nan(\"\"))";
+        }
+        if (std::isinf(d)) {
+            return std::string("T(") + sign + "__builtin_inf())";
+        }
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "T(%a)", d);
+        return buf;
+    }
+
+    static uint64_t hash(const std::string& s) {
+        // FNV-1a
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char ch : s) {
+            h ^= ch;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // the macros cxx predefines with flags: among them its version and
+    // the instruction sets -march=native resolves to on this CPU, so
+    // that an object built for another CPU is never loaded from a shared
+    // cache. run once per process for each compiler and flags
+    static std::string predefined(const std::string& cxx, const std::string& flags) {
+        static std::mutex mutex;
+        static std::unordered_map<std::string, std::string> seen;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = seen.find(cxx + '\n' + flags);
+        if (it != seen.end()) {
+            return it->second;
+        }
+        std::string cmd = cxx + " " + flags + " -std=c++17 -E -dM -x c++ /dev/null";
+        FILE* p = popen(cmd.c_str(), "r");
+        if (!p) {
+            throw std::runtime_error("JIT compiler failed: " + cmd);
+        }
+        std::string macros;
+        char buf[4096];
+        for (size_t n; (n = std::fread(buf, 1, sizeof(buf), p)) > 0;) {
+            macros.append(buf, n);
+        }
+        if (pclose(p) != 0) {
+            throw std::runtime_error("JIT compiler failed: " + cmd);
+        }
+        return seen.emplace(cxx + '\n' + flags, std::move(macros)).first->second;
+    }
+
+    // the backward lines of an op, run only if its gradient gk isn't
+    // zero: the interpreter skips such ops, see BackwardStats, and
+    // running them could turn 0 * inf into a NaN it never sees
+    static std::string unless_zero(const std::string& gk, const std::string& lines) {
+        if (lines.empty()) {
+            return lines;
+        }
+        return "    if (" + gk + " != T(0.0)) {\n" + lines + "    }\n";
+    }
+
+    // forward and backward lines of a Sum or Dot, written out term by
+    // term; the backward lines are appended to bwd
+    template <typename V, typename G>
+    static std::string reduce(Node<T>* n, V& v, G& g, std::vector<std::string>& bwd) {
+        Node<T>* const* cs = n->child_nodes();
+        size_t nc = n->num_children();
+        size_t m = n->op == Op::Dot ? nc / 2 : nc;
+
+        std::ostringstream fwd, back;
+        fwd << "    " << v(n) << " = T(0.0)";
+        for (size_t i = 0; i < m; ++i) {
+            if (n->op == Op::Dot) {
+                fwd << " + " << v(cs[i]) << " * " << v(cs[m + i]);
+            } else {
+                fwd << " + " << v(cs[i]);
+            }
+        }
+        fwd << ";\n";
+
+        auto acc = [&](const Node<T>* c, const std::string& expr) {
+            if (n->requires_grad && c->requires_grad) {
+                back << "        " << g(c) << " += " << expr << ";\n";
+            }
+        };
+        for (size_t i = 0; i < m; ++i) {
+            if (n->op == Op::Dot) {
+                acc(cs[i], g(n) + " * " + v(cs[m + i]));
+                acc(cs[m + i], g(n) + " * " + v(cs[i]));
+            } else {
+                acc(cs[i], g(n));
+            }
+        }
+        bwd.push_back(unless_zero(g(n), back.str()));
+        return fwd.str();
+    }
+
+    void generate(const std::vector<Node<T>*>& ops) {
+        std::unordered_map<const Node<T>*, size_t> slot;
+        for (Node<T>* n : ops) {
+            Node<T>* const* cs = n->child_nodes();
+            for (size_t i = 0, nc = n->num_children(); i < nc; ++i) {
+                Node<T>* c = cs[i];
+                if (c->op == Op::None && !slot.count(c)) {
+                    slot[c] = leaves.size();
+                    leaves.push_back(c);
+                }
+            }
+        }
+        if (root->op == Op::None && !slot.count(root)) {
+            slot[root] = leaves.size();
+            leaves.push_back(root);
+        }
+        size_t n_slots = leaves.size();
+        for (Node<T>* n : ops) {
+            slot[n] = n_slots++;
+        }
+        root_slot = slot[root];
+
+        auto v = [&](const Node<T>* n) { return "v[" + std::to_string(slot[n]) + "]"; };
+        auto g = [&](const Node<T>* n) { return "g[" + std::to_string(slot[n]) + "]"; };
+
+        std::ostringstream fwd;
+        std::vector<std::string> bwd;
+        for (Node<T>* n : ops) {
+            // the kernels of a fused node are compiled code already,
+            // with no expression left to write out
+            if (n->op == Op::Fused) {
+                throw std::invalid_argument("graph with fused nodes can't be compiled");
+            }
+            // a checkpointed segment is rebuilt from its function
+            if (n->op == Op::Checkpoint || n->op == Op::Output) {
+                throw std::invalid_argument("graph with checkpoints can't be compiled");
+            }
+            if (n->op == Op::Sum || n->op == Op::Dot) {
+                fwd << reduce(n, v, g, bwd);
+                continue;
+            }
+
+            std::string k = v(n), a = v(&n->child(0));
+            bool has_const = n->op == Op::MulConst || n->op == Op::DivConst ||
+                             n->op == Op::PowConst ||
+                             ((n->op == Op::Add || n->op == Op::Sub) && n->n_children == 1);
+            std::string b = n->n_children == 2 ? v(&n->child(1))
+                          : has_const ? literal(n->constant()) : "";
+
+            std::string gk = g(n);
+
+            // ops and leaves that need no gradient get none, as in Node::add_grad
+            std::ostringstream back;
+            auto acc = [&](const Node<T>* c, const std::string& expr) {
+                if (n->requires_grad && c->requires_grad) {
+                    back << "        " << g(c) << " += " << expr << ";\n";
+                }
+            };
+            Node<T>* x0 = &n->child(0);
+            Node<T>* x1 = n->n_children == 2 ? &n->child(1) : nullptr;
+            switch (n->op) {
+            case Op::Add:
+                fwd << "    " << k << " = " << a << " + " << b << ";\n";
+                acc(x0, gk);
+                if (x1) {
+                    acc(x1, gk);
+                }
+                break;
+
+            case Op::Sub:
+                fwd << "    " << k << " = " << a << " - " << b << ";\n";
+                acc(x0, gk);
+                if (x1) {
+                    acc(x1, "-" + gk);
+                }
+                break;
+
+            case Op::Mul:
+                fwd << "    " << k << " = " << a << " * " << b << ";\n";
+                acc(x0, gk + " * " + b);
+                acc(x1, gk + " * " + a);
+                break;
+
+            case Op::MulConst:
+                fwd << "    " << k << " = " << a << " * " << b << ";\n";
+                acc(x0, gk + " * " + b);
+                break;
+
+            case Op::Div:
+                fwd << "    if (" << b << " == 0) return 1;\n";
+                fwd << "    " << k << " = " << a << " / " << b << ";\n";
+                acc(x0, gk + " / " + b);
+                acc(x1, "-" + gk + " * " + a + " / (" + b + " * " + b + ")");
+                break;
+
+            case Op::DivConst:
+                fwd << "    " << k << " = " << a << " / " << b << ";\n";
+                acc(x0, gk + " / " + b);
+                break;
+
+            case Op::Neg:
+                fwd << "    " << k << " = -" << a << ";\n";
+                acc(x0, "-" + gk);
+                break;
+
+            case Op::Pow:
+                fwd << "    " << k << " = T(std::pow(" << a << ", " << b << "));\n";
+                acc(x0, gk + " * " + b + " * std::pow(" + a + ", " + b + " - 1)");
+                acc(x1, gk + " * std::pow(" + a + ", " + b + ") * std::log(" + a + ")");
+                break;
+
+            case Op::PowConst:
+                fwd << "    " << k << " = T(std::pow(" << a << ", " << b << "));\n";
+                acc(x0, gk + " * " + b + " * std::pow(" + a + ", " + b + " - 1)");
+                break;
+
+            case Op::Relu:
+                fwd << "    " << k << " = " << a << " < 0.0 ? T(0.0) : " << a << ";\n";
+                acc(x0, a + " < 0.0 ? T(0.0) : " + gk);
+                break;
+
+            case Op::Cast:
+                throw std::invalid_argument("graph with cast nodes can't be compiled");
+
+            // handled, or rejected, above; and a graph has no leaves among its ops
+            case Op::Sum:
+            case Op::Dot:
+            case Op::Fused:
+            case Op::Checkpoint:
+            case Op::Output:
+            case Op::None:
+                throw std::logic_error("unexpected op in a captured graph");
+
+            case Op::Freed:
+                n->check_not_freed();
+                break;
+            }
+            bwd.push_back(unless_zero(gk, back.str()));
+        }
+
+        std::ostringstream out;
+        out << "// generated by ptMgrad, do not edit\n"
+            << "#include <cmath>\n\n"
+            << "typedef " << (std::is_same_v<T, float> ? "float" : "double") << " T;\n\n"
+            << "extern \"C\" int ptmgrad_kernel(T* v, T* g) {\n"
+            << fwd.str() << "\n"
+            << "    for (int i = " << leaves.size() << "; i < " << n_slots << "; ++i) {\n"
+            << "        g[i] = T(0.0);\n"
+            << "    }\n"
+            << "    g[" << root_slot << "] = T(1.0);\n\n";
+        // backward runs the ops in reverse
+        for (auto it = bwd.rbegin(); it != bwd.rend(); ++it) {
+            out << *it;
+        }
+        out << "    return 0;\n"
+            << "}\n";
+        src = out.str();
+
+        values.assign(n_slots, T(0));
+        grads.assign(n_slots, T(0));
+    }
+
+    void release() {
+        if (handle) {
+            dlclose(handle);
+            handle = nullptr;
+        }
+        for (Node<T>* n : leaves) {
+            Node<T>::release(n);
+        }
+        leaves.clear();
+        if (root) {
+            Node<T>::release(root);
+            root = nullptr;
+        }
+    }
+
+    static std::string default_cache_dir() {
+        if (const char* env = std::getenv("PTMGRAD_JIT_CACHE")) {
+            return env;
+        }
+        std::filesystem::path dir;
+        if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+            dir = xdg;
+        } else if (const char* home = std::getenv("HOME"); home && *home) {
+            dir = home;
+            dir /= ".cache";
+        } else {
+            throw std::runtime_error("no JIT cache: set HOME, XDG_CACHE_HOME or PTMGRAD_JIT_CACHE");
+        }
+        dir /= "ptmgrad_jit";
+        return dir.string();
+    }
+
+    // a directory or regular file of this user that no other can write
+    // to, and so can't have planted or replaced an object in
+    static void check_private(const std::string& path, bool dir) {
+        struct stat st;
+        if (::lstat(path.c_str(), &st) != 0) {
+            throw std::runtime_error("JIT cache: can't stat " + path);
+        }
+        bool kind = dir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode);
+        if (!kind || st.st_uid != ::geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+            throw std::runtime_error("JIT cache: " + path + " is not private to this user");
+        }
+    }
+
+    void build(const JitOptions& options) {
+        namespace fs = std::filesystem;
+
+        std::string dir = options.cache_dir.empty() ? default_cache_dir() : options.cache_dir;
+        std::string cxx = options.compiler;
+        if (cxx.empty()) {
+            const char* env = std::getenv("CXX");
+            cxx = env ? env : "c++";
+        }
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx",
+                      static_cast<unsigned long long>(hash(cxx + '\n' + options.flags + '\n' +
+                                                           predefined(cxx, options.flags) + '\n' + src)));
+        fs::path base(dir);
+        if (base.has_parent_path()) {
+            fs::create_directories(base.parent_path());
+        }
+        ::mkdir(dir.c_str(), 0700);
+        check_private(dir, true);
+        base /= name;
+        so_path = base.string() + ".so";
+
+        cache_hit = fs::exists(fs::symlink_status(so_path));
+        if (!cache_hit) {
+            // write and build under names of their own and rename, so
+            // that concurrent builds, in this process or others, never
+            // see a half written file. mkstemp reserves the names
+            std::string tmp = base.string() + ".XXXXXX";
+            int fd = ::mkstemp(tmp.data());
+            if (fd < 0) {
+                throw std::runtime_error("JIT cache: can't create a file in " + dir);
+            }
+            ::close(fd);
+            auto cleanup = [&] {
+                std::error_code ec;
+                fs::remove(tmp + ".cpp", ec);
+                fs::remove(tmp + ".tmp", ec);
+                fs::remove(tmp, ec);
+            };
+            try {
+                std::ofstream(tmp + ".cpp") << src;
+                std::string cmd = cxx + " " + options.flags + " -std=c++17 -shared -fPIC -o '" +
+                                  tmp + ".tmp' '" + tmp + ".cpp'";
+                if (std::system(cmd.c_str()) != 0) {
+                    throw std::runtime_error("JIT compilation failed: " + cmd);
+                }
+                fs::rename(tmp + ".cpp", base.string() + ".cpp");
+                fs::rename(tmp + ".tmp", so_path);
+            } catch (...) {
+                cleanup();
+                throw;
+            }
+            cleanup();
+        }
+        check_private(so_path, false);
+
+        handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            throw std::runtime_error(std::string("dlopen failed: ").append(dlerror()));
+        }
+        kernel = reinterpret_cast<kernel_type>(dlsym(handle, "ptmgrad_kernel"));
+        if (!kernel) {
+            throw std::runtime_error(std::string("dlsym failed: ").append(dlerror()));
+        }
+    }
+
+public:
+    explicit Compiled(const Graph<T>& graph, const JitOptions& options = JitOptions()) {
+        if (!graph.root) {
+            throw std::logic_error("no graph captured");
+        }
+        root = graph.root;
+        generate(graph.ops);
+
+        for (Node<T>* n : leaves) {
+            Node<T>::retain(n);
+        }
+        Node<T>::retain(root);
+
+        try {
+            build(options);
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    ~Compiled() {
+        release();
+    }
+
+    Compiled(const Compiled&) = delete;
+    Compiled& operator=(const Compiled&) = delete;
+
+    // same as Graph::replay: forward from the current leaf values,
+    // then accumulate into the leaf gradients. of the ops, only the
+    // output node is updated
+    void run() {
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            values[i] = leaves[i]->x;
+            grads[i] = leaves[i]->get_grad();
+        }
+        if (kernel(values.data(), grads.data()) != 0) {
+            throw std::invalid_argument("Division by zero");
+        }
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            leaves[i]->set_grad(grads[i]);
+        }
+        root->x = values[root_slot];
+        root->set_grad(grads[root_slot]);
+    }
+
+    void run(const std::vector<Value<T>*>& inputs, const std::vector<T>& data) {
+        if (inputs.size() != data.size()) {
+            throw std::invalid_argument("Vectors must have the same size");
+        }
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            inputs[i]->set_data(data[i]);
+        }
+        run();
+    }
+
+    const std::string& source() const {
+        return src;
+    }
+
+    const std::string& path() const {
+        return so_path;
+    }
+
+    // true when the object was loaded from the cache without compiling
+    bool from_cache() const {
+        return cache_hit;
+    }
+};
+
+}  // namespace ptMgrad
@@ -6,22 +6,58 @@
 #include <cstdlib>
 
 #include "engine.h"
+#include "tensor.h"
 
 
 namespace ptMgrad {
 
 template <typename T>
 class Module {
+protected:
+    // the generation of the gradients of the parameters, nested in
+    // those of the modules this one is part of
+    GradScope grads;
+
+    // for modules to call once their parameters are made
+    void bind_parameters() {
+        for (auto* p : parameters()) {
+            p->set_grad_scope(grads);
+        }
+    }
+
 public:
     virtual std::vector<Value<T>*> parameters() = 0;
+
+    // zeroes the gradients of the parameters of this module in one step,
+    // by advancing their scope. other leaves keep theirs; to zero those
+    // of every leaf, call GradGeneration::advance()
     virtual void zero_grad() {
-        for (auto* p : parameters()) {
-            p->set_grad(0.0);
-        }
+        grads.advance();
+    }
+
+    // make this module part of parent, whose zero_grad then zeroes the
+    // gradients of this one's parameters too
+    void nest_in(const Module& parent) {
+        grads.nest_in(parent.grads);
     }
 };
 
 
+// a random weight: in [-1, 1], or with real and imaginary parts each
+// in [-1, 1], drawn from std::rand
+template <typename T>
+inline T random_weight() {
+    if constexpr (is_complex_v<T>) {
+        using R = decltype(T().real());
+        R re = static_cast<R>(std::rand()) / static_cast<R>(RAND_MAX) * R(2.0) - R(1.0);
+        R im = static_cast<R>(std::rand()) / static_cast<R>(RAND_MAX) * R(2.0) - R(1.0);
+        return T(re, im);
+    } else {
+        return static_cast<T>(std::rand()) / static_cast<T>(RAND_MAX) * T(2.0) - T(1.0);
+    }
+}
+
+
 template <typename T>
 class Neuron : public Module<T> {
 private:
@@ -32,23 +68,15 @@ private:
 public:
     Neuron(int nin, bool nonlin = true) : w(nin), b(0), nonlin(nonlin) {
         for (auto& wi : w) {
-             if constexpr (is_complex_v<T>) {
-                // random complex weight: real and imaginary parts in [-1, 1]
-                using R = decltype(T().real());
-                R re = static_cast<R>(std::rand()) / static_cast<R>(RAND_MAX) * R(2.0) - R(1.0);
-                R im = static_cast<R>(std::rand()) / static_cast<R>(RAND_MAX) * R(2.0) - R(1.0);
-                wi = Value<T>(T(re, im));
-            } else {
-                wi = Value<T>(static_cast<T>(std::rand()) / static_cast<T>(RAND_MAX) * T(2.0) - T(1.0));
-            }
+            wi = Value<T>(random_weight<T>());
         }
+        this->bind_parameters();
     }
 
     Value<T> operator()(const std::vector<Value<T>>& x) {
-        Value<T> act = b;
-        for (size_t i = 0; i < w.size(); ++i) {
-            act = act + w[i] * x[i];
-        }
+        // one Dot node for the weighted sum instead of a chain of
+        // nin products and adds
+        Value<T> act = ptMgrad::dot(w, x) + b;
         return nonlin ? ptMgrad::relu(act) : act;
     }
 
@@ -80,6 +108,7 @@ public:
     Layer(int nin, int nout, bool nonlin = true) : nonlin(nonlin), nin(nin), nout(nout) {
         for (int i = 0; i < nout; ++i) {
             neurons.push_back(Neuron<T>(nin, nonlin));
+            neurons.back().nest_in(*this);
         }
     }
 
@@ -123,6 +152,7 @@ public:
     MLP(int nin, const std::vector<int>& nouts) : nin(nin), nouts(nouts) {
         for (size_t i = 0; i < nouts.size(); ++i) {
             layers.push_back(Layer<T>(nin, nouts[i], i != nouts.size() - 1));
+            layers.back().nest_in(*this);
             nin = nouts[i];
         }
     }
@@ -135,6 +165,15 @@ public:
         return out;
     }
 
+    // the layers one at a time, e.g. as the stages of a Checkpointed
+    Layer<T>& layer(size_t i) {
+        return layers[i];
+    }
+
+    size_t num_layers() const {
+        return layers.size();
+    }
+
     std::vector<Value<T>*> parameters() override {
         std::vector<Value<T>*> params;
         for (auto& layer : layers) {
@@ -154,4 +193,114 @@ public:
     }
 };
 
+
+
+// a Layer over a batch of samples at once: the weights of its neurons
+// are the columns of one nin x nout tensor, and a batch x nin input
+// goes through a single linear(), whose gemm applies the bias and the
+// relu to each tile as it's computed. weights are drawn neuron by
+// neuron, as Layer draws them, so that a DenseLayer made after the
+// same std::srand as a Layer has its weights
+template <typename T>
+class DenseLayer {
+private:
+    Tensor<T> w;
+    Tensor<T> b;
+    bool nonlin;
+    // as for Modules
+    GradScope grads;
+
+public:
+    DenseLayer(size_t nin, size_t nout, bool nonlin = true)
+        : w({nin, nout}), b({nout}), nonlin(nonlin) {
+        T* wd = w.data();
+        for (size_t j = 0; j < nout; ++j) {
+            for (size_t i = 0; i < nin; ++i) {
+                wd[i * nout + j] = random_weight<T>();
+            }
+        }
+        w.set_grad_scope(grads);
+        b.set_grad_scope(grads);
+    }
+
+    // batch x nout outputs of batch x nin inputs
+    Tensor<T> operator()(const Tensor<T>& x) {
+        return linear(x, w, b, nonlin);
+    }
+
+    std::vector<Tensor<T>*> parameters() {
+        return {&w, &b};
+    }
+
+    // as Module::zero_grad
+    void zero_grad() {
+        grads.advance();
+    }
+
+    void nest_in(const GradScope& parent) {
+        grads.nest_in(parent);
+    }
+
+    void print() {
+        std::cout << "DenseLayer of " << b.numel() << " " << (nonlin ? "ReLU" : "Linear")
+                  << "Neuron(" << w.shape()[0] << ")\n";
+    }
+};
+
+
+// an MLP over a batch of samples at once, of DenseLayers
+template <typename T>
+class DenseMLP {
+private:
+    std::vector<DenseLayer<T>> layers;
+    GradScope grads;
+
+public:
+    DenseMLP(size_t nin, const std::vector<size_t>& nouts) {
+        for (size_t i = 0; i < nouts.size(); ++i) {
+            layers.push_back(DenseLayer<T>(nin, nouts[i], i != nouts.size() - 1));
+            layers.back().nest_in(grads);
+            nin = nouts[i];
+        }
+    }
+
+    Tensor<T> operator()(const Tensor<T>& x) {
+        Tensor<T> out = x;
+        for (auto& layer : layers) {
+            out = layer(out);
+        }
+        return out;
+    }
+
+    DenseLayer<T>& layer(size_t i) {
+        return layers[i];
+    }
+
+    size_t num_layers() const {
+        return layers.size();
+    }
+
+    std::vector<Tensor<T>*> parameters() {
+        std::vector<Tensor<T>*> params;
+        for (auto& layer : layers) {
+            for (auto* p : layer.parameters()) {
+                params.push_back(p);
+            }
+        }
+        return params;
+    }
+
+    void zero_grad() {
+        grads.advance();
+    }
+
+    void print() {
+        std::cout << "DenseMLP of [";
+        for (auto& layer : layers) {
+            layer.print();
+        }
+        std::cout << "]\n";
+    }
+};
+
 }
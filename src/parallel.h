@@ -0,0 +1,225 @@
+// fixed pool of worker threads, for the parallel backward pass and
+// for building the graphs of a batch on several threads at once.
+// run(n, fn) calls fn(0) .. fn(n - 1) spread over the workers and the
+// calling thread, and returns once all of them have finished
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <cstddef>
+#include <cstdint>
+
+#include "arena.h"
+
+
+namespace ptMgrad {
+
+
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    // the job being run; a new generation wakes the workers, which take
+    // their copy of job and n_tasks under the mutex. run waits for every
+    // worker to have seen the generation, so that none wakes late to
+    // take tickets of the next job with what it read of this one
+    const std::function<void(size_t)>* job = nullptr;
+    size_t n_tasks = 0;
+    std::atomic<size_t> next{0};
+    size_t n_busy = 0;
+    size_t n_seen = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    void work(const std::function<void(size_t)>& fn, size_t n) {
+        size_t i;
+        while ((i = next.fetch_add(1, std::memory_order_relaxed)) < n) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    void loop() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            const std::function<void(size_t)>* fn = job;
+            size_t n = n_tasks;
+            ++n_seen;
+            ++n_busy;
+            lock.unlock();
+            work(*fn, n);
+            lock.lock();
+            if (--n_busy == 0 && n_seen == workers.size()) {
+                done.notify_one();
+            }
+        }
+    }
+
+public:
+    // n_threads counts the calling thread, so a pool of one runs
+    // everything inline
+    explicit ThreadPool(size_t n_threads = std::thread::hardware_concurrency()) {
+        for (size_t i = 1; i < n_threads; ++i) {
+            workers.emplace_back([this] { loop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& w : workers) {
+            w.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    // not reentrant: fn must not call run on the same pool
+    void run(size_t n, const std::function<void(size_t)>& fn) {
+        if (n == 0) {
+            return;
+        }
+        if (workers.empty() || n == 1) {
+            for (size_t i = 0; i < n; ++i) {
+                fn(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            n_tasks = n;
+            next.store(0, std::memory_order_relaxed);
+            error = nullptr;
+            n_seen = 0;
+            ++generation;
+        }
+        wake.notify_all();
+        work(fn, n);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return n_busy == 0 && n_seen == workers.size(); });
+        n_tasks = 0;
+        job = nullptr;
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    // shared pool with one thread per core
+    static ThreadPool& global() {
+        static ThreadPool pool;
+        return pool;
+    }
+};
+
+
+// gradients are accumulated under a lock while this is on for the
+// thread: during a parallel backward, since two nodes of the same
+// level may share a child, and while threads build separate graphs
+// over the same parameters. the locks are striped by node address
+class GradLock {
+private:
+    struct alignas(64) Stripe {
+        std::atomic<bool> held;
+    };
+
+    // zero initialised, so every stripe starts out free
+    static inline Stripe stripes[256];
+    static inline thread_local bool active = false;
+
+    Stripe& stripe;
+
+public:
+    explicit GradLock(const void* p)
+        : stripe(stripes[(reinterpret_cast<std::uintptr_t>(p) >> 4) % 256]) {
+        while (stripe.held.exchange(true, std::memory_order_acquire)) {
+            while (stripe.held.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    ~GradLock() {
+        stripe.held.store(false, std::memory_order_release);
+    }
+
+    GradLock(const GradLock&) = delete;
+    GradLock& operator=(const GradLock&) = delete;
+
+    static bool enabled() {
+        return active;
+    }
+
+    // turns locking on for the current thread while alive
+    class Scope {
+    private:
+        bool prev;
+
+    public:
+        Scope() : prev(active) {
+            active = true;
+        }
+
+        ~Scope() {
+            active = prev;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+};
+
+
+// runs fn(i) for i in [0, n) on the pool, so that every thread builds
+// and differentiates graphs of its own over shared parameters.
+// each call runs inside an ArenaScope over an arena kept per thread,
+// and with GradLock on, so gradients of the shared leaves are summed
+// under a lock. fn has to finish with its graph, backward included,
+// before returning, and copy out any value it wants to keep; the
+// parameters must not be changed while the batch runs
+template <typename F>
+void for_each_sample(ThreadPool& pool, size_t n, F&& fn) {
+    pool.run(n, [&](size_t i) {
+        static thread_local Arena arena;
+        ArenaScope scope(arena);
+        GradLock::Scope locked;
+        fn(i);
+    });
+}
+
+}  // namespace ptMgrad
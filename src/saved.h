@@ -0,0 +1,773 @@
+// compressed storage of what backward reads. compress(fn, inputs, policy)
+// builds the graph of fn once and keeps it as a Trace instead of as
+// nodes: a step per op, naming its operands by 32 bit ids, with long
+// operand lists that repeat, such as the inputs of every neuron of a
+// layer, stored once. what the ops saved is kept the way the policy says:
+//
+// - a relu keeps the sign of its input, one bit in a mask
+// - the values of the ops that products, quotients, powers and dots
+//   read, and of no others, are kept at full precision, or rounded to
+//   fp16 or bf16
+// - past a size, those values go to a scratch file, which is mapped
+//   only while backward reads it
+//
+// leaves and ops from outside fn are read as they are. fn has to build
+// its graph from float or double ops only; fused, cast and checkpointed
+// nodes are rejected. like checkpoint, whatever fn reads besides its
+// inputs has to be leaves that outlive backward
+
+#pragma once
+
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "checkpoint.h"
+
+
+namespace ptMgrad {
+
+
+// how the values of a trace are kept. fp16 has 11 significant bits and
+// overflows past 65504; bf16 keeps the range of float with 8 bits
+enum class Precision : unsigned char {
+    Full,
+    Half,
+    BFloat16
+};
+
+struct SavePolicy {
+    Precision precision = Precision::Full;
+    // values taking more bytes than this are spilled to a file in spill_dir
+    size_t spill_bytes = std::numeric_limits<size_t>::max();
+    std::string spill_dir = std::filesystem::temp_directory_path().string();
+};
+
+
+// IEEE 754 half precision, rounded to nearest even
+inline
+uint16_t
+to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t exp = (x >> 23) & 0xFF;
+    uint32_t man = x & 0x7FFFFF;
+
+    // infinity, and NaN kept quiet
+    if (exp == 0xFF) {
+        return static_cast<uint16_t>(sign | 0x7C00 | (man ? 0x200 | (man >> 13) : 0));
+    }
+    int e = static_cast<int>(exp) - 127 + 15;
+    if (e >= 31) {
+        return static_cast<uint16_t>(sign | 0x7C00);
+    }
+    uint32_t h, rem, half;
+    if (e <= 0) {
+        // subnormal, in units of 2^-24
+        if (e < -10) {
+            return static_cast<uint16_t>(sign);
+        }
+        man |= 0x800000;
+        uint32_t shift = static_cast<uint32_t>(14 - e);
+        h = man >> shift;
+        rem = man & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+    } else {
+        h = (static_cast<uint32_t>(e) << 10) | (man >> 13);
+        rem = man & 0x1FFF;
+        half = 0x1000;
+    }
+    // a carry out of the mantissa steps the exponent, up to infinity
+    if (rem > half || (rem == half && (h & 1))) {
+        ++h;
+    }
+    return static_cast<uint16_t>(sign | h);
+}
+
+inline
+float
+from_half(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t man = h & 0x3FF;
+
+    if (exp == 0) {
+        float f = std::ldexp(static_cast<float>(man), -24);
+        return sign ? -f : f;
+    }
+    uint32_t x = exp == 31 ? sign | 0x7F800000 | (man << 13)
+                           : sign | ((exp + 112) << 23) | (man << 13);
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// the upper half of a float, rounded to nearest even
+inline
+uint16_t
+to_bfloat16(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7FFFFFFF) > 0x7F800000) {
+        return static_cast<uint16_t>((x >> 16) | 0x40);
+    }
+    x += 0x7FFF + ((x >> 16) & 1);
+    return static_cast<uint16_t>(x >> 16);
+}
+
+inline
+float
+from_bfloat16(uint16_t h) {
+    uint32_t x = static_cast<uint32_t>(h) << 16;
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+
+// bits packed 64 to a word
+class BitMask {
+private:
+    std::vector<uint64_t> words;
+    std::vector<uint32_t> counts;
+    size_t n = 0;
+
+public:
+    void push_back(bool bit) {
+        if (n % 64 == 0) {
+            words.push_back(0);
+        }
+        if (bit) {
+            words.back() |= uint64_t(1) << (n % 64);
+        }
+        ++n;
+    }
+
+    bool operator[](size_t i) const {
+        return (words[i / 64] >> (i % 64)) & 1;
+    }
+
+    size_t size() const {
+        return n;
+    }
+
+    size_t bytes() const {
+        return words.capacity() * sizeof(uint64_t) + counts.capacity() * sizeof(uint32_t);
+    }
+
+    void shrink_to_fit() {
+        words.shrink_to_fit();
+        counts.shrink_to_fit();
+    }
+
+    // count the bits set before each word, for rank
+    void index() {
+        counts.resize(words.size());
+        uint32_t c = 0;
+        for (size_t w = 0; w < words.size(); ++w) {
+            counts[w] = c;
+            c += static_cast<uint32_t>(__builtin_popcountll(words[w]));
+        }
+    }
+
+    // the number of bits set before bit i, once indexed
+    size_t rank(size_t i) const {
+        uint64_t below = words[i / 64] & ((uint64_t(1) << (i % 64)) - 1);
+        return counts[i / 64] + static_cast<size_t>(__builtin_popcountll(below));
+    }
+};
+
+
+// a scratch file, unlinked as soon as it is made so that it goes away
+// with the process whatever happens
+class SpillFile {
+private:
+    int fd = -1;
+    size_t size = 0;
+
+public:
+    SpillFile(const std::string& dir, const unsigned char* data, size_t n) : size(n) {
+        std::string path = dir + "/ptmgrad_spill_XXXXXX";
+        fd = ::mkstemp(path.data());
+        if (fd < 0) {
+            throw std::runtime_error("can't create a spill file in " + dir);
+        }
+        ::unlink(path.c_str());
+        while (n > 0) {
+            ssize_t written = ::write(fd, data, n);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ::close(fd);
+                throw std::runtime_error("can't write the spill file");
+            }
+            data += written;
+            n -= static_cast<size_t>(written);
+        }
+    }
+
+    ~SpillFile() {
+        ::close(fd);
+    }
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    // the file mapped read only, for as long as the mapping lives
+    class Mapping {
+    private:
+        void* p = nullptr;
+        size_t n = 0;
+
+    public:
+        Mapping() = default;
+
+        Mapping(int fd, size_t n) : n(n) {
+            p = ::mmap(nullptr, n, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                p = nullptr;
+                throw std::runtime_error("can't map the spill file");
+            }
+        }
+
+        ~Mapping() {
+            if (p) {
+                ::munmap(p, n);
+            }
+        }
+
+        Mapping(Mapping&& other) noexcept : p(other.p), n(other.n) {
+            other.p = nullptr;
+        }
+
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+        Mapping& operator=(Mapping&&) = delete;
+
+        const unsigned char* data() const {
+            return static_cast<const unsigned char*>(p);
+        }
+    };
+
+    Mapping map() const {
+        return Mapping(fd, size);
+    }
+};
+
+
+// values of type T kept at the given precision, in memory or spilled
+template <typename T>
+class SavedValues {
+private:
+    Precision precision;
+    size_t n = 0;
+    std::vector<unsigned char> data;
+    std::unique_ptr<SpillFile> file;
+
+public:
+    explicit SavedValues(Precision precision = Precision::Full) : precision(precision) {}
+
+    size_t width() const {
+        return precision == Precision::Full ? sizeof(T) : sizeof(uint16_t);
+    }
+
+    void push_back(const T& v) {
+        size_t at = data.size();
+        data.resize(at + width());
+        if (precision == Precision::Full) {
+            std::memcpy(data.data() + at, &v, sizeof(T));
+        } else {
+            float f = static_cast<float>(v);
+            uint16_t h = precision == Precision::Half ? to_half(f) : to_bfloat16(f);
+            std::memcpy(data.data() + at, &h, sizeof(h));
+        }
+        ++n;
+    }
+
+    size_t size() const {
+        return n;
+    }
+
+    // bytes held in memory
+    size_t bytes() const {
+        return data.capacity();
+    }
+
+    bool spilled() const {
+        return file != nullptr;
+    }
+
+    void shrink_to_fit() {
+        data.shrink_to_fit();
+    }
+
+    void spill(const std::string& dir) {
+        if (data.empty()) {
+            return;
+        }
+        file = std::make_unique<SpillFile>(dir, data.data(), data.size());
+        std::vector<unsigned char>().swap(data);
+    }
+
+    // the values, read from memory or from the file mapped for as long
+    // as the view lives
+    class View {
+    private:
+        const unsigned char* p;
+        Precision precision;
+        SpillFile::Mapping mapping;
+
+    public:
+        View(const unsigned char* p, Precision precision, SpillFile::Mapping mapping)
+            : p(mapping.data() ? mapping.data() : p), precision(precision),
+              mapping(std::move(mapping)) {}
+
+        T operator[](size_t i) const {
+            if (precision == Precision::Full) {
+                T v;
+                std::memcpy(&v, p + i * sizeof(T), sizeof(T));
+                return v;
+            }
+            uint16_t h;
+            std::memcpy(&h, p + i * sizeof(h), sizeof(h));
+            return static_cast<T>(precision == Precision::Half ? from_half(h) : from_bfloat16(h));
+        }
+    };
+
+    View view() const {
+        return View(data.data(), precision, file ? file->map() : SpillFile::Mapping());
+    }
+};
+
+
+// the graph of a segment reduced to what its backward reads. the ops
+// recorded on a tape get the ids 0 to n - 1 in program order, and the
+// nodes from outside they read the ids after that
+template <typename T>
+class Trace {
+private:
+    static_assert(std::is_floating_point_v<T>, "only graphs of real types can be traced");
+
+    // op i of the tape. a unary or binary op reads a and b; for a
+    // constant op, b is where its constant is, and for a relu, its bit
+    // in the mask. a sum reads the list in ids at a, and a dot the
+    // lists at a and b; every list starts with its length. ops that
+    // need no gradient keep Op::None
+    struct Step {
+        uint32_t a;
+        uint32_t b;
+        Op op;
+        unsigned char n;
+    };
+
+    std::vector<Step> steps;
+    std::vector<uint32_t> ids;
+    std::vector<T> constants;
+    BitMask mask;
+    // which ops have their value among values, at the rank of their bit
+    BitMask saved;
+    SavedValues<T> values;
+    std::vector<Node<T>*> externals;
+    std::vector<uint32_t> outputs;
+
+    // a copy of the exact size. shrink_to_fit is no use here, its
+    // iterator arithmetic is taken up by the scalar operators of engine.h
+    template <typename U>
+    static void shrink(std::vector<U>& v) {
+        std::vector<U>(v.begin(), v.end()).swap(v);
+    }
+
+public:
+    Trace() = default;
+
+    ~Trace() {
+        clear();
+    }
+
+    Trace(const Trace&) = delete;
+    Trace& operator=(const Trace&) = delete;
+
+    void clear() {
+        for (Node<T>* n : externals) {
+            Node<T>::release(n);
+        }
+        steps.clear();
+        ids.clear();
+        constants.clear();
+        mask = BitMask();
+        saved = BitMask();
+        values = SavedValues<T>();
+        externals.clear();
+        outputs.clear();
+    }
+
+    // the ops recorded on tape, which built outs
+    void build(const Tape<T>& tape, const std::vector<Value<T>>& outs, const SavePolicy& policy) {
+        clear();
+        values = SavedValues<T>(policy.precision);
+
+        const std::vector<Node<T>*>& ops = tape.nodes();
+        std::unordered_map<const Node<T>*, uint32_t> id;
+        id.reserve(2 * ops.size());
+        for (size_t k = 0; k < ops.size(); ++k) {
+            id.emplace(ops[k], static_cast<uint32_t>(k));
+        }
+        auto id_of = [&](Node<T>* n) {
+            auto [it, fresh] = id.try_emplace(n, static_cast<uint32_t>(ops.size() + externals.size()));
+            if (fresh) {
+                Node<T>::retain(n);
+                externals.push_back(n);
+            }
+            return it->second;
+        };
+
+        // long lists are looked up by hash, and kept once
+        std::unordered_map<uint64_t, uint32_t> lists;
+        auto add_list = [&](Node<T>* const* cs, size_t n) {
+            uint32_t start = static_cast<uint32_t>(ids.size());
+            ids.push_back(static_cast<uint32_t>(n));
+            uint64_t h = 0xCBF29CE484222325ull;
+            for (size_t i = 0; i < n; ++i) {
+                uint32_t c = id_of(cs[i]);
+                ids.push_back(c);
+                h = (h ^ c) * 0x100000001B3ull;
+            }
+            if (n < 8) {
+                return start;
+            }
+            auto [it, fresh] = lists.try_emplace(h, start);
+            if (!fresh && ids[it->second] == n &&
+                std::equal(ids.begin() + start, ids.end(), ids.begin() + it->second)) {
+                ids.resize(start);
+                return it->second;
+            }
+            return start;
+        };
+
+        // the ops whose value backward reads: operands of products,
+        // quotients, powers and dots. those from outside are read as
+        // they are
+        std::vector<bool> read(ops.size(), false);
+        for (Node<T>* n : ops) {
+            if (!n->requires_grad) {
+                continue;
+            }
+            size_t m = 0;
+            switch (n->op) {
+            case Op::Mul:
+            case Op::Div:
+            case Op::Pow:
+            case Op::Dot:
+                m = n->num_children();
+                break;
+            case Op::PowConst:
+                m = 1;
+                break;
+            default:
+                break;
+            }
+            for (size_t i = 0; i < m; ++i) {
+                auto it = id.find(n->child_nodes()[i]);
+                if (it != id.end()) {
+                    read[it->second] = true;
+                }
+            }
+        }
+
+        steps.reserve(ops.size());
+        for (size_t k = 0; k < ops.size(); ++k) {
+            Node<T>* n = ops[k];
+            saved.push_back(read[k]);
+            if (read[k]) {
+                values.push_back(n->x);
+            }
+
+            Step s{0, 0, Op::None, 0};
+            if (n->requires_grad) {
+                s.op = n->op;
+                s.n = static_cast<unsigned char>(n->n_children);
+                switch (n->op) {
+                case Op::Add:
+                case Op::Sub:
+                case Op::Mul:
+                case Op::Div:
+                case Op::Pow:
+                    s.a = id_of(&n->child(0));
+                    s.b = n->n_children == 2 ? id_of(&n->child(1)) : 0;
+                    break;
+
+                case Op::Neg:
+                    s.a = id_of(&n->child(0));
+                    break;
+
+                case Op::MulConst:
+                case Op::DivConst:
+                case Op::PowConst:
+                    s.a = id_of(&n->child(0));
+                    s.b = static_cast<uint32_t>(constants.size());
+                    constants.push_back(n->constant());
+                    break;
+
+                case Op::Relu:
+                    s.a = id_of(&n->child(0));
+                    s.b = static_cast<uint32_t>(mask.size());
+                    mask.push_back(!(n->child(0).x < 0.0));
+                    break;
+
+                case Op::Sum:
+                    s.a = add_list(n->child_nodes(), n->num_children());
+                    break;
+
+                case Op::Dot: {
+                    size_t m = n->num_children() / 2;
+                    s.a = add_list(n->child_nodes(), m);
+                    s.b = add_list(n->child_nodes() + m, m);
+                    break;
+                }
+
+                default:
+                    throw std::invalid_argument("graph with cast, fused or checkpointed nodes can't be traced");
+                }
+            }
+            steps.push_back(s);
+        }
+
+        for (const Value<T>& o : outs) {
+            outputs.push_back(id_of(o.node));
+        }
+
+        shrink(ids);
+        shrink(constants);
+        shrink(externals);
+        mask.shrink_to_fit();
+        saved.index();
+        saved.shrink_to_fit();
+        values.shrink_to_fit();
+        if (values.bytes() > policy.spill_bytes) {
+            values.spill(policy.spill_dir);
+        }
+    }
+
+    // pass seeds[i], the gradient of output i, down to the nodes from
+    // outside, the way Node::run_backward would
+    void backward(const std::vector<T>& seeds) const {
+        size_t n_ops = steps.size();
+        std::vector<T> g(n_ops + externals.size(), T(0.0));
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            g[outputs[i]] += seeds[i];
+        }
+
+        auto kept = values.view();
+        auto value = [&](uint32_t i) {
+            return i < n_ops ? kept[saved.rank(i)] : externals[i - n_ops]->x;
+        };
+
+        uint64_t skipped = 0;
+        for (size_t k = n_ops; k-- > 0;) {
+            const Step& s = steps[k];
+            if (s.op == Op::None) {
+                continue;
+            }
+            const T gk = g[k];
+            if (gk == T(0.0)) {
+                ++skipped;
+                continue;
+            }
+
+            switch (s.op) {
+            case Op::Add:
+                g[s.a] += gk;
+                if (s.n == 2) {
+                    g[s.b] += gk;
+                }
+                break;
+
+            case Op::Sub:
+                g[s.a] += gk;
+                if (s.n == 2) {
+                    g[s.b] -= gk;
+                }
+                break;
+
+            case Op::Mul: {
+                T a = value(s.a), b = value(s.b);
+                g[s.a] += gk * b;
+                g[s.b] += gk * a;
+                break;
+            }
+
+            case Op::MulConst:
+                g[s.a] += gk * constants[s.b];
+                break;
+
+            case Op::Div: {
+                T a = value(s.a), b = value(s.b);
+                g[s.a] += gk / b;
+                g[s.b] += -gk * a / (b * b);
+                break;
+            }
+
+            case Op::DivConst:
+                g[s.a] += gk / constants[s.b];
+                break;
+
+            case Op::Neg:
+                g[s.a] -= gk;
+                break;
+
+            case Op::Pow: {
+                T a = value(s.a), b = value(s.b);
+                g[s.a] += gk * b * std::pow(a, b - 1);
+                g[s.b] += gk * std::pow(a, b) * std::log(a);
+                break;
+            }
+
+            case Op::PowConst: {
+                const T& c = constants[s.b];
+                g[s.a] += gk * c * std::pow(value(s.a), c - 1);
+                break;
+            }
+
+            case Op::Relu:
+                if (mask[s.b]) {
+                    g[s.a] += gk;
+                }
+                break;
+
+            case Op::Sum: {
+                const uint32_t* in = ids.data() + s.a;
+                for (uint32_t j = 1; j <= in[0]; ++j) {
+                    g[in[j]] += gk;
+                }
+                break;
+            }
+
+            case Op::Dot: {
+                const uint32_t* a = ids.data() + s.a;
+                const uint32_t* b = ids.data() + s.b;
+                for (uint32_t j = 1; j <= a[0]; ++j) {
+                    g[a[j]] += gk * value(b[j]);
+                    g[b[j]] += gk * value(a[j]);
+                }
+                break;
+            }
+
+            default:
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < externals.size(); ++i) {
+            if (g[n_ops + i] != T(0.0)) {
+                externals[i]->add_grad(g[n_ops + i]);
+            }
+        }
+        BackwardStats::add_skipped(skipped);
+    }
+
+    // number of ops
+    size_t size() const {
+        return steps.size();
+    }
+
+    bool spilled() const {
+        return values.spilled();
+    }
+
+    // number of values kept for backward
+    size_t saved_values() const {
+        return values.size();
+    }
+
+    // memory held, less the values in a spill file
+    size_t bytes() const {
+        return steps.capacity() * sizeof(Step) + ids.capacity() * sizeof(uint32_t) +
+               constants.capacity() * sizeof(T) + mask.bytes() + saved.bytes() + values.bytes() +
+               externals.capacity() * sizeof(Node<T>*) + outputs.capacity() * sizeof(uint32_t);
+    }
+};
+
+
+// the function of a compressed segment and its trace, kept in its
+// segment node. a replay of the forward builds the trace again
+template <typename T, class F>
+struct CompressedSegment : Node<T>::Segment {
+    F fn;
+    std::vector<Value<T>> inputs;
+    SavePolicy policy;
+    Trace<T> trace;
+
+    CompressedSegment(F _fn, const std::vector<Value<T>>& inputs, const SavePolicy& policy)
+        : fn(std::move(_fn)), inputs(inputs), policy(policy) {
+        record();
+        this->grads.assign(this->xs.size(), T(0.0));
+        this->apply = [](typename Node<T>::Segment& s, Node<T>&, bool forward) {
+            auto& self = static_cast<CompressedSegment&>(s);
+            if (forward) {
+                self.record();
+                return;
+            }
+            self.trace.backward(self.grads);
+            std::fill(self.grads.begin(), self.grads.end(), T(0.0));
+        };
+        this->destroy = [](typename Node<T>::Segment& s) {
+            static_cast<CompressedSegment&>(s).~CompressedSegment();
+        };
+    }
+
+    // build the graph of fn, keep it as a trace, and drop it; its ops
+    // go on a tape of their own, never on one being run backward
+    void record() {
+        Tape<T> tape;
+        TapeScope<T> scope(tape);
+        std::vector<Value<T>> out = segment_outputs<T>(fn(inputs));
+        if (!this->xs.empty() && out.size() != this->xs.size()) {
+            throw std::logic_error("compressed function changed its number of outputs");
+        }
+
+        trace.build(tape, out, policy);
+        this->xs.clear();
+        this->ys.clear();
+        for (const Value<T>& o : out) {
+            this->xs.push_back(o.dataX());
+            this->ys.push_back(o.dataY());
+        }
+    }
+};
+
+
+// fn(inputs), with the graph of fn kept as a trace that stores what
+// backward reads as the policy says. fn returns a Value or a vector of
+// them, and so does compress
+template <typename T, class F>
+inline
+auto
+compress(F fn, const std::vector<Value<T>>& inputs, const SavePolicy& policy = SavePolicy()) {
+    using Result = std::decay_t<std::invoke_result_t<F&, const std::vector<Value<T>>&>>;
+    static_assert(std::is_floating_point_v<T>, "only graphs of real types can be compressed");
+
+    if (NoGradGuard::enabled()) {
+        return Result(fn(inputs));
+    }
+    return segment_nodes<T, CompressedSegment<T, F>, F>(inputs, std::move(fn), inputs, policy);
+}
+
+}  // namespace ptMgrad
@@ -0,0 +1,1417 @@
+// dense tensors with autograd over whole tensors. a Tensor keeps its
+// elements in one buffer, along with its shape and the strides and
+// offset of its elements in it, and an op on tensors records a single
+// node for its result, whose backward works on whole buffers: a
+// 1000x1000 matrix is one node of the graph rather than a million
+// Values.
+//
+// ops write their results row major into buffers of their own. a view
+// -- a slice, transpose, reshape or expand -- shares the buffer of the
+// tensor it's taken of instead, with strides of its own, and the
+// elementwise ops broadcast their operands along stride 0 rather than
+// copying them out to a common shape.
+//
+// tensors follow the rules of Value. leaves require a gradient unless
+// told otherwise, and their gradients accumulate until zero_grad,
+// GradGeneration::advance() or an advance of their GradScope;
+// NoGradGuard turns graph building off;
+// backward frees the graph unless it is retained. elements are float,
+// double or complex
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "elementwise.h"
+#include "engine.h"
+#include "gemm.h"
+
+
+namespace ptMgrad {
+
+
+template <typename T>
+class Tensor;
+
+// tensors bring operators of their own, which the scalar overloads
+// of engine.h leave to them
+template <typename T>
+struct is_expression<Tensor<T>> : std::true_type {};
+
+
+// the sizes of the dimensions of a tensor, outermost first. a tensor
+// of no dimensions holds a single element
+using Shape = std::vector<size_t>;
+
+inline
+size_t
+numel(const Shape& shape) {
+    size_t n = 1;
+    for (size_t s : shape) {
+        n *= s;
+    }
+    return n;
+}
+
+// the strides, in elements, of a row major tensor of the given shape
+inline
+Shape
+contiguous_strides(const Shape& shape) {
+    Shape strides(shape.size());
+    size_t stride = 1;
+    for (size_t i = shape.size(); i-- > 0;) {
+        strides[i] = stride;
+        stride *= shape[i];
+    }
+    return strides;
+}
+
+// the shape of an elementwise op on tensors of shapes x and y. shapes
+// are aligned at their innermost dimensions, and sizes that differ
+// must have a 1 on one side, which is repeated to the size of the
+// other; missing outer dimensions count as 1
+inline
+Shape
+broadcast_shape(const Shape& x, const Shape& y) {
+    size_t d = std::max(x.size(), y.size());
+    Shape shape(d);
+    for (size_t i = 0; i < d; ++i) {
+        size_t a = i < d - x.size() ? 1 : x[i - (d - x.size())];
+        size_t b = i < d - y.size() ? 1 : y[i - (d - y.size())];
+        if (a != b && a != 1 && b != 1) {
+            throw std::invalid_argument("Tensors can't be broadcast together");
+        }
+        shape[i] = a == 1 ? b : a;
+    }
+    return shape;
+}
+
+// the strides over the dimensions of to of a tensor of shape from,
+// with the given strides, broadcast to it: 0 along the dimensions its
+// elements are repeated over
+inline
+Shape
+broadcast_strides(const Shape& from, const Shape& strides, const Shape& to) {
+    if (from.size() > to.size()) {
+        throw std::invalid_argument("Tensors can't be broadcast together");
+    }
+    Shape __k(to.size(), 0);
+    size_t lead = to.size() - from.size();
+    for (size_t i = 0; i < from.size(); ++i) {
+        if (from[i] == to[lead + i]) {
+            __k[lead + i] = strides[i];
+        } else if (from[i] != 1) {
+            throw std::invalid_argument("Tensors can't be broadcast together");
+        }
+    }
+    return __k;
+}
+
+
+// operation that produced a tensor node, dispatched on by backward
+enum class TensorOp : unsigned char {
+    None,       // leaf
+    Add,        // a single child when the other operand is a scalar
+    Sub,
+    Mul,
+    MulConst,
+    Div,
+    DivConst,
+    RDivConst,  // a constant over x
+    Neg,        // -x, or a constant minus x
+    PowConst,
+    Relu,
+    Copy,       // of a view into a buffer of its own
+    View,       // sharing the elements of its child, see Tensor::view
+    Sum,        // of all elements, into a tensor of no dimensions
+    MatMul,     // of an m x k and a k x n matrix, see gemm.h
+    Linear,     // x w + b over a batch of rows x, in one pass with gemm
+    LinearRelu, // relu(x w + b), likewise
+    Freed       // an op whose graph backward has freed, see TensorNode::free_graph
+};
+
+
+// the elements of a tensor, aligned for vector loads
+template <typename T>
+class Storage {
+private:
+    static_assert(std::is_trivially_destructible_v<T>, "elements are never destroyed");
+    static constexpr std::align_val_t alignment{64};
+
+    T* p;
+    size_t n;
+
+public:
+    explicit Storage(size_t n, const T& fill = T(0))
+        : p(static_cast<T*>(::operator new((n ? n : 1) * sizeof(T), alignment))), n(n) {
+        for (size_t i = 0; i < n; ++i) {
+            new (p + i) T(fill);
+        }
+    }
+
+    ~Storage() {
+        ::operator delete(p, alignment);
+    }
+
+    Storage(const Storage&) = delete;
+    Storage& operator=(const Storage&) = delete;
+
+    T* data() const {
+        return p;
+    }
+
+    size_t size() const {
+        return n;
+    }
+};
+
+
+// elementwise loops, over contiguous buffers and along strides
+namespace kernel {
+
+// the rows of a loop over every index of shape, row major, carrying
+// an offset into each of N operands along its strides: f(len, offsets,
+// steps) runs once per row of len elements, at offsets + q steps.
+// dimensions of size 1 are dropped and neighbours that every operand
+// steps through evenly are merged, so that operands that are all
+// contiguous make a single row
+template <size_t N, class F>
+inline void rows(const Shape& shape, const std::array<const Shape*, N>& strides, F f) {
+    Shape dims;
+    std::array<Shape, N> st;
+    for (size_t d = 0; d < shape.size(); ++d) {
+        if (shape[d] == 0) {
+            return;
+        }
+        if (shape[d] == 1) {
+            continue;
+        }
+        bool merge = !dims.empty();
+        for (size_t k = 0; k < N && merge; ++k) {
+            merge = st[k].back() == (*strides[k])[d] * shape[d];
+        }
+        if (merge) {
+            dims.back() *= shape[d];
+        } else {
+            dims.push_back(shape[d]);
+        }
+        for (size_t k = 0; k < N; ++k) {
+            if (merge) {
+                st[k].back() = (*strides[k])[d];
+            } else {
+                st[k].push_back((*strides[k])[d]);
+            }
+        }
+    }
+
+    std::array<size_t, N> off{}, step;
+    if (dims.empty()) {
+        step.fill(1);
+        f(size_t(1), off, step);
+        return;
+    }
+    size_t outer = dims.size() - 1;
+    for (size_t k = 0; k < N; ++k) {
+        step[k] = st[k].back();
+    }
+    Shape index(outer, 0);
+    for (;;) {
+        f(dims.back(), off, step);
+        // on to the next row, carrying into outer dimensions
+        size_t d = outer;
+        for (;;) {
+            if (d == 0) {
+                return;
+            }
+            --d;
+            ++index[d];
+            for (size_t k = 0; k < N; ++k) {
+                off[k] += st[k][d];
+            }
+            if (index[d] < dims[d]) {
+                break;
+            }
+            for (size_t k = 0; k < N; ++k) {
+                off[k] -= st[k][d] * dims[d];
+            }
+            index[d] = 0;
+        }
+    }
+}
+
+template <size_t N, class F, size_t... I>
+inline void elements_at(const Shape& shape, const std::array<const Shape*, N>& strides, F& f,
+                        std::index_sequence<I...>) {
+    rows<N>(shape, strides, [&](size_t len, const std::array<size_t, N>& off,
+                                const std::array<size_t, N>& step) {
+        if (((step[I] == 1) && ...)) {
+            for (size_t q = 0; q < len; ++q) {
+                f((off[I] + q)...);
+            }
+        } else {
+            for (size_t q = 0; q < len; ++q) {
+                f((off[I] + q * step[I])...);
+            }
+        }
+    });
+}
+
+// f(offsets...) for every index of shape, with the offset of the
+// element at that index in each of N operands
+template <size_t N, class F>
+inline void elements(const Shape& shape, const std::array<const Shape*, N>& strides, F f) {
+    elements_at<N>(shape, strides, f, std::make_index_sequence<N>());
+}
+
+// out = a op s, and out = op a, over every index of shape, into a
+// contiguous out, reading a along strides as; and out = a op b, with
+// b along bs as well. rows whose operands are contiguous, or with one
+// repeated along the row, go to the elementwise kernel
+template <class T>
+inline void scalar(ElementwiseOp op, const Shape& shape, T* out, const T* a, const Shape& as, T s) {
+    const ElementwiseKernel<T>& kern = elementwise_kernel<T>();
+    Shape os = contiguous_strides(shape);
+    rows<2>(shape, {&os, &as}, [&](size_t len, const std::array<size_t, 2>& off,
+                                   const std::array<size_t, 2>& step) {
+        if (step[1] == 1) {
+            kern.scalar(op, len, out + off[0], a + off[1], s);
+        } else {
+            with_op(op, [&](auto o) {
+                for (size_t q = 0; q < len; ++q) {
+                    out[off[0] + q] = apply<decltype(o)::value>(a[off[1] + q * step[1]], s);
+                }
+            });
+        }
+    });
+}
+
+template <class T>
+inline void unary(ElementwiseOp op, const Shape& shape, T* out, const T* a, const Shape& as) {
+    scalar(op, shape, out, a, as, T(0));
+}
+
+// b op a for a op b
+inline ElementwiseOp swapped(ElementwiseOp op) {
+    switch (op) {
+    case ElementwiseOp::Sub:
+        return ElementwiseOp::RSub;
+    case ElementwiseOp::Div:
+        return ElementwiseOp::RDiv;
+    default:
+        return op;
+    }
+}
+
+template <class T>
+inline void binary(ElementwiseOp op, const Shape& shape, T* out, const T* a, const Shape& as,
+                   const T* b, const Shape& bs) {
+    const ElementwiseKernel<T>& kern = elementwise_kernel<T>();
+    Shape os = contiguous_strides(shape);
+    rows<3>(shape, {&os, &as, &bs}, [&](size_t len, const std::array<size_t, 3>& off,
+                                        const std::array<size_t, 3>& step) {
+        T* o = out + off[0];
+        const T* x = a + off[1];
+        const T* y = b + off[2];
+        if (step[1] == 1 && step[2] == 1) {
+            kern.binary(op, len, o, x, y);
+        } else if (step[1] == 1 && step[2] == 0) {
+            kern.scalar(op, len, o, x, *y);
+        } else if (step[1] == 0 && step[2] == 1) {
+            kern.scalar(swapped(op), len, o, y, *x);
+        } else {
+            with_op(op, [&](auto p) {
+                for (size_t q = 0; q < len; ++q) {
+                    o[q] = apply<decltype(p)::value>(x[q * step[1]], y[q * step[2]]);
+                }
+            });
+        }
+    });
+}
+
+// out = out op a over every index of shape, with out along os and a
+// along as. out may be repeated, along stride 0, in which case its
+// elements gather every a they're repeated over
+template <class T>
+inline void accumulate(ElementwiseOp op, const Shape& shape, T* out, const Shape& os,
+                       const T* a, const Shape& as) {
+    const ElementwiseKernel<T>& kern = elementwise_kernel<T>();
+    rows<2>(shape, {&os, &as}, [&](size_t len, const std::array<size_t, 2>& off,
+                                   const std::array<size_t, 2>& step) {
+        T* o = out + off[0];
+        const T* x = a + off[1];
+        if (step[0] == 1 && step[1] == 1) {
+            kern.binary(op, len, o, o, x);
+        } else {
+            with_op(op, [&](auto p) {
+                for (size_t q = 0; q < len; ++q) {
+                    o[q * step[0]] = apply<decltype(p)::value>(o[q * step[0]], x[q * step[1]]);
+                }
+            });
+        }
+    });
+}
+
+// the gradient g through a relu at x, part by part for complex x
+template <class T>
+inline T relu_grad(const T& x, const T& g) {
+    if constexpr (is_complex_v<T>) {
+        using R = decltype(x.real());
+        return T(x.real() < R(0) ? R(0) : g.real(), x.imag() < R(0) ? R(0) : g.imag());
+    } else {
+        return x < T(0) ? T(0) : g;
+    }
+}
+
+// which parts of x a relu passes the gradient through, bit 0 for the
+// real part and bit 1 for the imaginary one
+template <class T>
+inline unsigned char relu_mask(const T& x) {
+    if constexpr (is_complex_v<T>) {
+        using R = decltype(x.real());
+        return static_cast<unsigned char>(!(x.real() < R(0)) | (!(x.imag() < R(0)) << 1));
+    } else {
+        return !(x < T(0));
+    }
+}
+
+// the gradient g through a relu, from the mask of its input
+template <class T>
+inline T relu_grad_masked(unsigned char mask, const T& g) {
+    if constexpr (is_complex_v<T>) {
+        using R = decltype(g.real());
+        return T(mask & 1 ? g.real() : R(0), mask & 2 ? g.imag() : R(0));
+    } else {
+        return mask ? g : T(0);
+    }
+}
+
+}  // namespace kernel
+
+
+// a node of a graph of tensors, Tensor is a handle to one. its
+// elements are at offset in storage, along strides, which views share
+// with the tensors they're taken of. the gradient is a contiguous
+// buffer of the same shape, allocated by the first gradient written
+// to it
+template <typename T>
+class TensorNode {
+public:
+    std::shared_ptr<Storage<T>> storage;
+    Shape shape;
+    Shape strides;
+    size_t offset = 0;
+    // of a View, where its elements are in the gradient of its child
+    Shape view_strides;
+    size_t view_offset = 0;
+    mutable std::vector<T> grad;
+    // the generation a leaf's gradient was written in; one from an
+    // older generation reads as zero
+    mutable uint32_t generation;
+    // the GradScope a leaf is bound to, if any
+    GradScope::Counter* scope = nullptr;
+    std::vector<std::shared_ptr<TensorNode>> children;
+    T constant = T(0);
+    // of a LinearRelu, kernel::relu_mask of each element before its relu
+    std::vector<unsigned char> relu_mask;
+    TensorOp op = TensorOp::None;
+    // false for leaves marked as constants and for ops that don't
+    // depend on any leaf that needs a gradient
+    bool requires_grad = true;
+
+    explicit TensorNode(Shape _shape, const T& fill = T(0))
+        : storage(std::make_shared<Storage<T>>(ptMgrad::numel(_shape), fill)),
+          shape(std::move(_shape)), strides(contiguous_strides(shape)),
+          generation(GradGeneration::current()) {}
+
+    // a view of the elements of another node
+    TensorNode(std::shared_ptr<Storage<T>> _storage, Shape _shape, Shape _strides, size_t _offset)
+        : storage(std::move(_storage)), shape(std::move(_shape)), strides(std::move(_strides)),
+          offset(_offset), generation(GradGeneration::current()) {}
+
+    // free iteratively so that long chains don't overflow the stack
+    ~TensorNode() {
+        GradScope::release(scope);
+        std::vector<std::shared_ptr<TensorNode>> dead = std::move(children);
+        while (!dead.empty()) {
+            std::shared_ptr<TensorNode> d = std::move(dead.back());
+            dead.pop_back();
+            if (d.use_count() == 1) {
+                for (auto& c : d->children) {
+                    dead.push_back(std::move(c));
+                }
+                d->children.clear();
+            }
+        }
+    }
+
+    TensorNode(const TensorNode&) = delete;
+    TensorNode& operator=(const TensorNode&) = delete;
+
+    size_t numel() const {
+        return ptMgrad::numel(shape);
+    }
+
+    T* data() const {
+        return storage->data() + offset;
+    }
+
+    // whether the elements are row major with no gaps
+    bool is_contiguous() const {
+        size_t stride = 1;
+        for (size_t d = shape.size(); d-- > 0;) {
+            if (shape[d] != 1 && strides[d] != stride) {
+                return false;
+            }
+            stride *= shape[d];
+        }
+        return true;
+    }
+
+    const TensorNode& child(size_t i) const {
+        return *children[i];
+    }
+
+    void add_child(const std::shared_ptr<TensorNode>& c) {
+        c->check_not_freed();
+        requires_grad = c->requires_grad || (!children.empty() && requires_grad);
+        children.push_back(c);
+    }
+
+    // the gradient, or null if nothing was written to it yet
+    const T* grad_data() const {
+        bool stamped = op == TensorOp::None || op == TensorOp::Freed;
+        if (grad.empty() || (stamped && generation != GradScope::current(scope))) {
+            return nullptr;
+        }
+        return grad.data();
+    }
+
+    // f(g) on the gradient buffer g, zeroed first if it holds nothing
+    // of this generation. with GradLock on, leaves shared by graphs on
+    // other threads are updated one thread at a time
+    template <class F>
+    void update_grad(F f) const {
+        if (!requires_grad) {
+            return;
+        }
+        if (GradLock::enabled()) {
+            GradLock lock(this);
+            accumulate(f);
+        } else {
+            accumulate(f);
+        }
+    }
+
+    template <class F>
+    void accumulate(F& f) const {
+        if (!grad_data()) {
+            grad.assign(numel(), T(0));
+            generation = GradScope::current(scope);
+        }
+        f(grad.data());
+    }
+
+    void zero_grad() const {
+        grad.clear();
+    }
+
+    // drop the children, keeping the value and gradient. as with
+    // Node::free_graph, the node is no leaf: building on it or running
+    // backward through it throws. leaves, which other graphs may share,
+    // are left alone
+    void free_graph() {
+        if (op == TensorOp::None || op == TensorOp::Freed) {
+            return;
+        }
+        children.clear();
+        std::vector<unsigned char>().swap(relu_mask);
+        op = TensorOp::Freed;
+        generation = GradGeneration::current();
+    }
+
+    void check_not_freed() const {
+        if (op == TensorOp::Freed) {
+            throw std::logic_error(
+                "graph was freed by an earlier backward, pass retain_graph to keep it");
+        }
+    }
+
+    // pass the gradient of this node on to its children. false if it
+    // has none, in which case there is nothing to pass on
+    bool run_backward() const {
+        if (op == TensorOp::None) {
+            return true;
+        }
+        const T* g = grad_data();
+        if (!g) {
+            return false;
+        }
+        size_t n = numel();
+
+        // the elementwise ops broadcast their children to the shape of
+        // this node. over its dimensions, the strides of g, and those
+        // of the gradient and of the elements of child i
+        Shape gs = contiguous_strides(shape);
+        auto grad_strides = [&](size_t i) {
+            return broadcast_strides(child(i).shape, contiguous_strides(child(i).shape), shape);
+        };
+        auto data_strides = [&](size_t i) {
+            return broadcast_strides(child(i).shape, child(i).strides, shape);
+        };
+
+        switch (op) {
+        case TensorOp::None:
+            break;
+
+        case TensorOp::Freed:
+            check_not_freed();
+            break;
+
+        case TensorOp::Add:
+        case TensorOp::Copy:
+            for (size_t i = 0; i < children.size(); ++i) {
+                Shape cs = grad_strides(i);
+                child(i).update_grad([&](T* gc) {
+                    kernel::accumulate(ElementwiseOp::Add, shape, gc, cs, g, gs);
+                });
+            }
+            break;
+
+        case TensorOp::Sub: {
+            Shape as = grad_strides(0);
+            child(0).update_grad([&](T* ga) {
+                kernel::accumulate(ElementwiseOp::Add, shape, ga, as, g, gs);
+            });
+            if (children.size() == 2) {
+                Shape bs = grad_strides(1);
+                child(1).update_grad([&](T* gb) {
+                    kernel::accumulate(ElementwiseOp::Sub, shape, gb, bs, g, gs);
+                });
+            }
+            break;
+        }
+
+        case TensorOp::Mul: {
+            const T* a = child(0).data();
+            const T* b = child(1).data();
+            Shape as = data_strides(0), bs = data_strides(1);
+            Shape gas = grad_strides(0), gbs = grad_strides(1);
+            child(0).update_grad([&](T* ga) {
+                kernel::elements<3>(shape, {&gs, &gas, &bs}, [&](size_t p, size_t q, size_t r) {
+                    ga[q] += g[p] * b[r];
+                });
+            });
+            child(1).update_grad([&](T* gb) {
+                kernel::elements<3>(shape, {&gs, &gbs, &as}, [&](size_t p, size_t q, size_t r) {
+                    gb[q] += g[p] * a[r];
+                });
+            });
+            break;
+        }
+
+        case TensorOp::MulConst:
+            child(0).update_grad([&](T* ga) {
+                for (size_t i = 0; i < n; ++i) {
+                    ga[i] += g[i] * constant;
+                }
+            });
+            break;
+
+        case TensorOp::Div: {
+            const T* b = child(1).data();
+            const T* out = data();
+            Shape bs = data_strides(1);
+            Shape gas = grad_strides(0), gbs = grad_strides(1);
+            child(0).update_grad([&](T* ga) {
+                kernel::elements<3>(shape, {&gs, &gas, &bs}, [&](size_t p, size_t q, size_t r) {
+                    ga[q] += g[p] / b[r];
+                });
+            });
+            // d(a / b)/db = -(a / b) / b
+            child(1).update_grad([&](T* gb) {
+                kernel::elements<3>(shape, {&gs, &gbs, &bs}, [&](size_t p, size_t q, size_t r) {
+                    gb[q] -= g[p] * out[p] / b[r];
+                });
+            });
+            break;
+        }
+
+        case TensorOp::DivConst:
+            child(0).update_grad([&](T* ga) {
+                for (size_t i = 0; i < n; ++i) {
+                    ga[i] += g[i] / constant;
+                }
+            });
+            break;
+
+        // d(c / a)/da = -(c / a) / a
+        case TensorOp::RDivConst: {
+            const T* a = child(0).data();
+            const T* out = data();
+            Shape as = data_strides(0);
+            child(0).update_grad([&](T* ga) {
+                kernel::elements<2>(shape, {&gs, &as}, [&](size_t p, size_t r) {
+                    ga[p] -= g[p] * out[p] / a[r];
+                });
+            });
+            break;
+        }
+
+        case TensorOp::Neg:
+            child(0).update_grad([&](T* ga) {
+                kernel::accumulate(ElementwiseOp::Sub, shape, ga, gs, g, gs);
+            });
+            break;
+
+        case TensorOp::PowConst:
+            if constexpr (!is_complex_v<T>) {
+                const T* a = child(0).data();
+                Shape as = data_strides(0);
+                child(0).update_grad([&](T* ga) {
+                    kernel::elements<2>(shape, {&gs, &as}, [&](size_t p, size_t r) {
+                        ga[p] += g[p] * constant * std::pow(a[r], constant - 1);
+                    });
+                });
+            }
+            break;
+
+        case TensorOp::Relu: {
+            const T* a = child(0).data();
+            Shape as = data_strides(0);
+            child(0).update_grad([&](T* ga) {
+                kernel::elements<2>(shape, {&gs, &as}, [&](size_t p, size_t r) {
+                    ga[p] += kernel::relu_grad(a[r], g[p]);
+                });
+            });
+            break;
+        }
+
+        // into the elements of the child this is a view of; those an
+        // expand repeats gather the gradients of all their repeats
+        case TensorOp::View:
+            child(0).update_grad([&](T* gc) {
+                kernel::accumulate(ElementwiseOp::Add, shape, gc + view_offset, view_strides, g, gs);
+            });
+            break;
+
+        case TensorOp::Sum: {
+            size_t m = child(0).numel();
+            child(0).update_grad([&](T* ga) {
+                for (size_t i = 0; i < m; ++i) {
+                    ga[i] += g[0];
+                }
+            });
+            break;
+        }
+
+        // for C = A B, dA = dC B^T and dB = A^T dC, each a gemm over
+        // an operand read transposed, by swapping its strides
+        case TensorOp::MatMul: {
+            size_t m = shape[0], k = child(0).shape[1], n = shape[1];
+            const T* a = child(0).data();
+            const T* b = child(1).data();
+            const Shape& as = child(0).strides;
+            const Shape& bs = child(1).strides;
+            child(0).update_grad([&](T* ga) {
+                gemm(m, k, n, g, n, 1, b, bs[1], bs[0], ga, k, true);
+            });
+            child(1).update_grad([&](T* gb) {
+                gemm(k, n, m, a, as[1], as[0], g, n, 1, gb, n, true);
+            });
+            break;
+        }
+
+        // as MatMul, with the gradient of the bias summed over the
+        // batch, and that of a relu applied to the rows first
+        case TensorOp::Linear:
+        case TensorOp::LinearRelu: {
+            size_t batch = shape[0], nout = shape[1], nin = child(0).shape[1];
+            const T* x = child(0).data();
+            const T* w = child(1).data();
+            const Shape& xs = child(0).strides;
+            const Shape& ws = child(1).strides;
+            std::vector<T> masked;
+            if (op == TensorOp::LinearRelu) {
+                masked.resize(n);
+                for (size_t i = 0; i < n; ++i) {
+                    masked[i] = kernel::relu_grad_masked(relu_mask[i], g[i]);
+                }
+                g = masked.data();
+            }
+            child(0).update_grad([&](T* gx) {
+                gemm(batch, nin, nout, g, nout, 1, w, ws[1], ws[0], gx, nin, true);
+            });
+            child(1).update_grad([&](T* gw) {
+                gemm(nin, nout, batch, x, xs[1], xs[0], g, nout, 1, gw, nout, true);
+            });
+            child(2).update_grad([&](T* gb) {
+                for (size_t r = 0; r < batch; ++r) {
+                    for (size_t j = 0; j < nout; ++j) {
+                        gb[j] += g[r * nout + j];
+                    }
+                }
+            });
+            break;
+        }
+        }
+        return true;
+    }
+
+    // topological order of the graph below root, children first;
+    // branches that need no gradient are left out
+    static void sort(const std::shared_ptr<TensorNode>& root,
+                     std::vector<std::shared_ptr<TensorNode>>& topo) {
+        std::unordered_set<const TensorNode*> visited;
+        std::vector<std::pair<const std::shared_ptr<TensorNode>*, bool>> stack;
+        stack.push_back({&root, false});
+
+        while (!stack.empty()) {
+            auto [v, done] = stack.back();
+            stack.pop_back();
+
+            if (done) {
+                topo.push_back(*v);
+                continue;
+            }
+            if (!visited.insert(v->get()).second) {
+                continue;
+            }
+
+            // re-push self so it is added to topo after all children
+            stack.push_back({v, true});
+            for (const auto& c : (*v)->children) {
+                if (c->requires_grad && !visited.count(c.get())) {
+                    stack.push_back({&c, false});
+                }
+            }
+        }
+    }
+};
+
+
+template <typename T>
+class Tensor {
+private:
+    static_assert(std::is_floating_point_v<T> || is_complex_v<T>,
+                  "tensors hold float, double or complex elements");
+
+    std::shared_ptr<TensorNode<T>> node;
+
+    explicit Tensor(std::shared_ptr<TensorNode<T>> _node) : node(std::move(_node)) {}
+
+    // a tensor of the given shape over the elements of this one, with
+    // no copy: layout(strides, offset) returns the strides of the view
+    // from those of this tensor, and moves the offset of its first
+    // element. it is applied both to where the elements are in memory
+    // and to where they are in this tensor's gradient, which backward
+    // adds the gradient of the view to
+    template <class F>
+    Tensor view(const Shape& shape, F layout) const {
+        size_t offset = node->offset, view_offset = 0;
+        Shape strides = layout(node->strides, offset);
+        Shape view_strides = layout(contiguous_strides(node->shape), view_offset);
+
+        Tensor<T> __k(std::make_shared<TensorNode<T>>(node->storage, shape, std::move(strides), offset));
+        __k.node->view_strides = std::move(view_strides);
+        __k.node->view_offset = view_offset;
+
+        __k.add_child(*this);
+
+        __k.set_backward(TensorOp::View);
+
+        return __k;
+    }
+
+public:
+    typedef T value_type;
+
+    // a tensor of no dimensions holding zero
+    Tensor() : Tensor(Shape{}) {}
+
+    explicit Tensor(const Shape& shape, const T& fill = T(0))
+        : node(std::make_shared<TensorNode<T>>(shape, fill)) {}
+
+    Tensor(const Shape& shape, const std::vector<T>& values)
+        : node(std::make_shared<TensorNode<T>>(shape)) {
+        if (values.size() != numel()) {
+            throw std::invalid_argument("Values don't match the shape");
+        }
+        std::copy(values.begin(), values.end(), data());
+    }
+
+    const Shape& shape() const {
+        return node->shape;
+    }
+
+    // strides of the dimensions, in elements
+    const Shape& strides() const {
+        return node->strides;
+    }
+
+    size_t dim() const {
+        return node->shape.size();
+    }
+
+    size_t numel() const {
+        return node->numel();
+    }
+
+    // the first element, the others following along strides(): row
+    // major unless this is a view. writing to them changes the value in
+    // place, for the views that share them as well, and for the ops
+    // already built over this tensor that read them in backward
+    T* data() {
+        return node->data();
+    }
+
+    const T* data() const {
+        return node->data();
+    }
+
+    T at(const Shape& index) const {
+        if (index.size() != dim()) {
+            throw std::out_of_range("Index doesn't match the number of dimensions");
+        }
+        size_t offset = 0;
+        for (size_t i = 0; i < index.size(); ++i) {
+            if (index[i] >= node->shape[i]) {
+                throw std::out_of_range("Index out of range");
+            }
+            offset += index[i] * node->strides[i];
+        }
+        return data()[offset];
+    }
+
+    bool is_contiguous() const {
+        return node->is_contiguous();
+    }
+
+    // a view of the elements begin, begin + step, ... before end along
+    // dimension d
+    Tensor slice(size_t d, size_t begin, size_t end, size_t step = 1) const {
+        if (d >= dim() || begin > end || end > shape()[d]) {
+            throw std::out_of_range("Slice out of range");
+        }
+        if (step == 0) {
+            throw std::invalid_argument("Slice step must be positive");
+        }
+        Shape s = shape();
+        s[d] = (end - begin + step - 1) / step;
+        return view(s, [&](Shape strides, size_t& offset) {
+            offset += begin * strides[d];
+            strides[d] *= step;
+            return strides;
+        });
+    }
+
+    // a view with dimensions d0 and d1 swapped
+    Tensor transpose(size_t d0 = 0, size_t d1 = 1) const {
+        if (d0 >= dim() || d1 >= dim()) {
+            throw std::out_of_range("Dimension out of range");
+        }
+        Shape s = shape();
+        std::swap(s[d0], s[d1]);
+        return view(s, [&](Shape strides, size_t&) {
+            std::swap(strides[d0], strides[d1]);
+            return strides;
+        });
+    }
+
+    // the elements in another shape of as many, row major. a view of a
+    // contiguous tensor; others are copied to a contiguous tensor first
+    Tensor reshape(const Shape& s) const {
+        if (ptMgrad::numel(s) != numel()) {
+            throw std::invalid_argument("Shape doesn't match the number of elements");
+        }
+        if (!is_contiguous()) {
+            return contiguous().reshape(s);
+        }
+        return view(s, [&](const Shape&, size_t&) {
+            return contiguous_strides(s);
+        });
+    }
+
+    // a view repeating this tensor to shape, as the elementwise ops
+    // broadcast it: along its dimensions of size 1, and along new
+    // outer ones. the repeats are the same elements, at stride 0
+    Tensor expand(const Shape& s) const {
+        if (broadcast_shape(shape(), s) != s) {
+            throw std::invalid_argument("Tensors can't be broadcast together");
+        }
+        return view(s, [&](const Shape& strides, size_t&) {
+            return broadcast_strides(shape(), strides, s);
+        });
+    }
+
+    // this tensor if it is contiguous, else a contiguous copy of it
+    Tensor contiguous() const {
+        if (is_contiguous()) {
+            return *this;
+        }
+        Tensor<T> __k(shape());
+        Shape os = contiguous_strides(shape());
+        T* out = __k.data();
+        const T* a = data();
+        kernel::elements<2>(shape(), {&os, &strides()}, [&](size_t p, size_t q) {
+            out[p] = a[q];
+        });
+
+        __k.add_child(*this);
+
+        __k.set_backward(TensorOp::Copy);
+
+        return __k;
+    }
+
+    // the single element of a tensor with one
+    T item() const {
+        if (numel() != 1) {
+            throw std::invalid_argument("Tensor has more than one element");
+        }
+        return data()[0];
+    }
+
+    // a leaf holding the gradient, zero if there is none
+    Tensor grad() const {
+        Tensor<T> __k(shape());
+        __k.set_requires_grad(false);
+        if (const T* g = node->grad_data()) {
+            std::copy(g, g + numel(), __k.data());
+        }
+        return __k;
+    }
+
+    // the gradient buffer, or null if there is no gradient
+    const T* grad_data() const {
+        return node->grad_data();
+    }
+
+    void zero_grad() {
+        node->zero_grad();
+    }
+
+    // a leaf that doesn't require grad is a constant: backward never
+    // enters it, and ops built only from constants are constants too
+    void set_requires_grad(bool _requires_grad) {
+        node->requires_grad = _requires_grad;
+    }
+
+    bool requires_grad() const {
+        return node->requires_grad;
+    }
+
+    // zero the gradient of this leaf whenever scope advances, along with
+    // the global generation
+    void set_grad_scope(const GradScope& scope) {
+        if (node->op != TensorOp::None || !node->children.empty()) {
+            throw std::invalid_argument("only leaves can be bound to a GradScope");
+        }
+        GradScope::retain(scope.get());
+        GradScope::release(node->scope);
+        node->scope = scope.get();
+        node->grad.clear();
+    }
+
+    void add_child(const Tensor& child) {
+        if (NoGradGuard::enabled()) {
+            return;
+        }
+        node->add_child(child.node);
+    }
+
+    void set_backward(TensorOp op, const T& constant = T(0)) {
+        if (NoGradGuard::enabled() || node->children.empty()) {
+            return;
+        }
+        node->op = op;
+        node->constant = constant;
+    }
+
+    // a LinearRelu, with kernel::relu_mask of each element before its relu
+    void set_backward(TensorOp op, std::vector<unsigned char> relu_mask) {
+        if (NoGradGuard::enabled() || node->children.empty()) {
+            return;
+        }
+        node->op = op;
+        node->relu_mask = std::move(relu_mask);
+    }
+
+    // the number of ops and leaves in the graph below this tensor
+    // that backward would visit
+    size_t graph_size() const {
+        std::vector<std::shared_ptr<TensorNode<T>>> topo;
+        TensorNode<T>::sort(node, topo);
+        return topo.size();
+    }
+
+    // backward from this tensor, seeded with ones: the gradient of the
+    // sum of its elements. the graph is freed on the way unless
+    // retain_graph is set, after which no backward can go through its
+    // ops and no op can be built on them
+    void backward(bool retain_graph = false) {
+        std::vector<std::shared_ptr<TensorNode<T>>> topo;
+        TensorNode<T>::sort(node, topo);
+        for (const auto& n : topo) {
+            n->check_not_freed();
+        }
+
+        // intermediate gradients start from zero on every pass
+        for (const auto& n : topo) {
+            if (n->op != TensorOp::None) {
+                n->zero_grad();
+            }
+        }
+        node->grad.assign(numel(), T(1));
+        node->generation = GradScope::current(node->scope);
+
+        // nodes no handle refers to go away as soon as they have run
+        uint64_t skipped = 0;
+        for (auto it = topo.rbegin(); it != topo.rend(); ++it) {
+            skipped += !(*it)->run_backward();
+            if (!retain_graph) {
+                (*it)->free_graph();
+                it->reset();
+            }
+        }
+        BackwardStats::add_skipped(skipped);
+    }
+};
+
+
+// x op y, with x and y broadcast to a common shape
+template <class T>
+inline Tensor<T> broadcast_map(ElementwiseOp op, const Tensor<T>& x, const Tensor<T>& y) {
+    Shape shape = broadcast_shape(x.shape(), y.shape());
+    Tensor<T> __k(shape);
+    kernel::binary(op, shape, __k.data(), x.data(), broadcast_strides(x.shape(), x.strides(), shape),
+                   y.data(), broadcast_strides(y.shape(), y.strides(), shape));
+    return __k;
+}
+
+
+template <class T>
+inline
+Tensor<T>
+operator+ (const Tensor<T>& x, const Tensor<T>& y) {
+    Tensor<T> __k = broadcast_map(ElementwiseOp::Add, x, y);
+
+    __k.add_child(x);
+    __k.add_child(y);
+
+    __k.set_backward(TensorOp::Add);
+
+    return __k;
+}
+
+template <class T>
+inline
+Tensor<T>
+operator+ (const Tensor<T>& x, const typename Tensor<T>::value_type& y) {
+    Tensor<T> __k(x.shape());
+    kernel::scalar(ElementwiseOp::Add, x.shape(), __k.data(), x.data(), x.strides(), y);
+
+    __k.add_child(x);
+
+    __k.set_backward(TensorOp::Add);
+
+    return __k;
+}
+
+template <class T>
+inline
+Tensor<T>
+operator+ (const typename Tensor<T>::value_type& x, const Tensor<T>& y) {
+    return y + x;
+}
+
+
+template <class T>
+inline
+Tensor<T>
+operator- (const Tensor<T>& x, const Tensor<T>& y) {
+    Tensor<T> __k = broadcast_map(ElementwiseOp::Sub, x, y);
+
+    __k.add_child(x);
+    __k.add_child(y);
+
+    __k.set_backward(TensorOp::Sub);
+
+    return __k;
+}
+
+template <class T>
+inline
+Tensor<T>
+operator- (const Tensor<T>& x, const typename Tensor<T>::value_type& y) {
+    Tensor<T> __k(x.shape());
+    kernel::scalar(ElementwiseOp::Sub, x.shape(), __k.data(), x.data(), x.strides(), y);
+
+    __k.add_child(x);
+
+    __k.set_backward(TensorOp::Sub);
+
+    return __k;
+}
+
+template <class T>
+inline
+Tensor<T>
+operator- (const typename Tensor<T>::value_type& x, const Tensor<T>& y) {
+    Tensor<T> __k(y.shape());
+    kernel::scalar(ElementwiseOp::RSub, y.shape(), __k.data(), y.data(), y.strides(), x);
+
+    __k.add_child(y);
+
+    __k.set_backward(TensorOp::Neg);
+
+    return __k;
+}
+
+
+template <class T>
+inline
+Tensor<T>
+operator* (const Tensor<T>& x, const Tensor<T>& y) {
+    Tensor<T> __k = broadcast_map(ElementwiseOp::Mul, x, y);
+
+    __k.add_child(x);
+    __k.add_child(y);
+
+    __k.set_backward(TensorOp::Mul);
+
+    return __k;
+}
+
+template <class T>
+inline
+Tensor<T>
+operator* (const Tensor<T>& x, const typename Tensor<T>::value_type& y) {
+    Tensor<T> __k(x.shape());
+    kernel::scalar(ElementwiseOp::Mul, x.shape(), __k.data(), x.data(), x.strides(), y);
+
+    __k.add_child(x);
+
+    __k.set_backward(TensorOp::MulConst, y);
+
+    return __k;
+}
+
+template <class T>
+inline
+Tensor<T>
+operator* (const typename Tensor<T>::value_type& x, const Tensor<T>& y) {
+    return y * x;
+}
+
+
+template <class T>
+inline
+Tensor<T>
+operator/ (const Tensor<T>& x, const Tensor<T>& y) {
+    Tensor<T> __k = broadcast_map(ElementwiseOp::Div, x, y);
+
+    __k.add_child(x);
+    __k.add_child(y);
+
+    __k.set_backward(TensorOp::Div);
+
+    return __k;
+}
+
+template <class T>
+inline
+Tensor<T>
+operator/ (const Tensor<T>& x, const typename Tensor<T>::value_type& y) {
+    Tensor<T> __k(x.shape());
+    kernel::scalar(ElementwiseOp::Div, x.shape(), __k.data(), x.data(), x.strides(), y);
+
+    __k.add_child(x);
+
+    __k.set_backward(TensorOp::DivConst, y);
+
+    return __k;
+}
+
+template <class T>
+inline
+Tensor<T>
+operator/ (const typename Tensor<T>::value_type& x, const Tensor<T>& y) {
+    Tensor<T> __k(y.shape());
+    kernel::scalar(ElementwiseOp::RDiv, y.shape(), __k.data(), y.data(), y.strides(), x);
+
+    __k.add_child(y);
+
+    __k.set_backward(TensorOp::RDivConst, x);
+
+    return __k;
+}
+
+
+template <class T>
+inline
+Tensor<T>
+operator- (const Tensor<T>& x) {
+    Tensor<T> __k(x.shape());
+    kernel::unary(ElementwiseOp::Neg, x.shape(), __k.data(), x.data(), x.strides());
+
+    __k.add_child(x);
+
+    __k.set_backward(TensorOp::Neg);
+
+    return __k;
+}
+
+
+// pow of complex tensors is not provided, as for Value
+template <class T>
+inline
+Tensor<T>
+pow(const Tensor<T>& x, const typename Tensor<T>::value_type& y) {
+    static_assert(!is_complex_v<T>, "pow of complex tensors is not differentiable here");
+    Tensor<T> __k(x.shape());
+    // squares and reciprocals run in the elementwise kernels, as x * x
+    // and 1 / x. these round once, where std::pow may be an ulp off.
+    // other exponents stay on std::pow: a vector pow is a polynomial
+    // approximation of its own, which can't give the scalar loop's
+    // results bit for bit the way every elementwise kernel does
+    if (y == T(2)) {
+        kernel::unary(ElementwiseOp::Square, x.shape(), __k.data(), x.data(), x.strides());
+    } else if (y == T(-1)) {
+        kernel::scalar(ElementwiseOp::RDiv, x.shape(), __k.data(), x.data(), x.strides(), T(1));
+    } else {
+        Shape os = contiguous_strides(x.shape());
+        T* out = __k.data();
+        const T* a = x.data();
+        kernel::elements<2>(x.shape(), {&os, &x.strides()}, [&](size_t p, size_t q) {
+            out[p] = std::pow(a[q], y);
+        });
+    }
+
+    __k.add_child(x);
+
+    __k.set_backward(TensorOp::PowConst, y);
+
+    return __k;
+}
+
+
+template <class T>
+inline
+Tensor<T>
+relu(const Tensor<T>& x) {
+    Tensor<T> __k(x.shape());
+    kernel::unary(ElementwiseOp::Relu, x.shape(), __k.data(), x.data(), x.strides());
+
+    __k.add_child(x);
+
+    __k.set_backward(TensorOp::Relu);
+
+    return __k;
+}
+
+
+// the sum of all elements, as a tensor of no dimensions
+template <class T>
+inline
+Tensor<T>
+sum(const Tensor<T>& x) {
+    Tensor<T> __k;
+    T total = T(0);
+    const T* a = x.data();
+    kernel::elements<1>(x.shape(), {&x.strides()}, [&](size_t i) {
+        total += a[i];
+    });
+    __k.data()[0] = total;
+
+    __k.add_child(x);
+
+    __k.set_backward(TensorOp::Sum);
+
+    return __k;
+}
+
+
+// the product of an m x k and a k x n matrix. either may be a view,
+// such as a transpose, which gemm reads along its strides
+template <class T>
+inline
+Tensor<T>
+matmul(const Tensor<T>& x, const Tensor<T>& y) {
+    if (x.dim() != 2 || y.dim() != 2 || x.shape()[1] != y.shape()[0]) {
+        throw std::invalid_argument("matmul needs an m x k and a k x n matrix");
+    }
+    size_t m = x.shape()[0], k = x.shape()[1], n = y.shape()[1];
+    Tensor<T> __k({m, n});
+    gemm(m, n, k, x.data(), x.strides()[0], x.strides()[1], y.data(), y.strides()[0], y.strides()[1],
+         __k.data(), n);
+
+    __k.add_child(x);
+    __k.add_child(y);
+
+    __k.set_backward(TensorOp::MatMul);
+
+    return __k;
+}
+
+
+// x w + b for a batch of rows x, batch x nin, weights w, nin x nout,
+// and a bias b of nout, followed by a relu with nonlin. the bias and
+// the relu are applied to every tile of the product as gemm completes
+// it, rather than in passes of their own. the relu keeps which elements
+// it passed, by their sign before it, so that its gradient at zero is
+// that of relu()
+template <class T>
+inline
+Tensor<T>
+linear(const Tensor<T>& x, const Tensor<T>& w, const Tensor<T>& b, bool nonlin = false) {
+    if (x.dim() != 2 || w.dim() != 2 || b.dim() != 1 || x.shape()[1] != w.shape()[0] ||
+        b.shape()[0] != w.shape()[1]) {
+        throw std::invalid_argument("linear needs a batch x nin input, nin x nout weights and nout biases");
+    }
+    size_t batch = x.shape()[0], nin = x.shape()[1], nout = w.shape()[1];
+    Tensor<T> __k({batch, nout});
+    const T* bias = b.data();
+    size_t bs = b.strides()[0];
+    std::vector<unsigned char> mask(nonlin ? batch * nout : 0);
+    unsigned char* mk = mask.data();
+    gemm(batch, nout, nin, x.data(), x.strides()[0], x.strides()[1], w.data(), w.strides()[0],
+         w.strides()[1], __k.data(), nout, false, gemm_kernel<T>(),
+         [bias, bs, nonlin, mk, nout](size_t i, size_t j, T* c, size_t rows, size_t cols, size_t ldc) {
+             for (size_t r = 0; r < rows; ++r) {
+                 T* row = c + r * ldc;
+                 for (size_t q = 0; q < cols; ++q) {
+                     T v = row[q] + bias[(j + q) * bs];
+                     if (nonlin) {
+                         mk[(i + r) * nout + j + q] = kernel::relu_mask(v);
+                         v = kernel::relu(v);
+                     }
+                     row[q] = v;
+                 }
+             }
+         });
+
+    __k.add_child(x);
+    __k.add_child(w);
+    __k.add_child(b);
+
+    if (nonlin) {
+        __k.set_backward(TensorOp::LinearRelu, std::move(mask));
+    } else {
+        __k.set_backward(TensorOp::Linear);
+    }
+
+    return __k;
+}
+
+}  // namespace ptMgrad
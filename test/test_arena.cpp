@@ -0,0 +1,215 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/arena.h"
+#include "../src/graph.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+TEST(ValueTest, ArenaAllocateAndReset) {
+    Arena arena(256);
+
+    void* p = arena.allocate(16, 8);
+    void* q = arena.allocate(16, 8);
+    EXPECT_NE(p, q);
+    EXPECT_EQ(arena.bytes_used(), 32u);
+    EXPECT_EQ(arena.num_blocks(), 1u);
+
+    // larger than a block
+    arena.allocate(1024, 16);
+    EXPECT_EQ(arena.num_blocks(), 2u);
+
+    arena.reset();
+    EXPECT_EQ(arena.bytes_used(), 0u);
+    EXPECT_EQ(arena.allocate(16, 8), p);
+}
+
+
+TEST(ValueTest, ArenaScopeRestoresPrevious) {
+    Arena outer;
+    Arena inner;
+
+    EXPECT_EQ(Arena::current(), nullptr);
+    {
+        ArenaScope a(outer);
+        EXPECT_EQ(Arena::current(), &outer);
+        {
+            ArenaScope b(inner);
+            EXPECT_EQ(Arena::current(), &inner);
+        }
+        EXPECT_EQ(Arena::current(), &outer);
+    }
+    EXPECT_EQ(Arena::current(), nullptr);
+}
+
+
+#define TEST_ARENA_GRAPH(TYPE, NAME)                                   \
+    TEST(ValueTest, Arena##NAME##Graph) {                              \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+        Value<TYPE> c = 4.0;                                           \
+                                                                       \
+        Value<TYPE> e = a * b + c - a / b;                             \
+        e.backward();                                                  \
+        TYPE ga = a.gradX(), gb = b.gradX(), gc = c.gradX();           \
+        a.zero_grad();                                                 \
+        b.zero_grad();                                                 \
+        c.zero_grad();                                                 \
+                                                                       \
+        Arena arena;                                                   \
+        {                                                              \
+            ArenaScope scope(arena);                                   \
+            Value<TYPE> f = a * b + c - a / b;                         \
+            f.backward();                                              \
+            EXPECT_EQ(f.dataX(), e.dataX());                           \
+            EXPECT_GT(arena.bytes_used(), 0u);                         \
+        }                                                              \
+        EXPECT_EQ(arena.bytes_used(), 0u);                             \
+        EXPECT_EQ(a.gradX(), ga);                                      \
+        EXPECT_EQ(b.gradX(), gb);                                      \
+        EXPECT_EQ(c.gradX(), gc);                                      \
+    }
+
+TEST_ARENA_GRAPH(float, Float)
+TEST_ARENA_GRAPH(double, Double)
+TEST_ARENA_GRAPH(ptMgrad::complex<float>, ComplexFloat)
+TEST_ARENA_GRAPH(ptMgrad::complex<double>, ComplexDouble)
+
+
+TEST(ValueTest, ArenaSteadyStateTraining) {
+    Value<double> w = 0.5;
+    Value<double> b = 0.0;
+    Arena arena(1024);
+    size_t blocks = 0;
+    double first = 0.0, last = 0.0;
+
+    for (int step = 0; step < 20; ++step) {
+        ArenaScope scope(arena);
+
+        Value<double> loss(0.0);
+        for (int i = 0; i < 16; ++i) {
+            Value<double> x = double(i) / 16.0;
+            Value<double> pred = relu(w * x + b);
+            loss = loss + pow(pred - Value<double>(2.0 * x.dataX()), 2.0);
+        }
+        loss = loss * (1.0 / 16.0);
+
+        w.zero_grad();
+        b.zero_grad();
+        loss.backward();
+
+        // assigning to a parameter keeps it out of the arena
+        w = w.dataX() - 0.1 * w.gradX();
+        b = b.dataX() - 0.1 * b.gradX();
+
+        if (step == 0) {
+            blocks = arena.num_blocks();
+            first = loss.dataX();
+        }
+        EXPECT_EQ(arena.num_blocks(), blocks);
+        last = loss.dataX();
+    }
+
+    EXPECT_LT(last, first);
+    EXPECT_GT(w.dataX(), 0.5);
+}
+
+
+// Value is a handle to a node, but copies keep value semantics: like
+// assignment, compound assignment points the handle at a new leaf
+TEST(ValueTest, ArenaCompoundAssignKeepsCopies) {
+    Value<double> a = 2.0;
+    Value<double> b = a;
+    b += 1.0;
+    EXPECT_EQ(a.dataX(), 2.0);
+    EXPECT_EQ(b.dataX(), 3.0);
+
+    Value<double> c = a;
+    c *= b;
+    c -= 1.0;
+    c /= Value<double>(5.0);
+    EXPECT_EQ(a.dataX(), 2.0);
+    EXPECT_EQ(c.dataX(), 1.0);
+
+    // and in place on itself
+    c += c;
+    EXPECT_EQ(c.dataX(), 2.0);
+
+    // parameters updated inside an arena scope stay on the heap
+    Arena arena;
+    {
+        ArenaScope scope(arena);
+        Value<double> loss = a * a;
+        loss.backward();
+        a -= 0.25 * a.gradX();
+    }
+    EXPECT_EQ(a.dataX(), 1.0);
+    EXPECT_EQ((a * 3.0).dataX(), 3.0);
+}
+
+
+// a cast node keeps its source alive: an operand of another type may
+// be a temporary, gone before backward or a replay reads it
+TEST(ValueTest, ArenaCastKeepsSource) {
+    Value<double> a = 2.0;
+    Value<double> r = a + Value<float>(3.0f);
+    r.backward();
+    EXPECT_EQ(a.gradX(), 1.0);
+
+    Value<double> e = a * Value<float>(3.0f);
+    Graph<double> graph(e);
+    a.set_data(4.0);
+    GradGeneration::advance();
+    graph.replay();
+    EXPECT_EQ(e.dataX(), 12.0);
+    EXPECT_EQ(a.gradX(), 3.0);
+}
+
+
+// an update step that builds on the parameter leaves it a heap leaf,
+// and the graph built on the old leaf keeps it alive until the reset
+TEST(ValueTest, ArenaAssignKeepsParameterOnHeap) {
+    Value<double> w = 1.0;
+    Arena arena;
+    for (int step = 0; step < 3; ++step) {
+        ArenaScope scope(arena);
+        Value<double> loss = w * w;
+        loss.backward(true);
+        w = w - Value<double>(0.25 * w.gradX());
+        w.zero_grad();
+        // a second backward still reads the old leaf
+        loss.backward();
+    }
+    EXPECT_EQ(w.dataX(), 0.125);
+    EXPECT_EQ(w.gradX(), 0.0);
+    EXPECT_EQ(arena.bytes_used(), 0u);
+
+    Value<double> y = w * 4.0;
+    y.backward();
+    EXPECT_EQ(y.dataX(), 0.5);
+    EXPECT_EQ(w.gradX(), 4.0);
+}
+
+
+TEST(ValueTest, ArenaReassignKeepsOperand) {
+    Value<double> w = 2.0;
+    Arena arena;
+    {
+        ArenaScope scope(arena);
+        Value<double> y = w * 3.0;
+        Value<double> z = y + Value<float>(1.0f);
+        w = Value<double>(5.0);
+        z.backward();
+        EXPECT_EQ(z.dataX(), 7.0);
+        EXPECT_EQ(w.dataX(), 5.0);
+        // the gradient went to the old leaf
+        EXPECT_EQ(w.gradX(), 0.0);
+    }
+    EXPECT_EQ(w.dataX(), 5.0);
+    EXPECT_EQ((w * 2.0).dataX(), 10.0);
+}
@@ -0,0 +1,317 @@
+#include <iostream>
+#include <cstdlib>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/checkpoint.h"
+#include "../src/graph.h"
+#include "../src/arena.h"
+#include "../src/parallel.h"
+#include "../src/jit.h"
+#include "../src/nn.h"
+
+
+using namespace ptMgrad;
+
+
+// the same value and gradients as the plain ops, for the inputs and
+// for a Value the function reads besides them
+#define TEST_VALUE_CHECKPOINT(TYPE, NAME)                                  \
+    TEST(ValueTest, Checkpoint##NAME) {                                    \
+        Value<TYPE> w = 3.0;                                               \
+        Value<TYPE> x = -2.0;                                              \
+        auto fn = [&](const std::vector<Value<TYPE>>& in) {                \
+            return relu(in[0] * w + in[0] * in[0]) * in[0];                \
+        };                                                                 \
+                                                                           \
+        Value<TYPE> e = fn({x}) * w;                                       \
+        e.backward();                                                      \
+        TYPE gw = w.gradX(), gx = x.gradX();                               \
+        w.zero_grad();                                                     \
+        x.zero_grad();                                                     \
+                                                                           \
+        Value<TYPE> f = checkpoint(fn, std::vector<Value<TYPE>>{x}) * w;   \
+        f.backward();                                                      \
+        EXPECT_EQ(f.dataX(), e.dataX());                                   \
+        EXPECT_EQ(w.gradX(), gw);                                          \
+        EXPECT_EQ(x.gradX(), gx);                                          \
+    }
+
+TEST_VALUE_CHECKPOINT(float, Float)
+TEST_VALUE_CHECKPOINT(double, Double)
+TEST_VALUE_CHECKPOINT(int, Int)
+
+
+TEST(ValueTest, CheckpointComplex) {
+    using C = complex<double>;
+    Value<C> a(C(1.0, 2.0));
+
+    Value<C> b = checkpoint([](const std::vector<Value<C>>& in) {
+        return in[0] * in[0];
+    }, std::vector<Value<C>>{a});
+    b.backward();
+
+    EXPECT_EQ(b.dataX().real(), -3.0);
+    EXPECT_EQ(b.dataX().imag(), 4.0);
+    EXPECT_EQ(a.gradX().real(), 2.0);
+    EXPECT_EQ(a.gradX().imag(), 4.0);
+}
+
+
+// the graph of the segment is not kept: one node for it and one for
+// each output
+TEST(ValueTest, CheckpointKeepsOutputsOnly) {
+    Value<double> a = 2.0;
+    auto fn = [](const std::vector<Value<double>>& in) {
+        Value<double> h = in[0];
+        for (int i = 0; i < 10; ++i) {
+            h = h * 1.5 + in[0];
+        }
+        return h;
+    };
+
+    EXPECT_EQ(Graph<double>(fn({a})).size(), 20u);
+    EXPECT_EQ(Graph<double>(checkpoint(fn, std::vector<Value<double>>{a})).size(), 2u);
+}
+
+
+// an output that backward never reaches passes nothing on
+TEST(ValueTest, CheckpointOutputs) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+
+    std::vector<Value<double>> out = checkpoint([](const std::vector<Value<double>>& in) {
+        return std::vector<Value<double>>{in[0] * in[1], in[0] + in[1], in[1]};
+    }, std::vector<Value<double>>{a, b});
+    ASSERT_EQ(out.size(), 3u);
+    EXPECT_EQ(out[0].dataX(), 6.0);
+    EXPECT_EQ(out[1].dataX(), 5.0);
+    EXPECT_EQ(out[2].dataX(), 3.0);
+
+    Value<double> e = out[0] * 2.0 + out[2];
+    e.backward();
+    EXPECT_EQ(a.gradX(), 6.0);
+    EXPECT_EQ(b.gradX(), 5.0);
+
+    // the segment freed its graph; backward through the other output
+    // throws
+    EXPECT_THROW(out[1].backward(), std::logic_error);
+    EXPECT_EQ(a.gradX(), 6.0);
+}
+
+
+// the sequential loss of model.cpp, with every sample checkpointed
+TEST(ValueTest, CheckpointLoss) {
+    std::srand(7);
+    MLP<double> model(3, {8, 8, 1});
+    std::vector<std::vector<double>> xs = {{1.0, -0.5, 0.25}, {0.5, 2.0, -1.0}, {-1.5, 0.5, 1.0}};
+    std::vector<double> ys = {1.0, -1.0, 0.5};
+
+    auto sample = [&](size_t i) {
+        return [&, i](const std::vector<Value<double>>& x) {
+            Value<double> diff = model(x)[0] - ys[i];
+            return diff * diff;
+        };
+    };
+    auto inputs = [&](size_t i) {
+        return std::vector<Value<double>>(xs[i].begin(), xs[i].end());
+    };
+
+    Value<double> plain = 0.0;
+    for (size_t i = 0; i < xs.size(); ++i) {
+        plain = plain + sample(i)(inputs(i));
+    }
+    plain.backward();
+    std::vector<double> grads;
+    for (auto* p : model.parameters()) {
+        grads.push_back(p->gradX());
+    }
+    model.zero_grad();
+
+    Value<double> loss = 0.0;
+    for (size_t i = 0; i < xs.size(); ++i) {
+        loss = loss + checkpoint(sample(i), inputs(i));
+    }
+    loss.backward();
+
+    EXPECT_EQ(loss.dataX(), plain.dataX());
+    std::vector<Value<double>*> params = model.parameters();
+    for (size_t i = 0; i < params.size(); ++i) {
+        EXPECT_EQ(params[i]->gradX(), grads[i]);
+    }
+}
+
+
+TEST(ValueTest, CheckpointRetainGraph) {
+    Value<double> a = 3.0;
+    Value<double> b = checkpoint([](const std::vector<Value<double>>& in) {
+        return in[0] * in[0];
+    }, std::vector<Value<double>>{a});
+
+    b.backward(true);
+    b.backward(true);
+    EXPECT_EQ(a.gradX(), 12.0);
+}
+
+
+// a Value the function reads besides its inputs gets its gradient
+// from a backward restricted to it
+TEST(ValueTest, CheckpointBackwardInputs) {
+    Value<double> w = 2.0;
+    Value<double> x = 3.0;
+    auto fn = [&](const std::vector<Value<double>>& in) {
+        return in[0] * w;
+    };
+
+    Value<double> f = checkpoint(fn, std::vector<Value<double>>{x}) * 1.0;
+    f.backward({&w});
+    EXPECT_EQ(w.gradX(), 3.0);
+}
+
+
+TEST(ValueTest, CheckpointGraphReplay) {
+    Value<double> w = 2.0;
+    Value<double> x = 3.0;
+
+    Value<double> e = checkpoint([&](const std::vector<Value<double>>& in) {
+        return pow(w * in[0] - 1.0, 2.0);
+    }, std::vector<Value<double>>{x});
+    Graph<double> graph(e);
+
+    w.set_data(1.0);
+    graph.replay();
+    EXPECT_EQ(e.dataX(), 4.0);
+    EXPECT_EQ(w.gradX(), 12.0);
+    EXPECT_EQ(x.gradX(), 4.0);
+}
+
+
+TEST(ValueTest, CheckpointTape) {
+    Value<double> a = 2.0;
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+
+    Value<double> b = checkpoint([](const std::vector<Value<double>>& in) {
+        return in[0] * in[0] * in[0];
+    }, std::vector<Value<double>>{a});
+    Value<double> c = b + a;
+    c.backward(tape);
+
+    EXPECT_EQ(tape.size(), 3u);
+    EXPECT_EQ(a.gradX(), 13.0);
+}
+
+
+TEST(ValueTest, CheckpointParallel) {
+    ThreadPool pool(4);
+    Value<double> w = 0.5;
+
+    std::vector<Value<double>> terms;
+    for (int i = 0; i < 300; ++i) {
+        terms.push_back(checkpoint([&](const std::vector<Value<double>>& in) {
+            return in[0] * w * w;
+        }, std::vector<Value<double>>{Value<double>(double(i % 3))}));
+    }
+    Value<double> loss = sum(terms);
+    loss.backward(pool);
+
+    // d/dw of sum x w^2 = 2 w sum x, with 100 each of 0, 1 and 2
+    EXPECT_EQ(w.gradX(), 300.0);
+}
+
+
+TEST(ValueTest, CheckpointInArena) {
+    Value<double> a = 2.0;
+    Arena arena;
+    for (int step = 0; step < 3; ++step) {
+        ArenaScope scope(arena);
+        Value<double> e = checkpoint([](const std::vector<Value<double>>& in) {
+            return in[0] * in[0] + 1.0;
+        }, std::vector<Value<double>>{a});
+        e.backward();
+    }
+    EXPECT_EQ(a.gradX(), 12.0);
+}
+
+
+TEST(ValueTest, CheckpointNoGrad) {
+    Value<double> a = 2.0;
+
+    NoGradGuard no_grad;
+    Value<double> e = checkpoint([](const std::vector<Value<double>>& in) {
+        return in[0] * in[0];
+    }, std::vector<Value<double>>{a});
+    e.backward();
+
+    EXPECT_EQ(e.dataX(), 4.0);
+    EXPECT_EQ(a.gradX(), 0.0);
+}
+
+
+// the layers of an MLP under budgets from everything kept down to
+// nothing kept, with the gradients of the plain model every time
+TEST(ValueTest, Checkpointed) {
+    std::srand(11);
+    MLP<double> model(4, {16, 16, 16, 16, 1});
+    std::vector<Value<double>> x = {0.5, -1.0, 2.0, 0.25};
+
+    Value<double> plain = model(x)[0];
+    plain.backward();
+    std::vector<double> grads;
+    for (auto* p : model.parameters()) {
+        grads.push_back(p->gradX());
+    }
+
+    std::vector<Stage<double>> stages;
+    for (size_t i = 0; i < model.num_layers(); ++i) {
+        stages.push_back([&model, i](const std::vector<Value<double>>& in) {
+            return model.layer(i)(in);
+        });
+    }
+
+    size_t kept = 0;
+    for (size_t budget : {size_t(1) << 30, size_t(20000), size_t(10000), size_t(0)}) {
+        model.zero_grad();
+        Checkpointed<double> run(stages, budget);
+        Value<double> out = run(x)[0];
+        out.backward();
+
+        // hidden units sum their gradients in another order
+        EXPECT_EQ(out.dataX(), plain.dataX());
+        std::vector<Value<double>*> params = model.parameters();
+        for (size_t i = 0; i < params.size(); ++i) {
+            EXPECT_NEAR(params[i]->gradX(), grads[i], 1e-12 * (1.0 + std::abs(grads[i])));
+        }
+
+        size_t n_checkpointed = 0, n_stages = 0;
+        for (const auto& s : run.segments()) {
+            n_checkpointed += s.checkpointed;
+            n_stages += s.end - s.begin;
+        }
+        EXPECT_EQ(n_stages, model.num_layers());
+        if (budget == size_t(1) << 30) {
+            EXPECT_EQ(n_checkpointed, 0u);
+            kept = run.peak_bytes();
+        } else if (budget > 0) {
+            EXPECT_GT(n_checkpointed, 0u);
+            EXPECT_LE(run.peak_bytes(), budget);
+            EXPECT_LT(run.peak_bytes(), kept);
+        } else {
+            EXPECT_EQ(n_checkpointed, run.segments().size());
+        }
+    }
+}
+
+
+TEST(ValueTest, JitRejectsCheckpoint) {
+    Value<double> a = 2.0;
+    Value<double> e = checkpoint([](const std::vector<Value<double>>& in) {
+        return in[0] * in[0];
+    }, std::vector<Value<double>>{a});
+    Graph<double> graph(e);
+
+    JitOptions options;
+    options.cache_dir = ::testing::TempDir() + "ptmgrad_jit_checkpoint";
+    EXPECT_THROW(Compiled<double>(graph, options), std::invalid_argument);
+}
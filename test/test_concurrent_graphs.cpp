@@ -0,0 +1,137 @@
+#include <iostream>
+#include <cstdlib>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/parallel.h"
+#include "../src/nn.h"
+
+
+using namespace ptMgrad;
+
+
+// sample i is sum over j of w[j] * x_ij, squared; the weights are
+// shared by every sample
+template <typename T>
+static T sample_loss(std::vector<Value<T>>& w, size_t i) {
+    Value<T> act = T(0.0);
+    for (size_t j = 0; j < w.size(); ++j) {
+        act = act + w[j] * T(int((i + j) % 4) - 1);
+    }
+    Value<T> loss = act * act;
+    loss.backward();
+    return loss.dataX();
+}
+
+
+#define TEST_CONCURRENT_GRAPHS(TYPE, NAME)                                 \
+    TEST(ValueTest, ConcurrentGraphs##NAME) {                              \
+        ThreadPool pool(4);                                                \
+        const size_t batch = 200, nw = 8;                                  \
+                                                                           \
+        std::vector<Value<TYPE>> w1, w2;                                   \
+        for (size_t j = 0; j < nw; ++j) {                                  \
+            w1.push_back(Value<TYPE>(TYPE(int(j % 3) - 1)));               \
+            w2.push_back(Value<TYPE>(TYPE(int(j % 3) - 1)));               \
+        }                                                                  \
+                                                                           \
+        std::vector<TYPE> loss1(batch), loss2(batch);                      \
+        for (size_t i = 0; i < batch; ++i) {                               \
+            loss1[i] = sample_loss(w1, i);                                 \
+        }                                                                  \
+        for_each_sample(pool, batch, [&](size_t i) {                       \
+            loss2[i] = sample_loss(w2, i);                                 \
+        });                                                                \
+                                                                           \
+        for (size_t i = 0; i < batch; ++i) {                               \
+            EXPECT_EQ(loss2[i], loss1[i]);                                 \
+        }                                                                  \
+        for (size_t j = 0; j < nw; ++j) {                                  \
+            EXPECT_EQ(w2[j].gradX(), w1[j].gradX());                       \
+        }                                                                  \
+    }
+
+TEST_CONCURRENT_GRAPHS(float, Float)
+TEST_CONCURRENT_GRAPHS(double, Double)
+TEST_CONCURRENT_GRAPHS(int, Int)
+
+
+// a mini-batch through the MLP of nn.h, forward and backward of every
+// sample on the pool, against the same batch run one sample at a time
+TEST(ValueTest, ConcurrentGraphsMLP) {
+    ThreadPool pool(4);
+    const size_t batch = 64;
+
+    std::srand(7);
+    MLP<double> serial(3, {8, 8, 1});
+    std::srand(7);
+    MLP<double> parallel(3, {8, 8, 1});
+
+    std::vector<std::vector<Value<double>>> xs;
+    for (size_t i = 0; i < batch; ++i) {
+        xs.push_back({0.1 * double(i % 5), -0.2 * double(i % 3), 0.05 * double(i)});
+    }
+    auto loss_of = [&](MLP<double>& model, size_t i) {
+        Value<double> diff = model(xs[i])[0] - double(i % 2);
+        Value<double> loss = diff * diff;
+        loss.backward();
+        return loss.dataX();
+    };
+
+    std::vector<double> loss1(batch), loss2(batch);
+    for (size_t i = 0; i < batch; ++i) {
+        loss1[i] = loss_of(serial, i);
+    }
+    for_each_sample(pool, batch, [&](size_t i) {
+        loss2[i] = loss_of(parallel, i);
+    });
+
+    for (size_t i = 0; i < batch; ++i) {
+        EXPECT_EQ(loss2[i], loss1[i]);
+    }
+    std::vector<Value<double>*> p1 = serial.parameters(), p2 = parallel.parameters();
+    ASSERT_EQ(p1.size(), p2.size());
+    for (size_t j = 0; j < p1.size(); ++j) {
+        EXPECT_NEAR(p2[j]->gradX(), p1[j]->gradX(), 1e-12 + 1e-9 * std::abs(p1[j]->gradX()));
+    }
+}
+
+
+// graphs on the heap, with handles to the shared leaves copied around
+// on every thread, so that their reference counts are hit concurrently
+TEST(ValueTest, ConcurrentGraphsOnHeap) {
+    ThreadPool pool(4);
+    Value<double> w = 2.0;
+    Value<double> b = 1.0;
+
+    pool.run(400, [&](size_t i) {
+        GradLock::Scope locked;
+        Value<double> wi = w;
+        Value<double> e = wi * double(i % 3) + b;
+        Value<double> f = e + w;
+        f.backward();
+    });
+
+    // i % 3 sums to 399 over the batch
+    EXPECT_EQ(w.gradX(), 399.0 + 400.0);
+    EXPECT_EQ(b.gradX(), 400.0);
+    EXPECT_EQ(w.dataX(), 2.0);
+}
+
+
+// predictions only: no graph at all, NoGradGuard is per thread
+TEST(ValueTest, ConcurrentGraphsNoGrad) {
+    ThreadPool pool(4);
+    Value<double> w = 3.0;
+
+    std::vector<double> out(100);
+    for_each_sample(pool, out.size(), [&](size_t i) {
+        NoGradGuard no_grad;
+        out[i] = (w * double(i)).dataX();
+    });
+    for (size_t i = 0; i < out.size(); ++i) {
+        EXPECT_EQ(out[i], 3.0 * double(i));
+    }
+    EXPECT_FALSE(NoGradGuard::enabled());
+}
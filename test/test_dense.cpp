@@ -0,0 +1,191 @@
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/nn.h"
+#include "../src/tensor.h"
+
+
+using namespace ptMgrad;
+
+
+template <typename T>
+static std::vector<T> random_matrix(size_t n) {
+    std::vector<T> v(n);
+    for (auto& x : v) {
+        x = T(std::rand()) / T(RAND_MAX) * T(2) - T(1);
+    }
+    return v;
+}
+
+
+// a DenseMLP and an MLP made after the same srand have the same
+// weights, and a batch through the first gives the outputs, and the
+// sums of the gradients, of its samples one by one through the second
+#define TEST_DENSE_MLP(TYPE, NAME, TOL)                                          \
+    TEST(ValueTest, DenseMLP##NAME) {                                            \
+        size_t nin = 7, batch = 37;                                              \
+        std::srand(4);                                                           \
+        MLP<TYPE> mlp(int(nin), {16, 33, 3});                                    \
+        std::srand(4);                                                           \
+        DenseMLP<TYPE> dense(nin, {16, 33, 3});                                  \
+        std::vector<TYPE> xs = random_matrix<TYPE>(batch * nin);                 \
+                                                                                 \
+        Value<TYPE> total = 0.0;                                                 \
+        std::vector<std::vector<Value<TYPE>>> outs;                              \
+        for (size_t r = 0; r < batch; ++r) {                                     \
+            std::vector<Value<TYPE>> x(xs.begin() + r * nin,                     \
+                                       xs.begin() + (r + 1) * nin);              \
+            outs.push_back(mlp(x));                                              \
+            for (auto& o : outs.back()) {                                        \
+                total = total + o * o;                                           \
+            }                                                                    \
+        }                                                                        \
+        total.backward(true);                                                    \
+                                                                                 \
+        Tensor<TYPE> y = dense(Tensor<TYPE>({batch, nin}, xs));                  \
+        ASSERT_EQ(y.shape(), Shape({batch, 3}));                                 \
+        for (size_t r = 0; r < batch; ++r) {                                     \
+            for (size_t j = 0; j < 3; ++j) {                                     \
+                EXPECT_NEAR(y.at({r, j}), outs[r][j].dataX(), TOL);              \
+            }                                                                    \
+        }                                                                        \
+        Tensor<TYPE> e = sum(y * y);                                             \
+        EXPECT_EQ(e.graph_size(), 12u);                                          \
+        e.backward();                                                            \
+        EXPECT_NEAR(e.item(), total.dataX(), TOL * std::abs(total.dataX()));     \
+                                                                                 \
+        /* the parameters of an MLP are, neuron by neuron, its weights */        \
+        /* and then its bias */                                                  \
+        std::vector<Value<TYPE>*> params = mlp.parameters();                     \
+        size_t p = 0;                                                            \
+        for (size_t l = 0; l < dense.num_layers(); ++l) {                        \
+            Tensor<TYPE> gw = dense.layer(l).parameters()[0]->grad();            \
+            Tensor<TYPE> gb = dense.layer(l).parameters()[1]->grad();            \
+            for (size_t j = 0; j < gw.shape()[1]; ++j) {                         \
+                for (size_t i = 0; i < gw.shape()[0]; ++i) {                     \
+                    TYPE v = params[p++]->gradX();                               \
+                    EXPECT_NEAR(gw.at({i, j}), v, TOL * (1 + std::abs(v)));      \
+                }                                                                \
+                TYPE v = params[p++]->gradX();                                   \
+                EXPECT_NEAR(gb.at({j}), v, TOL * (1 + std::abs(v)));             \
+            }                                                                    \
+        }                                                                        \
+        EXPECT_EQ(p, params.size());                                             \
+    }
+
+TEST_DENSE_MLP(float, Float, 1e-4)
+TEST_DENSE_MLP(double, Double, 1e-11)
+
+
+// the input's gradient too, through a layer without a relu and one
+// with, against the same layer built from matmul and the elementwise
+// ops
+TEST(ValueTest, DenseLinear) {
+    std::srand(5);
+    size_t batch = 21, nin = 19, nout = 13;
+    Tensor<double> x({batch, nin}, random_matrix<double>(batch * nin));
+    Tensor<double> w({nin, nout}, random_matrix<double>(nin * nout));
+    Tensor<double> bias = Tensor<double>({nout}, random_matrix<double>(nout));
+    Tensor<double> ones({batch, 1}, 1.0);
+    ones.set_requires_grad(false);
+
+    for (bool nonlin : {false, true}) {
+        GradGeneration::advance();
+        Tensor<double> y = linear(x, w, bias, nonlin);
+        EXPECT_EQ(y.graph_size(), 4u);
+        Tensor<double> e = sum(y * y);
+        e.backward();
+        Tensor<double> gx = x.grad(), gw = w.grad(), gb = bias.grad();
+
+        // the bias as a 1 x nout matrix, added to every row by a matmul
+        GradGeneration::advance();
+        Tensor<double> brow({1, nout}, std::vector<double>(bias.data(), bias.data() + nout));
+        Tensor<double> z = matmul(x, w) + matmul(ones, brow);
+        Tensor<double> r = nonlin ? relu(z) : z;
+        Tensor<double> f = sum(r * r);
+        f.backward();
+
+        EXPECT_NEAR(e.item(), f.item(), 1e-10 * f.item());
+        for (size_t i = 0; i < batch * nout; ++i) {
+            EXPECT_NEAR(y.data()[i], r.data()[i], 1e-12);
+        }
+        for (size_t i = 0; i < batch * nin; ++i) {
+            EXPECT_NEAR(gx.data()[i], x.grad_data()[i], 1e-11);
+        }
+        for (size_t i = 0; i < nin * nout; ++i) {
+            EXPECT_NEAR(gw.data()[i], w.grad_data()[i], 1e-11);
+        }
+        for (size_t j = 0; j < nout; ++j) {
+            EXPECT_NEAR(gb.data()[j], brow.grad_data()[j], 1e-11);
+        }
+    }
+}
+
+
+TEST(ValueTest, DenseComplex) {
+    using C = complex<double>;
+    // (1 + i)(1 - i) - 2i + 0.5 - 3i = 2.5 - 5i, whose relu is 2.5
+    Tensor<C> x({1, 2}, std::vector<C>{C(1.0, 1.0), C(0.0, -2.0)});
+    Tensor<C> w({2, 1}, std::vector<C>{C(1.0, -1.0), C(1.0, 0.0)});
+    Tensor<C> b({1}, std::vector<C>{C(0.5, -3.0)});
+
+    Tensor<C> y = linear(x, w, b, true);
+    EXPECT_EQ(y.item().real(), 2.5);
+    EXPECT_EQ(y.item().imag(), 0.0);
+
+    // the relu passes the real part of the gradient and blocks the
+    // imaginary part
+    Tensor<C> e = sum(y * C(1.0, 1.0));
+    e.backward();
+    EXPECT_EQ(b.grad_data()[0].real(), 1.0);
+    EXPECT_EQ(b.grad_data()[0].imag(), 0.0);
+    EXPECT_EQ(w.grad_data()[0].real(), 1.0);
+    EXPECT_EQ(w.grad_data()[0].imag(), 1.0);
+    EXPECT_EQ(x.grad_data()[1].real(), 1.0);
+    EXPECT_EQ(x.grad_data()[1].imag(), 0.0);
+}
+
+
+// a relu at exactly zero passes the gradient, as relu() and the relu
+// of Values do, whether linear applies it or it follows linear
+TEST(ValueTest, DenseReluAtZero) {
+    Tensor<double> x({2, 2}, std::vector<double>{1.0, -1.0, 1.0, 2.0});
+    Tensor<double> w({2, 1}, 1.0);
+    Tensor<double> b({1}, 0.0);
+
+    Tensor<double> y = linear(x, w, b, true);
+    EXPECT_EQ(y.at({0, 0}), 0.0);
+    sum(y).backward();
+    Tensor<double> gw = w.grad(), gb = b.grad();
+
+    GradGeneration::advance();
+    sum(relu(linear(x, w, b))).backward();
+    EXPECT_EQ(gb.at({0}), 2.0);
+    EXPECT_EQ(gb.at({0}), b.grad().at({0}));
+    EXPECT_EQ(gw.at({0, 0}), w.grad().at({0, 0}));
+    EXPECT_EQ(gw.at({1, 0}), w.grad().at({1, 0}));
+
+    Value<double> v = 0.0;
+    relu(v).backward();
+    EXPECT_EQ(v.gradX(), 1.0);
+}
+
+
+TEST(ValueTest, DenseShapes) {
+    Tensor<double> x({4, 3});
+    Tensor<double> w({3, 2});
+    Tensor<double> b({2});
+    EXPECT_THROW(linear(x, Tensor<double>({2, 3}), b), std::invalid_argument);
+    EXPECT_THROW(linear(x, w, Tensor<double>({3})), std::invalid_argument);
+    EXPECT_THROW(linear(Tensor<double>({3}), w, b), std::invalid_argument);
+    EXPECT_EQ(linear(x, w, b).shape(), Shape({4, 2}));
+
+    DenseMLP<double> mlp(3, {5, 2});
+    EXPECT_EQ(mlp.parameters().size(), 4u);
+    EXPECT_EQ(mlp(x).shape(), Shape({4, 2}));
+}
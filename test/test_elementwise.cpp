@@ -0,0 +1,209 @@
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/elementwise.h"
+#include "../src/tensor.h"
+
+
+using namespace ptMgrad;
+
+
+// random values in [-2, 2), with a NaN, zeros of both signs, infinities
+// and the smallest normal and denormal numbers among them
+template <typename T>
+static std::vector<T> edge_values(size_t n) {
+    std::vector<T> v(n);
+    for (auto& x : v) {
+        x = T(std::rand()) / T(RAND_MAX) * T(4) - T(2);
+    }
+    std::vector<T> edges = {
+        std::numeric_limits<T>::quiet_NaN(), T(0), -T(0),
+        std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity(),
+        std::numeric_limits<T>::min(), -std::numeric_limits<T>::denorm_min(), T(1)};
+    for (size_t i = 0; i < n; ++i) {
+        if (std::rand() % 4 == 0) {
+            v[i] = edges[std::rand() % edges.size()];
+        }
+    }
+    return v;
+}
+
+template <typename T>
+static bool same_bits(const std::vector<T>& a, const std::vector<T>& b) {
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+
+// every op of every kernel the CPU runs, on lengths around the widths
+// of the vectors and from unaligned starts, gives the bits of the
+// scalar loop
+#define TEST_ELEMENTWISE(TYPE, NAME)                                             \
+    TEST(ValueTest, Elementwise##NAME) {                                         \
+        using O = ElementwiseOp;                                                 \
+        std::srand(7);                                                           \
+        std::vector<O> ops = {O::Add, O::Sub, O::Mul, O::Div, O::RSub,           \
+                              O::RDiv, O::Neg, O::Relu, O::Square};              \
+        std::vector<TYPE> scalars = {TYPE(1.5), TYPE(-0.0), TYPE(0),             \
+                                     std::numeric_limits<TYPE>::quiet_NaN()};    \
+        std::vector<size_t> sizes = {0, 1, 3, 7, 8, 15, 16, 17, 33, 100, 1000};  \
+        for (const auto& kern : elementwise_kernels<TYPE>()) {                   \
+            for (size_t n : sizes) {                                             \
+                /* one element past the start, which no vector is aligned to */  \
+                std::vector<TYPE> a = edge_values<TYPE>(n + 1);                  \
+                std::vector<TYPE> b = edge_values<TYPE>(n + 1);                  \
+                for (O op : ops) {                                               \
+                    std::vector<TYPE> out(n), ref(n);                            \
+                    kern.binary(op, n, out.data(), a.data() + 1, b.data() + 1);  \
+                    kernel::with_op(op, [&](auto o) {                            \
+                        for (size_t i = 0; i < n; ++i) {                         \
+                            ref[i] = kernel::apply<o.value>(a[i + 1], b[i + 1]); \
+                        }                                                        \
+                    });                                                          \
+                    EXPECT_TRUE(same_bits(out, ref)) << kern.name << " binary "  \
+                        << int(op) << " n " << n;                                \
+                                                                                 \
+                    for (TYPE s : scalars) {                                     \
+                        kern.scalar(op, n, out.data(), a.data() + 1, s);         \
+                        kernel::with_op(op, [&](auto o) {                        \
+                            for (size_t i = 0; i < n; ++i) {                     \
+                                ref[i] = kernel::apply<o.value>(a[i + 1], s);    \
+                            }                                                    \
+                        });                                                      \
+                        EXPECT_TRUE(same_bits(out, ref)) << kern.name            \
+                            << " scalar " << int(op) << " n " << n               \
+                            << " s " << s;                                       \
+                    }                                                            \
+                }                                                                \
+                                                                                 \
+                for (O op : {O::Neg, O::Relu, O::Square}) {                      \
+                    std::vector<TYPE> out(n), ref(n);                            \
+                    kern.unary(op, n, out.data(), a.data() + 1);                 \
+                    kernel::with_op(op, [&](auto o) {                            \
+                        for (size_t i = 0; i < n; ++i) {                         \
+                            ref[i] = kernel::apply<o.value>(a[i + 1], a[i + 1]); \
+                        }                                                        \
+                    });                                                          \
+                    EXPECT_TRUE(same_bits(out, ref)) << kern.name << " unary "   \
+                        << int(op) << " n " << n;                                \
+                }                                                                \
+            }                                                                    \
+        }                                                                        \
+    }
+
+TEST_ELEMENTWISE(float, Float)
+TEST_ELEMENTWISE(double, Double)
+
+
+// the ops of tensors, through the kernel picked for this CPU, give the
+// bits of the same expression on each element: with the operands
+// contiguous, with either one broadcast along a row, and with a
+// transpose, which goes through the strided loop
+#define TEST_ELEMENTWISE_TENSOR(TYPE, NAME)                                      \
+    TEST(ValueTest, ElementwiseTensor##NAME) {                                   \
+        std::srand(8);                                                           \
+        size_t m = 9, n = 37;                                                    \
+        std::vector<TYPE> xs = edge_values<TYPE>(m * n);                         \
+        std::vector<TYPE> ys = edge_values<TYPE>(m * n);                         \
+        std::vector<TYPE> rs = edge_values<TYPE>(n);                             \
+        Tensor<TYPE> x({m, n}, xs), y({m, n}, ys), r({n}, rs);                   \
+        TYPE s = TYPE(0.75);                                                     \
+                                                                                 \
+        /* f(k) of element k, which is in column k % n */                        \
+        auto check = [&](const Tensor<TYPE>& t, auto f, const char* what) {      \
+            std::vector<TYPE> ref(m * n);                                        \
+            for (size_t k = 0; k < m * n; ++k) {                                 \
+                ref[k] = f(k);                                                   \
+            }                                                                    \
+            std::vector<TYPE> out(t.data(), t.data() + m * n);                   \
+            EXPECT_TRUE(same_bits(out, ref)) << what;                            \
+        };                                                                       \
+                                                                                 \
+        check(x + y, [&](size_t k) { return xs[k] + ys[k]; }, "add");            \
+        check(x - y, [&](size_t k) { return xs[k] - ys[k]; }, "sub");            \
+        check(x * y, [&](size_t k) { return xs[k] * ys[k]; }, "mul");            \
+        check(x / y, [&](size_t k) { return xs[k] / ys[k]; }, "div");            \
+        check(x - r, [&](size_t k) { return xs[k] - rs[k % n]; }, "sub row");    \
+        check(r / x, [&](size_t k) { return rs[k % n] / xs[k]; }, "row div");    \
+        check(x - s, [&](size_t k) { return xs[k] - s; }, "sub s");              \
+        check(s - x, [&](size_t k) { return s - xs[k]; }, "s sub");              \
+        check(x * s, [&](size_t k) { return xs[k] * s; }, "mul s");              \
+        check(s / x, [&](size_t k) { return s / xs[k]; }, "s div");              \
+        check(-x, [&](size_t k) { return -xs[k]; }, "neg");                      \
+        check(relu(x),                                                           \
+              [&](size_t k) { return xs[k] < TYPE(0) ? TYPE(0) : xs[k]; },       \
+              "relu");                                                           \
+        check(pow(x, TYPE(2)),                                                   \
+              [&](size_t k) { return xs[k] * xs[k]; }, "square");                \
+        check(pow(x, TYPE(-1)),                                                  \
+              [&](size_t k) { return TYPE(1) / xs[k]; }, "reciprocal");          \
+        check(pow(x, TYPE(3)),                                                   \
+              [&](size_t k) { return std::pow(xs[k], TYPE(3)); }, "cube");       \
+                                                                                 \
+        /* x again, held column major */                                         \
+        Tensor<TYPE> xt({n, m});                                                 \
+        for (size_t k = 0; k < m * n; ++k) {                                     \
+            xt.data()[(k % n) * m + k / n] = xs[k];                              \
+        }                                                                        \
+        check(xt.transpose() * y,                                                \
+              [&](size_t k) { return xs[k] * ys[k]; }, "transpose mul");         \
+        check(xt.transpose().contiguous(),                                       \
+              [&](size_t k) { return xs[k]; }, "contiguous");                    \
+    }
+
+TEST_ELEMENTWISE_TENSOR(float, Float)
+TEST_ELEMENTWISE_TENSOR(double, Double)
+
+
+// s - x and s / x are single nodes, with the gradients of the same
+// expressions on Values
+TEST(ValueTest, ElementwiseReversedGrad) {
+    std::vector<double> xs = {0.5, -2.0, 4.0};
+    Tensor<double> x({3}, xs);
+    Tensor<double> e = sum((3.0 - x) * (2.0 / x));
+    EXPECT_EQ(e.graph_size(), 5u);
+    e.backward();
+
+    for (size_t i = 0; i < 3; ++i) {
+        Value<double> v = xs[i];
+        Value<double> f = (Value<double>(3.0) - v) * (Value<double>(2.0) / v);
+        f.backward();
+        EXPECT_NEAR(x.grad().at({i}), v.gradX(), 1e-12);
+    }
+}
+
+
+TEST(ValueTest, ElementwiseComplex) {
+    using C = complex<double>;
+    const ElementwiseKernel<C>& kern = elementwise_kernel<C>();
+    EXPECT_STREQ(kern.name, "portable");
+
+    std::vector<C> a = {C(1.0, 2.0), C(-3.0, 0.5)};
+    std::vector<C> b = {C(0.0, 1.0), C(2.0, -1.0)};
+    std::vector<C> out(2);
+
+    // (1 + 2i) i = -2 + i, (-3 + 0.5i)(2 - i) = -5.5 + 4i
+    kern.binary(ElementwiseOp::Mul, 2, out.data(), a.data(), b.data());
+    EXPECT_EQ(out[0].real(), -2.0);
+    EXPECT_EQ(out[0].imag(), 1.0);
+    EXPECT_EQ(out[1].real(), -5.5);
+    EXPECT_EQ(out[1].imag(), 4.0);
+
+    kern.scalar(ElementwiseOp::RSub, 2, out.data(), a.data(), C(1.0, 1.0));
+    EXPECT_EQ(out[1].real(), 4.0);
+    EXPECT_EQ(out[1].imag(), 0.5);
+
+    // relu works on either part alone
+    kern.unary(ElementwiseOp::Relu, 2, out.data(), a.data());
+    EXPECT_EQ(out[1].real(), 0.0);
+    EXPECT_EQ(out[1].imag(), 0.5);
+    kern.unary(ElementwiseOp::Neg, 2, out.data(), a.data());
+    EXPECT_EQ(out[0].real(), -1.0);
+    EXPECT_EQ(out[0].imag(), -2.0);
+}
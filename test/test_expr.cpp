@@ -0,0 +1,195 @@
+#include <iostream>
+#include <filesystem>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/expr.h"
+#include "../src/graph.h"
+#include "../src/arena.h"
+#include "../src/parallel.h"
+#include "../src/jit.h"
+
+
+using namespace ptMgrad;
+
+
+// the same value and gradients as the plain ops
+#define TEST_VALUE_FUSE(TYPE, NAME)                                        \
+    TEST(ValueTest, Fuse##NAME) {                                          \
+        Value<TYPE> w = 3.0;                                               \
+        Value<TYPE> x = -2.0;                                              \
+        Value<TYPE> b = 4.0;                                               \
+                                                                           \
+        Value<TYPE> pred = w * x + b;                                      \
+        Value<TYPE> e = pow(pred - TYPE(5.0), TYPE(2.0));                  \
+        e.backward();                                                      \
+        TYPE gw = w.gradX(), gx = x.gradX(), gb = b.gradX();               \
+        w.zero_grad();                                                     \
+        x.zero_grad();                                                     \
+        b.zero_grad();                                                     \
+                                                                           \
+        Value<TYPE> f = fuse(pow(ex(w) * x + b - TYPE(5.0), TYPE(2.0)));   \
+        f.backward();                                                      \
+        EXPECT_EQ(f.dataX(), e.dataX());                                   \
+        EXPECT_EQ(w.gradX(), gw);                                          \
+        EXPECT_EQ(x.gradX(), gx);                                          \
+        EXPECT_EQ(b.gradX(), gb);                                          \
+    }
+
+TEST_VALUE_FUSE(float, Float)
+TEST_VALUE_FUSE(double, Double)
+TEST_VALUE_FUSE(int, Int)
+
+
+// every op, with constants on either side
+#define TEST_VALUE_FUSE_OPS(TYPE, NAME)                                    \
+    TEST(ValueTest, FuseOps##NAME) {                                       \
+        Value<TYPE> a = 1.5;                                               \
+        Value<TYPE> b = -0.5;                                              \
+                                                                           \
+        Value<TYPE> two = 2.0;                                             \
+        Value<TYPE> p = a / b, q = two - p, r = relu(q);                   \
+        Value<TYPE> s = -a, t = s * TYPE(3.0), u = r + t, v = b * a;       \
+        Value<TYPE> e = u / v;                                             \
+        e.backward();                                                      \
+        TYPE ga = a.gradX(), gb = b.gradX();                               \
+        a.zero_grad();                                                     \
+        b.zero_grad();                                                     \
+                                                                           \
+        Value<TYPE> f = fuse(                                              \
+            (relu(TYPE(2.0) - ex(a) / b) + -ex(a) * TYPE(3.0)) / (ex(b) * a)); \
+        f.backward();                                                      \
+        EXPECT_EQ(f.dataX(), e.dataX());                                   \
+        EXPECT_EQ(a.gradX(), ga);                                          \
+        EXPECT_EQ(b.gradX(), gb);                                          \
+    }
+
+TEST_VALUE_FUSE_OPS(float, Float)
+TEST_VALUE_FUSE_OPS(double, Double)
+
+
+TEST(ValueTest, FuseOneNode) {
+    Value<double> w = 0.5;
+    Value<double> x = 2.0;
+    Value<double> b = 0.25;
+
+    Value<double> plain = relu(w * x + b);
+    EXPECT_EQ(Graph<double>(plain).size(), 3u);
+
+    Value<double> fused = fuse(relu(ex(w) * x + b));
+    EXPECT_EQ(Graph<double>(fused).size(), 1u);
+    EXPECT_EQ(fused.dataX(), 1.25);
+}
+
+
+// a leaf used twice gets both contributions
+TEST(ValueTest, FuseSharedLeaf) {
+    Value<double> a = 3.0;
+
+    Value<double> e = fuse(ex(a) * a + a);
+    e.backward();
+
+    EXPECT_EQ(e.dataX(), 12.0);
+    EXPECT_EQ(a.gradX(), 7.0);
+}
+
+
+// an expression over other ops, and ops over a fused node
+TEST(ValueTest, FuseInGraph) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+
+    Value<double> ab = a * b;
+    Value<double> e = fuse(pow(ex(ab) - b, 2.0)) * a;
+    e.backward();
+
+    // (ab - b)^2 a = 9 * 2
+    EXPECT_EQ(e.dataX(), 18.0);
+    // d/da (ab - b)^2 a = 2 (ab - b) b a + (ab - b)^2
+    EXPECT_EQ(a.gradX(), 45.0);
+    // d/db = 2 (ab - b) (a - 1) a
+    EXPECT_EQ(b.gradX(), 12.0);
+}
+
+
+TEST(ValueTest, FuseDivisionByZero) {
+    Value<double> a = 2.0;
+    Value<double> z = 0.0;
+
+    EXPECT_THROW(fuse(ex(a) / z), std::invalid_argument);
+    EXPECT_THROW(fuse(ex(a) / 0.0), std::invalid_argument);
+}
+
+
+TEST(ValueTest, FuseGraphReplay) {
+    Value<double> w = 2.0;
+    Value<double> x = 3.0;
+
+    Value<double> e = fuse(pow(ex(w) * x - 1.0, 2.0));
+    Graph<double> graph(e);
+
+    w.set_data(1.0);
+    graph.replay();
+    EXPECT_EQ(e.dataX(), 4.0);
+    EXPECT_EQ(w.gradX(), 12.0);
+    EXPECT_EQ(x.gradX(), 4.0);
+}
+
+
+TEST(ValueTest, FuseInArena) {
+    Value<double> a = 2.0;
+    Arena arena;
+    for (int step = 0; step < 3; ++step) {
+        ArenaScope scope(arena);
+        Value<double> e = fuse(ex(a) * a + 1.0);
+        e.backward();
+    }
+    EXPECT_EQ(a.gradX(), 12.0);
+}
+
+
+TEST(ValueTest, FuseNoGrad) {
+    Value<double> a = 2.0;
+
+    NoGradGuard no_grad;
+    Value<double> e = fuse(ex(a) * a + 1.0);
+    e.backward();
+
+    EXPECT_EQ(e.dataX(), 5.0);
+    EXPECT_EQ(a.gradX(), 0.0);
+}
+
+
+// squared errors of a batch, on the pool, against the plain ops
+TEST(ValueTest, FuseConcurrentGraphs) {
+    ThreadPool pool(4);
+    const size_t batch = 100;
+    Value<double> w1 = 0.5, b1 = -0.25;
+    Value<double> w2 = 0.5, b2 = -0.25;
+
+    for_each_sample(pool, batch, [&](size_t i) {
+        Value<double> x = 0.1 * double(i);
+        Value<double> loss = pow(w1 * x + b1 - double(i % 3), 2.0);
+        loss.backward();
+    });
+    for_each_sample(pool, batch, [&](size_t i) {
+        Value<double> x = 0.1 * double(i);
+        Value<double> loss = fuse(pow(ex(w2) * x + b2 - double(i % 3), 2.0));
+        loss.backward();
+    });
+
+    EXPECT_NEAR(w2.gradX(), w1.gradX(), 1e-9 * std::abs(w1.gradX()));
+    EXPECT_NEAR(b2.gradX(), b1.gradX(), 1e-9 * std::abs(b1.gradX()));
+}
+
+
+TEST(ValueTest, JitRejectsFused) {
+    Value<double> a = 2.0;
+    Value<double> e = fuse(ex(a) * a);
+    Graph<double> graph(e);
+
+    JitOptions options;
+    options.cache_dir = ::testing::TempDir() + "ptmgrad_jit_fused";
+    EXPECT_THROW(Compiled<double>(graph, options), std::invalid_argument);
+}
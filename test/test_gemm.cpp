@@ -0,0 +1,165 @@
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/gemm.h"
+#include "../src/tensor.h"
+
+
+using namespace ptMgrad;
+
+
+template <typename T>
+static std::vector<T> random_matrix(size_t n) {
+    std::vector<T> v(n);
+    for (auto& x : v) {
+        x = T(std::rand()) / T(RAND_MAX) * T(2) - T(1);
+    }
+    return v;
+}
+
+// C = A B, one element at a time, in long double
+template <typename T>
+static std::vector<T> naive(size_t m, size_t n, size_t k,
+                            const T* a, size_t rsa, size_t csa,
+                            const T* b, size_t rsb, size_t csb) {
+    std::vector<T> c(m * n);
+    for (size_t i = 0; i < m; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            long double acc = 0;
+            for (size_t p = 0; p < k; ++p) {
+                acc += (long double)a[i * rsa + p * csa] * b[p * rsb + j * csb];
+            }
+            c[i * n + j] = T(acc);
+        }
+    }
+    return c;
+}
+
+
+// every kernel the CPU runs, on shapes with edge tiles and with more
+// than one block along every dimension
+#define TEST_GEMM(TYPE, NAME, TOL)                                               \
+    TEST(ValueTest, Gemm##NAME) {                                                \
+        std::srand(1);                                                           \
+        std::vector<std::vector<size_t>> shapes = {                              \
+            {1, 1, 1}, {5, 7, 3}, {12, 16, 8}, {13, 33, 9}, {37, 41, 300},       \
+            {700, 9, 20}, {3, 4200, 5}};                                         \
+        for (const auto& kern : gemm_kernels<TYPE>()) {                          \
+            for (const auto& s : shapes) {                                       \
+                size_t m = s[0], n = s[1], k = s[2];                             \
+                std::vector<TYPE> a = random_matrix<TYPE>(m * k);                \
+                std::vector<TYPE> b = random_matrix<TYPE>(k * n);                \
+                std::vector<TYPE> c(m * n, TYPE(7));                             \
+                gemm(m, n, k, a.data(), k, 1, b.data(), n, 1, c.data(), n,       \
+                     false, kern);                                               \
+                std::vector<TYPE> r = naive(m, n, k, a.data(), k, 1, b.data(), n, 1); \
+                for (size_t i = 0; i < m * n; ++i) {                             \
+                    ASSERT_NEAR(c[i], r[i], TOL * k) << kern.name << " " << m    \
+                        << "x" << n << "x" << k;                                 \
+                }                                                                \
+            }                                                                    \
+        }                                                                        \
+    }
+
+TEST_GEMM(float, Float, 1e-6)
+TEST_GEMM(double, Double, 1e-14)
+
+
+// transposed operands are read through swapped strides, and the
+// product is added to C
+TEST(ValueTest, GemmTransposed) {
+    std::srand(2);
+    size_t m = 29, n = 19, k = 31;
+    std::vector<double> at = random_matrix<double>(k * m);
+    std::vector<double> bt = random_matrix<double>(n * k);
+
+    for (const auto& kern : gemm_kernels<double>()) {
+        std::vector<double> c(m * n, 1.0);
+        gemm(m, n, k, at.data(), 1, m, bt.data(), 1, k, c.data(), n, true, kern);
+        std::vector<double> r = naive(m, n, k, at.data(), 1, m, bt.data(), 1, k);
+        for (size_t i = 0; i < m * n; ++i) {
+            EXPECT_NEAR(c[i], r[i] + 1.0, 1e-13) << kern.name;
+        }
+    }
+}
+
+
+TEST(ValueTest, GemmComplex) {
+    using C = complex<double>;
+    // (1 + i  2)   (i)     (-1 + i + 2 - 2i)   (1 - i)
+    // (0   -i) . (1 - i) = (-i - 1)          = (-1 - i)
+    std::vector<C> a = {C(1.0, 1.0), C(2.0, 0.0), C(0.0, 0.0), C(0.0, -1.0)};
+    std::vector<C> b = {C(0.0, 1.0), C(1.0, -1.0)};
+    std::vector<C> c(2);
+    gemm(2, 1, 2, a.data(), 2, 1, b.data(), 1, 1, c.data(), 1);
+    EXPECT_EQ(c[0].real(), 1.0);
+    EXPECT_EQ(c[0].imag(), -1.0);
+    EXPECT_EQ(c[1].real(), -1.0);
+    EXPECT_EQ(c[1].imag(), -1.0);
+}
+
+
+// d/dA of sum(W * (A B)) = W B^T, d/dB = A^T W
+#define TEST_MATMUL(TYPE, NAME, TOL)                                             \
+    TEST(ValueTest, MatMul##NAME) {                                              \
+        std::srand(3);                                                           \
+        size_t m = 23, k = 40, n = 18;                                           \
+        Tensor<TYPE> a({m, k}, random_matrix<TYPE>(m * k));                      \
+        Tensor<TYPE> b({k, n}, random_matrix<TYPE>(k * n));                      \
+        Tensor<TYPE> w({m, n}, random_matrix<TYPE>(m * n));                      \
+        w.set_requires_grad(false);                                              \
+                                                                                 \
+        Tensor<TYPE> c = matmul(a, b);                                           \
+        std::vector<TYPE> r = naive(m, n, k, a.data(), k, 1, b.data(), n, 1);    \
+        for (size_t i = 0; i < m * n; ++i) {                                     \
+            EXPECT_NEAR(c.data()[i], r[i], TOL * k);                             \
+        }                                                                        \
+                                                                                 \
+        Tensor<TYPE> e = sum(c * w);                                             \
+        EXPECT_EQ(e.graph_size(), 5u);                                           \
+        e.backward();                                                            \
+        std::vector<TYPE> ga = naive(m, k, n, w.data(), n, 1, b.data(), 1, n);   \
+        std::vector<TYPE> gb = naive(k, n, m, a.data(), 1, k, w.data(), n, 1);   \
+        for (size_t i = 0; i < m * k; ++i) {                                     \
+            EXPECT_NEAR(a.grad_data()[i], ga[i], TOL * n);                       \
+        }                                                                        \
+        for (size_t i = 0; i < k * n; ++i) {                                     \
+            EXPECT_NEAR(b.grad_data()[i], gb[i], TOL * m);                       \
+        }                                                                        \
+    }
+
+TEST_MATMUL(float, Float, 1e-6)
+TEST_MATMUL(double, Double, 1e-14)
+
+
+TEST(ValueTest, MatMulComplex) {
+    using C = complex<double>;
+    Tensor<C> a({1, 2}, std::vector<C>{C(1.0, 1.0), C(0.0, 2.0)});
+    Tensor<C> b({2, 1}, std::vector<C>{C(2.0, 0.0), C(1.0, -1.0)});
+
+    // (1 + i) 2 + 2i (1 - i) = 4 + 4i
+    Tensor<C> e = sum(matmul(a, b));
+    EXPECT_EQ(e.item().real(), 4.0);
+    EXPECT_EQ(e.item().imag(), 4.0);
+
+    e.backward();
+    EXPECT_EQ(a.grad_data()[1].real(), 1.0);
+    EXPECT_EQ(a.grad_data()[1].imag(), -1.0);
+    EXPECT_EQ(b.grad_data()[1].real(), 0.0);
+    EXPECT_EQ(b.grad_data()[1].imag(), 2.0);
+}
+
+
+TEST(ValueTest, MatMulShapes) {
+    Tensor<double> a({2, 3});
+    Tensor<double> b({2, 3});
+    Tensor<double> v({3});
+    EXPECT_THROW(matmul(a, b), std::invalid_argument);
+    EXPECT_THROW(matmul(a, v), std::invalid_argument);
+    EXPECT_EQ(matmul(a, Tensor<double>({3, 5})).shape(), Shape({2, 5}));
+}
@@ -0,0 +1,211 @@
+#include <iostream>
+#include <cstdlib>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/graph.h"
+#include "../src/parallel.h"
+#include "../src/nn.h"
+
+
+using namespace ptMgrad;
+
+
+#define TEST_GRAD_GENERATION(TYPE, NAME)                                   \
+    TEST(ValueTest, GradGeneration##NAME) {                                \
+        Value<TYPE> a = 2.0;                                               \
+        Value<TYPE> b = 3.0;                                               \
+                                                                           \
+        Value<TYPE> c = a * b;                                             \
+        c.backward(true);                                                  \
+        EXPECT_EQ(a.gradX(), TYPE(3.0));                                   \
+                                                                           \
+        GradGeneration::advance();                                         \
+        EXPECT_EQ(a.gradX(), TYPE(0.0));                                   \
+        EXPECT_EQ(b.gradX(), TYPE(0.0));                                   \
+                                                                           \
+        /* the stale gradient is not added to */                           \
+        c.backward();                                                      \
+        EXPECT_EQ(a.gradX(), TYPE(3.0));                                   \
+        EXPECT_EQ(b.gradX(), TYPE(2.0));                                   \
+    }
+
+TEST_GRAD_GENERATION(float, Float)
+TEST_GRAD_GENERATION(double, Double)
+TEST_GRAD_GENERATION(int, Int)
+
+
+TEST(ValueTest, GradGenerationComplex) {
+    using C = complex<double>;
+    Value<C> a(C(1.0, 2.0));
+
+    Value<C> b = a * a;
+    b.backward(true);
+    GradGeneration::advance();
+    EXPECT_EQ(a.gradX().real(), 0.0);
+    EXPECT_EQ(a.gradX().imag(), 0.0);
+
+    b.backward();
+    EXPECT_EQ(a.gradX().real(), 2.0);
+    EXPECT_EQ(a.gradX().imag(), 4.0);
+}
+
+
+// an op freed by backward is a leaf from then on, stamped like one
+TEST(ValueTest, GradGenerationFreedOp) {
+    Value<double> a = 2.0;
+
+    Value<double> h = a * 3.0;
+    Value<double> c = h * h;
+    c.backward();
+    EXPECT_EQ(h.gradX(), 12.0);
+
+    GradGeneration::advance();
+    EXPECT_EQ(h.gradX(), 0.0);
+    EXPECT_EQ(a.gradX(), 0.0);
+}
+
+
+// set and zeroed by hand within a generation, as before
+TEST(ValueTest, GradGenerationSetGrad) {
+    Value<double> a = 2.0;
+
+    GradGeneration::advance();
+    a.set_grad(5.0);
+    EXPECT_EQ(a.gradX(), 5.0);
+    a.add_grad(1.0);
+    EXPECT_EQ(a.gradX(), 6.0);
+    a.zero_grad();
+    EXPECT_EQ(a.gradX(), 0.0);
+}
+
+
+// training with Module::zero_grad matches zeroing every parameter
+TEST(ValueTest, GradGenerationModule) {
+    std::srand(3);
+    MLP<double> by_hand(2, {4, 1});
+    std::srand(3);
+    MLP<double> by_generation(2, {4, 1});
+
+    std::vector<std::vector<Value<double>>> xs = {{0.5, -1.0}, {1.0, 2.0}, {-0.5, 0.25}};
+    auto step = [&](MLP<double>& model) {
+        Value<double> loss = 0.0;
+        for (auto& x : xs) {
+            loss = loss + pow(model(x)[0] - 1.0, 2.0);
+        }
+        loss.backward();
+        for (auto* p : model.parameters()) {
+            p->set_data(p->dataX() - 0.05 * p->get_grad());
+        }
+    };
+
+    for (int epoch = 0; epoch < 5; ++epoch) {
+        for (auto* p : by_hand.parameters()) {
+            p->set_grad(0.0);
+        }
+        step(by_hand);
+        by_generation.zero_grad();
+        step(by_generation);
+    }
+
+    std::vector<Value<double>*> p1 = by_hand.parameters(), p2 = by_generation.parameters();
+    for (size_t j = 0; j < p1.size(); ++j) {
+        EXPECT_EQ(p2[j]->dataX(), p1[j]->dataX());
+    }
+
+    // the generation is the module's: the other model keeps its gradients
+    std::vector<double> kept;
+    for (auto* p : p1) {
+        kept.push_back(p->gradX());
+    }
+    by_generation.zero_grad();
+    for (size_t j = 0; j < p1.size(); ++j) {
+        EXPECT_EQ(p2[j]->gradX(), 0.0);
+        EXPECT_EQ(p1[j]->gradX(), kept[j]);
+    }
+
+    // and the global one zeroes every leaf
+    GradGeneration::advance();
+    for (size_t j = 0; j < p1.size(); ++j) {
+        EXPECT_EQ(p1[j]->gradX(), 0.0);
+    }
+}
+
+
+// zero_grad of a module leaves other leaves alone
+TEST(ValueTest, GradGenerationModuleScope) {
+    std::srand(3);
+    MLP<double> mlp(2, {3, 1});
+    Value<double> x = 2.0;
+    Value<double> y = x * x;
+    y.backward();
+    mlp.zero_grad();
+    EXPECT_EQ(x.gradX(), 4.0);
+
+    // a layer zeroes its own parameters, its MLP all of them
+    std::vector<Value<double>> in = {0.5, -1.0};
+    mlp(in)[0].backward();
+    Value<double>* first = mlp.layer(0).parameters()[0];
+    Value<double>* last = mlp.layer(1).parameters()[0];
+    double g = last->gradX();
+    EXPECT_NE(g, 0.0);
+    mlp.layer(0).zero_grad();
+    EXPECT_EQ(first->gradX(), 0.0);
+    EXPECT_EQ(last->gradX(), g);
+    mlp.zero_grad();
+    EXPECT_EQ(last->gradX(), 0.0);
+
+    // a parameter assigned to stays in its module
+    *last = 0.5;
+    mlp(in)[0].backward();
+    EXPECT_NE(last->gradX(), 0.0);
+    mlp.zero_grad();
+    EXPECT_EQ(last->gradX(), 0.0);
+}
+
+
+TEST(ValueTest, GradGenerationDenseScope) {
+    std::srand(3);
+    DenseMLP<double> mlp(2, {3, 1});
+    Tensor<double> x({1, 2}, 1.0);
+    Tensor<double> y = sum(x * x);
+    y.backward();
+    sum(mlp(Tensor<double>({4, 2}, 0.5))).backward();
+    Tensor<double>* w = mlp.layer(1).parameters()[0];
+    EXPECT_NE(w->grad_data(), nullptr);
+
+    mlp.zero_grad();
+    EXPECT_EQ(w->grad_data(), nullptr);
+    EXPECT_EQ(x.grad().at({0, 0}), 2.0);
+}
+
+
+TEST(ValueTest, GradGenerationGraphReplay) {
+    Value<double> w = 2.0;
+    Value<double> x = 3.0;
+
+    Value<double> e = w * x;
+    Graph<double> graph(e);
+    for (int step = 0; step < 3; ++step) {
+        GradGeneration::advance();
+        graph.replay();
+    }
+    EXPECT_EQ(w.gradX(), 3.0);
+}
+
+
+// shared parameters zeroed between batches on the pool
+TEST(ValueTest, GradGenerationConcurrent) {
+    ThreadPool pool(4);
+    Value<double> w = 2.0;
+
+    for (int batch = 0; batch < 3; ++batch) {
+        GradGeneration::advance();
+        for_each_sample(pool, 100, [&](size_t i) {
+            Value<double> e = w * double(i % 2);
+            e.backward();
+        });
+        EXPECT_EQ(w.gradX(), 50.0);
+    }
+}
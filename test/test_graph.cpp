@@ -0,0 +1,155 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/graph.h"
+#include "../src/arena.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+template <typename T>
+static Value<T> graph_fn(const Value<T>& a, const Value<T>& b, const Value<T>& c) {
+    Value<T> h = a * b + c / a - relu(b - c);
+    return (h + T(1.5)) * T(2.0) - h / T(4.0) + neg(c) - a;
+}
+
+
+#define TEST_GRAPH_REPLAY(TYPE, NAME)                                  \
+    TEST(ValueTest, Graph##NAME##Replay) {                             \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+        Value<TYPE> c = 4.0;                                           \
+                                                                       \
+        Value<TYPE> e = graph_fn(a, b, c);                             \
+        Graph<TYPE> graph(e);                                          \
+                                                                       \
+        a.set_data(TYPE(1.5));                                         \
+        b.set_data(TYPE(-0.5));                                        \
+        c.set_data(TYPE(3.0));                                         \
+        graph.replay();                                                \
+        TYPE ea = e.dataX();                                           \
+        TYPE ga = a.gradX(), gb = b.gradX(), gc = c.gradX();           \
+        a.zero_grad();                                                 \
+        b.zero_grad();                                                 \
+        c.zero_grad();                                                 \
+                                                                       \
+        Value<TYPE> f = graph_fn(a, b, c);                             \
+        f.backward();                                                  \
+        EXPECT_EQ(ea, f.dataX());                                      \
+        EXPECT_EQ(ga, a.gradX());                                      \
+        EXPECT_EQ(gb, b.gradX());                                      \
+        EXPECT_EQ(gc, c.gradX());                                      \
+    }
+
+TEST_GRAPH_REPLAY(float, Float)
+TEST_GRAPH_REPLAY(double, Double)
+
+
+#define TEST_GRAPH_REPLAY_COMPLEX(TYPE, NAME)                          \
+    TEST(ValueTest, Graph##NAME##Replay) {                             \
+        Value<TYPE> a(TYPE(2.0, 1.0));                                 \
+        Value<TYPE> b(TYPE(3.0, -1.0));                                \
+        Value<TYPE> c(TYPE(4.0, 0.5));                                 \
+                                                                       \
+        Value<TYPE> e = graph_fn(a, b, c);                             \
+        Graph<TYPE> graph(e);                                          \
+                                                                       \
+        a.set_data(TYPE(1.5, -2.0));                                   \
+        b.set_data(TYPE(-0.5, 0.25));                                  \
+        graph.replay();                                                \
+        TYPE ea = e.dataX();                                           \
+        TYPE ga = a.gradX(), gb = b.gradX();                           \
+        a.zero_grad();                                                 \
+        b.zero_grad();                                                 \
+                                                                       \
+        Value<TYPE> f = graph_fn(a, b, c);                             \
+        f.backward();                                                  \
+        EXPECT_EQ(ea.real(), f.dataX().real());                        \
+        EXPECT_EQ(ea.imag(), f.dataX().imag());                        \
+        EXPECT_EQ(ga.real(), a.gradX().real());                        \
+        EXPECT_EQ(ga.imag(), a.gradX().imag());                        \
+        EXPECT_EQ(gb.real(), b.gradX().real());                        \
+        EXPECT_EQ(gb.imag(), b.gradX().imag());                        \
+    }
+
+TEST_GRAPH_REPLAY_COMPLEX(ptMgrad::complex<float>, ComplexFloat)
+TEST_GRAPH_REPLAY_COMPLEX(ptMgrad::complex<double>, ComplexDouble)
+
+
+TEST(ValueTest, GraphReplayTraining) {
+    Value<double> w = 0.5, b = 0.0;
+    Value<double> x = 0.0, t = 0.0;
+    Value<double> loss = pow(w * x + b - t, 2.0);
+
+    Graph<double> graph(loss);
+    EXPECT_EQ(graph.size(), 4u);
+
+    double w_ref = 0.5, b_ref = 0.0;
+    for (int step = 0; step < 20; ++step) {
+        double xi = double(step % 4), ti = 2.0 * xi + 1.0;
+
+        w.zero_grad();
+        b.zero_grad();
+        graph.replay({&x, &t}, {xi, ti});
+
+        // same step, built from scratch
+        Value<double> wr = w_ref, br = b_ref;
+        Value<double> lr = pow(wr * xi + br - ti, 2.0);
+        lr.backward();
+        EXPECT_EQ(loss.dataX(), lr.dataX());
+        EXPECT_EQ(w.gradX(), wr.gradX());
+        EXPECT_EQ(b.gradX(), br.gradX());
+
+        w.set_data(w.dataX() - 0.05 * w.gradX());
+        b.set_data(b.dataX() - 0.05 * b.gradX());
+        w_ref -= 0.05 * wr.gradX();
+        b_ref -= 0.05 * br.gradX();
+    }
+}
+
+
+TEST(ValueTest, GraphReplayInArena) {
+    Value<double> a = 2.0;
+    Arena arena;
+    ArenaScope scope(arena);
+
+    Value<double> e = a * a + a * 3.0;
+    Graph<double> graph(e);
+    size_t used = arena.bytes_used();
+
+    for (int i = 0; i < 10; ++i) {
+        a.set_data(double(i));
+        a.zero_grad();
+        graph.replay();
+        EXPECT_EQ(e.dataX(), double(i * i + 3 * i));
+        EXPECT_EQ(a.gradX(), double(2 * i + 3));
+    }
+    EXPECT_EQ(arena.bytes_used(), used);
+}
+
+
+TEST(ValueTest, GraphBackwardWithoutCapture) {
+    Graph<double> graph;
+    EXPECT_THROW(graph.backward(), std::logic_error);
+}
+
+
+// a backward without retain_graph frees the captured ops, which can't
+// be replayed afterwards
+TEST(ValueTest, GraphReplayAfterFree) {
+    Value<double> a = 2.0;
+    Value<double> b = 4.0;
+    Value<double> y = a * b;
+    Graph<double> graph(y);
+
+    y.backward();
+    a.set_data(5.0);
+    EXPECT_THROW(graph.forward(), std::logic_error);
+    EXPECT_THROW(graph.backward(), std::logic_error);
+    EXPECT_THROW(Graph<double>{y}, std::logic_error);
+    EXPECT_EQ(y.dataX(), 8.0);
+}
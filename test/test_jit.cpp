@@ -0,0 +1,239 @@
+#include <iostream>
+#include <filesystem>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/graph.h"
+#include "../src/jit.h"
+#include "../src/nn.h"
+
+
+using namespace ptMgrad;
+
+
+// a fresh cache for every test, so that compiles are not skipped
+static JitOptions jit_options(const std::string& name) {
+    JitOptions options;
+    options.cache_dir = ::testing::TempDir() + "ptmgrad_jit_" + name;
+    std::filesystem::remove_all(options.cache_dir);
+    return options;
+}
+
+
+TEST(ValueTest, JitXorMatchesReplay) {
+    std::srand(0);
+    using V = Value<double>;
+
+    std::vector<std::vector<V>> xs = {
+        {V(0.0), V(0.0)}, {V(0.0), V(1.0)}, {V(1.0), V(0.0)}, {V(1.0), V(1.0)},
+    };
+    std::vector<double> ys = {0.0, 1.0, 1.0, 0.0};
+    MLP<double> model(2, {4, 1});
+
+    V loss(0.0);
+    for (size_t i = 0; i < xs.size(); ++i) {
+        loss = loss + pow(model(xs[i])[0] - V(ys[i]), 2.0);
+    }
+    V mse = loss * V(0.25);
+
+    Graph<double> graph(mse);
+    Compiled<double> jit(graph, jit_options("xor"));
+    EXPECT_FALSE(jit.from_cache());
+
+    auto params = model.parameters();
+    for (int step = 0; step < 10; ++step) {
+        model.zero_grad();
+        jit.run();
+        double jit_loss = mse.dataX();
+        std::vector<double> jit_grads;
+        for (auto* p : params) {
+            jit_grads.push_back(p->get_grad());
+        }
+
+        model.zero_grad();
+        graph.replay();
+        EXPECT_EQ(jit_loss, mse.dataX());
+        for (size_t i = 0; i < params.size(); ++i) {
+            EXPECT_EQ(jit_grads[i], params[i]->get_grad());
+        }
+
+        for (auto* p : params) {
+            p->set_data(p->dataX() - 0.1 * p->get_grad());
+        }
+    }
+}
+
+
+#define TEST_JIT_OPS(TYPE, NAME)                                       \
+    TEST(ValueTest, Jit##NAME##Ops) {                                  \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+        Value<TYPE> c = 4.0;                                           \
+                                                                       \
+        Value<TYPE> h = a * b + c / a - relu(b - c) + neg(a);          \
+        Value<TYPE> e = pow(h, TYPE(2.0)) / TYPE(4.0) - h * TYPE(0.5)  \
+                        + pow(c, a) + (TYPE(1.0) + h) - TYPE(3.0);     \
+        Graph<TYPE> graph(e);                                          \
+        Compiled<TYPE> jit(graph, jit_options(#NAME));                 \
+                                                                       \
+        a.set_data(TYPE(1.5));                                         \
+        b.set_data(TYPE(5.0));                                         \
+        jit.run();                                                     \
+        TYPE ej = e.dataX();                                           \
+        TYPE ga = a.gradX(), gb = b.gradX(), gc = c.gradX();           \
+        a.zero_grad();                                                 \
+        b.zero_grad();                                                 \
+        c.zero_grad();                                                 \
+                                                                       \
+        graph.replay();                                                \
+        EXPECT_EQ(ej, e.dataX());                                      \
+        EXPECT_EQ(ga, a.gradX());                                      \
+        EXPECT_EQ(gb, b.gradX());                                      \
+        EXPECT_EQ(gc, c.gradX());                                      \
+    }
+
+TEST_JIT_OPS(float, Float)
+TEST_JIT_OPS(double, Double)
+
+
+TEST(ValueTest, JitCachedObject) {
+    JitOptions options = jit_options("cache");
+    Value<double> a = 2.0;
+    Value<double> e = a * a + 1.0;
+    Graph<double> graph(e);
+
+    Compiled<double> first(graph, options);
+    Compiled<double> second(graph, options);
+    EXPECT_FALSE(first.from_cache());
+    EXPECT_TRUE(second.from_cache());
+    EXPECT_EQ(first.path(), second.path());
+
+    second.run({&a}, {3.0});
+    EXPECT_EQ(e.dataX(), 10.0);
+    EXPECT_EQ(a.gradX(), 6.0);
+}
+
+
+// constants that are infinite or NaN are written out as builtins
+TEST(ValueTest, JitNonFiniteConstants) {
+    double inf = std::numeric_limits<double>::infinity();
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+    Value<double> e = a * inf + (b + -inf) * 0.0;
+    Value<double> f = a + std::numeric_limits<double>::quiet_NaN();
+    Graph<double> ge(e), gf(f);
+
+    Compiled<double>(ge, jit_options("inf")).run();
+    EXPECT_TRUE(std::isnan(e.dataX()));
+    EXPECT_EQ(a.gradX(), inf);
+    Compiled<double>(gf, jit_options("nan")).run();
+    EXPECT_TRUE(std::isnan(f.dataX()));
+}
+
+
+// an op with a zero gradient is skipped, as the interpreter skips it,
+// so that 0 * inf stays out of the gradients
+TEST(ValueTest, JitSkipsZeroGradients) {
+    Value<double> x = 2.0;
+    Value<double> w = std::numeric_limits<double>::infinity();
+    Value<double> c = 3.0;
+    Value<double> q = relu(-(x * w)) * c + c;
+    Graph<double> graph(q);
+
+    GradGeneration::advance();
+    graph.replay();
+    double replayed = x.gradX();
+    EXPECT_EQ(replayed, 0.0);
+
+    Compiled<double> jit(graph, jit_options("zero"));
+    GradGeneration::advance();
+    jit.run();
+    EXPECT_EQ(x.gradX(), replayed);
+    EXPECT_EQ(c.gradX(), 1.0);
+}
+
+
+// objects are loaded only from a directory, and only as files, that
+// belong to this user and no other can write to
+TEST(ValueTest, JitPrivateCache) {
+    namespace fs = std::filesystem;
+    JitOptions options = jit_options("private");
+    Value<double> a = 2.0;
+    Value<double> e = a * a;
+    Graph<double> graph(e);
+    std::string path = Compiled<double>(graph, options).path();
+    EXPECT_EQ(fs::status(options.cache_dir).permissions() & fs::perms::all, fs::perms::owner_all);
+
+    fs::permissions(path, fs::perms::others_write, fs::perm_options::add);
+    EXPECT_THROW(Compiled<double>(graph, options), std::runtime_error);
+    fs::permissions(path, fs::perms::others_write, fs::perm_options::remove);
+    EXPECT_TRUE(Compiled<double>(graph, options).from_cache());
+
+    fs::permissions(options.cache_dir, fs::perms::group_write, fs::perm_options::add);
+    EXPECT_THROW(Compiled<double>(graph, options), std::runtime_error);
+}
+
+
+// every build writes under names of its own, so threads compiling
+// the same graph don't clobber each other, and a failed build leaves
+// nothing behind
+TEST(ValueTest, JitConcurrentBuilds) {
+    namespace fs = std::filesystem;
+    JitOptions options = jit_options("threads");
+    Value<double> a = 2.0;
+    Value<double> e = a * a + 1.0;
+    Graph<double> graph(e);
+
+    std::vector<std::string> paths(4);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        threads.emplace_back([&, i] {
+            paths[i] = Compiled<double>(graph, options).path();
+        });
+    }
+    for (std::thread& t : threads) {
+        t.join();
+    }
+
+    Compiled<double> jit(graph, options);
+    EXPECT_TRUE(jit.from_cache());
+    EXPECT_EQ(paths[0], jit.path());
+    jit.run({&a}, {3.0});
+    EXPECT_EQ(e.dataX(), 10.0);
+    size_t files = 0;
+    for (auto& entry : fs::directory_iterator(options.cache_dir)) {
+        EXPECT_TRUE(entry.path().extension() == ".so" || entry.path().extension() == ".cpp");
+        ++files;
+    }
+    EXPECT_EQ(files, 2u);
+
+    JitOptions failing = jit_options("failing");
+    failing.flags += " -Wl,--ptmgrad-no-such-option";
+    EXPECT_THROW(Compiled<double>(graph, failing), std::runtime_error);
+    EXPECT_TRUE(fs::is_empty(failing.cache_dir));
+}
+
+
+TEST(ValueTest, JitDivisionByZero) {
+    Value<double> a = 1.0;
+    Value<double> b = 2.0;
+    Value<double> e = a / b;
+    Graph<double> graph(e);
+    Compiled<double> jit(graph, jit_options("div"));
+
+    b.set_data(0.0);
+    EXPECT_THROW(jit.run(), std::invalid_argument);
+}
+
+
+TEST(ValueTest, JitRejectsCast) {
+    Value<double> a = 1.0;
+    Value<float> b = 2.0f;
+    Value<double> e = a * b;
+    Graph<double> graph(e);
+    EXPECT_THROW(Compiled<double>(graph, jit_options("cast")), std::invalid_argument);
+}
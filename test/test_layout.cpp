@@ -0,0 +1,62 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/graph.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+// value, gradient, two children and the flags; no second component
+static_assert(sizeof(Node<double>) <= 40);
+static_assert(sizeof(Node<float>) <= 32);
+static_assert(sizeof(Value<double>) == sizeof(void*));
+
+
+TEST(ValueTest, RealValueHasNoSecondComponent) {
+    Value<double> a(1.0, 2.0);
+    Value<double> b = a * 3.0 + a;
+
+    EXPECT_EQ(a.dataX(), 1.0);
+    EXPECT_EQ(a.dataY(), 0.0);
+    EXPECT_EQ(b.dataY(), 0.0);
+}
+
+
+// the real parts make up x and the imaginary parts y
+TEST(ValueTest, ComplexValueKeepsSecondComponent) {
+    using C = complex<double>;
+    Value<C> a(C(1.0, 2.0), C(3.0, 4.0));
+
+    EXPECT_EQ(a.dataX().imag(), 3.0);
+    EXPECT_EQ(a.dataY().real(), 2.0);
+    EXPECT_EQ(a.dataY().imag(), 4.0);
+}
+
+
+// the constant of an op is kept in place of the second child
+#define TEST_VALUE_CONSTANT_OPS(TYPE, NAME)                                \
+    TEST(ValueTest, ConstantOps##NAME) {                                   \
+        Value<TYPE> a = 2.0;                                               \
+                                                                           \
+        Value<TYPE> c = (a + TYPE(3.0)) * TYPE(2.0) - TYPE(4.0);           \
+        Value<TYPE> b = pow(c, TYPE(2.0)) / TYPE(4.0);                     \
+        Graph<TYPE> graph(b);                                              \
+        graph.replay();                                                    \
+        EXPECT_EQ(b.dataX(), TYPE(9.0));                                   \
+        /* d/da ((2a + 2)^2 / 4) = 2 (a + 1), 0 for int where 1 / 4 is */ \
+        EXPECT_EQ(a.gradX(), std::is_integral_v<TYPE> ? TYPE(0) : TYPE(6.0)); \
+                                                                           \
+        a.zero_grad();                                                     \
+        a.set_data(TYPE(1.0));                                             \
+        graph.replay();                                                    \
+        EXPECT_EQ(b.dataX(), TYPE(4.0));                                   \
+        EXPECT_EQ(a.gradX(), std::is_integral_v<TYPE> ? TYPE(0) : TYPE(4.0)); \
+    }
+
+TEST_VALUE_CONSTANT_OPS(float, Float)
+TEST_VALUE_CONSTANT_OPS(double, Double)
+TEST_VALUE_CONSTANT_OPS(int, Int)
@@ -0,0 +1,152 @@
+#include <iostream>
+#include <type_traits>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/arena.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+static_assert(std::is_nothrow_move_constructible_v<Value<double>>);
+static_assert(std::is_nothrow_move_assignable_v<Value<double>>);
+static_assert(std::is_nothrow_move_constructible_v<Value<complex<float>>>);
+
+
+#define TEST_VALUE_MOVE(TYPE, NAME)                                        \
+    TEST(ValueTest, Move##NAME) {                                          \
+        Value<TYPE> a = 2.0;                                               \
+        Value<TYPE> b = 3.0;                                               \
+                                                                           \
+        Value<TYPE> c = a * b;                                             \
+        Value<TYPE> d(std::move(c));                                       \
+        Value<TYPE> e = 1.0;                                               \
+        e = std::move(d);                                                  \
+        e.backward();                                                      \
+                                                                           \
+        EXPECT_EQ(e.dataX(), TYPE(6.0));                                   \
+        EXPECT_EQ(a.gradX(), TYPE(3.0));                                   \
+        EXPECT_EQ(b.gradX(), TYPE(2.0));                                   \
+                                                                           \
+        /* a moved from handle can be assigned again */                    \
+        c = a;                                                             \
+        EXPECT_EQ(c.dataX(), TYPE(2.0));                                   \
+        d = TYPE(5.0);                                                     \
+        EXPECT_EQ(d.dataX(), TYPE(5.0));                                   \
+    }
+
+TEST_VALUE_MOVE(float, Float)
+TEST_VALUE_MOVE(double, Double)
+TEST_VALUE_MOVE(int, Int)
+
+
+// every operator with temporary operands, against the same expression
+// over named values
+template <typename T>
+static Value<T> with_temporaries(const Value<T>& a, const Value<T>& b) {
+    return relu(-((a * b) + (a - b)) * (b + T(1.0)) / (a * T(2.0))) +
+           ((a + b) - (a * a)) / ((b - T(0.5)) * b) +
+           (a / T(4.0)) * (b - a);
+}
+
+template <typename T>
+static Value<T> with_names(const Value<T>& a, const Value<T>& b) {
+    Value<T> p = a * b, q = a - b, r = p + q, s = -r, t = b + T(1.0), u = s * t;
+    Value<T> v = a * T(2.0), w = u / v, x = relu(w);
+    Value<T> y = a + b, z = a * a, yz = y - z, m = b - T(0.5), n = m * b, o = yz / n;
+    Value<T> k = a / T(4.0), l = b - a, kl = k * l;
+    Value<T> xo = x + o;
+    return xo + kl;
+}
+
+
+#define TEST_VALUE_RVALUE_OPS(TYPE, NAME)                                  \
+    TEST(ValueTest, RvalueOps##NAME) {                                     \
+        Value<TYPE> a = -1.5;                                              \
+        Value<TYPE> b = 2.5;                                               \
+                                                                           \
+        Value<TYPE> e = with_names(a, b);                                  \
+        e.backward();                                                      \
+        TYPE ga = a.gradX(), gb = b.gradX();                               \
+        a.zero_grad();                                                     \
+        b.zero_grad();                                                     \
+                                                                           \
+        Value<TYPE> f = with_temporaries(a, b);                            \
+        f.backward();                                                      \
+        EXPECT_EQ(f.dataX(), e.dataX());                                   \
+        EXPECT_EQ(a.gradX(), ga);                                          \
+        EXPECT_EQ(b.gradX(), gb);                                          \
+    }
+
+TEST_VALUE_RVALUE_OPS(float, Float)
+TEST_VALUE_RVALUE_OPS(double, Double)
+
+
+TEST(ValueTest, RvalueOpsComplex) {
+    using C = complex<double>;
+    Value<C> a(C(1.0, 2.0));
+    Value<C> b(C(3.0, -1.0));
+
+    Value<C> e = (a * b + a) * (b - a);
+    e.backward();
+    C ga = a.gradX();
+    a.zero_grad();
+
+    Value<C> p = a * b, q = p + a, r = b - a;
+    Value<C> f = q * r;
+    f.backward();
+    EXPECT_EQ(e.dataX().real(), f.dataX().real());
+    EXPECT_EQ(e.dataX().imag(), f.dataX().imag());
+    EXPECT_EQ(ga.real(), a.gradX().real());
+    EXPECT_EQ(ga.imag(), a.gradX().imag());
+}
+
+
+// the same temporary on both sides
+TEST(ValueTest, RvalueSameOperand) {
+    Value<double> a = 3.0;
+
+    Value<double> t = a * 2.0;
+    Value<double> e = std::move(t) * std::move(t);
+    e.backward();
+
+    EXPECT_EQ(e.dataX(), 36.0);
+    EXPECT_EQ(a.gradX(), 24.0);
+}
+
+
+TEST(ValueTest, RvalueOpsInArena) {
+    Value<double> a = 2.0;
+    Arena arena;
+    for (int step = 0; step < 3; ++step) {
+        ArenaScope scope(arena);
+        Value<double> e = (a * a + 1.0) * (a - 0.5);
+        e.backward();
+    }
+    // d/da (a^3 - 0.5 a^2 + a - 0.5) = 3a^2 - a + 1, three times
+    EXPECT_EQ(a.gradX(), 33.0);
+}
+
+
+TEST(ValueTest, RvalueOpsNoGrad) {
+    Value<double> a = 2.0;
+
+    NoGradGuard no_grad;
+    Value<double> e = (a * a + 1.0) * (a - 0.5);
+    e.backward();
+
+    EXPECT_EQ(e.dataX(), 7.5);
+    EXPECT_EQ(a.gradX(), 0.0);
+}
+
+
+TEST(ValueTest, RvalueOpsDivisionByZero) {
+    Value<double> a = 2.0;
+    Value<double> z = 0.0;
+
+    EXPECT_THROW((a * 1.0) / z, std::invalid_argument);
+    EXPECT_THROW((a * 1.0) / 0.0, std::invalid_argument);
+}
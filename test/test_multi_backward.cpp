@@ -0,0 +1,87 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/nn.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+TEST(ValueTest, MultiBackwardMatchesWeightedSum) {
+    std::srand(0);
+    MLP<double> model(2, {4, 3});
+    std::vector<Value<double>> x = {Value<double>(0.5), Value<double>(-1.0)};
+    std::vector<double> seeds = {1.0, 2.0, -0.5};
+
+    std::vector<Value<double>> out = model(x);
+    Value<double> loss = out[0] * seeds[0] + out[1] * seeds[1] + out[2] * seeds[2];
+    model.zero_grad();
+    loss.backward(true);
+    std::vector<double> expected;
+    for (auto* p : model.parameters()) {
+        expected.push_back(p->get_grad());
+    }
+
+    model.zero_grad();
+    ptMgrad::backward(out, seeds);
+    auto params = model.parameters();
+    for (size_t i = 0; i < params.size(); ++i) {
+        EXPECT_DOUBLE_EQ(params[i]->get_grad(), expected[i]);
+    }
+}
+
+
+#define TEST_MULTI_BACKWARD(TYPE, NAME)                                \
+    TEST(ValueTest, MultiBackward##NAME) {                             \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+        Value<TYPE> c = 4.0;                                           \
+                                                                       \
+        Value<TYPE> r1 = a * b;                                        \
+        Value<TYPE> r2 = r1 * c;                                       \
+        ptMgrad::backward(std::vector<Value<TYPE>>{r1, r2});           \
+                                                                       \
+        EXPECT_EQ(a.gradX(), TYPE(15.0));                              \
+        EXPECT_EQ(b.gradX(), TYPE(10.0));                              \
+        EXPECT_EQ(c.gradX(), TYPE(6.0));                               \
+    }
+
+TEST_MULTI_BACKWARD(float, Float)
+TEST_MULTI_BACKWARD(double, Double)
+TEST_MULTI_BACKWARD(int, Int)
+
+
+TEST(ValueTest, MultiBackwardComplexSeeds) {
+    using C = complex<double>;
+    Value<C> a(C(1.0, 1.0));
+    Value<C> b(C(2.0, 0.0));
+
+    Value<C> r1 = a + b;
+    Value<C> r2 = a - b;
+    ptMgrad::backward(std::vector<Value<C>>{r1, r2}, std::vector<C>{C(1.0, 2.0), C(3.0, 0.0)});
+
+    EXPECT_EQ(a.gradX().real(), 4.0);
+    EXPECT_EQ(a.gradX().imag(), 2.0);
+    EXPECT_EQ(b.gradX().real(), -2.0);
+    EXPECT_EQ(b.gradX().imag(), 2.0);
+}
+
+
+TEST(ValueTest, MultiBackwardRepeatedRoot) {
+    Value<double> a = 3.0;
+    Value<double> e = a * a;
+
+    ptMgrad::backward(std::vector<Value<double>>{e, e}, std::vector<double>{1.0, 0.5});
+    EXPECT_EQ(a.gradX(), 9.0);
+}
+
+
+TEST(ValueTest, MultiBackwardSizeMismatch) {
+    Value<double> a = 3.0;
+    std::vector<Value<double>> roots = {a * a};
+    EXPECT_THROW(ptMgrad::backward(roots, std::vector<double>{1.0, 2.0}),
+                 std::invalid_argument);
+}
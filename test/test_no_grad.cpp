@@ -0,0 +1,113 @@
+#include <iostream>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/Array.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+#define TEST_NO_GRAD(TYPE, NAME)                                       \
+    TEST(ValueTest, NoGrad##NAME) {                                    \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+        Value<TYPE> e = a * b + a / b - relu(b - a);                   \
+                                                                       \
+        NoGradGuard no_grad;                                           \
+        Value<TYPE> f = a * b + a / b - relu(b - a);                   \
+        f.backward();                                                  \
+                                                                       \
+        EXPECT_EQ(f.dataX(), e.dataX());                               \
+        EXPECT_EQ(f.gradX(), TYPE(1.0));                               \
+        EXPECT_EQ(a.gradX(), TYPE(0.0));                               \
+        EXPECT_EQ(b.gradX(), TYPE(0.0));                               \
+    }
+
+TEST_NO_GRAD(float, Float)
+TEST_NO_GRAD(double, Double)
+TEST_NO_GRAD(int, Int)
+
+
+TEST(ValueTest, NoGradComplex) {
+    Value<complex<double>> a(complex<double>(1.0, 2.0));
+    Value<complex<double>> b(complex<double>(3.0, -1.0));
+
+    NoGradGuard no_grad;
+    Value<complex<double>> f = a * b - neg(a);
+    f.backward();
+
+    EXPECT_EQ(f.dataX().real(), 6.0);
+    EXPECT_EQ(f.dataX().imag(), 7.0);
+    EXPECT_EQ(a.gradX().real(), 0.0);
+    EXPECT_EQ(a.gradX().imag(), 0.0);
+}
+
+
+TEST(ValueTest, NoGradArray) {
+    Array<Value<double>> a = {Value<double>(1.0), Value<double>(2.0)};
+    Array<Value<double>> b = {Value<double>(3.0), Value<double>(4.0)};
+
+    NoGradGuard no_grad;
+    Array<Value<double>> c = a * b + a;
+    c[1].backward();
+
+    EXPECT_EQ(c[0].dataX(), 4.0);
+    EXPECT_EQ(c[1].dataX(), 10.0);
+    EXPECT_EQ(a[1].gradX(), 0.0);
+    EXPECT_EQ(b[1].gradX(), 0.0);
+}
+
+
+TEST(ValueTest, NoGradNothingRecorded) {
+    Value<double> a = 2.0;
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+
+    {
+        NoGradGuard no_grad;
+        Value<double> b = a * a + 1.0;
+        EXPECT_EQ(tape.size(), 0u);
+    }
+    Value<double> c = a * a;
+    EXPECT_EQ(tape.size(), 1u);
+}
+
+
+TEST(ValueTest, NoGradNestedAndRestored) {
+    EXPECT_FALSE(NoGradGuard::enabled());
+    {
+        NoGradGuard outer;
+        {
+            NoGradGuard inner;
+            EXPECT_TRUE(NoGradGuard::enabled());
+        }
+        EXPECT_TRUE(NoGradGuard::enabled());
+    }
+    EXPECT_FALSE(NoGradGuard::enabled());
+
+    Value<double> a = 2.0;
+    Value<double> b = a * a;
+    b.backward();
+    EXPECT_EQ(a.gradX(), 4.0);
+}
+
+
+TEST(ValueTest, NoGradPerThread) {
+    NoGradGuard no_grad;
+
+    double grad = 0.0;
+    std::thread worker([&grad] {
+        Value<double> a = 3.0;
+        Value<double> b = a * a;
+        b.backward();
+        grad = a.gradX();
+    });
+    worker.join();
+
+    EXPECT_TRUE(NoGradGuard::enabled());
+    EXPECT_EQ(grad, 6.0);
+}
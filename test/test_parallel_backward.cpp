@@ -0,0 +1,184 @@
+#include <iostream>
+#include <atomic>
+#include <stdexcept>
+#include <functional>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/parallel.h"
+
+
+using namespace ptMgrad;
+
+
+// added up pairwise, so that every level of the graph is wide
+template <typename T>
+static Value<T> pairwise_sum(std::vector<Value<T>> terms) {
+    while (terms.size() > 1) {
+        std::vector<Value<T>> next;
+        for (size_t i = 0; i + 1 < terms.size(); i += 2) {
+            next.push_back(terms[i] + terms[i + 1]);
+        }
+        if (terms.size() % 2) {
+            next.push_back(terms.back());
+        }
+        terms.swap(next);
+    }
+    return terms[0];
+}
+
+
+// sum over i of relu(x * w[i] + c[i]). every product reads the same x,
+// so the nodes of one level all accumulate into a shared gradient
+template <typename T>
+static Value<T> wide_graph(const Value<T>& x, std::vector<Value<T>>& w, size_t width) {
+    std::vector<Value<T>> terms;
+    for (size_t i = 0; i < width; ++i) {
+        w.push_back(Value<T>(T(int(i % 7) - 3)));
+        Value<T> h = x * w[i] + T(int(i % 5));
+        terms.push_back(ptMgrad::relu(h));
+    }
+    return pairwise_sum(terms);
+}
+
+
+#define TEST_PARALLEL_BACKWARD(TYPE, NAME)                                 \
+    TEST(ValueTest, ParallelBackward##NAME) {                              \
+        ThreadPool pool(4);                                                \
+        const size_t width = 2000;                                         \
+                                                                           \
+        Value<TYPE> x1 = 2.0;                                              \
+        std::vector<Value<TYPE>> w1;                                       \
+        Value<TYPE> serial = wide_graph(x1, w1, width);                    \
+        serial.backward();                                                 \
+                                                                           \
+        Value<TYPE> x2 = 2.0;                                              \
+        std::vector<Value<TYPE>> w2;                                       \
+        Value<TYPE> parallel = wide_graph(x2, w2, width);                  \
+        parallel.backward(pool);                                           \
+                                                                           \
+        EXPECT_EQ(x2.gradX(), x1.gradX());                                 \
+        for (size_t i = 0; i < width; ++i) {                               \
+            EXPECT_EQ(w2[i].gradX(), w1[i].gradX());                       \
+        }                                                                  \
+    }
+
+TEST_PARALLEL_BACKWARD(float, Float)
+TEST_PARALLEL_BACKWARD(double, Double)
+TEST_PARALLEL_BACKWARD(int, Int)
+
+
+// a layer of independent sums that all read the same inputs
+TEST(ValueTest, ParallelBackwardWideLayer) {
+    ThreadPool pool(4);
+    const size_t nin = 16, nout = 512;
+
+    auto run = [&](std::vector<Value<double>>& xs, bool parallel) {
+        std::vector<Value<double>> outs;
+        for (size_t o = 0; o < nout; ++o) {
+            Value<double> act = 0.0;
+            for (size_t i = 0; i < nin; ++i) {
+                act = act + xs[i] * double((o + i) % 3);
+            }
+            outs.push_back(act * act);
+        }
+        Value<double> loss = 0.0;
+        for (auto& o : outs) {
+            loss = loss + o;
+        }
+        if (parallel) {
+            loss.backward(pool);
+        } else {
+            loss.backward();
+        }
+    };
+
+    std::vector<Value<double>> a, b;
+    for (size_t i = 0; i < nin; ++i) {
+        a.push_back(Value<double>(0.25 * double(i)));
+        b.push_back(Value<double>(0.25 * double(i)));
+    }
+    run(a, false);
+    run(b, true);
+    for (size_t i = 0; i < nin; ++i) {
+        EXPECT_NEAR(b[i].gradX(), a[i].gradX(), 1e-9 * std::abs(a[i].gradX()));
+    }
+}
+
+
+TEST(ValueTest, ParallelBackwardRetainGraph) {
+    ThreadPool pool(4);
+    Value<double> x = 1.5;
+    std::vector<Value<double>> w;
+    Value<double> loss = wide_graph(x, w, 1000);
+
+    loss.backward(pool, true);
+    double once = x.gradX();
+    loss.backward(pool);
+    EXPECT_EQ(x.gradX(), 2 * once);
+
+    // freed by the second pass
+    EXPECT_THROW(loss.backward(pool), std::logic_error);
+    EXPECT_EQ(x.gradX(), 2 * once);
+}
+
+
+TEST(ValueTest, ParallelBackwardComplex) {
+    using C = complex<double>;
+    ThreadPool pool(4);
+
+    Value<C> x(C(1.0, 2.0));
+    std::vector<Value<C>> terms;
+    for (int i = 0; i < 500; ++i) {
+        terms.push_back(x * Value<C>(C(1.0, 0.0)));
+    }
+    Value<C> loss = pairwise_sum(terms);
+    loss.backward(pool);
+    EXPECT_EQ(x.gradX().real(), 500.0);
+    EXPECT_EQ(x.gradX().imag(), 0.0);
+}
+
+
+TEST(ValueTest, ThreadPoolRunsEveryTask) {
+    ThreadPool pool(3);
+    EXPECT_EQ(pool.size(), 3u);
+
+    std::vector<std::atomic<int>> hits(1000);
+    for (int round = 0; round < 10; ++round) {
+        pool.run(hits.size(), [&](size_t i) { ++hits[i]; });
+    }
+    for (auto& h : hits) {
+        EXPECT_EQ(h.load(), 10);
+    }
+}
+
+
+// back to back jobs of a few tasks, each with a function of its own,
+// which workers waking late must not mix up
+TEST(ValueTest, ThreadPoolBackToBack) {
+    ThreadPool pool(8);
+    std::vector<int> hits(2 * 2000, 0);
+    for (int round = 0; round < 2000; ++round) {
+        std::function<void(size_t)> fn = [&hits, round](size_t i) { ++hits[2 * round + i]; };
+        pool.run(2, fn);
+    }
+    for (int h : hits) {
+        EXPECT_EQ(h, 1);
+    }
+}
+
+
+TEST(ValueTest, ThreadPoolRethrows) {
+    ThreadPool pool(3);
+    EXPECT_THROW(pool.run(100, [](size_t i) {
+        if (i == 42) {
+            throw std::runtime_error("task failed");
+        }
+    }), std::runtime_error);
+
+    // the pool is still usable afterwards
+    std::atomic<int> n{0};
+    pool.run(100, [&](size_t) { ++n; });
+    EXPECT_EQ(n.load(), 100);
+}
@@ -0,0 +1,129 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/graph.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+TEST(ValueTest, RequiresGradPropagates) {
+    Value<double> x = 2.0;
+    Value<double> w = 3.0;
+    x.set_requires_grad(false);
+
+    EXPECT_TRUE(w.requires_grad());
+    EXPECT_FALSE(x.requires_grad());
+    EXPECT_FALSE((x * 2.0).requires_grad());
+    EXPECT_FALSE((x + x).requires_grad());
+    EXPECT_TRUE((x * w).requires_grad());
+    EXPECT_TRUE((w * x).requires_grad());
+}
+
+
+#define TEST_REQUIRES_GRAD(TYPE, NAME)                                 \
+    TEST(ValueTest, RequiresGrad##NAME##Constant) {                    \
+        Value<TYPE> x = 2.0;                                           \
+        Value<TYPE> w = 3.0;                                           \
+        x.set_requires_grad(false);                                    \
+                                                                       \
+        Value<TYPE> e = w * x + x * x - relu(x / w);                   \
+        e.backward();                                                  \
+                                                                       \
+        Value<TYPE> xr = 2.0;                                          \
+        Value<TYPE> wr = 3.0;                                          \
+        Value<TYPE> er = wr * xr + xr * xr - relu(xr / wr);            \
+        er.backward();                                                 \
+                                                                       \
+        EXPECT_EQ(x.gradX(), TYPE(0.0));                               \
+        EXPECT_EQ(w.gradX(), wr.gradX());                              \
+    }
+
+TEST_REQUIRES_GRAD(float, Float)
+TEST_REQUIRES_GRAD(double, Double)
+TEST_REQUIRES_GRAD(ptMgrad::complex<float>, ComplexFloat)
+TEST_REQUIRES_GRAD(ptMgrad::complex<double>, ComplexDouble)
+
+
+TEST(ValueTest, RequiresGradOnTapeAndGraph) {
+    Value<double> x = 2.0;
+    Value<double> w = 3.0;
+    x.set_requires_grad(false);
+
+    {
+        Tape<double> tape;
+        TapeScope<double> scope(tape);
+        Value<double> e = w * x + pow(x, 2.0);
+        e.backward();
+        EXPECT_EQ(w.gradX(), 2.0);
+        EXPECT_EQ(x.gradX(), 0.0);
+    }
+
+    w.zero_grad();
+    Value<double> e = w * x + pow(x, 2.0);
+    Graph<double> graph(e);
+    x.set_data(4.0);
+    graph.replay();
+    EXPECT_EQ(e.dataX(), 28.0);
+    EXPECT_EQ(w.gradX(), 4.0);
+    EXPECT_EQ(x.gradX(), 0.0);
+}
+
+
+TEST(ValueTest, BackwardInputsPrunes) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+
+    // the b branch cannot reach a
+    Value<double> e = a * a + b * b * b;
+    e.backward({&a});
+
+    EXPECT_EQ(a.gradX(), 4.0);
+    EXPECT_EQ(b.gradX(), 0.0);
+}
+
+
+TEST(ValueTest, BackwardInputsMatchesFull) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+    Value<double> c = 4.0;
+
+    Value<double> h = a * b;
+    Value<double> e = h * c + h / a - relu(c - b);
+    e.backward(true);
+    double ga = a.gradX(), gb = b.gradX(), gc = c.gradX();
+    a.zero_grad();
+    b.zero_grad();
+    c.zero_grad();
+
+    Value<double> f = h * c + h / a - relu(c - b);
+    f.backward({&a, &c}, true);
+    EXPECT_EQ(a.gradX(), ga);
+    EXPECT_EQ(c.gradX(), gc);
+
+    b.zero_grad();
+    Value<double> g = h * c + h / a - relu(c - b);
+    g.backward({&b});
+    EXPECT_EQ(b.gradX(), gb);
+}
+
+
+// assigning a new value to a constant keeps it a constant
+TEST(ValueTest, RequiresGradKeptOnAssign) {
+    Value<double> x = 2.0;
+    Value<double> w = 3.0;
+    x.set_requires_grad(false);
+
+    x = 4.0;
+    EXPECT_FALSE(x.requires_grad());
+    x += 1.0;
+    EXPECT_FALSE(x.requires_grad());
+
+    Value<double> e = x * w;
+    e.backward();
+    EXPECT_EQ(x.gradX(), 0.0);
+    EXPECT_EQ(w.gradX(), 5.0);
+}
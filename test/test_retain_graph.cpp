@@ -0,0 +1,140 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+#define TEST_FREE_GRAPH(TYPE, NAME)                                    \
+    TEST(ValueTest, FreeGraph##NAME) {                                 \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+                                                                       \
+        Value<TYPE> h = a * b;                                         \
+        Value<TYPE> e = h + a;                                         \
+        e.backward();                                                  \
+        EXPECT_EQ(a.gradX(), TYPE(4.0));                               \
+        EXPECT_EQ(b.gradX(), TYPE(2.0));                               \
+                                                                       \
+        /* the graph is gone, values and gradients are kept */         \
+        EXPECT_EQ(h.dataX(), TYPE(6.0));                               \
+        EXPECT_EQ(h.gradX(), TYPE(1.0));                               \
+                                                                       \
+        /* and no backward can go through it any more */               \
+        EXPECT_THROW(e.backward(), std::logic_error);                  \
+        EXPECT_EQ(a.gradX(), TYPE(4.0));                               \
+        EXPECT_EQ(b.gradX(), TYPE(2.0));                               \
+    }
+
+TEST_FREE_GRAPH(float, Float)
+TEST_FREE_GRAPH(double, Double)
+TEST_FREE_GRAPH(int, Int)
+
+
+#define TEST_RETAIN_GRAPH(TYPE, NAME)                                  \
+    TEST(ValueTest, RetainGraph##NAME) {                               \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+                                                                       \
+        Value<TYPE> e = a * b + a;                                     \
+        e.backward(true);                                              \
+        e.backward();                                                  \
+        EXPECT_EQ(a.gradX(), TYPE(8.0));                               \
+        EXPECT_EQ(b.gradX(), TYPE(4.0));                               \
+    }
+
+TEST_RETAIN_GRAPH(float, Float)
+TEST_RETAIN_GRAPH(double, Double)
+TEST_RETAIN_GRAPH(int, Int)
+
+
+TEST(ValueTest, FreeGraphComplex) {
+    using C = complex<double>;
+    Value<C> a(C(1.0, 2.0));
+    Value<C> b(C(3.0, 0.0));
+
+    Value<C> e = a * b;
+    e.backward();
+    EXPECT_THROW(e.backward(), std::logic_error);
+    EXPECT_EQ(a.gradX().real(), 3.0);
+    EXPECT_EQ(b.gradX().real(), 1.0);
+    EXPECT_EQ(b.gradX().imag(), 2.0);
+}
+
+
+TEST(ValueTest, FreeGraphOnTape) {
+    Value<double> a = 2.0;
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+
+    Value<double> e = a * a + a;
+    e.backward();
+    EXPECT_THROW(e.backward(), std::logic_error);
+    EXPECT_EQ(a.gradX(), 5.0);
+
+    Value<double> f = a * a;
+    f.backward(true);
+    f.backward(tape);
+    EXPECT_EQ(a.gradX(), 13.0);
+}
+
+
+// ops recorded before a root but not reached from it keep their graph
+TEST(ValueTest, FreeGraphOnTapeUnreached) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+
+    Value<double> y2 = a * b;
+    Value<double> y1 = b * b;
+    y1.backward();
+    y2.backward();
+    EXPECT_EQ(a.gradX(), 3.0);
+    EXPECT_EQ(b.gradX(), 8.0);
+}
+
+
+TEST(ValueTest, FreeGraphMultiRoot) {
+    Value<double> a = 2.0;
+    Value<double> r1 = a * 3.0;
+    Value<double> r2 = r1 * a;
+
+    std::vector<Value<double>> roots = {r1, r2};
+    ptMgrad::backward(roots);
+    EXPECT_THROW(ptMgrad::backward(roots), std::logic_error);
+    EXPECT_EQ(a.gradX(), 15.0);
+}
+
+
+// an intermediate used again after a backward through it
+TEST(ValueTest, FreeGraphReuse) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+
+    Value<double> h = a * b;
+    (h + 1.0).backward();
+    EXPECT_THROW(h * 2.0, std::logic_error);
+
+    // kept, it works
+    Value<double> k = a * b;
+    (k + 1.0).backward(true);
+    (k * 2.0).backward();
+    EXPECT_EQ(a.gradX(), 3.0 + (3.0 + 6.0));
+}
+
+
+TEST(ValueTest, FreeGraphLongChain) {
+    Value<double> x = 1.0;
+    Value<double> loss(0.0);
+    for (int i = 0; i < 200000; ++i) {
+        loss = loss + x * 0.5;
+    }
+    loss.backward();
+    EXPECT_EQ(x.gradX(), 100000.0);
+    EXPECT_EQ(loss.dataX(), 100000.0);
+}
@@ -0,0 +1,264 @@
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/saved.h"
+#include "../src/expr.h"
+#include "../src/graph.h"
+#include "../src/nn.h"
+
+
+using namespace ptMgrad;
+
+
+TEST(ValueTest, HalfConversion) {
+    EXPECT_EQ(to_half(1.0f), 0x3C00);
+    EXPECT_EQ(to_half(-2.5f), 0xC100);
+    EXPECT_EQ(to_half(65504.0f), 0x7BFF);
+    EXPECT_EQ(to_half(65520.0f), 0x7C00);
+    EXPECT_EQ(to_half(std::ldexp(1.0f, -24)), 0x0001);
+    EXPECT_EQ(to_half(std::ldexp(1.0f, -26)), 0x0000);
+    // ties go to even
+    EXPECT_EQ(to_half(1.0f + std::ldexp(1.0f, -11)), 0x3C00);
+    EXPECT_EQ(to_half(1.0f + 3 * std::ldexp(1.0f, -11)), 0x3C02);
+    EXPECT_TRUE(std::isnan(from_half(to_half(std::numeric_limits<float>::quiet_NaN()))));
+
+    for (uint32_t h = 0; h < 0x10000; ++h) {
+        float f = from_half(static_cast<uint16_t>(h));
+        if (!std::isnan(f)) {
+            EXPECT_EQ(to_half(f), h);
+        }
+    }
+}
+
+
+TEST(ValueTest, BFloat16Conversion) {
+    EXPECT_EQ(to_bfloat16(1.0f), 0x3F80);
+    EXPECT_EQ(to_bfloat16(-2.5f), 0xC020);
+    EXPECT_EQ(to_bfloat16(1.0f + std::ldexp(1.0f, -8)), 0x3F80);
+    EXPECT_EQ(to_bfloat16(1.0f + 3 * std::ldexp(1.0f, -8)), 0x3F82);
+    EXPECT_TRUE(std::isnan(from_bfloat16(to_bfloat16(std::numeric_limits<float>::quiet_NaN()))));
+
+    for (uint32_t h = 0; h < 0x10000; ++h) {
+        float f = from_bfloat16(static_cast<uint16_t>(h));
+        if (!std::isnan(f)) {
+            EXPECT_EQ(to_bfloat16(f), h);
+        }
+    }
+}
+
+
+TEST(ValueTest, BitMask) {
+    BitMask mask;
+    for (int i = 0; i < 200; ++i) {
+        mask.push_back(i % 3 == 0);
+    }
+    EXPECT_EQ(mask.size(), 200u);
+    EXPECT_EQ(mask.bytes(), 32u);
+    for (int i = 0; i < 200; ++i) {
+        EXPECT_EQ(mask[i], i % 3 == 0);
+    }
+}
+
+
+// every op, at full precision: the values and gradients of the plain ops
+#define TEST_VALUE_COMPRESS(TYPE, NAME)                                    \
+    TEST(ValueTest, Compress##NAME) {                                      \
+        Value<TYPE> w = 1.5;                                               \
+        Value<TYPE> x = -0.5;                                              \
+        Value<TYPE> y = 2.0;                                               \
+        auto fn = [&](const std::vector<Value<TYPE>>& in) {                \
+            Value<TYPE> a = in[0] * w + in[1], b = in[0] - in[1] * TYPE(3);\
+            Value<TYPE> c = relu(a) / b - -in[1] / TYPE(4);                \
+            Value<TYPE> d = pow(y, in[1]) + pow(a, TYPE(2)) - TYPE(1);     \
+            return sum(std::vector<Value<TYPE>>{c, d, dot(in, in)});       \
+        };                                                                 \
+                                                                           \
+        Value<TYPE> e = fn({w, x}) * w;                                    \
+        e.backward();                                                      \
+        TYPE gw = w.gradX(), gx = x.gradX(), gy = y.gradX();               \
+        GradGeneration::advance();                                         \
+                                                                           \
+        Value<TYPE> f = compress(fn, std::vector<Value<TYPE>>{w, x}) * w;  \
+        f.backward();                                                      \
+        EXPECT_EQ(f.dataX(), e.dataX());                                   \
+        EXPECT_NEAR(w.gradX(), gw, 1e-5 * std::abs(gw));                   \
+        EXPECT_NEAR(x.gradX(), gx, 1e-5 * std::abs(gx));                   \
+        EXPECT_NEAR(y.gradX(), gy, 1e-5 * std::abs(gy));                   \
+    }
+
+TEST_VALUE_COMPRESS(float, Float)
+TEST_VALUE_COMPRESS(double, Double)
+
+
+// an MLP compressed layer by layer, against the plain one
+static void compare_mlp(Precision precision, double tolerance, size_t spill_bytes = SIZE_MAX) {
+    std::srand(3);
+    MLP<double> model(16, {32, 32, 1});
+    std::vector<Value<double>> x;
+    for (int i = 0; i < 16; ++i) {
+        x.push_back(Value<double>(0.1 * i - 0.7));
+    }
+
+    Value<double> plain = model(x)[0];
+    plain.backward();
+    std::vector<double> grads;
+    for (auto* p : model.parameters()) {
+        grads.push_back(p->gradX());
+    }
+    model.zero_grad();
+
+    SavePolicy policy;
+    policy.precision = precision;
+    policy.spill_bytes = spill_bytes;
+    std::vector<Value<double>> h = x;
+    for (size_t i = 0; i < model.num_layers(); ++i) {
+        h = compress([&model, i](const std::vector<Value<double>>& in) {
+            return model.layer(i)(in);
+        }, h, policy);
+    }
+    h[0].backward();
+
+    // the values themselves are computed as usual
+    EXPECT_EQ(h[0].dataX(), plain.dataX());
+    double scale = 0.0;
+    for (double g : grads) {
+        scale = std::max(scale, std::abs(g));
+    }
+    std::vector<Value<double>*> params = model.parameters();
+    for (size_t i = 0; i < params.size(); ++i) {
+        EXPECT_NEAR(params[i]->gradX(), grads[i], tolerance * scale);
+    }
+}
+
+TEST(ValueTest, CompressFull) {
+    compare_mlp(Precision::Full, 1e-12);
+}
+
+TEST(ValueTest, CompressHalf) {
+    compare_mlp(Precision::Half, 2e-3);
+}
+
+TEST(ValueTest, CompressBFloat16) {
+    compare_mlp(Precision::BFloat16, 2e-2);
+}
+
+TEST(ValueTest, CompressSpill) {
+    compare_mlp(Precision::Full, 1e-12, 0);
+    compare_mlp(Precision::Half, 2e-3, 0);
+}
+
+
+// the loss of model.cpp as a trace against the same loss as nodes: a
+// chain of elementwise ops keeps a step for each node, a value only for
+// the operands of the products, and a relu a bit for its input
+TEST(ValueTest, TraceBytes) {
+    Value<double> w = 0.9;
+    Value<double> b = 0.1;
+    std::vector<Value<double>> xs;
+    for (int i = 0; i < 1000; ++i) {
+        xs.push_back(Value<double>(0.001 * i));
+    }
+
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+    Value<double> loss = 0.0;
+    for (const Value<double>& x : xs) {
+        Value<double> diff = relu(w * x + b) - x;
+        loss = loss + diff * diff;
+    }
+
+    SavePolicy policy;
+    Trace<double> full, half, spilled;
+    full.build(tape, {loss}, policy);
+    policy.precision = Precision::Half;
+    half.build(tape, {loss}, policy);
+    policy.spill_bytes = 0;
+    spilled.build(tape, {loss}, policy);
+
+    EXPECT_EQ(full.size(), tape.size());
+    EXPECT_EQ(full.saved_values(), xs.size());
+    EXPECT_LT(full.bytes(), tape.bytes());
+    EXPECT_LT(2 * half.bytes(), tape.bytes());
+    EXPECT_FALSE(half.spilled());
+    EXPECT_TRUE(spilled.spilled());
+    EXPECT_LT(spilled.bytes(), half.bytes());
+}
+
+
+// a layer reads its weights as they are, a pointer for each, so its
+// trace saves less
+TEST(ValueTest, TraceBytesLayer) {
+    std::srand(5);
+    Layer<double> layer(64, 64);
+    std::vector<Value<double>> x;
+    for (int i = 0; i < 64; ++i) {
+        x.push_back(Value<double>(0.01 * i));
+    }
+
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+    std::vector<Value<double>> out = layer(x);
+
+    SavePolicy policy;
+    policy.precision = Precision::Half;
+    Trace<double> half;
+    half.build(tape, out, policy);
+    EXPECT_LT(half.bytes(), tape.bytes());
+}
+
+
+TEST(ValueTest, CompressGraphReplay) {
+    Value<double> w = 2.0;
+    Value<double> x = 3.0;
+
+    Value<double> e = compress([&](const std::vector<Value<double>>& in) {
+        return pow(w * in[0] - 1.0, 2.0);
+    }, std::vector<Value<double>>{x});
+    Graph<double> graph(e);
+
+    w.set_data(1.0);
+    graph.replay();
+    EXPECT_EQ(e.dataX(), 4.0);
+    EXPECT_EQ(w.gradX(), 12.0);
+    EXPECT_EQ(x.gradX(), 4.0);
+}
+
+
+TEST(ValueTest, CompressRetainGraph) {
+    Value<double> a = 3.0;
+    Value<double> b = compress([](const std::vector<Value<double>>& in) {
+        return relu(in[0]) * in[0];
+    }, std::vector<Value<double>>{a});
+
+    b.backward(true);
+    b.backward(true);
+    EXPECT_EQ(a.gradX(), 12.0);
+}
+
+
+TEST(ValueTest, CompressNoGrad) {
+    Value<double> a = 2.0;
+
+    NoGradGuard no_grad;
+    Value<double> e = compress([](const std::vector<Value<double>>& in) {
+        return in[0] * in[0];
+    }, std::vector<Value<double>>{a});
+    e.backward();
+
+    EXPECT_EQ(e.dataX(), 4.0);
+    EXPECT_EQ(a.gradX(), 0.0);
+}
+
+
+TEST(ValueTest, CompressRejectsFused) {
+    Value<double> a = 2.0;
+    auto fn = [](const std::vector<Value<double>>& in) {
+        return fuse(ex(in[0]) * in[0]);
+    };
+    EXPECT_THROW(compress(fn, std::vector<Value<double>>{a}), std::invalid_argument);
+}
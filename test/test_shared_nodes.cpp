@@ -0,0 +1,74 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+/*
+ * A value used by several ops is one node of the graph,
+ * so its gradient is accumulated once per use, not per copy.
+ */
+
+
+#define TEST_SHARED_SUBEXPRESSION(TYPE, NAME)                          \
+    TEST(ValueTest, Shared##NAME##Subexpression) {                     \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+                                                                       \
+        Value<TYPE> h = a * b;                                         \
+        Value<TYPE> z = h + h;                                         \
+        z.backward();                                                  \
+                                                                       \
+        EXPECT_EQ(h.gradX(), TYPE(2.0));                               \
+        EXPECT_EQ(a.gradX(), TYPE(6.0));                               \
+        EXPECT_EQ(b.gradX(), TYPE(4.0));                               \
+    }
+
+TEST_SHARED_SUBEXPRESSION(float, Float)
+TEST_SHARED_SUBEXPRESSION(double, Double)
+TEST_SHARED_SUBEXPRESSION(int, Int)
+
+
+TEST(ValueTest, SharedComplexSubexpression) {
+    Value<complex<double>> a(complex<double>(2.0, 0.0));
+    Value<complex<double>> b(complex<double>(3.0, 0.0));
+
+    Value<complex<double>> h = a * b;
+    Value<complex<double>> z = h + h;
+    z.backward();
+
+    EXPECT_EQ(a.gradX().real(), 6.0);
+    EXPECT_EQ(b.gradX().real(), 4.0);
+}
+
+
+TEST(ValueTest, SharedOperandOfOneOp) {
+    Value<double> a = 3.0;
+
+    Value<double> h = a + 1.0;
+    Value<double> z = h * h;
+    z.backward();
+
+    EXPECT_EQ(z.dataX(), 16.0);
+    EXPECT_EQ(a.gradX(), 8.0);
+}
+
+
+TEST(ValueTest, SharedAcrossLongChain) {
+    Value<double> x = 0.5;
+    Value<double> h = x * 2.0;
+
+    Value<double> s(0.0);
+    for (int i = 0; i < 100; ++i) {
+        s = s + h;
+    }
+    s.backward();
+
+    EXPECT_EQ(h.gradX(), 100.0);
+    EXPECT_EQ(x.gradX(), 200.0);
+}
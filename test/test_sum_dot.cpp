@@ -0,0 +1,222 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/graph.h"
+#include "../src/arena.h"
+#include "../src/Array.h"
+#include "../src/nn.h"
+
+
+using namespace ptMgrad;
+
+
+// sum
+
+#define TEST_VALUE_SUM(TYPE, NAME)                                         \
+    TEST(ValueTest, Sum##NAME) {                                           \
+        std::vector<Value<TYPE>> a = {1.0, 2.0, 3.0, 4.0};                 \
+                                                                           \
+        Value<TYPE> b = ptMgrad::sum(a);                                   \
+        Value<TYPE> c = b * a[1];                                          \
+        c.backward();                                                      \
+                                                                           \
+        EXPECT_EQ(b.dataX(), TYPE(10.0));                                  \
+        EXPECT_EQ(c.dataX(), TYPE(20.0));                                  \
+        EXPECT_EQ(a[0].gradX(), TYPE(2.0));                                \
+        EXPECT_EQ(a[1].gradX(), TYPE(12.0));                               \
+        EXPECT_EQ(a[2].gradX(), TYPE(2.0));                                \
+        EXPECT_EQ(a[3].gradX(), TYPE(2.0));                                \
+    }
+
+TEST_VALUE_SUM(float, Float)
+TEST_VALUE_SUM(double, Double)
+TEST_VALUE_SUM(int, Int)
+
+
+// dot
+
+#define TEST_VALUE_DOT(TYPE, NAME)                                         \
+    TEST(ValueTest, Dot##NAME) {                                           \
+        std::vector<Value<TYPE>> a = {1.0, 2.0, 3.0};                      \
+        std::vector<Value<TYPE>> b = {4.0, -5.0, 6.0};                     \
+                                                                           \
+        Value<TYPE> c = ptMgrad::dot(a, b);                                \
+        c.backward();                                                      \
+                                                                           \
+        EXPECT_EQ(c.dataX(), TYPE(12.0));                                  \
+        for (size_t i = 0; i < a.size(); ++i) {                            \
+            EXPECT_EQ(a[i].gradX(), b[i].dataX());                         \
+            EXPECT_EQ(b[i].gradX(), a[i].dataX());                         \
+        }                                                                  \
+    }
+
+TEST_VALUE_DOT(float, Float)
+TEST_VALUE_DOT(double, Double)
+TEST_VALUE_DOT(int, Int)
+
+
+// the same value and gradients as the chain of products and adds
+#define TEST_VALUE_DOT_CHAIN(TYPE, NAME)                                   \
+    TEST(ValueTest, Dot##NAME##MatchesChain) {                             \
+        std::vector<Value<TYPE>> a, b;                                     \
+        for (int i = 0; i < 50; ++i) {                                     \
+            a.push_back(Value<TYPE>(TYPE(0.25 * (i % 7) - 0.5)));          \
+            b.push_back(Value<TYPE>(TYPE(0.5 * (i % 5) + 0.125)));         \
+        }                                                                  \
+                                                                           \
+        Value<TYPE> chain = TYPE(0.0);                                     \
+        for (size_t i = 0; i < a.size(); ++i) {                            \
+            chain = chain + a[i] * b[i];                                   \
+        }                                                                  \
+        Value<TYPE> e = relu(chain) * chain;                               \
+        e.backward();                                                      \
+        std::vector<TYPE> ga, gb;                                          \
+        for (size_t i = 0; i < a.size(); ++i) {                            \
+            ga.push_back(a[i].gradX());                                    \
+            gb.push_back(b[i].gradX());                                    \
+            a[i].zero_grad();                                              \
+            b[i].zero_grad();                                              \
+        }                                                                  \
+                                                                           \
+        Value<TYPE> d = ptMgrad::dot(a, b);                                \
+        Value<TYPE> f = relu(d) * d;                                       \
+        f.backward();                                                      \
+        EXPECT_EQ(f.dataX(), e.dataX());                                   \
+        for (size_t i = 0; i < a.size(); ++i) {                            \
+            EXPECT_EQ(a[i].gradX(), ga[i]);                                \
+            EXPECT_EQ(b[i].gradX(), gb[i]);                                \
+        }                                                                  \
+    }
+
+TEST_VALUE_DOT_CHAIN(float, Float)
+TEST_VALUE_DOT_CHAIN(double, Double)
+
+
+TEST(ValueTest, DotSharedOperand) {
+    std::vector<Value<double>> a = {1.0, -2.0, 3.0};
+
+    Value<double> c = ptMgrad::dot(a, a);
+    c.backward();
+
+    EXPECT_EQ(c.dataX(), 14.0);
+    EXPECT_EQ(a[0].gradX(), 2.0);
+    EXPECT_EQ(a[1].gradX(), -4.0);
+    EXPECT_EQ(a[2].gradX(), 6.0);
+}
+
+
+TEST(ValueTest, DotSizeMismatch) {
+    std::vector<Value<double>> a = {1.0, 2.0};
+    std::vector<Value<double>> b = {1.0};
+
+    EXPECT_THROW(ptMgrad::dot(a, b), std::invalid_argument);
+}
+
+
+TEST(ValueTest, SumEmpty) {
+    std::vector<Value<double>> a;
+
+    Value<double> b = ptMgrad::sum(a);
+    b.backward();
+
+    EXPECT_EQ(b.dataX(), 0.0);
+}
+
+
+TEST(ValueTest, ComplexSumDot) {
+    using C = complex<double>;
+    std::vector<Value<C>> a = {Value<C>(C(1.0, 2.0)), Value<C>(C(3.0, -1.0))};
+    std::vector<Value<C>> b = {Value<C>(C(0.5, 0.0)), Value<C>(C(2.0, 1.0))};
+
+    Value<C> s = ptMgrad::sum(a);
+    EXPECT_EQ(s.dataX().real(), 4.0);
+    EXPECT_EQ(s.dataX().imag(), 1.0);
+
+    // (1 + 2i) * 0.5 + (3 - i) * (2 + i) = 7.5 + 2i
+    Value<C> d = ptMgrad::dot(a, b);
+    d.backward();
+    EXPECT_EQ(d.dataX().real(), 7.5);
+    EXPECT_EQ(d.dataX().imag(), 2.0);
+    EXPECT_EQ(a[1].gradX().real(), 2.0);
+    EXPECT_EQ(a[1].gradX().imag(), 1.0);
+    EXPECT_EQ(b[0].gradX().real(), 1.0);
+    EXPECT_EQ(b[0].gradX().imag(), 2.0);
+}
+
+
+TEST(ValueTest, ArraySumDot) {
+    Array<Value<double>> a = {Value<double>(1.0), Value<double>(2.0), Value<double>(3.0)};
+    Array<Value<double>> b = {Value<double>(2.0), Value<double>(2.0), Value<double>(-1.0)};
+
+    Value<double> s = ptMgrad::sum(a);
+    Value<double> d = ptMgrad::dot(a, b);
+    Value<double> e = s + d;
+    e.backward();
+
+    EXPECT_EQ(s.dataX(), 6.0);
+    EXPECT_EQ(d.dataX(), 3.0);
+    EXPECT_EQ(a[0].gradX(), 3.0);
+    EXPECT_EQ(a[2].gradX(), 0.0);
+    EXPECT_EQ(b[1].gradX(), 2.0);
+}
+
+
+TEST(ValueTest, SumDotInArena) {
+    std::vector<Value<double>> a = {1.0, 2.0, 3.0};
+    Arena arena;
+    for (int step = 0; step < 3; ++step) {
+        ArenaScope scope(arena);
+        std::vector<Value<double>> h;
+        for (auto& x : a) {
+            h.push_back(x * 2.0);
+        }
+        Value<double> e = ptMgrad::dot(h, a) + ptMgrad::sum(h);
+        e.backward();
+    }
+    // d/dx (2x * x + 2x) = 4x + 2, three times
+    EXPECT_EQ(a[0].gradX(), 18.0);
+    EXPECT_EQ(a[2].gradX(), 42.0);
+}
+
+
+TEST(ValueTest, SumDotNoGrad) {
+    std::vector<Value<double>> a = {1.0, 2.0};
+
+    NoGradGuard no_grad;
+    Value<double> d = ptMgrad::dot(a, a);
+    d.backward();
+
+    EXPECT_EQ(d.dataX(), 5.0);
+    EXPECT_EQ(a[0].gradX(), 0.0);
+}
+
+
+TEST(ValueTest, SumDotGraphReplay) {
+    std::vector<Value<double>> a = {1.0, 2.0, 3.0};
+    std::vector<Value<double>> b = {4.0, 5.0, 6.0};
+
+    Value<double> e = ptMgrad::dot(a, b) * ptMgrad::sum(b);
+    Graph<double> graph(e);
+    EXPECT_EQ(graph.size(), 3u);
+
+    a[0].set_data(2.0);
+    graph.replay();
+    // (8 + 10 + 18) * 15
+    EXPECT_EQ(e.dataX(), 540.0);
+    EXPECT_EQ(a[0].gradX(), 60.0);
+    // 15 * a[1] + 36
+    EXPECT_EQ(b[1].gradX(), 66.0);
+}
+
+
+// a neuron is one Dot, one bias add and the relu, whatever its width
+TEST(ValueTest, NeuronNodeCount) {
+    Neuron<double> neuron(64);
+    std::vector<Value<double>> x(64, Value<double>(0.5));
+
+    Value<double> out = neuron(x);
+    Graph<double> graph(out);
+    EXPECT_EQ(graph.size(), 3u);
+}
@@ -0,0 +1,125 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/arena.h"
+#include "../src/complex.h"
+
+
+using namespace ptMgrad;
+
+
+#define TEST_TAPE_BACKWARD(TYPE, NAME)                                 \
+    TEST(ValueTest, Tape##NAME##Backward) {                            \
+        Value<TYPE> a = 2.0;                                           \
+        Value<TYPE> b = 3.0;                                           \
+        Value<TYPE> c = 4.0;                                           \
+                                                                       \
+        Value<TYPE> e = a * b + c / a - relu(b - c);                   \
+        e.backward();                                                  \
+        TYPE ga = a.gradX(), gb = b.gradX(), gc = c.gradX();           \
+        a.zero_grad();                                                 \
+        b.zero_grad();                                                 \
+        c.zero_grad();                                                 \
+                                                                       \
+        Tape<TYPE> tape;                                               \
+        {                                                              \
+            TapeScope<TYPE> scope(tape);                               \
+            Value<TYPE> f = a * b + c / a - relu(b - c);               \
+            EXPECT_EQ(tape.size(), 6u);                                \
+            f.backward();                                              \
+        }                                                              \
+        EXPECT_EQ(tape.size(), 0u);                                    \
+        EXPECT_EQ(a.gradX(), ga);                                      \
+        EXPECT_EQ(b.gradX(), gb);                                      \
+        EXPECT_EQ(c.gradX(), gc);                                      \
+    }
+
+TEST_TAPE_BACKWARD(float, Float)
+TEST_TAPE_BACKWARD(double, Double)
+TEST_TAPE_BACKWARD(ptMgrad::complex<float>, ComplexFloat)
+TEST_TAPE_BACKWARD(ptMgrad::complex<double>, ComplexDouble)
+
+
+TEST(ValueTest, TapeIgnoresLaterOps) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+
+    Value<double> c = a * b;
+    Value<double> d = c * a;   // recorded after c, not reachable from it
+    d.backward(true);
+    EXPECT_EQ(a.gradX(), 12.0);
+
+    a.zero_grad();
+    b.zero_grad();
+    c.backward(tape);
+    EXPECT_EQ(a.gradX(), 3.0);
+    EXPECT_EQ(b.gradX(), 2.0);
+}
+
+
+TEST(ValueTest, TapeSharedSubexpression) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+
+    Value<double> h = a * b;
+    Value<double> z = h + h;
+    z.backward();
+    EXPECT_EQ(a.gradX(), 6.0);
+    EXPECT_EQ(b.gradX(), 4.0);
+}
+
+
+TEST(ValueTest, TapeWithArena) {
+    Value<double> w = 0.5;
+    Arena arena;
+    Tape<double> tape;
+
+    for (int step = 0; step < 3; ++step) {
+        ArenaScope memory(arena);
+        TapeScope<double> scope(tape);
+
+        Value<double> loss(0.0);
+        for (int i = 1; i <= 4; ++i) {
+            loss = loss + w * double(i);
+        }
+        w.zero_grad();
+        loss.backward();
+        EXPECT_EQ(w.gradX(), 10.0);
+    }
+}
+
+
+// ops built before the tape are not on it, so backward sorts the
+// graph instead, running them and zeroing their gradients
+TEST(ValueTest, TapeFallsBackForEarlierOps) {
+    Value<double> a = 2.0;
+    Value<double> b = a * a;
+    (b + 1.0).backward(true);
+    EXPECT_EQ(b.gradX(), 1.0);
+    a.zero_grad();
+
+    Tape<double> tape;
+    TapeScope<double> scope(tape);
+    Value<double> c = b * 3.0;
+    c.backward(true);
+    EXPECT_EQ(a.gradX(), 12.0);
+    EXPECT_EQ(b.gradX(), 3.0);
+    EXPECT_THROW(c.backward(tape), std::invalid_argument);
+}
+
+
+TEST(ValueTest, TapeRejectsUnrecordedRoot) {
+    Value<double> a = 2.0;
+    Value<double> b = a * a;
+
+    Tape<double> tape;
+    EXPECT_THROW(b.backward(tape), std::invalid_argument);
+}
@@ -0,0 +1,218 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/tensor.h"
+#include "../src/parallel.h"
+
+
+using namespace ptMgrad;
+
+
+TEST(ValueTest, TensorShape) {
+    Tensor<double> a({2, 3}, {1.0, 2.0, 3.0, 4.0, 5.0, 6.0});
+    EXPECT_EQ(a.dim(), 2u);
+    EXPECT_EQ(a.numel(), 6u);
+    EXPECT_EQ(a.strides(), Shape({3, 1}));
+    EXPECT_EQ(a.at({1, 0}), 4.0);
+    EXPECT_EQ(a.at({0, 2}), 3.0);
+    EXPECT_THROW(a.at({2, 0}), std::out_of_range);
+    EXPECT_THROW(a.item(), std::invalid_argument);
+
+    Tensor<double> s;
+    EXPECT_EQ(s.dim(), 0u);
+    EXPECT_EQ(s.item(), 0.0);
+
+    Tensor<double> f({4, 5, 6}, 2.5);
+    EXPECT_EQ(f.strides(), Shape({30, 6, 1}));
+    EXPECT_EQ(f.at({3, 4, 5}), 2.5);
+
+    EXPECT_THROW(Tensor<double>({2, 2}, {1.0, 2.0, 3.0}), std::invalid_argument);
+    EXPECT_THROW(a + f, std::invalid_argument);
+}
+
+
+// every op, against the same ops on one Value per element
+#define TEST_TENSOR_OPS(TYPE, NAME)                                              \
+    TEST(ValueTest, TensorOps##NAME) {                                           \
+        std::vector<TYPE> xs = {0.5, -1.5, 2.0, 3.0, -0.25, 1.0};                \
+        std::vector<TYPE> ys = {2.0, 0.5, -1.0, 4.0, 1.5, -3.0};                 \
+        Tensor<TYPE> x({2, 3}, xs);                                              \
+        Tensor<TYPE> y({2, 3}, ys);                                              \
+                                                                                 \
+        Tensor<TYPE> a = relu(x * y + TYPE(1)) - x / y;                          \
+        Tensor<TYPE> b = pow(a, TYPE(2)) * TYPE(0.5) - -y / TYPE(4);             \
+        Tensor<TYPE> e = sum(b + TYPE(3) / (y * y) - TYPE(2));                   \
+        e.backward();                                                            \
+                                                                                 \
+        Value<TYPE> total = 0.0;                                                 \
+        std::vector<Value<TYPE>> vx(xs.begin(), xs.end());                       \
+        std::vector<Value<TYPE>> vy(ys.begin(), ys.end());                       \
+        for (size_t i = 0; i < xs.size(); ++i) {                                 \
+            Value<TYPE> va = relu(vx[i] * vy[i] + TYPE(1)) - vx[i] / vy[i];      \
+            Value<TYPE> vb = pow(va, TYPE(2)) * TYPE(0.5) - -vy[i] / TYPE(4);    \
+            total = total + vb + Value<TYPE>(TYPE(3)) / (vy[i] * vy[i]) - TYPE(2); \
+        }                                                                        \
+        total.backward();                                                        \
+                                                                                 \
+        EXPECT_NEAR(e.item(), total.dataX(), 1e-5 * std::abs(total.dataX()));    \
+        Tensor<TYPE> gx = x.grad(), gy = y.grad();                               \
+        for (size_t i = 0; i < xs.size(); ++i) {                                 \
+            EXPECT_NEAR(gx.data()[i], vx[i].gradX(), 1e-5 * (1 + std::abs(vx[i].gradX()))); \
+            EXPECT_NEAR(gy.data()[i], vy[i].gradX(), 1e-5 * (1 + std::abs(vy[i].gradX()))); \
+        }                                                                        \
+    }
+
+TEST_TENSOR_OPS(float, Float)
+TEST_TENSOR_OPS(double, Double)
+
+
+TEST(ValueTest, TensorComplex) {
+    using C = complex<double>;
+    Tensor<C> a({2}, std::vector<C>{C(1.0, 2.0), C(-1.0, 0.5)});
+    Tensor<C> b({2}, std::vector<C>{C(3.0, -1.0), C(2.0, 2.0)});
+
+    // (1 + 2i)(3 - i) = 5 + 5i, (-1 + 0.5i)(2 + 2i) = -3 - i
+    Tensor<C> c = a * b;
+    EXPECT_EQ(c.data()[0].real(), 5.0);
+    EXPECT_EQ(c.data()[0].imag(), 5.0);
+    EXPECT_EQ(c.data()[1].real(), -3.0);
+    EXPECT_EQ(c.data()[1].imag(), -1.0);
+
+    Tensor<C> e = sum(relu(c) + a);
+    EXPECT_EQ(e.item().real(), 5.0);
+    EXPECT_EQ(e.item().imag(), 7.5);
+    e.backward();
+
+    // relu passes both parts of the first product and blocks both
+    // parts of the second
+    Tensor<C> ga = a.grad(), gb = b.grad();
+    EXPECT_EQ(ga.data()[0].real(), 4.0);
+    EXPECT_EQ(ga.data()[0].imag(), -1.0);
+    EXPECT_EQ(ga.data()[1].real(), 1.0);
+    EXPECT_EQ(ga.data()[1].imag(), 0.0);
+    EXPECT_EQ(gb.data()[0].real(), 1.0);
+    EXPECT_EQ(gb.data()[0].imag(), 2.0);
+    EXPECT_EQ(gb.data()[1].real(), 0.0);
+    EXPECT_EQ(gb.data()[1].imag(), 0.0);
+}
+
+
+// a graph over a million elements is a handful of nodes
+TEST(ValueTest, TensorOneNodePerOp) {
+    Tensor<float> w({1000, 1000}, 0.5f);
+    Tensor<float> x({1000, 1000}, 2.0f);
+
+    Tensor<float> e = sum(relu(w * x - 0.5f) * w);
+    EXPECT_EQ(e.graph_size(), 7u);
+    EXPECT_EQ(e.item(), 1e6f * 0.25f);
+
+    e.backward();
+    Tensor<float> g = w.grad();
+    // d/dw of w relu(w x - 0.5) = relu(w x - 0.5) + w x
+    EXPECT_EQ(g.at({0, 0}), 1.5f);
+    EXPECT_EQ(g.at({999, 999}), 1.5f);
+}
+
+
+TEST(ValueTest, TensorAccumulate) {
+    Tensor<double> a({3}, {1.0, 2.0, 3.0});
+
+    Tensor<double> b = sum(a * a);
+    b.backward(true);
+    b.backward();
+    EXPECT_EQ(a.grad().at({2}), 12.0);
+
+    a.zero_grad();
+    EXPECT_EQ(a.grad_data(), nullptr);
+    EXPECT_EQ(a.grad().at({2}), 0.0);
+
+    Tensor<double> c = sum(a * 2.0);
+    c.backward();
+    EXPECT_EQ(a.grad().at({2}), 2.0);
+
+    GradGeneration::advance();
+    EXPECT_EQ(a.grad_data(), nullptr);
+    Tensor<double> d = sum(a * 3.0);
+    d.backward();
+    EXPECT_EQ(a.grad().at({2}), 3.0);
+}
+
+
+// backward frees the graph, after which the ops are leaves
+TEST(ValueTest, TensorFreesGraph) {
+    Tensor<double> a({2}, {1.0, 2.0});
+    Tensor<double> h = a * 3.0;
+    Tensor<double> e = sum(h * h);
+    EXPECT_EQ(e.graph_size(), 4u);
+
+    e.backward();
+    EXPECT_EQ(e.graph_size(), 1u);
+    EXPECT_EQ(a.grad().at({1}), 36.0);
+    EXPECT_EQ(h.grad().at({1}), 12.0);
+
+    // nothing goes through the freed ops any more
+    EXPECT_THROW(e.backward(), std::logic_error);
+    EXPECT_THROW(h * 2.0, std::logic_error);
+    EXPECT_THROW(h.slice(0, 0, 1), std::logic_error);
+    EXPECT_EQ(a.grad().at({1}), 36.0);
+}
+
+
+TEST(ValueTest, TensorRequiresGrad) {
+    Tensor<double> a({2}, {1.0, 2.0});
+    Tensor<double> b({2}, {3.0, 4.0});
+    b.set_requires_grad(false);
+
+    Tensor<double> c = b * 2.0;
+    EXPECT_FALSE(c.requires_grad());
+
+    Tensor<double> e = sum(a * c);
+    EXPECT_EQ(e.graph_size(), 3u);
+    e.backward();
+    EXPECT_EQ(a.grad().at({1}), 8.0);
+    EXPECT_EQ(b.grad_data(), nullptr);
+}
+
+
+TEST(ValueTest, TensorNoGrad) {
+    Tensor<double> a({2}, {1.0, 2.0});
+
+    NoGradGuard no_grad;
+    Tensor<double> e = sum(a * a);
+    EXPECT_EQ(e.item(), 5.0);
+    EXPECT_EQ(e.graph_size(), 1u);
+    e.backward();
+    EXPECT_EQ(a.grad_data(), nullptr);
+}
+
+
+// destroying a long chain doesn't overflow the stack
+TEST(ValueTest, TensorLongChain) {
+    Tensor<double> a({4}, 1.0);
+    Tensor<double> h = a;
+    for (int i = 0; i < 100000; ++i) {
+        h = h + 1.0;
+    }
+    EXPECT_EQ(h.at({0}), 100001.0);
+}
+
+
+// graphs on several threads over shared parameters
+TEST(ValueTest, TensorParallel) {
+    ThreadPool pool(4);
+    Tensor<double> w({64}, 0.5);
+
+    for_each_sample(pool, 200, [&](size_t i) {
+        Tensor<double> x({64}, double(i % 4));
+        Tensor<double> e = sum(w * x);
+        e.backward();
+    });
+
+    // 50 each of 0, 1, 2 and 3
+    EXPECT_EQ(w.grad().at({0}), 300.0);
+    EXPECT_EQ(w.grad().at({63}), 300.0);
+}
@@ -116,6 +116,19 @@ TEST(ValueTest, ComplexNeg) {
 }
 
 
+TEST(ValueTest, ComplexNegOPBackward) {
+    Value<complex<float>> a(complex<float>(1.0f, 2.0f));
+
+    Value<complex<float>> b = -a;
+    b.backward();
+
+    EXPECT_EQ(b.dataX().real(), -1.0f);
+    EXPECT_EQ(b.dataX().imag(), -2.0f);
+    EXPECT_EQ(a.gradX().real(), -1.0f);
+    EXPECT_EQ(a.gradX().imag(), 0.0f);
+}
+
+
 TEST(ValueTest, ComplexNegNeg) {
     Value<complex<float>> a(complex<float>(-1.0f, -2.0f));
 
@@ -0,0 +1,233 @@
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/tensor.h"
+
+
+using namespace ptMgrad;
+
+
+template <typename T>
+static std::vector<T> random_matrix(size_t n) {
+    std::vector<T> v(n);
+    for (auto& x : v) {
+        x = T(std::rand()) / T(RAND_MAX) * T(2) - T(1);
+    }
+    return v;
+}
+
+
+// a slice shares the elements of the tensor it's taken of, and its
+// gradient lands on the elements it covers
+TEST(ValueTest, ViewSlice) {
+    Tensor<double> a({3, 4}, {0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0});
+
+    // columns 1 and 3 of rows 1 and 2
+    Tensor<double> s = a.slice(0, 1, 3).slice(1, 1, 4, 2);
+    EXPECT_EQ(s.shape(), Shape({2, 2}));
+    EXPECT_EQ(s.strides(), Shape({4, 2}));
+    EXPECT_EQ(s.data(), a.data() + 5);
+    EXPECT_FALSE(s.is_contiguous());
+    EXPECT_EQ(s.at({0, 0}), 5.0);
+    EXPECT_EQ(s.at({1, 1}), 11.0);
+
+    Tensor<double> e = sum(s * s);
+    EXPECT_EQ(e.item(), 25.0 + 49.0 + 81.0 + 121.0);
+    e.backward();
+    Tensor<double> g = a.grad();
+    EXPECT_EQ(g.at({1, 1}), 10.0);
+    EXPECT_EQ(g.at({2, 3}), 22.0);
+    EXPECT_EQ(g.at({1, 2}), 0.0);
+    EXPECT_EQ(g.at({0, 1}), 0.0);
+
+    // writing through a view writes the shared element
+    s.data()[0] = -1.0;
+    EXPECT_EQ(a.at({1, 1}), -1.0);
+
+    EXPECT_THROW(a.slice(2, 0, 1), std::out_of_range);
+    EXPECT_THROW(a.slice(1, 3, 5), std::out_of_range);
+    EXPECT_THROW(a.slice(1, 0, 2, 0), std::invalid_argument);
+}
+
+
+// a transpose goes into matmul as it is, read by gemm along swapped
+// strides
+#define TEST_VIEW_TRANSPOSE(TYPE, NAME, TOL)                                     \
+    TEST(ValueTest, ViewTranspose##NAME) {                                       \
+        std::srand(6);                                                           \
+        size_t m = 17, k = 9, n = 11;                                            \
+        Tensor<TYPE> at({k, m}, random_matrix<TYPE>(k * m));                     \
+        Tensor<TYPE> b({n, k}, random_matrix<TYPE>(n * k));                      \
+                                                                                 \
+        Tensor<TYPE> a = at.transpose();                                         \
+        EXPECT_EQ(a.shape(), Shape({m, k}));                                     \
+        EXPECT_EQ(a.data(), at.data());                                          \
+        Tensor<TYPE> c = matmul(a, b.transpose());                               \
+        Tensor<TYPE> e = sum(c * c);                                             \
+        e.backward();                                                            \
+                                                                                 \
+        /* the same from contiguous copies, of new views, as backward */         \
+        /* has made a a leaf */                                                  \
+        Tensor<TYPE> ac = at.transpose().contiguous();                           \
+        Tensor<TYPE> bc = b.transpose().contiguous();                            \
+        EXPECT_TRUE(ac.is_contiguous());                                         \
+        EXPECT_NE(ac.data(), at.data());                                         \
+        Tensor<TYPE> c2 = matmul(ac, bc);                                        \
+        for (size_t i = 0; i < m; ++i) {                                         \
+            for (size_t j = 0; j < n; ++j) {                                     \
+                EXPECT_NEAR(c.at({i, j}), c2.at({i, j}), TOL);                   \
+            }                                                                    \
+        }                                                                        \
+        Tensor<TYPE> gat = at.grad(), gb = b.grad();                             \
+        GradGeneration::advance();                                               \
+        Tensor<TYPE> e2 = sum(c2 * c2);                                          \
+        e2.backward();                                                           \
+        for (size_t p = 0; p < k; ++p) {                                         \
+            for (size_t i = 0; i < m; ++i) {                                     \
+                EXPECT_NEAR(gat.at({p, i}), at.grad().at({p, i}), TOL);          \
+            }                                                                    \
+            for (size_t j = 0; j < n; ++j) {                                     \
+                EXPECT_NEAR(gb.at({j, p}), b.grad().at({j, p}), TOL);            \
+            }                                                                    \
+        }                                                                        \
+    }
+
+TEST_VIEW_TRANSPOSE(float, Float, 1e-4)
+TEST_VIEW_TRANSPOSE(double, Double, 1e-12)
+
+
+TEST(ValueTest, ViewReshape) {
+    Tensor<double> a({2, 3}, {1.0, 2.0, 3.0, 4.0, 5.0, 6.0});
+
+    // a view of a contiguous tensor
+    Tensor<double> r = a.reshape({3, 2});
+    EXPECT_EQ(r.data(), a.data());
+    EXPECT_EQ(r.at({2, 0}), 5.0);
+
+    // a copy of a transpose, whose elements aren't row major
+    Tensor<double> t = a.transpose().reshape({6});
+    EXPECT_NE(t.data(), a.data());
+    EXPECT_EQ(t.at({1}), 4.0);
+    EXPECT_EQ(t.at({4}), 3.0);
+
+    Tensor<double> w({6}, {1.0, 2.0, 3.0, 4.0, 5.0, 6.0});
+    w.set_requires_grad(false);
+    Tensor<double> e = sum(r.reshape({6}) * w) + sum(t * w);
+    e.backward();
+    // a[0][2] is element 2 of r and element 4 of t
+    EXPECT_EQ(a.grad().at({0, 2}), 3.0 + 5.0);
+    EXPECT_EQ(a.grad().at({1, 0}), 4.0 + 2.0);
+
+    EXPECT_THROW(a.reshape({4}), std::invalid_argument);
+}
+
+
+// a row of biases added to every row of a matrix is broadcast along
+// stride 0, and its gradient is the sum of those of the rows
+TEST(ValueTest, ViewBiasRow) {
+    Tensor<double> x({3, 2}, {1.0, 2.0, 3.0, 4.0, 5.0, 6.0});
+    Tensor<double> b({2}, {10.0, 20.0});
+
+    Tensor<double> y = x + b;
+    EXPECT_EQ(y.shape(), Shape({3, 2}));
+    EXPECT_EQ(y.at({2, 1}), 26.0);
+
+    // x, b, the add, the product and the sum: no node holds a copy of b
+    Tensor<double> e = sum(y * y);
+    EXPECT_EQ(e.graph_size(), 5u);
+    e.backward();
+    EXPECT_EQ(b.grad().at({0}), 2.0 * (11.0 + 13.0 + 15.0));
+    EXPECT_EQ(b.grad().at({1}), 2.0 * (22.0 + 24.0 + 26.0));
+    EXPECT_EQ(x.grad().at({1, 0}), 26.0);
+
+    // expand makes the same view explicit
+    Tensor<double> be = b.expand({3, 2});
+    EXPECT_EQ(be.data(), b.data());
+    EXPECT_EQ(be.strides(), Shape({0, 1}));
+    EXPECT_EQ(be.at({2, 1}), 20.0);
+
+    EXPECT_THROW(x + Tensor<double>({3}), std::invalid_argument);
+    EXPECT_THROW(b.expand({3, 3}), std::invalid_argument);
+    EXPECT_THROW(x.expand({2}), std::invalid_argument);
+}
+
+
+// every elementwise op on broadcast operands, against the same ops on
+// one Value per element
+#define TEST_VIEW_BROADCAST(TYPE, NAME)                                          \
+    TEST(ValueTest, ViewBroadcast##NAME) {                                       \
+        std::vector<TYPE> cs = {0.5, -1.5, 2.0};                                 \
+        std::vector<TYPE> rs = {2.0, 0.5, -1.0, 4.0};                            \
+        Tensor<TYPE> col({3, 1}, cs);                                            \
+        Tensor<TYPE> row({4}, rs);                                               \
+        Tensor<TYPE> s({}, std::vector<TYPE>{TYPE(1.5)});                        \
+                                                                                 \
+        Tensor<TYPE> a = relu(col * row - s) + col / row;                        \
+        EXPECT_EQ(a.shape(), Shape({3, 4}));                                     \
+        Tensor<TYPE> e = sum(a * a.slice(1, 0, 1) - row);                        \
+        e.backward();                                                            \
+                                                                                 \
+        std::vector<Value<TYPE>> vc(cs.begin(), cs.end());                       \
+        std::vector<Value<TYPE>> vr(rs.begin(), rs.end());                       \
+        Value<TYPE> vs = TYPE(1.5);                                              \
+        Value<TYPE> total = 0.0;                                                 \
+        for (size_t i = 0; i < 3; ++i) {                                         \
+            Value<TYPE> first = relu(vc[i] * vr[0] - vs) + vc[i] / vr[0];        \
+            for (size_t j = 0; j < 4; ++j) {                                     \
+                Value<TYPE> va = relu(vc[i] * vr[j] - vs) + vc[i] / vr[j];       \
+                total = total + va * first - vr[j];                              \
+            }                                                                    \
+        }                                                                        \
+        total.backward();                                                        \
+                                                                                 \
+        EXPECT_NEAR(e.item(), total.dataX(), 1e-5 * std::abs(total.dataX()));    \
+        for (size_t i = 0; i < 3; ++i) {                                         \
+            EXPECT_NEAR(col.grad().at({i, 0}), vc[i].gradX(),                    \
+                        1e-5 * (1 + std::abs(vc[i].gradX())));                   \
+        }                                                                        \
+        for (size_t j = 0; j < 4; ++j) {                                         \
+            EXPECT_NEAR(row.grad().at({j}), vr[j].gradX(),                       \
+                        1e-5 * (1 + std::abs(vr[j].gradX())));                   \
+        }                                                                        \
+        EXPECT_NEAR(s.grad().item(), vs.gradX(), 1e-5 * (1 + std::abs(vs.gradX()))); \
+    }
+
+TEST_VIEW_BROADCAST(float, Float)
+TEST_VIEW_BROADCAST(double, Double)
+
+
+TEST(ValueTest, ViewComplex) {
+    using C = complex<double>;
+    Tensor<C> a({2, 2}, std::vector<C>{C(1.0, 1.0), C(2.0, 0.0), C(0.0, -1.0), C(3.0, 2.0)});
+    Tensor<C> b({2}, std::vector<C>{C(0.0, 1.0), C(1.0, 0.0)});
+
+    // the second column of a, times b down the rows: (2)(i), (3 + 2i)(1)
+    Tensor<C> e = sum(a.slice(1, 1, 2) * b.reshape({2, 1}));
+    EXPECT_EQ(e.item().real(), 3.0);
+    EXPECT_EQ(e.item().imag(), 4.0);
+
+    e.backward();
+    EXPECT_EQ(a.grad().at({0, 1}).imag(), 1.0);
+    EXPECT_EQ(a.grad().at({1, 1}).real(), 1.0);
+    EXPECT_EQ(a.grad().at({0, 0}).real(), 0.0);
+    EXPECT_EQ(b.grad().at({1}).real(), 3.0);
+    EXPECT_EQ(b.grad().at({1}).imag(), 2.0);
+}
+
+
+// views without a graph still share their elements
+TEST(ValueTest, ViewNoGrad) {
+    Tensor<double> a({4}, {1.0, 2.0, 3.0, 4.0});
+
+    NoGradGuard no_grad;
+    Tensor<double> v = a.slice(0, 2, 4);
+    EXPECT_EQ(v.data(), a.data() + 2);
+    EXPECT_EQ(v.graph_size(), 1u);
+    Tensor<double> e = sum(v);
+    EXPECT_EQ(e.item(), 7.0);
+}
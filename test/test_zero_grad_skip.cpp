@@ -0,0 +1,153 @@
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "../src/engine.h"
+#include "../src/graph.h"
+#include "../src/parallel.h"
+#include "../src/nn.h"
+
+
+using namespace ptMgrad;
+
+
+// the relu is dead, so the ops below it receive zero and are skipped
+#define TEST_VALUE_ZERO_GRAD_SKIP(TYPE, NAME)                              \
+    TEST(ValueTest, ZeroGradSkip##NAME) {                                  \
+        Value<TYPE> a = 2.0;                                               \
+        Value<TYPE> b = 3.0;                                               \
+        Value<TYPE> c = 4.0;                                               \
+                                                                           \
+        Value<TYPE> h = relu(a * b - TYPE(10.0));                          \
+        Value<TYPE> loss = h * c + a;                                      \
+        BackwardStats::reset();                                            \
+        loss.backward();                                                   \
+                                                                           \
+        /* the sub and the product below the relu */                       \
+        EXPECT_EQ(BackwardStats::skipped(), 2u);                           \
+        EXPECT_EQ(a.gradX(), TYPE(1.0));                                   \
+        EXPECT_EQ(b.gradX(), TYPE(0.0));                                   \
+        EXPECT_EQ(c.gradX(), TYPE(0.0));                                   \
+    }
+
+TEST_VALUE_ZERO_GRAD_SKIP(float, Float)
+TEST_VALUE_ZERO_GRAD_SKIP(double, Double)
+TEST_VALUE_ZERO_GRAD_SKIP(int, Int)
+
+
+// an op that still receives gradient from a live path is run
+TEST(ValueTest, ZeroGradSkipLivePath) {
+    Value<double> a = 2.0;
+    Value<double> b = 3.0;
+
+    Value<double> p = a * b;
+    Value<double> loss = relu(p - 10.0) + p;
+    BackwardStats::reset();
+    loss.backward();
+
+    // only the sub below the relu
+    EXPECT_EQ(BackwardStats::skipped(), 1u);
+    EXPECT_EQ(a.gradX(), 3.0);
+    EXPECT_EQ(b.gradX(), 2.0);
+}
+
+
+// a dead unit of a layer: nothing below it is run, the gradients are
+// those of the live units alone
+TEST(ValueTest, ZeroGradSkipDeadUnits) {
+    std::vector<Value<double>> x = {1.0, -2.0, 0.5};
+    std::vector<std::vector<Value<double>>> w;
+    std::vector<Value<double>> units;
+    for (int u = 0; u < 8; ++u) {
+        w.push_back({double(u % 3) - 1.0, 0.5, double(u % 2)});
+        Value<double> act = ptMgrad::dot(w[u], x);
+        units.push_back(relu(act * 2.0 - 1.0));
+    }
+    Value<double> loss = ptMgrad::sum(units);
+    BackwardStats::reset();
+    loss.backward();
+
+    size_t dead = 0;
+    for (int u = 0; u < 8; ++u) {
+        double act = ptMgrad::dot(w[u], x).dataX() * 2.0 - 1.0;
+        if (act < 0.0) {
+            ++dead;
+            for (auto& wi : w[u]) {
+                EXPECT_EQ(wi.gradX(), 0.0);
+            }
+        } else {
+            EXPECT_EQ(w[u][0].gradX(), 2.0 * x[0].dataX());
+        }
+    }
+    ASSERT_GT(dead, 0u);
+    // the sub, the product and the dot of every dead unit
+    EXPECT_EQ(BackwardStats::skipped(), 3 * dead);
+}
+
+
+TEST(ValueTest, ZeroGradSkipParallel) {
+    ThreadPool pool(4);
+    auto build = [](Value<double>& x, std::vector<Value<double>>& w) {
+        std::vector<Value<double>> terms;
+        for (int i = 0; i < 2000; ++i) {
+            w.push_back(Value<double>(double(i % 7) - 3.0));
+            terms.push_back(relu(x * w[i] + 1.0));
+        }
+        return ptMgrad::sum(terms);
+    };
+
+    Value<double> x1 = 2.0, x2 = 2.0;
+    std::vector<Value<double>> w1, w2;
+    Value<double> serial = build(x1, w1);
+    Value<double> parallel = build(x2, w2);
+
+    BackwardStats::reset();
+    serial.backward();
+    uint64_t skipped = BackwardStats::skipped();
+    EXPECT_GT(skipped, 0u);
+
+    BackwardStats::reset();
+    parallel.backward(pool);
+    EXPECT_EQ(BackwardStats::skipped(), skipped);
+    EXPECT_EQ(x2.gradX(), x1.gradX());
+    for (size_t i = 0; i < w1.size(); ++i) {
+        EXPECT_EQ(w2[i].gradX(), w1[i].gradX());
+    }
+}
+
+
+// replay skips the same ops, and picks up units that come alive
+TEST(ValueTest, ZeroGradSkipGraphReplay) {
+    Value<double> a = 1.0;
+    Value<double> b = 3.0;
+
+    Value<double> loss = relu(a * b - 6.0) + a;
+    Graph<double> graph(loss);
+
+    BackwardStats::reset();
+    graph.replay();
+    EXPECT_EQ(BackwardStats::skipped(), 2u);
+    EXPECT_EQ(a.gradX(), 1.0);
+
+    a.zero_grad();
+    a.set_data(4.0);
+    BackwardStats::reset();
+    graph.replay();
+    EXPECT_EQ(BackwardStats::skipped(), 0u);
+    EXPECT_EQ(a.gradX(), 4.0);
+}
+
+
+TEST(ValueTest, ZeroGradSkipComplex) {
+    using C = complex<double>;
+    Value<C> a(C(1.0, 2.0));
+    Value<C> zero(C(0.0, 0.0));
+
+    Value<C> loss = (a * a) * zero + a;
+    BackwardStats::reset();
+    loss.backward();
+
+    EXPECT_EQ(BackwardStats::skipped(), 1u);
+    EXPECT_EQ(a.gradX().real(), 1.0);
+    EXPECT_EQ(a.gradX().imag(), 0.0);
+}